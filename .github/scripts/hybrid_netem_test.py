@@ -0,0 +1,161 @@
+#!/usr/bin/python3
+# Adaptive hybrid bridging under tc netem. Needs root, nanomq built with
+# -DNNG_ENABLE_QUIC=ON and a broker on this host taking QUIC on 14567 and
+# MQTT over TCP on 1883, EMQX for one.
+#
+# netem on the QUIC port first, the bridge has to go over to TCP. Then
+# netem moves to the TCP port and the bridge has to come back to QUIC once
+# dwell is over.
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+import requests
+
+base_url = "http://127.0.0.1:8081/api/v4"
+nanomq_log_path = "/tmp/nanomq_hybrid.log"
+nanomq_conf_path = "/tmp/nanomq_hybrid.conf"
+nanomq_cmd = "nanomq start --conf " + nanomq_conf_path
+
+quic_port = 14567
+tcp_port = 1883
+netem = "delay 200ms 20ms loss 10%"
+dev = "lo"
+
+nanomq_conf = """
+listeners.tcp {
+	bind = "0.0.0.0:1885"
+}
+http_server {
+	port = 8081
+	username = admin
+	password = public
+	auth_type = basic
+}
+log {
+	to = [file]
+	level = info
+	dir = "/tmp"
+	file = "nanomq_hybrid.log"
+}
+bridges.mqtt.hybrid {
+	server = "mqtt-quic://127.0.0.1:%d"
+	proto_ver = 4
+	clientid = "hybrid_netem"
+	keepalive = 60s
+	clean_start = true
+	hybrid_bridging = true
+	forwards = ["netem/#"]
+	adaptive {
+		enable = true
+		interval = 500ms
+		window = 10
+		margin = 20
+		hold = 3
+		dwell = 20s
+	}
+}
+""" % quic_port
+
+
+def sh(cmd, check=True):
+    print("$ " + cmd)
+    return subprocess.run(shlex.split(cmd), check=check)
+
+
+def netem_on(port):
+    sh("tc qdisc add dev %s root handle 1: prio bands 3 "
+       "priomap 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0" % dev)
+    sh("tc qdisc add dev %s parent 1:3 handle 30: netem %s" % (dev, netem))
+    for match in ("dport", "sport"):
+        sh("tc filter add dev %s parent 1:0 protocol ip u32 "
+           "match ip %s %d 0xffff flowid 1:3" % (dev, match, port))
+
+
+def netem_off():
+    sh("tc qdisc del dev %s root" % dev, check=False)
+
+
+def bridge_adaptive():
+    response = requests.get(base_url + "/metrics", auth=('admin', 'public'))
+    if response.status_code != 200:
+        return None
+    for item in response.json().get("metrics", []):
+        if item.get("name") == "bridge" and item.get("bridge") == "hybrid":
+            return item.get("adaptive")
+    return None
+
+
+def wait_transport(transport, timeout):
+    start = time.time()
+    while time.time() - start < timeout:
+        try:
+            adaptive = bridge_adaptive()
+        except requests.RequestException:
+            adaptive = None
+        if adaptive is not None:
+            print("on %s, quic score %.1f ms, tcp score %.1f ms" % (
+                adaptive["transport"], adaptive["quic"]["score"],
+                adaptive["tcp"]["score"]))
+            if adaptive["transport"] == transport:
+                return time.time() - start
+        time.sleep(1)
+    return None
+
+
+def hybrid_netem_test():
+    # both ways measured on a clean path first
+    if wait_transport("quic", 30) is None:
+        print("bridge not on quic at start")
+        return False
+    time.sleep(10)
+
+    netem_on(quic_port)
+    took = wait_transport("tcp", 60)
+    if took is None:
+        print("bridge stayed on quic under netem")
+        return False
+    print("over to tcp in %.1f s" % took)
+    netem_off()
+
+    netem_on(tcp_port)
+    took = wait_transport("quic", 90)
+    if took is None:
+        print("bridge stayed on tcp under netem")
+        return False
+    print("back to quic in %.1f s" % took)
+    netem_off()
+
+    adaptive = bridge_adaptive()
+    print("switches: %d" % adaptive["switches"])
+    return adaptive["switches"] >= 2
+
+
+if __name__ == '__main__':
+    if os.geteuid() != 0:
+        print("tc netem needs root")
+        sys.exit(1)
+
+    with open(nanomq_conf_path, "w") as f:
+        f.write(nanomq_conf)
+    if os.path.exists(nanomq_log_path):
+        os.remove(nanomq_log_path)
+
+    netem_off()
+    nanomq = subprocess.Popen(shlex.split(nanomq_cmd),
+                              stdout=subprocess.PIPE,
+                              universal_newlines=True)
+    time.sleep(2)
+    try:
+        ok = hybrid_netem_test()
+    finally:
+        netem_off()
+        nanomq.terminate()
+
+    if not ok:
+        with open(nanomq_log_path) as log:
+            print(log.read())
+        raise AssertionError
+    print("hybrid netem test passed")
@@ -1,7 +1,99 @@
 #ifdef ACL_SUPP
+#include <string.h>
+
 #include "include/acl_handler.h"
+#include "include/topic_trie.h"
 #include "nng/protocol/mqtt/mqtt_parser.h"
+#include "nng/supplemental/nanolib/cvector.h"
 #include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+// rules without more topic bits than this are decided without the heap
+#define ACL_STACK_WORDS 16
+
+#define ACL_CACHE_SLOTS 8
+#define ACL_CACHE_BUCKETS 4096
+#define ACL_CACHE_LOCKS 64
+// longer topics are decided every time
+#define ACL_CACHE_TOPIC_MAX 256
+
+typedef struct acl_key acl_key;
+
+// rules naming one username or clientid, in rule order
+struct acl_key {
+	const char *str;
+	uint32_t   *ids; // cvector
+	acl_key    *next;
+};
+
+typedef struct {
+	acl_key **buckets;
+	size_t    mask;
+} acl_index;
+
+typedef struct acl_engine acl_engine;
+
+// config->acl compiled, with its own copy of the rules so a reload frees
+// the config ones as soon as the new engine is in.
+struct acl_engine {
+	acl_rule  **rules;
+	size_t      rule_count;
+	acl_index   by_username;
+	acl_index   by_clientid;
+	uint32_t   *generic; // cvector, rules evaluated per connection
+	topic_trie *topics;  // rule topics tagged with the rule index
+	uint64_t   *any_topic; // bitset of rules without topics
+	size_t      words;
+	uint32_t    refs; // checks between engine_get() and engine_put()
+	acl_engine *retired;
+};
+
+typedef struct {
+	uint32_t hash;
+	uint32_t len;
+	uint8_t  action;
+	bool     verdict;
+	char    *topic;
+} acl_verdict;
+
+typedef struct acl_pipe_cache acl_pipe_cache;
+
+// most recently used first
+struct acl_pipe_cache {
+	uint32_t        pipe;
+	uint64_t        gen;
+	uint32_t        len;
+	acl_verdict     slots[ACL_CACHE_SLOTS];
+	acl_pipe_cache *next;
+};
+
+static struct {
+	nng_mtx        *mtx; // engine, retired and walkers
+	nng_cv         *cv;  // a retired engine or a walk is done
+	acl_engine     *engine;
+	acl_engine     *retired; // replaced engines, see acl_engine_quiesce()
+	uint32_t        walkers; // checks walking config->acl, no engine yet
+	nng_atomic_u64 *gen;
+	acl_pipe_cache *buckets[ACL_CACHE_BUCKETS];
+	nng_mtx        *locks[ACL_CACHE_LOCKS];
+} acl_state = { .mtx = NULL };
+
+static uint32_t
+acl_hash(const char *str, size_t *len)
+{
+	// FNV-1a
+	uint32_t    h = 2166136261u;
+	const char *p = str;
+
+	for (; *p != '\0'; p++) {
+		h ^= (uint8_t) *p;
+		h *= 16777619u;
+	}
+	if (len != NULL) {
+		*len = p - str;
+	}
+	return h;
+}
 
 static bool
 match_rule_content_str(acl_rule_ct *ct, const char *cmp_str)
@@ -16,166 +108,784 @@ match_rule_content_str(acl_rule_ct *ct, const char *cmp_str)
 	return match;
 }
 
-bool
-auth_acl(conf *config, acl_action_type act_type, conn_param *param,
-    const char *topic)
+// whether the connection is one the rule talks about
+static bool
+match_rule_subject(acl_rule *rule, const char *username, const char *clientid)
 {
-	conn_param_clone(param);
+	acl_sub_rule *sub_rule;
 
-	conf_acl *acl = &config->acl;
+	switch (rule->rule_type) {
+	case ACL_USERNAME:
+		return match_rule_content_str(&rule->rule_ct.ct, username);
 
-	bool match     = false;
-	bool sub_match = true;
-	bool result    = false;
+	case ACL_CLIENTID:
+		return match_rule_content_str(&rule->rule_ct.ct, clientid);
 
-	for (size_t i = 0; i < acl->rule_count; i++) {
-		acl_rule *      rule   = acl->rules[i];
-		acl_action_type action = rule->action;
+	case ACL_AND:
+		for (size_t j = 0; j < rule->rule_ct.array.count; j++) {
+			sub_rule = rule->rule_ct.array.rules[j];
+			switch (sub_rule->rule_type) {
+			case ACL_USERNAME:
+				if (!match_rule_content_str(
+				        &sub_rule->rule_ct, username)) {
+					return false;
+				}
+				break;
+			case ACL_CLIENTID:
+				if (!match_rule_content_str(
+				        &sub_rule->rule_ct, clientid)) {
+					return false;
+				}
+				break;
+				// TODO Not supported yet
+				// case ACL_IPADDR:
+				// 	break;
+			default:
+				break;
+			}
+		}
+		return true;
 
-		if (action != ACL_ALL && action != act_type) {
-			continue;
+	case ACL_OR:
+		for (size_t j = 0; j < rule->rule_ct.array.count; j++) {
+			sub_rule = rule->rule_ct.array.rules[j];
+			switch (sub_rule->rule_type) {
+			case ACL_USERNAME:
+				if (match_rule_content_str(
+				        &sub_rule->rule_ct, username)) {
+					return true;
+				}
+				break;
+			case ACL_CLIENTID:
+				if (match_rule_content_str(
+				        &sub_rule->rule_ct, clientid)) {
+					return true;
+				}
+				break;
+				// TODO Not supported yet
+				// case ACL_IPADDR:
+				// 	break;
+			default:
+				break;
+			}
 		}
+		return false;
 
-		switch (rule->rule_type) {
-		case ACL_USERNAME:
-			match = match_rule_content_str(&rule->rule_ct.ct,
-			    (const char *) conn_param_get_username(param));
-			break;
+		// TODO Not supported yet
+		// case ACL_IPADDR:
+		// 	break;
 
-		case ACL_CLIENTID:
-			match = match_rule_content_str(&rule->rule_ct.ct,
-			    (const char *) conn_param_get_clientid(param));
-			break;
+	case ACL_NONE:
+		return true;
 
-		case ACL_AND:
-			for (size_t j = 0; j < rule->rule_ct.array.count;
-			     j++) {
-				acl_sub_rule *sub_rule =
-				    rule->rule_ct.array.rules[j];
-				switch (sub_rule->rule_type) {
-				case ACL_USERNAME:
-					if (!match_rule_content_str(
-					        &sub_rule->rule_ct,
-					        (const char *)
-					            conn_param_get_username(
-					                param))) {
-						sub_match = false;
-						break;
-					}
-					break;
-
-				case ACL_CLIENTID:
-					if (!match_rule_content_str(
-					        &sub_rule->rule_ct,
-					        (const char *)
-					            conn_param_get_clientid(
-					                param))) {
-						sub_match = false;
-						break;
-					}
-					break;
-
-					// TODO Not supported yet
-					// case ACL_IPADDR:
-					// 	break;
-
-				default:
-					break;
-				}
-				if (!sub_match) {
-					break;
-				}
+	default:
+		return false;
+	}
+}
+
+static int
+index_init(acl_index *idx, size_t n)
+{
+	size_t size = 16;
+
+	while (size < n * 2) {
+		size <<= 1;
+	}
+	if ((idx->buckets = nng_zalloc(size * sizeof(acl_key *))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	idx->mask = size - 1;
+	return 0;
+}
+
+static void
+index_fini(acl_index *idx)
+{
+	acl_key *k, *next;
+
+	if (idx->buckets == NULL) {
+		return;
+	}
+	for (size_t i = 0; i <= idx->mask; i++) {
+		for (k = idx->buckets[i]; k != NULL; k = next) {
+			next = k->next;
+			cvector_free(k->ids);
+			nng_free(k, sizeof(*k));
+		}
+	}
+	nng_free(idx->buckets, (idx->mask + 1) * sizeof(acl_key *));
+}
+
+static int
+index_add(acl_index *idx, const char *str, uint32_t id)
+{
+	acl_key **b = &idx->buckets[acl_hash(str, NULL) & idx->mask];
+	acl_key  *k;
+
+	for (k = *b; k != NULL && strcmp(k->str, str) != 0; k = k->next)
+		;
+	if (k == NULL) {
+		if ((k = nng_zalloc(sizeof(*k))) == NULL) {
+			return NNG_ENOMEM;
+		}
+		k->str  = str;
+		k->next = *b;
+		*b      = k;
+	}
+	cvector_push_back(k->ids, id);
+	return 0;
+}
+
+static uint32_t *
+index_find(acl_index *idx, const char *str)
+{
+	acl_key *k;
+
+	if (str == NULL) {
+		return NULL;
+	}
+	for (k = idx->buckets[acl_hash(str, NULL) & idx->mask]; k != NULL;
+	     k = k->next) {
+		if (strcmp(k->str, str) == 0) {
+			return k->ids;
+		}
+	}
+	return NULL;
+}
+
+static void
+ct_free(acl_rule_ct *ct)
+{
+	if (ct->type == ACL_RULE_SINGLE_STRING && ct->value.str != NULL) {
+		nng_strfree(ct->value.str);
+	}
+}
+
+// only a single string is ever matched, see match_rule_content_str()
+static int
+ct_dup(acl_rule_ct *dst, const acl_rule_ct *src)
+{
+	*dst = *src;
+	memset(&dst->value, 0, sizeof(dst->value));
+	if (src->type == ACL_RULE_SINGLE_STRING && src->value.str != NULL &&
+	    (dst->value.str = nng_strdup(src->value.str)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	return 0;
+}
+
+static void
+rule_free(acl_rule *r)
+{
+	acl_sub_rules_array *arr = &r->rule_ct.array;
+
+	if (r->rule_type == ACL_AND || r->rule_type == ACL_OR) {
+		for (size_t j = 0; j < arr->count; j++) {
+			if (arr->rules[j] != NULL) {
+				ct_free(&arr->rules[j]->rule_ct);
+				nng_free(arr->rules[j], sizeof(acl_sub_rule));
 			}
-			if (sub_match) {
-				match = true;
+		}
+		if (arr->rules != NULL) {
+			nng_free(arr->rules, arr->count * sizeof(acl_sub_rule *));
+		}
+	} else {
+		ct_free(&r->rule_ct.ct);
+	}
+	for (size_t j = 0; j < r->topic_count; j++) {
+		nng_strfree(r->topics[j]);
+	}
+	if (r->topics != NULL) {
+		nng_free(r->topics, r->topic_count * sizeof(char *));
+	}
+	nng_free(r, sizeof(*r));
+}
+
+// what the engine matches of src, nothing borrowed
+static int
+rule_dup(acl_rule **rp, const acl_rule *src)
+{
+	const acl_sub_rules_array *from = &src->rule_ct.array;
+	acl_sub_rules_array       *to;
+	acl_rule                  *r;
+	size_t                     n = src->topic_count;
+
+	if ((r = nng_zalloc(sizeof(*r))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	r->id        = src->id;
+	r->permit    = src->permit;
+	r->rule_type = src->rule_type;
+	r->action    = src->action;
+	to           = &r->rule_ct.array;
+	if (src->rule_type == ACL_AND || src->rule_type == ACL_OR) {
+		if (from->count > 0 &&
+		    (to->rules = nng_zalloc(
+		         from->count * sizeof(acl_sub_rule *))) == NULL) {
+			goto fail;
+		}
+		to->count = from->count;
+		for (size_t j = 0; j < from->count; j++) {
+			if ((to->rules[j] = nng_zalloc(sizeof(acl_sub_rule))) ==
+			        NULL ||
+			    ct_dup(&to->rules[j]->rule_ct,
+			        &from->rules[j]->rule_ct) != 0) {
+				goto fail;
 			}
-			break;
+			to->rules[j]->rule_type = from->rules[j]->rule_type;
+		}
+	} else if (ct_dup(&r->rule_ct.ct, &src->rule_ct.ct) != 0) {
+		goto fail;
+	}
+	if (n > 0 && (r->topics = nng_zalloc(n * sizeof(char *))) == NULL) {
+		goto fail;
+	}
+	for (; r->topic_count < n; r->topic_count++) {
+		if ((r->topics[r->topic_count] =
+		            nng_strdup(src->topics[r->topic_count])) == NULL) {
+			goto fail;
+		}
+	}
+	*rp = r;
+	return 0;
 
-		case ACL_OR:
-			for (size_t j = 0; j < rule->rule_ct.array.count;
-			     j++) {
-				acl_sub_rule *sub_rule =
-				    rule->rule_ct.array.rules[j];
-				switch (sub_rule->rule_type) {
-				case ACL_USERNAME:
-					match |= match_rule_content_str(
-					    &sub_rule->rule_ct,
-					    (const char *)
-					        conn_param_get_username(
-					            param));
-					break;
-
-				case ACL_CLIENTID:
-					match |= match_rule_content_str(
-					    &sub_rule->rule_ct,
-					    (const char *)
-					        conn_param_get_clientid(
-					            param));
-					break;
-
-					// TODO Not supported yet
-					// case ACL_IPADDR:
-					// 	break;
-
-				default:
-					break;
-				}
-				if (match) {
-					break;
-				}
+fail:
+	if (r->topics != NULL && r->topic_count < n) {
+		// sized for n, freed as such
+		for (size_t j = 0; j < r->topic_count; j++) {
+			nng_strfree(r->topics[j]);
+		}
+		nng_free(r->topics, n * sizeof(char *));
+		r->topics      = NULL;
+		r->topic_count = 0;
+	}
+	rule_free(r);
+	return NNG_ENOMEM;
+}
+
+static void
+engine_free(acl_engine *e)
+{
+	if (e->rules != NULL) {
+		for (size_t i = 0; i < e->rule_count; i++) {
+			if (e->rules[i] != NULL) {
+				rule_free(e->rules[i]);
 			}
-			break;
+		}
+		nng_free(e->rules, e->rule_count * sizeof(acl_rule *));
+	}
+	index_fini(&e->by_username);
+	index_fini(&e->by_clientid);
+	cvector_free(e->generic);
+	topic_trie_destroy(e->topics);
+	if (e->any_topic != NULL) {
+		nng_free(e->any_topic, e->words * sizeof(uint64_t));
+	}
+	nng_free(e, sizeof(*e));
+}
 
-			// TODO Not supported yet
-			// case ACL_IPADDR:
-			// 	break;
+static int
+engine_compile(acl_engine **ep, conf_acl *acl)
+{
+	acl_engine *e;
+	acl_rule   *rule;
+	acl_index  *idx;
+	int         rv;
 
-		case ACL_NONE:
-			match = true;
-			break;
+	if ((e = nng_zalloc(sizeof(*e))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	e->rule_count = acl->rule_count;
+	e->words      = (acl->rule_count + 63) / 64;
+	if (e->rule_count > 0 &&
+	    (e->rules = nng_zalloc(e->rule_count * sizeof(acl_rule *))) ==
+	        NULL) {
+		rv = NNG_ENOMEM;
+		goto fail;
+	}
+	if ((rv = index_init(&e->by_username, acl->rule_count)) != 0 ||
+	    (rv = index_init(&e->by_clientid, acl->rule_count)) != 0 ||
+	    (rv = topic_trie_create(&e->topics)) != 0) {
+		goto fail;
+	}
+	if (e->words > 0 &&
+	    (e->any_topic = nng_zalloc(e->words * sizeof(uint64_t))) == NULL) {
+		rv = NNG_ENOMEM;
+		goto fail;
+	}
 
-		default:
-			break;
+	for (uint32_t i = 0; i < acl->rule_count; i++) {
+		if ((rv = rule_dup(&e->rules[i], acl->rules[i])) != 0) {
+			goto fail;
+		}
+		rule = e->rules[i];
+		idx  = NULL;
+		if (rule->rule_type == ACL_USERNAME) {
+			idx = &e->by_username;
+		} else if (rule->rule_type == ACL_CLIENTID) {
+			idx = &e->by_clientid;
 		}
 
-		if (!match) {
+		if (idx != NULL &&
+		    rule->rule_ct.ct.type == ACL_RULE_SINGLE_STRING) {
+			rv = index_add(idx, rule->rule_ct.ct.value.str, i);
+		} else if (idx != NULL &&
+		    rule->rule_ct.ct.type != ACL_RULE_ALL) {
+			// matches nobody
 			continue;
+		} else {
+			cvector_push_back(e->generic, i);
+		}
+		if (rv != 0) {
+			goto fail;
 		}
 
-		if (rule->topic_count > 0) {
-			char **topic_array = rule->topics;
-			bool   found       = false;
-			for (size_t j = 0;
-			     j < rule->topic_count && found != true; j++) {
-				if (topic_filter(rule->topics[j], topic)) {
-					found = true;
-					break;
-				}
-			}
-			if (found == false) {
-				match = false;
-				continue;
+		if (rule->topic_count == 0) {
+			e->any_topic[i / 64] |= 1ull << (i % 64);
+		}
+		for (size_t j = 0; j < rule->topic_count; j++) {
+			if ((rv = topic_trie_insert(
+			         e->topics, rule->topics[j], i)) != 0) {
+				goto fail;
 			}
 		}
+	}
+	*ep = e;
+	return 0;
 
-		result = rule->permit == ACL_ALLOW ? match : !match;
+fail:
+	engine_free(e);
+	return rv;
+}
 
-		break;
+static void
+set_topic_bit(uint32_t id, void *arg)
+{
+	uint64_t *bits = arg;
+
+	bits[id / 64] |= 1ull << (id % 64);
+}
+
+// Same decision as walking the rules in order: the first rule whose
+// action, subject and topics all match decides.
+static bool
+engine_decide(acl_engine *e, conf *config, acl_action_type act_type,
+    conn_param *param, const char *topic)
+{
+	uint64_t    stack_bits[ACL_STACK_WORDS];
+	uint64_t   *bits     = stack_bits;
+	const char *username = (const char *) conn_param_get_username(param);
+	const char *clientid = (const char *) conn_param_get_clientid(param);
+	uint32_t   *lists[3];
+	size_t      pos[3] = { 0, 0, 0 };
+	bool        match  = false;
+	bool        result = false;
+
+	if (e->words > ACL_STACK_WORDS &&
+	    (bits = nng_alloc(e->words * sizeof(uint64_t))) == NULL) {
+		return false;
 	}
+	if (e->words > 0) {
+		memcpy(bits, e->any_topic, e->words * sizeof(uint64_t));
+	}
+	topic_trie_match(e->topics, topic, set_topic_bit, bits);
+
+	lists[0] = index_find(&e->by_username, username);
+	lists[1] = index_find(&e->by_clientid, clientid);
+	lists[2] = e->generic;
 
-	conn_param_free(param);
+	for (;;) {
+		uint32_t  id    = UINT32_MAX;
+		int       which = -1;
+		acl_rule *rule;
 
-	// if (!match && config->acl_nomatch == ACL_ALLOW &&
-	//     acl->rule_count > 0) {
-	// 	return true;
-	// } else {
-	// 	return result;
-	// }
+		// merge the candidate lists back into rule order
+		for (int k = 0; k < 3; k++) {
+			if (pos[k] < cvector_size(lists[k]) &&
+			    lists[k][pos[k]] < id) {
+				id    = lists[k][pos[k]];
+				which = k;
+			}
+		}
+		if (which < 0) {
+			break;
+		}
+		pos[which]++;
 
+		rule = e->rules[id];
+		if (rule->action != ACL_ALL && rule->action != act_type) {
+			continue;
+		}
+		if ((bits[id / 64] & (1ull << (id % 64))) == 0) {
+			continue;
+		}
+		if (which == 2 &&
+		    !match_rule_subject(rule, username, clientid)) {
+			continue;
+		}
+		match  = true;
+		result = rule->permit == ACL_ALLOW;
+		break;
+	}
+
+	if (bits != stack_bits) {
+		nng_free(bits, e->words * sizeof(uint64_t));
+	}
 	if (match) {
 		return result;
+	}
+	return config->acl_nomatch == ACL_ALLOW;
+}
+
+// the engine with a reference taken, or NULL and the walk of the rules
+// of config->acl counted, *acl a copy taken with them
+static acl_engine *
+engine_get(conf *config, conf_acl *acl)
+{
+	acl_engine *e;
+
+	if (acl_state.mtx == NULL) {
+		*acl = config->acl;
+		return NULL;
+	}
+	nng_mtx_lock(acl_state.mtx);
+	if ((e = acl_state.engine) != NULL) {
+		e->refs++;
 	} else {
-		return config->acl_nomatch == ACL_ALLOW ? true : result;
+		*acl = config->acl;
+		acl_state.walkers++;
+	}
+	nng_mtx_unlock(acl_state.mtx);
+	return e;
+}
+
+static void
+engine_put(acl_engine *e)
+{
+	if (acl_state.mtx == NULL) {
+		return;
+	}
+	nng_mtx_lock(acl_state.mtx);
+	if (e != NULL) {
+		if (--e->refs == 0 && e != acl_state.engine) {
+			nng_cv_wake(acl_state.cv);
+		}
+	} else if (--acl_state.walkers == 0) {
+		nng_cv_wake(acl_state.cv);
+	}
+	nng_mtx_unlock(acl_state.mtx);
+}
+
+/**
+ * @brief compile config->acl and drop every cached verdict. Called once
+ *        from broker() and again from reload_acl_config(). The engine
+ *        copies the rules, call acl_engine_quiesce() before freeing the
+ *        ones a check may have walked.
+ */
+int
+acl_engine_load(conf *config)
+{
+	acl_engine *e;
+	int         rv;
+
+	if (acl_state.mtx == NULL) {
+		// first call comes from broker() before any work runs
+		if ((rv = nng_mtx_alloc(&acl_state.mtx)) != 0) {
+			return rv;
+		}
+		for (size_t i = 0; i < ACL_CACHE_LOCKS; i++) {
+			if ((rv = nng_mtx_alloc(&acl_state.locks[i])) != 0) {
+				return rv;
+			}
+		}
+		if ((rv = nng_cv_alloc(&acl_state.cv, acl_state.mtx)) != 0) {
+			return rv;
+		}
+		nng_atomic_alloc64(&acl_state.gen);
+	}
+	if ((rv = engine_compile(&e, &config->acl)) != 0) {
+		log_error("acl compile failed: %d", rv);
+		return rv;
+	}
+	nng_mtx_lock(acl_state.mtx);
+	if (acl_state.engine != NULL) {
+		acl_state.engine->retired = acl_state.retired;
+		acl_state.retired         = acl_state.engine;
+	}
+	acl_state.engine = e;
+	nng_mtx_unlock(acl_state.mtx);
+	nng_atomic_inc64(acl_state.gen);
+
+	log_info("acl compiled: %zu rules, %zu evaluated per connection",
+	    e->rule_count, cvector_size(e->generic));
+	return 0;
+}
+
+/**
+ * @brief wait until no check uses an engine acl_engine_load() replaced or
+ *        walks config->acl, and free those engines.
+ */
+void
+acl_engine_quiesce(void)
+{
+	acl_engine  *e, *done = NULL;
+	acl_engine **pp;
+	bool         busy;
+
+	if (acl_state.mtx == NULL) {
+		return;
+	}
+	nng_mtx_lock(acl_state.mtx);
+	for (;;) {
+		busy = acl_state.walkers > 0;
+		pp   = &acl_state.retired;
+		while ((e = *pp) != NULL) {
+			if (e->refs == 0) {
+				*pp        = e->retired;
+				e->retired = done;
+				done       = e;
+			} else {
+				busy = true;
+				pp   = &e->retired;
+			}
+		}
+		if (!busy) {
+			break;
+		}
+		nng_cv_wait(acl_state.cv);
+	}
+	nng_mtx_unlock(acl_state.mtx);
+
+	for (; done != NULL; done = e) {
+		e = done->retired;
+		engine_free(done);
+	}
+}
+
+/**
+ * @brief make the acl of new_conf the one of config. The rules go in
+ *        through a new engine, which drops every cached verdict, and the
+ *        ones they replace end up in new_conf once no check reads them.
+ * @return the error of compiling the new rules, config keeps its own then
+ */
+int
+acl_engine_reload(conf *config, conf *new_conf)
+{
+	conf_acl acl;
+	int      rv;
+
+	if (new_conf->acl.enable && (rv = acl_engine_load(new_conf)) != 0) {
+		return rv;
+	}
+	if (acl_state.mtx != NULL) {
+		nng_mtx_lock(acl_state.mtx);
+	}
+	acl                     = config->acl;
+	config->acl             = new_conf->acl;
+	new_conf->acl           = acl;
+	config->acl_nomatch     = new_conf->acl_nomatch;
+	config->acl_deny_action = new_conf->acl_deny_action;
+	if (acl_state.mtx != NULL) {
+		nng_mtx_unlock(acl_state.mtx);
+	}
+	acl_engine_quiesce();
+	log_info("acl reloaded: %zu rules", config->acl.rule_count);
+	return 0;
+}
+
+static void
+pipe_cache_clear(acl_pipe_cache *pc)
+{
+	for (uint32_t i = 0; i < pc->len; i++) {
+		nng_free(pc->slots[i].topic, pc->slots[i].len + 1);
+	}
+	pc->len = 0;
+}
+
+void
+acl_engine_fini(void)
+{
+	acl_engine     *e, *next;
+	acl_pipe_cache *pc, *pc_next;
+
+	if (acl_state.mtx == NULL) {
+		return;
+	}
+	if (acl_state.engine != NULL) {
+		engine_free(acl_state.engine);
+	}
+	for (e = acl_state.retired; e != NULL; e = next) {
+		next = e->retired;
+		engine_free(e);
+	}
+	acl_state.engine  = NULL;
+	acl_state.retired = NULL;
+	for (size_t i = 0; i < ACL_CACHE_BUCKETS; i++) {
+		for (pc = acl_state.buckets[i]; pc != NULL; pc = pc_next) {
+			pc_next = pc->next;
+			pipe_cache_clear(pc);
+			nng_free(pc, sizeof(*pc));
+		}
+		acl_state.buckets[i] = NULL;
+	}
+	for (size_t i = 0; i < ACL_CACHE_LOCKS; i++) {
+		nng_mtx_free(acl_state.locks[i]);
+	}
+	nng_atomic_free64(acl_state.gen);
+	nng_cv_free(acl_state.cv);
+	nng_mtx_free(acl_state.mtx);
+	acl_state.mtx = NULL;
+}
+
+bool
+auth_acl(conf *config, acl_action_type act_type, conn_param *param,
+    const char *topic)
+{
+	conf_acl    acl;
+	acl_engine *e = engine_get(config, &acl);
+	const char *username, *clientid;
+	bool        result = config->acl_nomatch == ACL_ALLOW;
+
+	if (e != NULL) {
+		result = engine_decide(e, config, act_type, param, topic);
+		engine_put(e);
+		return result;
+	}
+
+	// not compiled (yet), walk the rules
+	username = (const char *) conn_param_get_username(param);
+	clientid = (const char *) conn_param_get_clientid(param);
+	for (size_t i = 0; i < acl.rule_count; i++) {
+		acl_rule *rule  = acl.rules[i];
+		bool      found = rule->topic_count == 0;
+
+		if (rule->action != ACL_ALL && rule->action != act_type) {
+			continue;
+		}
+		if (!match_rule_subject(rule, username, clientid)) {
+			continue;
+		}
+		for (size_t j = 0; j < rule->topic_count && !found; j++) {
+			found = topic_filter(rule->topics[j], topic);
+		}
+		if (found) {
+			result = rule->permit == ACL_ALLOW;
+			break;
+		}
+	}
+	engine_put(NULL);
+	return result;
+}
+
+static acl_pipe_cache **
+pipe_cache_find(uint32_t pipe)
+{
+	acl_pipe_cache **pp = &acl_state.buckets[pipe % ACL_CACHE_BUCKETS];
+
+	while (*pp != NULL && (*pp)->pipe != pipe) {
+		pp = &(*pp)->next;
+	}
+	return pp;
+}
+
+/**
+ * @brief auth_acl() with the recent verdicts of the pipe remembered.
+ */
+bool
+auth_acl_pipe(conf *config, acl_action_type act_type, uint32_t pipe,
+    conn_param *param, const char *topic)
+{
+	nng_mtx         *mtx;
+	acl_pipe_cache  *pc;
+	acl_verdict      v;
+	uint64_t         gen;
+	size_t           len;
+	uint32_t         hash;
+
+	if (acl_state.mtx == NULL) {
+		return auth_acl(config, act_type, param, topic);
+	}
+	hash = acl_hash(topic, &len);
+	if (len > ACL_CACHE_TOPIC_MAX) {
+		return auth_acl(config, act_type, param, topic);
+	}
+	mtx = acl_state.locks[(pipe % ACL_CACHE_BUCKETS) % ACL_CACHE_LOCKS];
+	gen = nng_atomic_get64(acl_state.gen);
+
+	nng_mtx_lock(mtx);
+	pc = *pipe_cache_find(pipe);
+	if (pc != NULL && pc->gen == gen) {
+		for (uint32_t i = 0; i < pc->len; i++) {
+			v = pc->slots[i];
+			if (v.hash == hash && v.len == len &&
+			    v.action == act_type &&
+			    memcmp(v.topic, topic, len) == 0) {
+				memmove(&pc->slots[1], &pc->slots[0],
+				    i * sizeof(acl_verdict));
+				pc->slots[0] = v;
+				nng_mtx_unlock(mtx);
+				return v.verdict;
+			}
+		}
+	}
+	nng_mtx_unlock(mtx);
+
+	v.hash    = hash;
+	v.len     = len;
+	v.action  = act_type;
+	v.verdict = auth_acl(config, act_type, param, topic);
+	if ((v.topic = nng_alloc(len + 1)) == NULL) {
+		return v.verdict;
+	}
+	memcpy(v.topic, topic, len + 1);
+
+	nng_mtx_lock(mtx);
+	pc = *pipe_cache_find(pipe);
+	if (pc == NULL && (pc = nng_zalloc(sizeof(*pc))) != NULL) {
+		pc->pipe = pipe;
+		pc->gen  = gen;
+		pc->next = acl_state.buckets[pipe % ACL_CACHE_BUCKETS];
+		acl_state.buckets[pipe % ACL_CACHE_BUCKETS] = pc;
+	}
+	if (pc == NULL || pc->gen > gen) {
+		// rules were reloaded while this verdict was made
+		nng_mtx_unlock(mtx);
+		nng_free(v.topic, len + 1);
+		return v.verdict;
+	}
+	if (pc->gen != gen) {
+		pipe_cache_clear(pc);
+		pc->gen = gen;
+	}
+	if (pc->len == ACL_CACHE_SLOTS) {
+		pc->len--;
+		nng_free(pc->slots[pc->len].topic, pc->slots[pc->len].len + 1);
+	}
+	memmove(&pc->slots[1], &pc->slots[0], pc->len * sizeof(acl_verdict));
+	pc->slots[0] = v;
+	pc->len++;
+	nng_mtx_unlock(mtx);
+	return v.verdict;
+}
+
+// the pipe is gone, its id may come back for another client
+void
+acl_cache_drop(uint32_t pipe)
+{
+	nng_mtx         *mtx;
+	acl_pipe_cache **pp, *pc;
+
+	if (acl_state.mtx == NULL) {
+		return;
+	}
+	mtx = acl_state.locks[(pipe % ACL_CACHE_BUCKETS) % ACL_CACHE_LOCKS];
+	nng_mtx_lock(mtx);
+	pp = pipe_cache_find(pipe);
+	if ((pc = *pp) != NULL) {
+		*pp = pc->next;
+		pipe_cache_clear(pc);
+		nng_free(pc, sizeof(*pc));
 	}
+	nng_mtx_unlock(mtx);
 }
-#endif
\ No newline at end of file
+#endif
@@ -9,6 +9,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if !defined(NANO_PLATFORM_WINDOWS)
 #include <signal.h>
@@ -35,18 +36,25 @@
 
 #include "include/acl_handler.h"
 #include "include/bridge.h"
+#include "include/bridge_envelope.h"
+#include "include/bridge_route.h"
 #include "include/nanomq_rule.h"
 #include "include/mqtt_api.h"
 #include "include/nanomq.h"
 #include "include/process.h"
 #include "include/pub_handler.h"
 #include "include/sub_handler.h"
+#include "include/sub_cache.h"
 #include "include/unsub_handler.h"
 #include "include/web_server.h"
 #include "include/rest_api.h"
 #include "include/webhook_post.h"
 #include "include/webhook_inproc.h"
 #include "include/cmd_proc.h"
+#include "include/conf_ext.h"
+#include "include/retain_log.h"
+#include "include/rule_prog.h"
+#include "include/rule_sink.h"
 #include "include/nanomq.h"
 // #if defined(SUPP_RULE_ENGINE)
 // 	#include <foundationdb/fdb_c.h>
@@ -155,71 +163,362 @@ intHandler(int dummy)
 }
 #endif
 
-static inline bool
-bridge_handler(nano_work *work)
+// The publish rebuilt as a client msg, for the nodes that speak another
+// MQTT version than the publisher. Its topic, payload and properties are
+// copies the msg owns.
+static nng_msg *
+bridge_rebuild_msg(nano_work *work)
 {
-	nng_msg  *smsg;
-	bool      rv    = false;
 	property *props = NULL;
-	uint32_t  index = work->ctx.id - 1;
 
 	if (work->proto_ver == MQTT_PROTOCOL_VERSION_v5) {
 		mqtt_property_dup(
 		    &props, work->pub_packet->var_header.publish.properties);
 	}
-
-	smsg = bridge_publish_msg(
+	return bridge_publish_msg(
 	    work->pub_packet->var_header.publish.topic_name.body,
 	    work->pub_packet->payload.data, work->pub_packet->payload.len,
 	    work->pub_packet->fixed_header.dup,
 	    work->pub_packet->fixed_header.qos,
 	    work->pub_packet->fixed_header.retain, props);
+}
 
-	for (size_t t = 0; t < work->config->bridge.count; t++) {
+static inline bool
+bridge_handler(nano_work *work)
+{
+	nng_msg      *smsg;
+	bool          rv     = false;
+	bool          wire_5 = nng_msg_cmd_type(work->msg) == CMD_PUBLISH_V5;
+	bridge_route *route  = bridge_route_get();
+
+	if (work->bridge_ids != NULL) {
+		cvector_set_size(work->bridge_ids, 0);
+	}
+	if (route == NULL) {
+		return false;
+	}
+	// the nodes to forward to in one walk, aws_bridge_forward() takes
+	// its own from the same ids
+	bridge_route_match(route,
+	    work->pub_packet->var_header.publish.topic_name.body,
+	    &work->bridge_ids);
+
+	for (size_t k = 0; k < cvector_size(work->bridge_ids); k++) {
+		uint32_t t = work->bridge_ids[k];
+		if (t >= work->config->bridge.count) {
+			// aws_bridge.nodes, ids are in node order
+			break;
+		}
 		conf_bridge_node *node = work->config->bridge.nodes[t];
 		nng_mtx_lock(node->mtx);
 		if (node->enable) {
-			for (size_t i = 0; i < node->forwards_count; i++) {
-				if (topic_filter(node->forwards[i],
-				        work->pub_packet->var_header.publish
-				            .topic_name.body)) {
-					work->state = SEND;
-					nng_msg_clone(smsg);
-					nng_socket *socket = node->sock;
-
-					// what if send qos msg failed?
-					// nanosdk deal with fail send
-					// and close the pipe
-					if (nng_aio_busy(
-					        node->bridge_aio[index])) {
-						nng_msg_free(smsg);
-						log_info(
-						    "bridging to %s aio busy! "
-						    "msg lost! ",
-						    node->address);
-					} else {
-						nng_aio_set_timeout(node->bridge_aio[index],
-						    3000);
-						nng_aio_set_msg(node->bridge_aio[index],
-						    smsg);
-						nng_send_aio(*socket, node->bridge_aio[index]);
-					}
-					rv = true;
-				}
+			bridge_param *param = node->bridge_arg;
+
+			// a msg of its own per node, the client sets the packet
+			// id in it. Nodes of the same version take the wire
+			// image as it came in.
+			smsg = NULL;
+			if (wire_5 ==
+			    (node->proto_ver == MQTT_PROTOCOL_VERSION_v5)) {
+				smsg = bridge_wire_msg(work->msg,
+				    work->pub_packet->var_header.publish
+				        .topic_name.body);
 			}
+			if (smsg == NULL) {
+				smsg = bridge_rebuild_msg(work);
+			}
+			work->state = SEND;
+			// queued on the connection of the topic, spilled or
+			// dropped when full
+			bridge_forward(param, smsg);
+			rv = true;
 		}
 		nng_mtx_unlock(node->mtx);
 	}
-	if (!rv) {
-		work->proto_ver == MQTT_PROTOCOL_VERSION_v5
-		    ? nng_mqttv5_msg_encode(smsg)
-		    : nng_mqtt_msg_encode(smsg);
-	}
-	nng_msg_free(smsg);
 
 	return rv;
 }
 
+// Encode the publish at most once and hand the very same wire image to
+// every subscriber pipe. Only a reference is taken per pipe, per-pipe
+// fields (packet id, QoS downgrade, v4/v5 properties) are patched by the
+// protocol layer when the msg is written out.
+static inline void
+server_pub_fanout(nano_work *work, nng_msg *smsg)
+{
+	mqtt_msg_info *msg_infos = work->pipe_ct->msg_infos;
+	size_t         size      = work->pipe_ct->msg_infos_len;
+
+	if (size == 0) {
+		return;
+	}
+	work->msg = smsg;
+	if (!encode_pub_message(smsg, work, PUBLISH)) {
+		return;
+	}
+	for (size_t i = 0; i < size; ++i) {
+		nng_msg_clone(smsg);
+		work->pid.id = msg_infos[i].pipe;
+		nng_aio_set_prov_data(work->aio, &work->pid.id);
+		work->msg = smsg;
+		nng_aio_set_msg(work->aio, work->msg);
+		nng_ctx_send(work->ctx, work->aio);
+	}
+}
+
+static inline void
+server_pub_release(nano_work *work)
+{
+	nng_msg_free(work->msg);
+	work->msg = NULL;
+	// free conn_param due to clone in protocol layer
+	conn_param_free(work->cparam);
+	free_pub_packet(work->pub_packet);
+	work->pub_packet = NULL;
+	free_pipe_content(work->pipe_ct);
+}
+
+// Hand a publish that went through handle_pub over to the batch. The
+// work keeps going with the spare pipe_content of the slot.
+static inline void
+server_batch_stage(nano_work *work)
+{
+	pub_batch           *batch = &work->batch;
+	pub_batch_entry     *e     = &batch->entries[batch->len];
+	struct pipe_content *spare = e->pipe_ct;
+
+	e->msg        = work->msg;
+	e->pid        = work->pid;
+	e->cparam     = work->cparam;
+	e->pub_packet = work->pub_packet;
+	e->pipe_ct    = work->pipe_ct;
+	e->proto_ver  = work->proto_ver;
+
+	work->msg        = NULL;
+	work->cparam     = NULL;
+	work->pub_packet = NULL;
+	work->pipe_ct    = spare;
+	if (batch->len++ == 0) {
+		batch->deadline =
+		    nng_clock() + conf_ext_get()->mqtt.batch_latency;
+	}
+}
+
+// Fan out every staged publish back to back, then run bridge, rule
+// engine and webhook for each of them. The state of the msg the work is
+// currently handling is left untouched.
+static void
+server_batch_flush(nano_work *work)
+{
+	pub_batch                *batch      = &work->batch;
+	nng_msg                  *msg        = work->msg;
+	nng_pipe                  pid        = work->pid;
+	conn_param               *cparam     = work->cparam;
+	struct pub_packet_struct *pub_packet = work->pub_packet;
+	struct pipe_content      *pipe_ct    = work->pipe_ct;
+	uint8_t                   proto_ver  = work->proto_ver;
+	uint8_t                   flag       = work->flag;
+
+	if (batch->len == 0) {
+		return;
+	}
+	nng_aio_set_timeout(work->aio, NNG_DURATION_DEFAULT);
+	for (uint32_t i = 0; i < batch->len; i++) {
+		pub_batch_entry *e = &batch->entries[i];
+
+		work->pid        = e->pid;
+		work->cparam     = e->cparam;
+		work->pub_packet = e->pub_packet;
+		work->pipe_ct    = e->pipe_ct;
+		work->proto_ver  = e->proto_ver;
+		work->flag       = CMD_PUBLISH;
+		server_pub_fanout(work, e->msg);
+		work->msg = e->msg;
+
+		if (work->config->bridge_mode) {
+			bridge_handler(work);
+#if defined(SUPP_AWS_BRIDGE)
+			aws_bridge_forward(work);
+#endif
+		}
+#if defined(SUPP_RULE_ENGINE)
+		if (work->config->rule_eng.option != RULE_ENG_OFF) {
+			rule_engine_insert_sql(work);
+		}
+#endif
+		webhook_entry(work, 0);
+		server_pub_release(work);
+	}
+	log_trace("flushed %u staged publishes", batch->len);
+	batch->len = 0;
+
+	work->msg        = msg;
+	work->pid        = pid;
+	work->cparam     = cparam;
+	work->pub_packet = pub_packet;
+	work->pipe_ct    = pipe_ct;
+	work->proto_ver  = proto_ver;
+	work->flag       = flag;
+}
+
+// Receive the next msg for a work that has publishes staged, the recv
+// times out when the oldest of them is due.
+static inline void
+server_batch_recv(nano_work *work)
+{
+	pub_batch *batch = &work->batch;
+	nng_time   now   = nng_clock();
+
+	if (batch->len == batch->cap || now >= batch->deadline) {
+		server_batch_flush(work);
+	} else {
+		nng_aio_set_timeout(
+		    work->aio, (nng_duration) (batch->deadline - now));
+	}
+	work->state = RECV;
+	nng_ctx_recv(work->ctx, work->aio);
+}
+
+struct envelope_unpack {
+	nano_work  *work;
+	nng_pipe    pipe;
+	const char *clientid;
+	uint8_t     proto_ver;
+	uint32_t    dropped; // records on topics the node did not subscribe
+};
+
+// one publish of the envelope, as if the bridge had received it: only
+// on a topic the node subscribed to, within the qos it was granted
+static int
+envelope_record_cb(bridge_envelope_record *rec, void *arg)
+{
+	struct envelope_unpack *u   = arg;
+	uint8_t                 qos = rec->qos;
+	nng_msg                *msg;
+	char                   *topic;
+
+	if ((topic = nng_alloc(rec->topic_len + 1)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	memcpy(topic, rec->topic, rec->topic_len);
+	topic[rec->topic_len] = '\0';
+	if (!bridge_envelope_accept(u->work->node, topic, &qos)) {
+		log_debug("bridge envelope record on %s dropped, not "
+		          "subscribed",
+		    topic);
+		nng_free(topic, rec->topic_len + 1);
+		u->dropped++;
+		return 0;
+	}
+	msg = bridge_publish_msg(topic, (uint8_t *) rec->payload,
+	    rec->payload_len, false, qos, rec->retain, NULL);
+	nng_free(topic, rec->topic_len + 1);
+	if (msg == NULL) {
+		return NNG_ENOMEM;
+	}
+	if (u->proto_ver == MQTT_PROTOCOL_VERSION_v5) {
+		nng_mqttv5_msg_encode(msg);
+	} else {
+		nng_mqtt_msg_encode(msg);
+	}
+	nng_msg_set_cmd_type(msg, CMD_PUBLISH);
+	nng_msg_set_pipe(msg, u->pipe);
+	nng_msg_set_conn_param(
+	    msg, create_cparam(u->clientid, u->proto_ver));
+	cvector_push_back(u->work->unpacked, msg);
+	return 0;
+}
+
+// A publish a bridge with envelope enabled received on its envelope
+// topic is an envelope of a nanomq peer: it is replaced by the first of
+// the publishes it packs, server_extra_recv() hands the others over after
+// it. Records on topics none of the subscriptions of the node match are
+// dropped, so a remote publisher cannot reach local topics past them,
+// and NULL comes back when that leaves nothing. Anything else comes back
+// as it is.
+static nng_msg *
+server_envelope_unpack(nano_work *work, nng_msg *msg)
+{
+	conn_param            *cparam = nng_msg_get_conn_param(msg);
+	struct envelope_unpack u;
+	const conf_bridge_ext *ext;
+	const char            *topic;
+	uint8_t               *payload;
+	uint32_t               len = 0;
+	int                    rv;
+
+	if (work->node == NULL) {
+		return msg;
+	}
+	ext = conf_ext_bridge(conf_ext_get(), work->node->name);
+	if (!ext->envelope.enable || ext->envelope.topic == NULL) {
+		return msg;
+	}
+	topic = nng_mqtt_msg_get_publish_topic(msg, &len);
+	if (topic == NULL || len != strlen(ext->envelope.topic) ||
+	    memcmp(topic, ext->envelope.topic, len) != 0) {
+		return msg;
+	}
+	len     = 0;
+	payload = nng_mqtt_msg_get_publish_payload(msg, &len);
+	if (payload == NULL || !bridge_envelope_check(payload, len)) {
+		return msg;
+	}
+	u.work      = work;
+	u.pipe      = nng_msg_get_pipe(msg);
+	u.clientid  = (const char *) conn_param_get_clientid(cparam);
+	u.proto_ver = conn_param_get_protover(cparam);
+	u.dropped   = 0;
+	if (u.clientid == NULL) {
+		u.clientid = "";
+	}
+	rv = bridge_envelope_unpack(payload, len, envelope_record_cb, &u);
+	if (rv == 0 && cvector_size(work->unpacked) == 0 && u.dropped > 0) {
+		log_warn("bridge envelope of %u msgs on unsubscribed topics "
+		         "dropped",
+		    u.dropped);
+		conn_param_free(cparam);
+		nng_msg_free(msg);
+		return NULL;
+	}
+	if (rv != 0 || cvector_size(work->unpacked) == 0) {
+		log_warn("bridge envelope delivered as it is: %d", rv);
+		for (size_t i = 0; i < cvector_size(work->unpacked); i++) {
+			conn_param_free(
+			    nng_msg_get_conn_param(work->unpacked[i]));
+			nng_msg_free(work->unpacked[i]);
+		}
+		if (work->unpacked != NULL) {
+			cvector_set_size(work->unpacked, 0);
+		}
+		return msg;
+	}
+	// free conn_param due to clone in protocol layer
+	conn_param_free(cparam);
+	nng_msg_free(msg);
+	work->unpacked_next = 1;
+	return work->unpacked[0];
+}
+
+// Go on with the next publish unpacked from an envelope, or with the
+// extra ctx once there is none left.
+static void
+server_extra_recv(nano_work *work)
+{
+	work->state = RECV;
+	if (work->unpacked_next < cvector_size(work->unpacked)) {
+		nng_aio_set_msg(
+		    work->aio, work->unpacked[work->unpacked_next++]);
+		nng_aio_finish(work->aio, 0);
+		return;
+	}
+	if (work->unpacked != NULL) {
+		cvector_set_size(work->unpacked, 0);
+	}
+	work->unpacked_next = 0;
+	nng_ctx_recv(work->extra_ctx, work->aio);
+}
+
 void
 server_cb(void *arg)
 {
@@ -228,7 +527,6 @@ server_cb(void *arg)
 	nng_msg       *smsg = NULL;
 	int            rv;
 
-	mqtt_msg_info *msg_info;
 	nng_socket    *newsock = NULL;
 
 	switch (work->state) {
@@ -245,8 +543,15 @@ server_cb(void *arg)
 		break;
 	case RECV:
 		log_debug("RECV  ^^^^ ctx%d ^^^^\n", work->ctx.id);
+		// nothing allocated by the previous cycle is alive anymore,
+		// unless it belongs to a staged publish
+		if (work->batch.len == 0) {
+			nano_arena_reset(work->arena);
+		}
 		if ((rv = nng_aio_result(work->aio)) != 0) {
 			// log_warn("RECV nng aio result error: %d", rv);
+			// NNG_ETIMEDOUT: staged publishes are due
+			server_batch_flush(work);
 			work->state = RECV;
 			if (work->proto == PROTO_MQTT_BROKER) {
 				nng_ctx_recv(work->ctx, work->aio);
@@ -267,7 +572,15 @@ server_cb(void *arg)
 			type = nng_msg_get_type(msg);
 			if (type == CMD_CONNACK) {
 				log_info("bridge client is connected!");
-			} else if (type != CMD_PUBLISH) {
+			} else if (type == CMD_PUBLISH) {
+				if (cvector_size(work->unpacked) == 0 &&
+				    (msg = server_envelope_unpack(
+				         work, msg)) == NULL) {
+					work->state = RECV;
+					nng_ctx_recv(work->extra_ctx, work->aio);
+					break;
+				}
+			} else {
 				// only accept publish/CONNACK/DISCONNECT
 				// msg from upstream
 				work->state = RECV;
@@ -295,6 +608,11 @@ server_cb(void *arg)
 		work->proto_ver = conn_param_get_protover(work->cparam);
 		work->flag      = nng_msg_cmd_type(msg);
 
+		// anything but a publish goes out after the staged ones
+		if (work->batch.len > 0 && work->flag != CMD_PUBLISH) {
+			server_batch_flush(work);
+		}
+
 		if (work->flag == CMD_SUBSCRIBE) {
 			smsg = work->msg;
 			work->msg_ret = NULL;
@@ -413,6 +731,7 @@ server_cb(void *arg)
 				break;
 			}
 			if (work->code != SUCCESS) {
+				server_batch_flush(work);
 				//what if extra ctx brings a wrong msg?
 				if (work->proto != PROTO_MQTT_BROKER) {
 					work->state = SEND;
@@ -423,13 +742,18 @@ server_cb(void *arg)
 				work->state = CLOSE;
 				free_pub_packet(work->pub_packet);
 				work->pub_packet = NULL;
-				cvector_free(work->pipe_ct->msg_infos);
+				free_pipe_content(work->pipe_ct);
 				// free conn_param due to clone in protocol layer
 				conn_param_free(work->cparam);
 				nng_aio_finish(work->aio, 0);
 				// break or return?
 				break;
 			}
+			if (work->batch.cap > 0) {
+				server_batch_stage(work);
+				server_batch_recv(work);
+				break;
+			}
 		} else if (work->flag == CMD_CONNACK) {
 			uint8_t *body        = nng_msg_body(work->msg);
 			uint8_t  reason_code = *(body + 1);
@@ -441,6 +765,12 @@ server_cb(void *arg)
 				nng_aio_set_msg(work->aio, work->msg);
 				nng_ctx_send(work->ctx, work->aio);
 			}
+			// a resumed session is put back into the tree by the
+			// protocol layer, behind the subscriber cache's back and
+			// with filters not known here
+			if (conn_param_get_clean_start(work->cparam) == 0) {
+				sub_cache_invalidate(NULL);
+			}
 			smsg = nano_msg_notify_connect(work->cparam, reason_code);
 			webhook_entry(work, reason_code);
 			// Set V4/V5 flag for publish notify msg
@@ -466,6 +796,9 @@ server_cb(void *arg)
 			if (dbhash_check_id(work->pid.id)) {
 				destroy_sub_client(work->pid.id, work->db);
 			}
+#ifdef ACL_SUPP
+			acl_cache_drop(work->pid.id);
+#endif
 			// bridge's will msg only valid at remote
 			if (work->proto != PROTO_MQTT_BRIDGE) {
 				if (conn_param_get_will_flag(work->cparam) ==
@@ -497,21 +830,10 @@ server_cb(void *arg)
 				nng_fatal("WAIT nng_ctx_recv/send", rv);
 			}
 			smsg      = work->msg; // reuse the same msg
-			cvector(mqtt_msg_info) msg_infos;
-			msg_infos = work->pipe_ct->msg_infos;
-
-			log_trace("total pipes: %ld", cvector_size(msg_infos));
-			if (cvector_size(msg_infos))
-				if (encode_pub_message(smsg, work, PUBLISH))
-					for (int i = 0; i < cvector_size(msg_infos) && rv== 0; ++i) {
-						msg_info = &msg_infos[i];
-						nng_msg_clone(smsg);
-						work->pid.id = msg_info->pipe;
-						nng_aio_set_prov_data(work->aio, &work->pid.id);
-						work->msg = smsg;
-						nng_aio_set_msg(work->aio, work->msg);
-						nng_ctx_send(work->ctx, work->aio);
-					}
+
+			log_trace("total pipes: %u",
+			    work->pipe_ct->msg_infos_len);
+			server_pub_fanout(work, smsg);
 			work->msg = smsg;
 
 			// bridge logic first
@@ -532,19 +854,11 @@ server_cb(void *arg)
 				nng_aio_finish(work->aio, 0);
 				break;
 			}
-			nng_msg_free(work->msg);
+			server_pub_release(work);
 			smsg = NULL;
-			work->msg = NULL;
-			// free conn_param due to clone in protocol layer
-			conn_param_free(work->cparam);
-			free_pub_packet(work->pub_packet);
-			work->pub_packet = NULL;
-			cvector_free(msg_infos);
-			work->pipe_ct->msg_infos = NULL;
-			init_pipe_content(work->pipe_ct);
 			work->state = RECV;
 			if (work->proto != PROTO_MQTT_BROKER) {
-				nng_ctx_recv(work->extra_ctx, work->aio);
+				server_extra_recv(work);
 			} else {
 				nng_ctx_recv(work->ctx, work->aio);
 			}
@@ -587,11 +901,7 @@ server_cb(void *arg)
 			free_pub_packet(work->pub_packet);
 			work->pub_packet = NULL;
 		}
-		if (work->pipe_ct->msg_infos != NULL) {
-			cvector_free(work->pipe_ct->msg_infos);
-			work->pipe_ct->msg_infos = NULL;
-			init_pipe_content(work->pipe_ct);
-		}
+		free_pipe_content(work->pipe_ct);
 		// free conn_param due to clone in protocol layer
 		conn_param_free(work->cparam);
 		work->state = RECV;
@@ -599,7 +909,7 @@ server_cb(void *arg)
 		if (work->proto == PROTO_MQTT_BROKER) {
 			nng_ctx_recv(work->ctx, work->aio);
 		} else{
-			nng_ctx_recv(work->extra_ctx, work->aio);
+			server_extra_recv(work);
 		}
 		break;
 	case END:
@@ -613,31 +923,16 @@ server_cb(void *arg)
 			smsg      = work->msg; // reuse the same msg
 			work->msg = NULL;
 
-			cvector(mqtt_msg_info) msg_infos;
-			msg_infos = work->pipe_ct->msg_infos;
-
-			log_debug("total pipes: %ld", cvector_size(msg_infos));
-			//TODO encode abstract msg only
-			if (cvector_size(msg_infos))
-				if (encode_pub_message(smsg, work, PUBLISH))
-					for (int i=0; i<cvector_size(msg_infos); ++i) {
-						msg_info = &msg_infos[i];
-						nng_msg_clone(smsg);
-						work->pid.id = msg_info->pipe;
-						nng_aio_set_prov_data(work->aio, &work->pid.id);
-						work->msg = smsg;
-						nng_aio_set_msg(work->aio, work->msg);
-						nng_ctx_send(work->ctx, work->aio);
-					}
+			log_debug("total pipes: %u",
+			    work->pipe_ct->msg_infos_len);
+			server_pub_fanout(work, smsg);
 			webhook_entry(work, 0);
 			nng_msg_free(smsg);
 			smsg = NULL;
 			work->msg = NULL;
 			free_pub_packet(work->pub_packet);
 			work->pub_packet = NULL;
-			cvector_free(work->pipe_ct->msg_infos);
-			work->pipe_ct->msg_infos = NULL;
-			init_pipe_content(work->pipe_ct);
+			free_pipe_content(work->pipe_ct);
 
 			// processing will msg
 			if (conn_param_get_will_flag(work->cparam) &&
@@ -668,6 +963,9 @@ server_cb(void *arg)
 					    .prop_len = get_properties_len(
 					    work->pub_packet->var_header
 					        .publish.properties);
+					// will properties differ from the
+					// composed msg, re-encode in WAIT
+					work->pub_packet->encoded = false;
 				} else {
 					nng_msg_set_cmd_type(msg, CMD_PUBLISH);
 					handle_pub(work, work->pipe_ct,
@@ -732,14 +1030,62 @@ alloc_work(nng_socket sock)
 	w->pipe_ct = nng_alloc(sizeof(struct pipe_content));
 	init_pipe_content(w->pipe_ct);
 	w->pub_packet = NULL;
+	if ((rv = nano_arena_init(&w->arena, NANO_ARENA_CHUNK_SIZE)) != 0) {
+		nng_fatal("nano_arena_init", rv);
+	}
+	memset(&w->batch, 0, sizeof(w->batch));
+	if ((rv = nng_msg_alloc(&w->json_buf, 0)) != 0) {
+		nng_fatal("nng_msg_alloc", rv);
+	}
+	w->payload_json   = NULL;
+	w->payload_parsed = false;
+	w->payload_whole  = false;
+	w->rule_ids       = NULL;
+	w->bridge_ids     = NULL;
+	w->unpacked       = NULL;
+	w->unpacked_next  = 0;
+	w->node           = NULL;
 
 	w->state = INIT;
 	return (w);
 }
 
+static void
+alloc_batch(nano_work *w, uint32_t cap)
+{
+	pub_batch *batch = &w->batch;
+
+	if ((batch->entries = nng_zalloc(cap * sizeof(pub_batch_entry))) ==
+	    NULL) {
+		nng_fatal("nng_zalloc", NNG_ENOMEM);
+	}
+	for (uint32_t i = 0; i < cap; i++) {
+		if ((batch->entries[i].pipe_ct =
+		            nng_alloc(sizeof(struct pipe_content))) == NULL) {
+			nng_fatal("nng_alloc", NNG_ENOMEM);
+		}
+		init_pipe_content(batch->entries[i].pipe_ct);
+	}
+	batch->cap = cap;
+}
+
+static void
+free_batch(nano_work *w)
+{
+	pub_batch *batch = &w->batch;
+
+	for (uint32_t i = 0; i < batch->cap; i++) {
+		free_pipe_content(batch->entries[i].pipe_ct);
+		nng_free(batch->entries[i].pipe_ct, sizeof(struct pipe_content));
+	}
+	nng_free(batch->entries, batch->cap * sizeof(pub_batch_entry));
+	batch->entries = NULL;
+	batch->cap     = 0;
+}
+
 nano_work *
 proto_work_init(nng_socket sock,nng_socket inproc_sock, nng_socket bridge_sock, uint8_t proto,
-    dbtree *db_tree, dbtree *db_tree_ret, conf *config)
+    dbtree *db_tree, retain_store *db_tree_ret, conf *config)
 {
 	int        rv;
 	nano_work *w;
@@ -752,6 +1098,12 @@ proto_work_init(nng_socket sock,nng_socket inproc_sock, nng_socket bridge_sock,
 
 	w->sqlite_db = NULL;
 
+	// publishes from bridges and the http api are never coalesced
+	if (proto == PROTO_MQTT_BROKER &&
+	    conf_ext_get()->mqtt.batch_size > 1) {
+		alloc_batch(w, conf_ext_get()->mqtt.batch_size);
+	}
+
 #if defined(NNG_SUPP_SQLITE)
 	nng_socket_get_ptr(sock, NMQ_OPT_MQTT_QOS_DB, &w->sqlite_db);
 #endif
@@ -789,7 +1141,8 @@ proto_work_init(nng_socket sock,nng_socket inproc_sock, nng_socket bridge_sock,
 }
 
 static dbtree           *db        = NULL;
-static dbtree           *db_ret    = NULL;
+static retain_store     *db_ret    = NULL;
+static retain_log       *db_ret_log = NULL;
 // TODO For HTTP SUB/UNSUB usage
 static struct hashmap_s *cid_table = NULL;
 
@@ -859,6 +1212,12 @@ broker(conf *nanomq_conf)
 		}
 	}
 
+	if ((rv = rule_set_load(cr)) != 0) {
+		nng_fatal("rule_set_load", rv);
+	}
+	if ((rv = rule_sink_start(cr)) != 0) {
+		nng_fatal("rule_sink_start", rv);
+	}
 
 
 #endif
@@ -868,9 +1227,40 @@ broker(conf *nanomq_conf)
 	if (db == NULL) {
 		printf("NNL_ERROR error in db create");
 	}
-	dbtree_create(&db_ret);
-	if (db_ret == NULL) {
-		printf("NNL_ERROR error in db create");
+	if (retain_store_create(&db_ret) != 0) {
+		printf("NNL_ERROR error in retain store create");
+	}
+	conf_retain_ext *retain_conf = &conf_ext_get()->retain;
+	if (db_ret != NULL && retain_conf->backend == RETAIN_BACKEND_LOG) {
+		bool retain_in_sqlite = false;
+#if defined(NNG_SUPP_SQLITE)
+		retain_in_sqlite = nanomq_conf->sqlite.enable;
+#endif
+		if (retain_in_sqlite) {
+			log_warn("retained msgs are kept in sqlite, retain log "
+			         "is not used");
+		} else if ((rv = retain_log_open(&db_ret_log,
+		                retain_conf->path != NULL
+		                    ? retain_conf->path
+		                    : CONF_EXT_RETAIN_LOG_PATH,
+		                db_ret, retain_conf->compact_interval)) != 0) {
+			log_error("retain log disabled: %s", nng_strerror(rv));
+		}
+	}
+
+	if ((rv = sub_cache_init(SUB_CACHE_BUCKETS)) != 0) {
+		log_warn("subscriber cache disabled: %s", nng_strerror(rv));
+	}
+#ifdef ACL_SUPP
+	if (nanomq_conf->acl.enable &&
+	    (rv = acl_engine_load(nanomq_conf)) != 0) {
+		log_warn("acl rules are walked linearly: %s", nng_strerror(rv));
+	}
+#endif
+	if (conf_ext_get()->mqtt.batch_size > 1) {
+		log_info("publish batching: up to %u msgs within %u ms",
+		    conf_ext_get()->mqtt.batch_size,
+		    conf_ext_get()->mqtt.batch_latency);
 	}
 
 	dbhash_init_cached_table();
@@ -940,6 +1330,9 @@ broker(conf *nanomq_conf)
 			}
 		}
 #endif
+		if ((rv = bridge_route_load(nanomq_conf)) != 0) {
+			nng_fatal("bridge_route_load", rv);
+		}
 	log_debug("bridge init finished");
 	}
 	// MQTT Broker service
@@ -966,6 +1359,7 @@ broker(conf *nanomq_conf)
 					    inproc_sock, *bridge_sock,
 					    PROTO_MQTT_BRIDGE, db, db_ret,
 					    nanomq_conf);
+					works[i]->node = node;
 				}
 				tmp += node->parallel;
 			}
@@ -1122,29 +1516,40 @@ broker(conf *nanomq_conf)
 			conf *conf = works[0]->config;
 			for (size_t t = 0; t < conf->bridge.count; t++) {
 				conf_bridge_node *node = conf->bridge.nodes[t];
-				size_t aio_count = (conf->parallel + node->parallel * 2);
-				if (node->enable) {
-					for (size_t i = 0; i < aio_count; i++) {
-						nng_aio_finish_error(node->bridge_aio[i], 0);
-						nng_aio_abort(node->bridge_aio[i], NNG_ECLOSED);
-						nng_aio_free(node->bridge_aio[i]);
-					}
-					nng_free(node->bridge_aio, aio_count * sizeof(nng_aio *));
+				if (node->enable && node->bridge_arg != NULL) {
+					bridge_param *param = node->bridge_arg;
+					bridge_conns_free(param);
 				}
 				// free(node->name);
 				// free(node->address);
 				// free(node->clientid);
 				// nng_free(node, sizeof(conf_bridge_node));
 			}
+			bridge_route_fini();
 			// nng_free(
 			//     conf->bridge.nodes, sizeof(conf_bridge_node **));
 
 			for (size_t i = 0; i < num_ctx; i++) {
 				nng_free(works[i]->pipe_ct,
 				    sizeof(struct pipe_content));
+				nano_arena_fini(works[i]->arena);
+				nng_msg_free(works[i]->json_buf);
+				cvector_free(works[i]->rule_ids);
+				cvector_free(works[i]->bridge_ids);
+				cvector_free(works[i]->unpacked);
+				free_batch(works[i]);
 				nng_free(works[i], sizeof(struct work));
 			}
 			nng_free(works, num_ctx * sizeof(struct work *));
+			sub_cache_fini();
+			retain_log_close(db_ret_log);
+#ifdef ACL_SUPP
+			acl_engine_fini();
+#endif
+#if defined(SUPP_RULE_ENGINE)
+			rule_sink_stop();
+			rule_set_fini();
+#endif
 			break;
 		}
 		nng_msleep(6000);
@@ -1561,6 +1966,7 @@ broker_start(int argc, char **argv)
 
 	// Priority: config < environment variables < command opts
 	conf_init(nanomq_conf);
+	conf_ext_init(conf_ext_get());
 
 	rc = file_path_parse(argc, argv, &nanomq_conf->conf_file);
 
@@ -1573,6 +1979,7 @@ broker_start(int argc, char **argv)
 	} else {
 		// HOCON as default
 		conf_parse_ver2(nanomq_conf);
+		conf_ext_parse(conf_ext_get(), nanomq_conf);
 	}
 
 	read_env_conf(nanomq_conf);
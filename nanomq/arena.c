@@ -0,0 +1,240 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/arena.h"
+#include "nng/supplemental/util/platform.h"
+#include "nng/supplemental/nanolib/log.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(x) (((x) + (ARENA_ALIGN - 1)) & ~((size_t) ARENA_ALIGN - 1))
+
+typedef struct arena_chunk arena_chunk;
+
+struct arena_chunk {
+	arena_chunk *next;
+	size_t       size; // usable bytes behind the header
+	size_t       used;
+	size_t       last; // offset of the latest allocation
+};
+
+// keep chunk data aligned whatever the header size is
+#define CHUNK_HDR ARENA_ROUND(sizeof(arena_chunk))
+#define CHUNK_DATA(c) ((uint8_t *) (c) + CHUNK_HDR)
+
+struct nano_arena {
+	arena_chunk *head; // chunk allocations are taken from
+	size_t       chunk_size;
+	// per cycle counters, folded into the global ones on reset so the
+	// hot path never touches a shared cache line
+	uint64_t allocs;
+	uint64_t bytes;
+	uint64_t chunks;
+};
+
+static struct {
+	bool            initialed;
+	nng_atomic_u64 *allocs;
+	nng_atomic_u64 *bytes;
+	nng_atomic_u64 *chunks;
+	nng_atomic_u64 *resets;
+} g_arena = { .initialed = false };
+
+static arena_chunk *
+chunk_alloc(size_t size)
+{
+	arena_chunk *c;
+
+	if ((c = nng_alloc(CHUNK_HDR + size)) == NULL) {
+		return NULL;
+	}
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	c->last = 0;
+	return c;
+}
+
+static void
+chunk_free(arena_chunk *c)
+{
+	nng_free(c, CHUNK_HDR + c->size);
+}
+
+int
+nano_arena_init(nano_arena **arena, size_t chunk_size)
+{
+	nano_arena *a;
+
+	// works are created from broker() before any of them runs
+	if (!g_arena.initialed) {
+		nng_atomic_alloc64(&g_arena.allocs);
+		nng_atomic_alloc64(&g_arena.bytes);
+		nng_atomic_alloc64(&g_arena.chunks);
+		nng_atomic_alloc64(&g_arena.resets);
+		g_arena.initialed = true;
+	}
+	if ((a = nng_zalloc(sizeof(*a))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	a->chunk_size = ARENA_ROUND(
+	    chunk_size == 0 ? NANO_ARENA_CHUNK_SIZE : chunk_size);
+	if ((a->head = chunk_alloc(a->chunk_size)) == NULL) {
+		nng_free(a, sizeof(*a));
+		return NNG_ENOMEM;
+	}
+	nng_atomic_inc64(g_arena.chunks);
+	*arena = a;
+	return 0;
+}
+
+void
+nano_arena_fini(nano_arena *arena)
+{
+	arena_chunk *c, *next;
+
+	if (arena == NULL) {
+		return;
+	}
+	for (c = arena->head; c != NULL; c = next) {
+		next = c->next;
+		chunk_free(c);
+	}
+	nng_free(arena, sizeof(*arena));
+}
+
+void *
+nano_arena_alloc(nano_arena *arena, size_t size)
+{
+	arena_chunk *c = arena->head;
+	void        *p;
+
+	size = ARENA_ROUND(size == 0 ? 1 : size);
+	if (c->size - c->used < size) {
+		// overflow chunk, merged into a bigger primary one on reset
+		size_t csz = size > arena->chunk_size ? size : arena->chunk_size;
+		if ((c = chunk_alloc(csz)) == NULL) {
+			log_error("arena chunk alloc %zu failed", csz);
+			return NULL;
+		}
+		c->next     = arena->head;
+		arena->head = c;
+		arena->chunks++;
+	}
+	p       = CHUNK_DATA(c) + c->used;
+	c->last = c->used;
+	c->used += size;
+	arena->allocs++;
+	arena->bytes += size;
+	return p;
+}
+
+void *
+nano_arena_zalloc(nano_arena *arena, size_t size)
+{
+	void *p;
+
+	if ((p = nano_arena_alloc(arena, size)) != NULL) {
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+void *
+nano_arena_realloc(
+    nano_arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+	arena_chunk *c = arena->head;
+	void        *p;
+
+	if (ptr == NULL) {
+		return nano_arena_alloc(arena, new_size);
+	}
+	// the latest allocation grows in place while the chunk has room
+	if ((uint8_t *) ptr == CHUNK_DATA(c) + c->last &&
+	    c->size - c->last >= ARENA_ROUND(new_size)) {
+		arena->bytes += ARENA_ROUND(new_size) - (c->used - c->last);
+		c->used = c->last + ARENA_ROUND(new_size);
+		return ptr;
+	}
+	if ((p = nano_arena_alloc(arena, new_size)) != NULL) {
+		memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+	}
+	return p;
+}
+
+void
+nano_arena_reset(nano_arena *arena)
+{
+	arena_chunk *c, *next;
+	size_t       total = 0;
+
+	if (arena == NULL) {
+		return;
+	}
+	if (arena->head->next != NULL) {
+		// the last cycle did not fit: replace all chunks by a single
+		// one big enough for it, so the next cycle stays off the heap
+		for (c = arena->head; c != NULL; c = c->next) {
+			total += c->used;
+		}
+		total = ARENA_ROUND(total);
+		if (total > NANO_ARENA_CHUNK_MAX) {
+			total = NANO_ARENA_CHUNK_MAX;
+		}
+		if (total < arena->chunk_size) {
+			total = arena->chunk_size;
+		}
+		if ((c = chunk_alloc(total)) != NULL) {
+			for (arena_chunk *old = arena->head; old != NULL;
+			     old = next) {
+				next = old->next;
+				chunk_free(old);
+			}
+			arena->chunk_size = total;
+			arena->head       = c;
+			arena->chunks++;
+		} else {
+			// keep the chunks we already have
+			log_warn("arena chunk alloc %zu failed", total);
+			for (c = arena->head->next; c != NULL; c = c->next) {
+				c->used = 0;
+				c->last = 0;
+			}
+		}
+	}
+	arena->head->used = 0;
+	arena->head->last = 0;
+
+	if (arena->allocs != 0) {
+		nng_atomic_add64(g_arena.allocs, arena->allocs);
+		nng_atomic_add64(g_arena.bytes, arena->bytes);
+		nng_atomic_inc64(g_arena.resets);
+	}
+	if (arena->chunks != 0) {
+		nng_atomic_add64(g_arena.chunks, arena->chunks);
+	}
+	arena->allocs = 0;
+	arena->bytes  = 0;
+	arena->chunks = 0;
+}
+
+void
+nano_arena_get_stats(nano_arena_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!g_arena.initialed) {
+		return;
+	}
+	stats->allocs = nng_atomic_get64(g_arena.allocs);
+	stats->bytes  = nng_atomic_get64(g_arena.bytes);
+	stats->chunks = nng_atomic_get64(g_arena.chunks);
+	stats->resets = nng_atomic_get64(g_arena.resets);
+}
@@ -23,6 +23,7 @@
 #include "nng/nng.h"
 #include "nng/protocol/reqrep0/req.h"
 #include "nng/supplemental/nanolib/conf.h"
+#include "nng/supplemental/nanolib/cvector.h"
 #include "nng/supplemental/nanolib/utils.h"
 #include "nng/supplemental/util/platform.h"
 #include "nng/supplemental/nanolib/log.h"
@@ -537,48 +538,39 @@ aws_bridge_forward(nano_work *work)
 	    work->pub_packet->fixed_header.qos,
 	    work->pub_packet->fixed_header.retain);
 
-	int rv;
+	int    rv;
+	size_t base = work->config->bridge.count;
 
-	for (size_t t = 0; t < work->config->aws_bridge.count; t++) {
-		conf_bridge_node *node = work->config->aws_bridge.nodes[t];
+	// matched by bridge_handler() for every bridge node, aws_bridge.nodes
+	// come after bridge.nodes
+	for (size_t k = 0; k < cvector_size(work->bridge_ids); k++) {
+		if (work->bridge_ids[k] < base) {
+			continue;
+		}
+		conf_bridge_node *node =
+		    work->config->aws_bridge.nodes[work->bridge_ids[k] - base];
 		if (node->enable) {
-			for (size_t i = 0; i < node->forwards_count; i++) {
-				if (topic_filter(node->forwards[i],
-				        work->pub_packet->var_header.publish
-				            .topic_name.body)) {
-					MQTTContext_t *mqtt_ctx = node->sock;
-					uint16_t       packet_id =
-					    MQTT_GetPacketId(mqtt_ctx);
-					rv = MQTT_Publish(
-					    mqtt_ctx, &pub_info, packet_id);
-
-					/* Calling MQTT_ProcessLoop to process
-					 * incoming publish echo, since
-					 * application subscribed to the same
-					 * topic the broker will send publish
-					 * message back to the application.
-					 * This function also sends ping
-					 * request to broker if
-					 * MQTT_KEEP_ALIVE_INTERVAL_SECONDS has
-					 * expired since the last MQTT packet
-					 * sent and receive ping responses. */
-					int mqttStatus =
-					    MQTT_ProcessLoop(mqtt_ctx,
-					        MQTT_PROCESS_LOOP_TIMEOUT_MS);
-
-					/* For any error in #MQTT_ProcessLoop,
-					 * exit the loop and disconnect from
-					 * the broker. */
-					if (mqttStatus != MQTTSuccess) {
-						log_error("MQTT_ProcessLoop "
-						          "returned with "
-						          "status = %s.",
-						    MQTT_Status_strerror(
-						        mqttStatus));
-						rv = EXIT_FAILURE;
-						break;
-					}
-				}
+			MQTTContext_t *mqtt_ctx  = node->sock;
+			uint16_t       packet_id = MQTT_GetPacketId(mqtt_ctx);
+			rv = MQTT_Publish(mqtt_ctx, &pub_info, packet_id);
+
+			/* Calling MQTT_ProcessLoop to process incoming publish
+			 * echo, since application subscribed to the same topic
+			 * the broker will send publish message back to the
+			 * application. This function also sends ping request
+			 * to broker if MQTT_KEEP_ALIVE_INTERVAL_SECONDS has
+			 * expired since the last MQTT packet sent and receive
+			 * ping responses. */
+			int mqttStatus =
+			    MQTT_ProcessLoop(mqtt_ctx, MQTT_PROCESS_LOOP_TIMEOUT_MS);
+
+			/* For any error in #MQTT_ProcessLoop, log it and go on
+			 * with the next node. */
+			if (mqttStatus != MQTTSuccess) {
+				log_error("MQTT_ProcessLoop returned with "
+				          "status = %s.",
+				    MQTT_Status_strerror(mqttStatus));
+				rv = EXIT_FAILURE;
 			}
 		}
 	}
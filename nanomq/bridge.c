@@ -14,6 +14,7 @@
 
 #include "include/nanomq.h"
 #include "include/mqtt_api.h"
+#include "include/conf_ext.h"
 
 #ifdef NNG_SUPP_TLS
 #include "nng/supplemental/tls/tls.h"
@@ -29,6 +30,9 @@ static const char *tls_scheme  = "tls+mqtt-tcp";
 static nng_mtx *reload_lock = NULL;
 
 static void bridge_tcp_connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg);
+static int  bridge_conns_alloc(
+     bridge_param *param, conf_bridge_node *node, bool multi);
+static int  bridge_conns_start(bridge_param *param, conf *config);
 
 #if defined(SUPP_QUIC)
 static int  bridge_quic_connect_cb(void *rmsg, void *arg);
@@ -40,6 +44,17 @@ static property *will_property(conf_bridge_conn_will_properties *will_prop);
 
 static nng_thread *hybridger_thr;
 
+// count the connection going up or down and let its send queue know, the
+// queue is not there yet for the first connects of the first connection
+static void
+bridge_conn_link(bridge_conn *c, bool up)
+{
+	nng_atomic_inc64(up ? c->connects : c->disconnects);
+	if (c->queue != NULL) {
+		bridge_queue_set_link(c->queue, up);
+	}
+}
+
 static void quic_ack_cb(void *arg);
 
 static int
@@ -65,8 +80,8 @@ apply_sqlite_config(
 #endif
 }
 
-nng_msg *
-create_connect_msg(conf_bridge_node *node)
+static nng_msg *
+create_connect_msg_id(conf_bridge_node *node, const char *clientid)
 {
 	// create a CONNECT message
 	/* CONNECT */
@@ -76,8 +91,8 @@ create_connect_msg(conf_bridge_node *node)
 	nng_mqtt_msg_set_connect_keep_alive(connmsg, node->keepalive);
 	nng_mqtt_msg_set_connect_proto_version(connmsg, node->proto_ver);
 	nng_mqtt_msg_set_connect_clean_session(connmsg, node->clean_start);
-	if (node->clientid) {
-		nng_mqtt_msg_set_connect_client_id(connmsg, node->clientid);
+	if (clientid) {
+		nng_mqtt_msg_set_connect_client_id(connmsg, clientid);
 	}
 	if (node->username) {
 		nng_mqtt_msg_set_connect_user_name(connmsg, node->username);
@@ -108,6 +123,12 @@ create_connect_msg(conf_bridge_node *node)
 	return connmsg;
 }
 
+nng_msg *
+create_connect_msg(conf_bridge_node *node)
+{
+	return create_connect_msg_id(node, node->clientid);
+}
+
 nng_msg *
 create_disconnect_msg()
 {
@@ -144,6 +165,187 @@ bridge_publish_msg(const char *topic, uint8_t *payload, uint32_t len, bool dup,
 	return pubmsg;
 }
 
+// size of the MQTT v5 property at p with its identifier, 0 for one a
+// PUBLISH does not carry or one running past end
+static size_t
+pub_prop_size(const uint8_t *p, const uint8_t *end)
+{
+	size_t n;
+
+	if (end - p < 1) {
+		return 0;
+	}
+	switch (p[0]) {
+	case PAYLOAD_FORMAT_INDICATOR:
+		n = 2;
+		break;
+	case TOPIC_ALIAS:
+		n = 3;
+		break;
+	case MESSAGE_EXPIRY_INTERVAL:
+		n = 5;
+		break;
+	case CONTENT_TYPE:
+	case RESPONSE_TOPIC:
+	case CORRELATION_DATA:
+		if (end - p < 3) {
+			return 0;
+		}
+		n = 3 + ((p[1] << 8) | p[2]);
+		break;
+	case USER_PROPERTY:
+		if (end - p < 3) {
+			return 0;
+		}
+		n = 3 + ((p[1] << 8) | p[2]);
+		if ((size_t) (end - p) < n + 2) {
+			return 0;
+		}
+		n += 2 + ((p[n] << 8) | p[n + 1]);
+		break;
+	case SUBSCRIPTION_IDENTIFIER:
+		n = 1;
+		do {
+			if (n > 4 || end - p <= (ptrdiff_t) n) {
+				return 0;
+			}
+		} while (p[n++] & 0x80);
+		break;
+	default:
+		return 0;
+	}
+	return (size_t) (end - p) >= n ? n : 0;
+}
+
+// variable byte integer at p, the bytes it takes or 0 when malformed
+static size_t
+varint_get(const uint8_t *p, const uint8_t *end, uint32_t *val)
+{
+	size_t n = 0;
+
+	*val = 0;
+	do {
+		if (n == 4 || p + n >= end) {
+			return 0;
+		}
+		*val |= (uint32_t) (p[n] & 0x7f) << (7 * n);
+	} while (p[n++] & 0x80);
+	return n;
+}
+
+/**
+ * @brief the wire image of a publish the broker received, as the client
+ *        msg a bridge of the same MQTT version sends. The image is taken
+ *        as it is, but for a topic alias, which only means something on
+ *        the inbound connection: it is dropped and topic goes in its place
+ *        when the image has none.
+ *        The client encodes the msg when it sends it, from the topic,
+ *        payload and properties decoded out of a copy of the image that
+ *        sits behind the body, so it never writes over what it reads.
+ * @return NULL when the image does not hold together
+ */
+nng_msg *
+bridge_wire_msg(nng_msg *src, const char *topic)
+{
+	uint8_t       *header = nng_msg_header(src);
+	const uint8_t *body   = nng_msg_body(src);
+	const uint8_t *end    = body + nng_msg_len(src);
+	const uint8_t *props, *alias = NULL;
+	const char    *t;
+	uint8_t        hdr[5], *q;
+	nng_msg       *msg;
+	uint32_t       tlen, ntlen, plen = 0, left = 0;
+	size_t         idlen, vlen, blen, n;
+	bool           v5 = nng_msg_cmd_type(src) == CMD_PUBLISH_V5;
+	int            rv;
+
+	if (nng_msg_header_len(src) < 2 || (header[0] >> 4) != PUBLISH ||
+	    end - body < 2) {
+		return NULL;
+	}
+	tlen  = (body[0] << 8) | body[1];
+	idlen = ((header[0] >> 1) & 0x03) > 0 ? 2 : 0;
+	if ((size_t) (end - body) < 2 + tlen + idlen) {
+		return NULL;
+	}
+	props = body + 2 + tlen + idlen;
+	if (v5) {
+		if ((vlen = varint_get(props, end, &plen)) == 0 ||
+		    plen > (size_t) (end - props) - vlen) {
+			return NULL;
+		}
+		props += vlen;
+		for (const uint8_t *r = props; r < props + plen; r += n) {
+			if ((n = pub_prop_size(r, props + plen)) == 0) {
+				return NULL;
+			}
+			if (r[0] == TOPIC_ALIAS) {
+				alias = r;
+			}
+		}
+		left = plen - (alias != NULL ? 3 : 0);
+	}
+	if (tlen > 0) {
+		topic = (const char *) body + 2;
+		ntlen = tlen;
+	} else if (topic == NULL || (ntlen = strlen(topic)) == 0) {
+		return NULL;
+	}
+	blen = 2 + ntlen + idlen + (end - props - plen);
+	if (v5) {
+		blen += put_var_integer(hdr, left) + left;
+	}
+
+	// the copy the fields are decoded from goes behind the body, for now
+	// the body is the copy
+	if (nng_msg_alloc(&msg, 2 * blen) != 0) {
+		return NULL;
+	}
+	nng_msg_trim(msg, blen);
+	q    = nng_msg_body(msg);
+	*q++ = ntlen >> 8;
+	*q++ = ntlen & 0xff;
+	memcpy(q, topic, ntlen);
+	q += ntlen;
+	memcpy(q, body + 2 + tlen, idlen);
+	q += idlen;
+	if (v5) {
+		q += put_var_integer(q, left);
+		if (alias == NULL) {
+			memcpy(q, props, plen);
+			q += plen;
+		} else {
+			memcpy(q, props, alias - props);
+			q += alias - props;
+			memcpy(q, alias + 3, props + plen - alias - 3);
+			q += props + plen - alias - 3;
+		}
+	}
+	memcpy(q, props + plen, end - props - plen);
+	hdr[0] = header[0];
+	if (nng_msg_header_append(
+	        msg, hdr, 1 + put_var_integer(hdr + 1, blen)) != 0) {
+		nng_msg_free(msg);
+		return NULL;
+	}
+	nng_msg_set_cmd_type(msg, nng_msg_cmd_type(src));
+	nng_mqtt_msg_proto_data_alloc(msg);
+	rv = v5 ? nng_mqttv5_msg_decode(msg) : nng_mqtt_msg_decode(msg);
+	// the body the client encodes into, in the room in front of the copy
+	if (rv != 0 || nng_msg_insert(msg, nng_msg_body(msg), blen) != 0) {
+		nng_msg_free(msg);
+		return NULL;
+	}
+	nng_msg_chop(msg, blen);
+	t = nng_mqtt_msg_get_publish_topic(msg, &tlen);
+	if ((uintptr_t) t < (uintptr_t) nng_msg_body(msg) + blen) {
+		// the insert did not take the room, the fields point nowhere
+		nng_msg_free(msg);
+		return NULL;
+	}
+	return msg;
+}
+
 static void
 send_callback(nng_mqtt_client *client, nng_msg *msg, void *obj)
 {
@@ -360,6 +562,22 @@ conn_property(conf_bridge_conn_properties *conf_prop)
 	return NULL;
 }
 
+// the transport a hybrid bridge is on now, by the address it dialed
+static bridge_transport
+hybrid_transport(conf_bridge_node *node)
+{
+	const char *addr = node->address;
+
+	if (0 == strncmp(addr, quic_scheme, strlen(quic_scheme))) {
+		return BRIDGE_TRANSPORT_QUIC;
+	}
+	if (0 == strncmp(addr, tcp_scheme, strlen(tcp_scheme)) ||
+	    0 == strncmp(addr, tls_scheme, strlen(tls_scheme))) {
+		return BRIDGE_TRANSPORT_TCP;
+	}
+	return BRIDGE_TRANSPORTS;
+}
+
 static void
 hybrid_tcp_connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 {
@@ -375,6 +593,11 @@ hybrid_tcp_disconnect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 	nng_pipe_get_int(p, NNG_OPT_MQTT_DISCONNECT_REASON, &reason);
 	log_warn("bridge client disconnected! RC [%d] \n", reason);
 	bridge_param *bridge_arg = arg;
+	// the socket closed by a switch to QUIC the prober asked for
+	if (hybrid_transport(bridge_arg->config) != BRIDGE_TRANSPORT_TCP) {
+		return;
+	}
+	bridge_conn_link(&bridge_arg->conns[0], false);
 
 	nng_mtx_lock(bridge_arg->switch_mtx);
 	nng_cv_wake1(bridge_arg->switch_cv);
@@ -449,9 +672,14 @@ hybrid_quic_disconnect_cb(void *rmsg, void *arg)
 	}
 	log_warn("quic bridge client disconnected! RC [%d]", reason);
 
+	bridge_param *bridge_arg = arg;
+	// the socket closed by a switch to TCP the prober asked for
+	if (hybrid_transport(bridge_arg->config) != BRIDGE_TRANSPORT_QUIC) {
+		return 0;
+	}
 	// wait 3000ms and ready to reconnect
 	nng_msleep(3000);
-	bridge_param *bridge_arg = arg;
+	bridge_conn_link(&bridge_arg->conns[0], false);
 
 	nng_mtx_lock(bridge_arg->switch_mtx);
 	nng_cv_wake1(bridge_arg->switch_cv);
@@ -544,20 +772,6 @@ hybridger_cb(void *arg)
 		nng_fatal("nng_cv_alloc", rv);
 		return;
 	}
-	// alloc an AIO for each ctx bridging use only
-	node->bridge_aio =
-	    nng_alloc((bridge_arg->conf->parallel + node->parallel * 2) *
-	        sizeof(nng_aio *));
-
-	for (uint32_t num = 0;
-	     num < (bridge_arg->conf->parallel + node->parallel * 2); num++) {
-		if ((rv = nng_aio_alloc(&node->bridge_aio[num], NULL, node)) !=
-		    0) {
-			nng_fatal("bridge_aio nng_aio_alloc", rv);
-		}
-		log_debug("parallel %d", num);
-	}
-
 	char addr_back[160] = {'\0'};
 	if (0 != gen_fallback_url(node->address, addr_back))
 		strcpy(addr_back, node->address);
@@ -616,6 +830,385 @@ hybridger_cb(void *arg)
 	bridge_arg->switch_mtx = NULL;
 }
 
+#if defined(SUPP_QUIC)
+// Probes of a hybrid bridge with conf_ext bridges.mqtt.<name>.adaptive
+// enabled. A session of its own over each transport publishes a sequence
+// number every interval to a topic it subscribed to, so the remote broker
+// sends it back after a round trip. They speak MQTT 3.1.1 at QoS 0 and
+// stay up while the bridge is on the other transport, so that one is
+// measured all along.
+typedef struct {
+	bridge_transport transport;
+	bridge_adapt    *adapt;
+	nng_socket       sock;
+	nng_mqtt_client *client;
+	nng_msg         *connmsg;
+	nng_aio         *recv_aio;
+	char             clientid[128];
+	char             topic[160];
+	nng_mtx         *mtx;
+	uint64_t         seq; // of the probe in flight
+	nng_time         sent_at;
+	bool             waiting;
+	bool             receiving; // recv_aio armed
+} bridge_probe;
+
+struct bridge_prober {
+	bridge_param *param;
+	char          tcp_url[160];
+	bridge_probe  probes[BRIDGE_TRANSPORTS];
+	nng_thread   *thr;
+	nng_mtx      *mtx;
+	nng_cv       *cv;
+	bool          closing;
+};
+
+// no will and no properties, a probe carries nothing but itself
+static nng_msg *
+probe_connect_msg(conf_bridge_node *node, const char *clientid)
+{
+	nng_msg *connmsg;
+
+	if (nng_mqtt_msg_alloc(&connmsg, 0) != 0) {
+		return NULL;
+	}
+	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_keep_alive(connmsg, node->keepalive);
+	nng_mqtt_msg_set_connect_proto_version(
+	    connmsg, MQTT_PROTOCOL_VERSION_v311);
+	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
+	nng_mqtt_msg_set_connect_client_id(connmsg, clientid);
+	if (node->username) {
+		nng_mqtt_msg_set_connect_user_name(connmsg, node->username);
+	}
+	if (node->password) {
+		nng_mqtt_msg_set_connect_password(connmsg, node->password);
+	}
+	return connmsg;
+}
+
+static void
+probe_subscribe(bridge_probe *p, int reason)
+{
+	nng_mqtt_topic_qos *topic_qos;
+
+	log_info("bridge probe %s connected! RC [%d]", p->clientid, reason);
+	if (reason != 0) {
+		return;
+	}
+	topic_qos = nng_mqtt_topic_qos_array_create(1);
+	// no_local off, the probe comes back to the session that sent it
+	nng_mqtt_topic_qos_array_set(topic_qos, 0, p->topic, 0, 0, 0, 0);
+	nng_mqtt_subscribe_async(p->client, topic_qos, 1, NULL);
+	nng_mqtt_topic_qos_array_free(topic_qos, 1);
+}
+
+static void
+probe_tcp_connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
+{
+	int reason = 0;
+
+	nng_pipe_get_int(p, NNG_OPT_MQTT_CONNECT_REASON, &reason);
+	probe_subscribe(arg, reason);
+}
+
+static int
+probe_quic_connect_cb(void *rmsg, void *arg)
+{
+	int reason = nng_mqtt_msg_get_connack_return_code(rmsg);
+
+	nng_msg_free(rmsg);
+	probe_subscribe(arg, reason);
+	return 0;
+}
+
+static int
+probe_quic_disconnect_cb(void *rmsg, void *arg)
+{
+	bridge_probe *p = arg;
+
+	if (rmsg) {
+		nng_msg_free(rmsg);
+	}
+	log_warn("bridge probe %s disconnected!", p->clientid);
+	return 0;
+}
+
+static void
+probe_recv_cb(void *arg)
+{
+	bridge_probe *p   = arg;
+	nng_msg      *msg;
+	uint8_t      *payload;
+	uint32_t      len = 0;
+	uint64_t      seq = 0;
+	nng_duration  rtt = -1;
+
+	if (nng_aio_result(p->recv_aio) != 0) {
+		// armed again by the next probe
+		nng_mtx_lock(p->mtx);
+		p->receiving = false;
+		nng_mtx_unlock(p->mtx);
+		return;
+	}
+	msg = nng_aio_get_msg(p->recv_aio);
+	nng_aio_set_msg(p->recv_aio, NULL);
+	if (nng_mqtt_msg_get_packet_type(msg) == NNG_MQTT_PUBLISH &&
+	    (payload = nng_mqtt_msg_get_publish_payload(msg, &len)) != NULL &&
+	    len == sizeof(seq)) {
+		for (uint32_t i = 0; i < len; i++) {
+			seq = seq << 8 | payload[i];
+		}
+		nng_mtx_lock(p->mtx);
+		// a late answer to a probe already counted lost is dropped
+		if (p->waiting && seq == p->seq) {
+			p->waiting = false;
+			rtt        = (nng_duration) (nng_clock() - p->sent_at);
+		}
+		nng_mtx_unlock(p->mtx);
+	}
+	nng_msg_free(msg);
+	if (rtt >= 0) {
+		bridge_adapt_sample(p->adapt, p->transport, false, rtt);
+	}
+	nng_recv_aio(p->sock, p->recv_aio);
+}
+
+static int
+probe_open(bridge_probe *p, conf_bridge_node *node, const char *url)
+{
+	nng_dialer dialer;
+	int        rv;
+
+	if ((p->connmsg = probe_connect_msg(node, p->clientid)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if (p->transport == BRIDGE_TRANSPORT_QUIC) {
+		if ((rv = nng_mqtt_quic_open_conf(
+		         &p->sock, url, (void *) node)) != 0) {
+			return rv;
+		}
+		nng_socket_set(
+		    p->sock, NANO_CONF, node, sizeof(conf_bridge_node));
+		if ((rv = nng_mqtt_quic_set_connect_cb(
+		         &p->sock, probe_quic_connect_cb, p)) != 0 ||
+		    (rv = nng_mqtt_quic_set_disconnect_cb(
+		         &p->sock, probe_quic_disconnect_cb, p)) != 0) {
+			return rv;
+		}
+		p->client =
+		    nng_mqtt_client_alloc(p->sock, &send_callback, true);
+		nng_aio_set_msg(p->client->send_aio, p->connmsg);
+		nng_send_aio(p->sock, p->client->send_aio);
+	} else {
+		if ((rv = nng_mqtt_client_open(&p->sock)) != 0) {
+			return rv;
+		}
+		if ((rv = nng_dialer_create(&dialer, p->sock, url)) != 0) {
+			return rv;
+		}
+		nng_dialer_set_ptr(dialer, NNG_OPT_MQTT_CONNMSG, p->connmsg);
+		nng_socket_set_ptr(p->sock, NNG_OPT_MQTT_CONNMSG, p->connmsg);
+		nng_mqtt_set_connect_cb(p->sock, probe_tcp_connect_cb, p);
+		p->client =
+		    nng_mqtt_client_alloc(p->sock, &send_callback, true);
+		nng_dialer_start(dialer, NNG_FLAG_NONBLOCK);
+	}
+	return 0;
+}
+
+// one not back within the interval is lost
+static void
+probe_send(bridge_probe *p, nng_time now)
+{
+	uint8_t  payload[sizeof(uint64_t)];
+	nng_msg *msg;
+	uint64_t seq;
+	bool     lost, arm;
+
+	nng_mtx_lock(p->mtx);
+	lost         = p->waiting;
+	seq          = ++p->seq;
+	p->sent_at   = now;
+	p->waiting   = true;
+	arm          = !p->receiving;
+	p->receiving = true;
+	nng_mtx_unlock(p->mtx);
+	if (lost) {
+		bridge_adapt_sample(p->adapt, p->transport, true, 0);
+	}
+	if (arm) {
+		nng_recv_aio(p->sock, p->recv_aio);
+	}
+	for (size_t i = 0; i < sizeof(payload); i++) {
+		payload[i] = (uint8_t) (seq >> (8 * (sizeof(payload) - 1 - i)));
+	}
+	msg = bridge_publish_msg(
+	    p->topic, payload, sizeof(payload), false, 0, false, NULL);
+	// not connected, it is lost by the next one
+	if (nng_sendmsg(p->sock, msg, NNG_FLAG_NONBLOCK) != 0) {
+		nng_msg_free(msg);
+	}
+}
+
+static void
+prober_cb(void *arg)
+{
+	bridge_prober              *pr    = arg;
+	bridge_param               *param = pr->param;
+	conf_bridge_node           *node  = param->config;
+	const conf_bridge_adaptive *adaptive =
+	    &conf_ext_bridge(conf_ext_get(), node->name)->adaptive;
+	bridge_queue_stats stats;
+	bridge_transport   active;
+	nng_time           now, next;
+
+	for (;;) {
+		nng_mtx_lock(pr->mtx);
+		next = nng_clock() + adaptive->interval;
+		while (!pr->closing &&
+		    nng_cv_until(pr->cv, next) != NNG_ETIMEDOUT) {
+		}
+		if (pr->closing) {
+			nng_mtx_unlock(pr->mtx);
+			return;
+		}
+		nng_mtx_unlock(pr->mtx);
+		now = nng_clock();
+		for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+			probe_send(&pr->probes[t], now);
+		}
+		active = hybrid_transport(node);
+		bridge_queue_get_stats(param->conns[0].queue, &stats);
+		bridge_adapt_sent(param->adapt, active, stats.sent_bytes, now);
+		if (active == BRIDGE_TRANSPORTS ||
+		    !bridge_adapt_decide(param->adapt, active, now)) {
+			continue;
+		}
+		log_warn("bridge %s: probes score %s better, switching over",
+		    node->name,
+		    bridge_transport_name(active == BRIDGE_TRANSPORT_TCP
+		            ? BRIDGE_TRANSPORT_QUIC
+		            : BRIDGE_TRANSPORT_TCP));
+		// hybridger takes it from here as it does on a disconnect
+		nng_mtx_lock(param->switch_mtx);
+		nng_cv_wake1(param->switch_cv);
+		nng_mtx_unlock(param->switch_mtx);
+	}
+}
+
+// closes what prober_start() opened, the thread is gone by then
+static void
+prober_free(bridge_prober *pr)
+{
+	for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+		bridge_probe *p = &pr->probes[t];
+
+		if (nng_socket_id(p->sock) > 0) {
+			nng_close(p->sock);
+		}
+		if (p->recv_aio != NULL) {
+			nng_aio_stop(p->recv_aio);
+			nng_aio_free(p->recv_aio);
+		}
+		if (p->client != NULL) {
+			nng_mqtt_client_free(p->client, true);
+		}
+		// the QUIC one went out on the send aio of the client
+		if (p->connmsg != NULL &&
+		    p->transport == BRIDGE_TRANSPORT_TCP) {
+			nng_msg_free(p->connmsg);
+		}
+		if (p->mtx != NULL) {
+			nng_mtx_free(p->mtx);
+		}
+	}
+	// the probes share it
+	bridge_adapt_free(pr->probes[0].adapt);
+	if (pr->cv != NULL) {
+		nng_cv_free(pr->cv);
+	}
+	if (pr->mtx != NULL) {
+		nng_mtx_free(pr->mtx);
+	}
+	nng_free(pr, sizeof(*pr));
+}
+
+// quic_url is the address of the node, the one TCP falls back to is
+// probed alongside it
+static int
+prober_start(bridge_param *param, const char *quic_url,
+    const conf_bridge_adaptive *adaptive)
+{
+	conf_bridge_node *node = param->config;
+	const char       *id   = node->clientid ? node->clientid : node->name;
+	bridge_prober    *pr;
+	bridge_adapt     *adapt;
+	const char       *url;
+	int               rv;
+
+	if ((pr = nng_zalloc(sizeof(*pr))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	pr->param = param;
+	if (0 != gen_fallback_url((char *) quic_url, pr->tcp_url)) {
+		nng_free(pr, sizeof(*pr));
+		return NNG_EADDRINVAL;
+	}
+	if ((rv = bridge_adapt_alloc(&adapt, adaptive)) != 0) {
+		nng_free(pr, sizeof(*pr));
+		return rv;
+	}
+	for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+		pr->probes[t].transport = t;
+		pr->probes[t].adapt     = adapt;
+	}
+	if ((rv = nng_mtx_alloc(&pr->mtx)) != 0 ||
+	    (rv = nng_cv_alloc(&pr->cv, pr->mtx)) != 0) {
+		prober_free(pr);
+		return rv;
+	}
+	for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+		bridge_probe *p = &pr->probes[t];
+
+		snprintf(p->clientid, sizeof(p->clientid), "%s-probe-%s", id,
+		    bridge_transport_name(t));
+		snprintf(
+		    p->topic, sizeof(p->topic), "nanomq/probe/%s", p->clientid);
+		url = t == BRIDGE_TRANSPORT_QUIC ? quic_url : pr->tcp_url;
+		if ((rv = nng_mtx_alloc(&p->mtx)) != 0 ||
+		    (rv = nng_aio_alloc(&p->recv_aio, probe_recv_cb, p)) != 0 ||
+		    (rv = probe_open(p, node, url)) != 0) {
+			prober_free(pr);
+			return rv;
+		}
+	}
+	if ((rv = nng_thread_create(&pr->thr, prober_cb, pr)) != 0) {
+		prober_free(pr);
+		return rv;
+	}
+	param->adapt  = adapt;
+	param->prober = pr;
+	return 0;
+}
+
+static void
+prober_stop(bridge_param *param)
+{
+	bridge_prober *pr = param->prober;
+
+	nng_mtx_lock(pr->mtx);
+	pr->closing = true;
+	nng_cv_wake(pr->cv);
+	nng_mtx_unlock(pr->mtx);
+	nng_thread_destroy(pr->thr);
+
+	param->adapt  = NULL;
+	param->prober = NULL;
+	prober_free(pr);
+}
+#endif
+
 int
 hybrid_bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 {
@@ -628,11 +1221,21 @@ hybrid_bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 	bridge_arg->config = node;
 	bridge_arg->sock   = sock;
 	bridge_arg->conf   = config;
+	bridge_arg->adapt  = NULL;
+	bridge_arg->prober = NULL;
 	if (reload_lock == NULL) {
 		nng_mtx_alloc(&reload_lock);
 	}
+	// hybridger moves node->address along as it switches
+	char *addr = node->address;
 
-	int rv = nng_mtx_alloc(&bridge_arg->exec_mtx);
+	// switching between QUIC and TCP, a single connection
+	int rv = bridge_conns_alloc(bridge_arg, node, false);
+	if (rv != 0) {
+		nng_fatal("bridge_conns_alloc", rv);
+		return rv;
+	}
+	rv = nng_mtx_alloc(&bridge_arg->exec_mtx);
 	if (rv != 0) {
 		nng_fatal("nng_mtx_alloc", rv);
 		return rv;
@@ -655,7 +1258,31 @@ hybrid_bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 	nng_cv_free(bridge_arg->exec_cv);
 	bridge_arg->exec_cv = NULL;
 
-	return rv;
+	// the socket is open now, spilled messages may go out at once
+	node->bridge_arg = (void *) bridge_arg;
+	if ((rv = bridge_conns_start(bridge_arg, config)) != 0) {
+		nng_fatal("bridge_conns_start", rv);
+	}
+
+	const conf_bridge_ext *ext =
+	    conf_ext_bridge(conf_ext_get(), node->name);
+	if (!ext->adaptive.enable) {
+		return rv;
+	}
+#if defined(SUPP_QUIC)
+	if (0 != strncmp(addr, quic_scheme, strlen(quic_scheme))) {
+		log_warn(
+		    "bridge %s: adaptive needs a QUIC address", node->name);
+	} else if ((rv = prober_start(bridge_arg, addr, &ext->adaptive)) !=
+	    0) {
+		log_error("bridge %s: adaptive probes: %s", node->name,
+		    nng_strerror(rv));
+	}
+#else
+	(void) addr;
+	log_warn("bridge %s: adaptive needs QUIC support", node->name);
+#endif
+	return 0;
 }
 
 #if defined(SUPP_QUIC)
@@ -756,6 +1383,7 @@ bridge_quic_connect_cb(void *rmsg, void *arg)
 	// get connect reason
 	reason = nng_mqtt_msg_get_connack_return_code(msg);
 	cp     = nng_msg_get_conn_param(msg);
+	bridge_conn_link(&param->conns[0], true);
 	// get property for MQTT V5
 	// property *prop;
 	// nng_pipe_get_ptr(p, NNG_OPT_MQTT_CONNECT_PROPERTY, &prop);
@@ -769,7 +1397,10 @@ bridge_quic_connect_cb(void *rmsg, void *arg)
 static int
 bridge_quic_disconnect_cb(void *rmsg, void *arg)
 {
-	int reason = 0;
+	bridge_param *param  = arg;
+	int           reason = 0;
+
+	bridge_conn_link(&param->conns[0], false);
 	// get connect reason
 	if (rmsg) {
 		reason = nng_mqtt_msg_get_connack_return_code(rmsg);
@@ -828,6 +1459,289 @@ bridge_quic_client(nng_socket *sock, conf *config, conf_bridge_node *node, bridg
 }
 #endif
 
+// a pipe of a socket bridge_conns_reload() replaced, the first connection
+// keeps node->sock and is not tracked
+static bool
+bridge_conn_retired(bridge_conn *c, nng_pipe p)
+{
+	uint64_t id = nng_atomic_get64(c->sock_id);
+
+	return id != 0 && id != (uint64_t) nng_socket_id(nng_pipe_socket(p));
+}
+
+// Connack of a connection that only publishes
+static void
+bridge_conn_connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
+{
+	bridge_conn *c      = arg;
+	int          reason = 0;
+
+	if (bridge_conn_retired(c, p)) {
+		return;
+	}
+	nng_pipe_get_int(p, NNG_OPT_MQTT_CONNECT_REASON, &reason);
+	bridge_conn_link(c, true);
+	log_info("Bridge client %s connection %u connected! RC [%d]",
+	    c->node->name, c->index, reason);
+}
+
+static void
+bridge_conn_disconnect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
+{
+	bridge_conn *c      = arg;
+	int          reason = 0;
+
+	// the socket a reload closed, not the link of the connection
+	if (bridge_conn_retired(c, p)) {
+		return;
+	}
+	nng_pipe_get_int(p, NNG_OPT_MQTT_DISCONNECT_REASON, &reason);
+	bridge_conn_link(c, false);
+	log_warn("Bridge client %s connection %u disconnected! RC [%d]",
+	    c->node->name, c->index, reason);
+}
+
+// Open a connection past the first one, TCP or TLS
+static int
+bridge_conn_open(bridge_conn *c)
+{
+	conf_bridge_node *node = c->node;
+	nng_socket       *sock;
+	nng_dialer        dialer;
+	nng_duration      duration = 240000;
+	char              db_name[32];
+	int               rv;
+
+	if ((sock = nng_alloc(sizeof(nng_socket))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if (node->proto_ver == MQTT_PROTOCOL_VERSION_v5) {
+		rv = nng_mqttv5_client_open(sock);
+	} else {
+		rv = nng_mqtt_client_open(sock);
+	}
+	if (rv != 0) {
+		nng_free(sock, sizeof(nng_socket));
+		return rv;
+	}
+	nng_atomic_set64(c->sock_id, nng_socket_id(*sock));
+	// each socket caches in a database of its own
+	snprintf(db_name, sizeof(db_name), "mqtt_client_%u.db", c->index);
+	apply_sqlite_config(sock, node, db_name);
+
+	if ((rv = nng_dialer_create(&dialer, *sock, node->address)) != 0) {
+		nng_close(*sock);
+		nng_free(sock, sizeof(nng_socket));
+		return rv;
+	}
+	// set backoff param to 24s
+	nng_dialer_set(dialer, NNG_OPT_MQTT_RECONNECT_BACKOFF_MAX, &duration,
+	    sizeof(nng_duration));
+#ifdef NNG_SUPP_TLS
+	if (node->tls.enable) {
+		if ((rv = init_dialer_tls(dialer, node->tls.ca, node->tls.cert,
+		         node->tls.key, node->tls.key_password)) != 0) {
+			log_error("init_dialer_tls: %s", nng_strerror(rv));
+		}
+	}
+#endif
+
+	c->connmsg = create_connect_msg_id(node, c->clientid);
+	nng_dialer_set_ptr(dialer, NNG_OPT_MQTT_CONNMSG, c->connmsg);
+	nng_socket_set_ptr(*sock, NNG_OPT_MQTT_CONNMSG, c->connmsg);
+	nng_mqtt_set_connect_cb(*sock, bridge_conn_connect_cb, c);
+	nng_mqtt_set_disconnect_cb(*sock, bridge_conn_disconnect_cb, c);
+	nng_dialer_start(dialer, NNG_FLAG_NONBLOCK);
+
+	c->sock = sock;
+	return 0;
+}
+
+// conf_ext bridges.mqtt.<name>.connections of the node, one for all but
+// TCP and TLS bridges
+static int
+bridge_conns_alloc(bridge_param *param, conf_bridge_node *node, bool multi)
+{
+	uint32_t n = conf_ext_bridge(conf_ext_get(), node->name)->connections;
+	int      rv;
+
+	if (n > 1 && !multi) {
+		log_warn("bridge %s: connections is for TCP and TLS only",
+		    node->name);
+		n = 1;
+	}
+	if ((param->conns = nng_zalloc(n * sizeof(bridge_conn))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	param->nconns = n;
+	for (uint32_t i = 0; i < n; i++) {
+		bridge_conn *c = &param->conns[i];
+
+		c->index = i;
+		c->node  = node;
+		if ((rv = nng_atomic_alloc64(&c->connects)) != 0 ||
+		    (rv = nng_atomic_alloc64(&c->disconnects)) != 0 ||
+		    (rv = nng_atomic_alloc64(&c->sock_id)) != 0) {
+			return rv;
+		}
+		if (i == 0 || node->clientid == NULL) {
+			// left to the remote broker without one
+			continue;
+		}
+		c->clientid =
+		    nng_alloc(strlen(node->clientid) + sizeof("-4294967295"));
+		if (c->clientid == NULL) {
+			return NNG_ENOMEM;
+		}
+		sprintf(c->clientid, "%s-%u", node->clientid, i);
+	}
+	return 0;
+}
+
+// undo bridge_conns_alloc() of a bridge that never started
+static void
+bridge_conns_fini(bridge_param *param)
+{
+	for (size_t i = 0; param->conns != NULL && i < param->nconns; i++) {
+		bridge_conn *c = &param->conns[i];
+
+		if (c->connects != NULL) {
+			nng_atomic_free64(c->connects);
+		}
+		if (c->disconnects != NULL) {
+			nng_atomic_free64(c->disconnects);
+		}
+		if (c->sock_id != NULL) {
+			nng_atomic_free64(c->sock_id);
+		}
+		if (c->clientid != NULL) {
+			nng_free(c->clientid,
+			    strlen(c->node->clientid) + sizeof("-4294967295"));
+		}
+	}
+	if (param->conns != NULL) {
+		nng_free(param->conns, param->nconns * sizeof(bridge_conn));
+	}
+	param->conns  = NULL;
+	param->nconns = 0;
+}
+
+// open the connections past the first one and a send queue for each,
+// they share the disk_cache_size of bridges.mqtt.cache
+static int
+bridge_conns_start(bridge_param *param, conf *config)
+{
+	conf_sqlite            cache = config->bridge.sqlite;
+	const conf_bridge_ext *ext =
+	    conf_ext_bridge(conf_ext_get(), param->config->name);
+	int                    rv;
+
+	cache.disk_cache_size /= param->nconns;
+	for (size_t i = 0; i < param->nconns; i++) {
+		bridge_conn *c = &param->conns[i];
+
+		if (i > 0 && (rv = bridge_conn_open(c)) != 0) {
+			return rv;
+		}
+		if ((rv = bridge_queue_alloc(
+		         &c->queue, c->node, c->sock, c->index, &cache)) != 0) {
+			return rv;
+		}
+		bridge_queue_set_link(c->queue,
+		    nng_atomic_get64(c->connects) >
+		        nng_atomic_get64(c->disconnects));
+		if (ext->envelope.enable &&
+		    (rv = bridge_envelope_alloc(
+		         &c->envelope, &ext->envelope, c->queue)) != 0) {
+			return rv;
+		}
+	}
+	return 0;
+}
+
+// envelope of the connection when the node packs its forwards
+static int
+bridge_conn_put(bridge_conn *c, nng_msg *msg)
+{
+	if (c->envelope != NULL) {
+		return bridge_envelope_put(c->envelope, msg);
+	}
+	return bridge_queue_put(c->queue, msg);
+}
+
+// the node was updated, open the connections past the first one again
+static void
+bridge_conns_reload(bridge_param *param)
+{
+	for (size_t i = 1; i < param->nconns; i++) {
+		bridge_conn *c     = &param->conns[i];
+		nng_socket  *tsock = c->sock;
+		nng_msg     *tmsg  = c->connmsg;
+		int          rv;
+
+		if ((rv = bridge_conn_open(c)) != 0) {
+			log_error("bridge %s connection %u reload failed: %s",
+			    c->node->name, c->index, nng_strerror(rv));
+			continue;
+		}
+		bridge_queue_set_sock(c->queue, c->sock);
+		nng_close(*tsock);
+		nng_free(tsock, sizeof(nng_socket));
+		// the closed socket was the last to use it
+		nng_msg_free(tmsg);
+	}
+}
+
+/**
+ * @brief queue msg on the connection its topic hashes to, so the
+ *        publishes of a topic keep their order.
+ */
+int
+bridge_forward(bridge_param *param, nng_msg *msg)
+{
+	const char *topic;
+	uint32_t    len;
+	uint32_t    h = 2166136261u;
+
+	if (param->nconns == 1) {
+		return bridge_conn_put(&param->conns[0], msg);
+	}
+	// FNV-1a
+	topic = nng_mqtt_msg_get_publish_topic(msg, &len);
+	for (uint32_t i = 0; i < len; i++) {
+		h ^= (uint8_t) topic[i];
+		h *= 16777619u;
+	}
+	return bridge_conn_put(&param->conns[h % param->nconns], msg);
+}
+
+void
+bridge_conns_free(bridge_param *param)
+{
+#if defined(SUPP_QUIC)
+	// the prober reads the stats of the first queue
+	if (param->prober != NULL) {
+		prober_stop(param);
+	}
+#endif
+	for (size_t i = 0; i < param->nconns; i++) {
+		bridge_conn *c = &param->conns[i];
+
+		// its last envelope goes to the queue
+		if (c->envelope != NULL) {
+			bridge_envelope_free(c->envelope);
+			c->envelope = NULL;
+		}
+		bridge_queue_free(c->queue);
+		c->queue = NULL;
+		if (i > 0 && c->sock != NULL) {
+			nng_close(*c->sock);
+			nng_free(c->sock, sizeof(nng_socket));
+			c->sock = NULL;
+		}
+	}
+}
+
 // Connack message callback function
 static void
 bridge_tcp_connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
@@ -839,6 +1753,7 @@ bridge_tcp_connect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 	uint16_t      port;
 	// get connect reason
 	nng_pipe_get_int(p, NNG_OPT_MQTT_CONNECT_REASON, &reason);
+	bridge_conn_link(&param->conns[0], true);
 	addr = nano_pipe_get_local_address(p);
 	port = nano_pipe_get_local_port(p);
 	// get property for MQTT V5
@@ -888,6 +1803,7 @@ bridge_tcp_disconnect_cb(nng_pipe p, nng_pipe_ev ev, void *arg)
 	log_warn("bridge client disconnected! RC [%d] \n", reason);
 
 	bridge_param *bridge_arg = arg;
+	bridge_conn_link(&bridge_arg->conns[0], false);
 	// Free cparam kept
 	// void *cparam = nng_msg_get_conn_param(bridge_arg->connmsg);
 	// if (cparam != NULL)
@@ -948,7 +1864,9 @@ bridge_tcp_reload(nng_socket *sock, conf *config, conf_bridge_node *node, bridge
 	if (0 != nng_socket_set_ptr(*sock, NNG_OPT_MQTT_CONNMSG, connmsg)) {
 		log_warn("Error in updating connmsg");
 	}
-	nng_mqtt_set_connect_cb(*sock, NULL, NULL);
+	// subscribed right below, the callback only counts the connect
+	nng_mqtt_set_connect_cb(
+	    *sock, bridge_conn_connect_cb, &bridge_arg->conns[0]);
 	nng_mqtt_set_disconnect_cb(*sock, bridge_tcp_disconnect_cb, bridge_arg);
 	nng_dialer_start(dialer, NNG_FLAG_NONBLOCK);
 
@@ -1041,20 +1959,6 @@ bridge_tcp_client(nng_socket *sock, conf *config, conf_bridge_node *node, bridge
 	return 0;
 }
 
-/**
- * independent callback API for bridging aio
- */
-void
-bridge_send_cb(void *arg)
-{
-	int rv;
-	nng_msg *msg = NULL;
-	nng_aio *aio;
-	conf_bridge_node *node = arg;
-
-	log_debug("bridge to %s msg sent", node->address);
-}
-
 int
 bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 {
@@ -1069,6 +1973,8 @@ bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 	bridge_arg->config = node;
 	bridge_arg->sock   = sock;
 	bridge_arg->conf   = config;
+	bridge_arg->adapt  = NULL;
+	bridge_arg->prober = NULL;
 	if (node->address == NULL) {
 		log_error("invalid bridging config!");
 		return -1;
@@ -1076,6 +1982,13 @@ bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 	if (reload_lock == NULL) {
 		nng_mtx_alloc(&reload_lock);
 	}
+	// the callbacks of the first connection count on it
+	if ((rv = bridge_conns_alloc(bridge_arg, node,
+	         0 == strncmp(node->address, tcp_scheme, strlen(tcp_scheme)) ||
+	             0 == strncmp(node->address, tls_scheme,
+	                      strlen(tls_scheme)))) != 0) {
+		nng_fatal("bridge_conns_alloc", rv);
+	}
 
 	if (0 == strncmp(node->address, tcp_scheme, strlen(tcp_scheme)) ||
 	    0 == strncmp(node->address, tls_scheme, strlen(tls_scheme))) {
@@ -1085,24 +1998,18 @@ bridge_client(nng_socket *sock, conf *config, conf_bridge_node *node)
 		bridge_quic_client(sock, config, node, bridge_arg);
 #endif
 	} else {
+		bridge_conns_fini(bridge_arg);
 		nng_free(bridge_arg, sizeof(bridge_param));
 		log_error("Unsupported bridge protocol.\n");
+		return NNG_ENOTSUP;
 	}
 
-	// alloc an AIO for each ctx bridging use only
-	node->bridge_aio = nng_alloc(
-	    (config->parallel + node->parallel * 2) * sizeof(nng_aio *));
-
 	node->sock = (void *) sock;
 	node->bridge_arg = (void *) bridge_arg;
 
-	for (uint32_t num = 0; num < (config->parallel + node->parallel * 2);
-	     num++) {
-		if ((rv = nng_aio_alloc(
-		         &node->bridge_aio[num], bridge_send_cb, node)) != 0) {
-			nng_fatal("bridge_aio nng_aio_alloc", rv);
-		}
-		log_debug("parallel %d", num);
+	// the publishes forwarded to this node queue up here
+	if ((rv = bridge_conns_start(bridge_arg, config)) != 0) {
+		nng_fatal("bridge_conns_start", rv);
 	}
 	return 0;
 }
@@ -1319,6 +2226,7 @@ bridge_reload(nng_socket *sock, conf *config, conf_bridge_node *node)
 	node->sock               = new;
 	node->enable             = true;
 	bridge_arg->sock         = new;
+	bridge_conns_reload(bridge_arg);
 	nng_mtx_unlock(reload_lock);
 
 	return 0;
@@ -0,0 +1,224 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include "include/bridge_adapt.h"
+#include "nng/supplemental/util/platform.h"
+
+// spans the throughput of the active transport is measured over, in ms
+#define BRIDGE_ADAPT_RATE_WINDOW 5000
+// a reconnect is not worth less, in ms
+#define BRIDGE_ADAPT_MIN_GAIN 10
+
+typedef struct {
+	bool     lost;
+	uint32_t rtt;
+} adapt_sample;
+
+typedef struct {
+	adapt_sample *ring; // the last window probes
+	uint32_t      next;
+	uint32_t      len;
+	uint64_t      probes;
+	uint64_t      lost;
+	double        throughput;
+} adapt_transport;
+
+struct bridge_adapt {
+	const conf_bridge_adaptive *conf;
+	nng_mtx                    *mtx;
+	adapt_transport             transports[BRIDGE_TRANSPORTS];
+	bridge_transport            active; // BRIDGE_TRANSPORTS until known
+	nng_time                    since;  // it became active
+	uint32_t                    better; // probes the other scored better
+	uint64_t                    switches;
+	// throughput of the active transport since rate_at
+	nng_time rate_at;
+	uint64_t rate_mark;
+};
+
+const char *
+bridge_transport_name(bridge_transport t)
+{
+	switch (t) {
+	case BRIDGE_TRANSPORT_TCP:
+		return "tcp";
+	case BRIDGE_TRANSPORT_QUIC:
+		return "quic";
+	default:
+		return "none";
+	}
+}
+
+int
+bridge_adapt_alloc(bridge_adapt **ap, const conf_bridge_adaptive *conf)
+{
+	bridge_adapt *a;
+	int           rv;
+
+	if ((a = nng_zalloc(sizeof(*a))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	a->conf   = conf;
+	a->active = BRIDGE_TRANSPORTS;
+	if ((rv = nng_mtx_alloc(&a->mtx)) != 0) {
+		bridge_adapt_free(a);
+		return rv;
+	}
+	for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+		if ((a->transports[t].ring = nng_zalloc(
+		         conf->window * sizeof(adapt_sample))) == NULL) {
+			bridge_adapt_free(a);
+			return NNG_ENOMEM;
+		}
+	}
+	*ap = a;
+	return 0;
+}
+
+void
+bridge_adapt_free(bridge_adapt *a)
+{
+	if (a == NULL) {
+		return;
+	}
+	for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+		if (a->transports[t].ring != NULL) {
+			nng_free(a->transports[t].ring,
+			    a->conf->window * sizeof(adapt_sample));
+		}
+	}
+	if (a->mtx != NULL) {
+		nng_mtx_free(a->mtx);
+	}
+	nng_free(a, sizeof(*a));
+}
+
+void
+bridge_adapt_sample(
+    bridge_adapt *a, bridge_transport t, bool lost, nng_duration rtt)
+{
+	adapt_transport *at = &a->transports[t];
+
+	nng_mtx_lock(a->mtx);
+	at->ring[at->next] = (adapt_sample){
+		.lost = lost,
+		.rtt  = lost || rtt < 0 ? 0 : (uint32_t) rtt,
+	};
+	at->next = (at->next + 1) % a->conf->window;
+	if (at->len < a->conf->window) {
+		at->len++;
+	}
+	at->probes++;
+	if (lost) {
+		at->lost++;
+	}
+	nng_mtx_unlock(a->mtx);
+}
+
+// with mtx held
+static void
+adapt_score(bridge_adapt *a, bridge_transport t, bridge_adapt_stats *stats)
+{
+	adapt_transport *at       = &a->transports[t];
+	uint64_t         sum      = 0;
+	uint32_t         answered = 0;
+
+	stats->probes     = at->probes;
+	stats->lost       = at->lost;
+	stats->throughput = at->throughput;
+	stats->scored     = at->len == a->conf->window;
+	for (uint32_t i = 0; i < at->len; i++) {
+		if (!at->ring[i].lost) {
+			sum += at->ring[i].rtt;
+			answered++;
+		}
+	}
+	stats->rtt =
+	    answered == 0 ? a->conf->interval : (double) sum / answered;
+	stats->loss = at->len == 0 ? 0 : 1 - (double) answered / at->len;
+	// a lost probe is sent again after a round trip, and one unanswered
+	// within the interval is as bad as it gets
+	stats->score = answered == 0 ? a->conf->interval
+	                             : stats->rtt / (1 - stats->loss);
+	if (stats->score > a->conf->interval) {
+		stats->score = a->conf->interval;
+	}
+}
+
+void
+bridge_adapt_sent(bridge_adapt *a, bridge_transport active,
+    uint64_t sent_bytes, nng_time now)
+{
+	nng_mtx_lock(a->mtx);
+	if (a->rate_at == 0 || sent_bytes < a->rate_mark) {
+		a->rate_at   = now;
+		a->rate_mark = sent_bytes;
+	} else if (now - a->rate_at >= BRIDGE_ADAPT_RATE_WINDOW &&
+	    active < BRIDGE_TRANSPORTS) {
+		a->transports[active].throughput =
+		    (double) (sent_bytes - a->rate_mark) * 1000 /
+		    (double) (now - a->rate_at);
+		a->rate_at   = now;
+		a->rate_mark = sent_bytes;
+	}
+	nng_mtx_unlock(a->mtx);
+}
+
+bool
+bridge_adapt_decide(bridge_adapt *a, bridge_transport active, nng_time now)
+{
+	bridge_adapt_stats cur, other;
+	bool               sw = false;
+
+	nng_mtx_lock(a->mtx);
+	if (active != a->active) {
+		// switched, by us or by the bridge failing over
+		a->active = active;
+		a->since  = now;
+		a->better = 0;
+	}
+	adapt_score(a, active, &cur);
+	adapt_score(a, active == BRIDGE_TRANSPORT_TCP ? BRIDGE_TRANSPORT_QUIC
+	                                              : BRIDGE_TRANSPORT_TCP,
+	    &other);
+	if (cur.scored && other.scored &&
+	    other.score * (100 + a->conf->margin) < cur.score * 100 &&
+	    other.score + BRIDGE_ADAPT_MIN_GAIN < cur.score) {
+		a->better++;
+	} else {
+		a->better = 0;
+	}
+	if (a->better >= a->conf->hold && now - a->since >= a->conf->dwell) {
+		a->better = 0;
+		a->switches++;
+		sw = true;
+	}
+	nng_mtx_unlock(a->mtx);
+	return sw;
+}
+
+void
+bridge_adapt_get_stats(
+    bridge_adapt *a, bridge_transport t, bridge_adapt_stats *stats)
+{
+	nng_mtx_lock(a->mtx);
+	adapt_score(a, t, stats);
+	nng_mtx_unlock(a->mtx);
+}
+
+uint64_t
+bridge_adapt_switches(bridge_adapt *a)
+{
+	uint64_t n;
+
+	nng_mtx_lock(a->mtx);
+	n = a->switches;
+	nng_mtx_unlock(a->mtx);
+	return n;
+}
@@ -0,0 +1,602 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/bridge.h"
+#include "include/bridge_envelope.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "nng/protocol/mqtt/mqtt_parser.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(SUPP_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(SUPP_ZSTD)
+#include <zstd.h>
+#endif
+
+#define ENVELOPE_MAGIC "NMQE"
+// records of one envelope, MQTT caps a publish at 256 MB anyway
+#define ENVELOPE_RAW_MAX (256 * 1024 * 1024)
+// flags, topic length and payload length of a record, the payload length
+// is a variable byte integer as in MQTT
+#define RECORD_OVERHEAD_MIN 4
+#define RECORD_OVERHEAD_MAX 7
+#define RECORD_PAYLOAD_MAX 268435455
+
+struct bridge_envelope {
+	const conf_bridge_envelope *conf;
+	bridge_compress             codec; // conf->compress if it is built in
+	bridge_queue               *q;
+	nng_mtx                    *mtx;
+	nng_aio                    *timer;
+	bool                        sleeping;
+	bool                        closing;
+	nng_msg                    *raw; // records of the open envelope
+	uint32_t                    count;
+	uint8_t                     qos; // highest of the records
+	nng_time                    deadline;
+	bridge_envelope_stats       stats;
+};
+
+static void
+put_u16(uint8_t *b, uint16_t v)
+{
+	b[0] = (uint8_t) (v >> 8);
+	b[1] = (uint8_t) v;
+}
+
+static void
+put_u32(uint8_t *b, uint32_t v)
+{
+	b[0] = (uint8_t) (v >> 24);
+	b[1] = (uint8_t) (v >> 16);
+	b[2] = (uint8_t) (v >> 8);
+	b[3] = (uint8_t) v;
+}
+
+static uint16_t
+get_u16(const uint8_t *b)
+{
+	return (uint16_t) ((b[0] << 8) | b[1]);
+}
+
+static uint32_t
+get_u32(const uint8_t *b)
+{
+	return ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) |
+	    ((uint32_t) b[2] << 8) | b[3];
+}
+
+/**
+ * @brief an empty envelope, room for the header is kept in front of the
+ *        records bridge_envelope_append() adds.
+ */
+int
+bridge_envelope_open(nng_msg **rawp, size_t cap)
+{
+	int rv;
+
+	// appends stay within the space of the message
+	if ((rv = nng_msg_alloc(rawp, BRIDGE_ENVELOPE_HEADER_LEN + cap)) != 0) {
+		return rv;
+	}
+	nng_msg_chop(*rawp, cap);
+	memset(nng_msg_body(*rawp), 0, BRIDGE_ENVELOPE_HEADER_LEN);
+	return 0;
+}
+
+int
+bridge_envelope_append(nng_msg *raw, uint8_t qos, bool retain,
+    const char *topic, uint32_t topic_len, const uint8_t *payload,
+    uint32_t payload_len)
+{
+	uint8_t  b[RECORD_OVERHEAD_MAX];
+	uint32_t len = payload_len;
+	uint32_t n   = 0;
+	int      rv;
+
+	if (topic_len > UINT16_MAX || payload_len > RECORD_PAYLOAD_MAX) {
+		return NNG_EINVAL;
+	}
+	b[0] = (uint8_t) ((qos & 0x03) | (retain ? 0x04 : 0));
+	put_u16(b + 1, (uint16_t) topic_len);
+	if ((rv = nng_msg_append(raw, b, 3)) != 0 ||
+	    (rv = nng_msg_append(raw, topic, topic_len)) != 0) {
+		return rv;
+	}
+	do {
+		b[n] = (uint8_t) (len & 0x7f);
+		len >>= 7;
+		if (len > 0) {
+			b[n] |= 0x80;
+		}
+		n++;
+	} while (len > 0);
+	if ((rv = nng_msg_append(raw, b, n)) != 0) {
+		return rv;
+	}
+	if (payload_len > 0) {
+		rv = nng_msg_append(raw, payload, payload_len);
+	}
+	return rv;
+}
+
+static void
+write_header(uint8_t *b, bridge_compress codec, uint32_t count, size_t raw_len)
+{
+	memcpy(b, ENVELOPE_MAGIC, 4);
+	b[4] = BRIDGE_ENVELOPE_VERSION;
+	b[5] = (uint8_t) codec;
+	put_u32(b + 6, count);
+	put_u32(b + 10, (uint32_t) raw_len);
+}
+
+// the compressed records in out after the header, NNG_ENOSPC when that
+// is no smaller than the records themselves
+static int
+compress_body(nng_msg *out, bridge_compress codec, int level,
+    const uint8_t *src, size_t len)
+{
+	uint8_t *dst = (uint8_t *) nng_msg_body(out) + BRIDGE_ENVELOPE_HEADER_LEN;
+	size_t   cap = nng_msg_len(out) - BRIDGE_ENVELOPE_HEADER_LEN;
+	size_t   n   = 0;
+
+	switch (codec) {
+#if defined(SUPP_ZLIB)
+	case BRIDGE_COMPRESS_DEFLATE: {
+		uLongf dlen = (uLongf) cap;
+
+		if (compress2(dst, &dlen, src, (uLong) len,
+		        level == 0 ? Z_DEFAULT_COMPRESSION : level) != Z_OK) {
+			return NNG_ENOSPC;
+		}
+		n = dlen;
+		break;
+	}
+#endif
+#if defined(SUPP_ZSTD)
+	case BRIDGE_COMPRESS_ZSTD:
+		// level 0 is the default of zstd
+		n = ZSTD_compress(dst, cap, src, len, level);
+		if (ZSTD_isError(n)) {
+			return NNG_ENOSPC;
+		}
+		break;
+#endif
+	default:
+		(void) dst;
+		(void) cap;
+		(void) src;
+		(void) level;
+		return NNG_ENOTSUP;
+	}
+	if (n >= len) {
+		return NNG_ENOSPC;
+	}
+	return nng_msg_realloc(out, BRIDGE_ENVELOPE_HEADER_LEN + n);
+}
+
+/**
+ * @brief finish the envelope raw with count records, compressed with
+ *        codec when that makes it smaller. Takes raw in every case.
+ */
+int
+bridge_envelope_seal(nng_msg *raw, uint32_t count, bridge_compress codec,
+    int level, nng_msg **payloadp)
+{
+	const uint8_t *src = (uint8_t *) nng_msg_body(raw) +
+	    BRIDGE_ENVELOPE_HEADER_LEN;
+	size_t   len = nng_msg_len(raw) - BRIDGE_ENVELOPE_HEADER_LEN;
+	size_t   cap = len;
+	nng_msg *out;
+	int      rv;
+
+	if (len > ENVELOPE_RAW_MAX) {
+		nng_msg_free(raw);
+		return NNG_EMSGSIZE;
+	}
+#if defined(SUPP_ZLIB)
+	if (codec == BRIDGE_COMPRESS_DEFLATE) {
+		cap = compressBound((uLong) len);
+	}
+#endif
+#if defined(SUPP_ZSTD)
+	if (codec == BRIDGE_COMPRESS_ZSTD) {
+		cap = ZSTD_compressBound(len);
+	}
+#endif
+	if (codec != BRIDGE_COMPRESS_NONE &&
+	    nng_msg_alloc(&out, BRIDGE_ENVELOPE_HEADER_LEN + cap) == 0) {
+		if ((rv = compress_body(out, codec, level, src, len)) == 0) {
+			write_header(nng_msg_body(out), codec, count, len);
+			nng_msg_free(raw);
+			*payloadp = out;
+			return 0;
+		}
+		nng_msg_free(out);
+	}
+	// sent as they are
+	write_header(nng_msg_body(raw), BRIDGE_COMPRESS_NONE, count, len);
+	*payloadp = raw;
+	return 0;
+}
+
+/**
+ * @brief whether node would have received a publish on topic from the
+ *        remote broker: a subscription of the node must match it, and
+ *        *qos is capped at the highest qos those grant. The records of an
+ *        envelope go through it like the publishes they stand for, which
+ *        keep their topic when bridged in.
+ */
+bool
+bridge_envelope_accept(
+    const conf_bridge_node *node, const char *topic, uint8_t *qos)
+{
+	const char *filter;
+	bool        match = false;
+	uint8_t     max   = 0;
+
+	for (size_t i = 0; i < node->sub_count; i++) {
+		filter = node->sub_list[i]->topic;
+		if (filter == NULL) {
+			continue;
+		}
+		if (strncmp(filter, "$share/", strlen("$share/")) == 0) {
+			// the group is for the remote broker
+			if ((filter = strchr(filter + strlen("$share/"), '/')) ==
+			    NULL) {
+				continue;
+			}
+			filter++;
+		}
+		if (topic_filter(filter, topic)) {
+			match = true;
+			if (node->sub_list[i]->qos > max) {
+				max = node->sub_list[i]->qos;
+			}
+		}
+	}
+	if (match && *qos > max) {
+		*qos = max;
+	}
+	return match;
+}
+
+bool
+bridge_envelope_check(const uint8_t *payload, size_t len)
+{
+	return len >= BRIDGE_ENVELOPE_HEADER_LEN &&
+	    memcmp(payload, ENVELOPE_MAGIC, 4) == 0 &&
+	    payload[4] == BRIDGE_ENVELOPE_VERSION;
+}
+
+static int
+decompress_body(bridge_compress codec, const uint8_t *src, size_t len,
+    uint8_t *dst, size_t raw_len)
+{
+	switch (codec) {
+#if defined(SUPP_ZLIB)
+	case BRIDGE_COMPRESS_DEFLATE: {
+		uLongf dlen = (uLongf) raw_len;
+
+		if (uncompress(dst, &dlen, src, (uLong) len) != Z_OK ||
+		    dlen != raw_len) {
+			return NNG_EPROTO;
+		}
+		return 0;
+	}
+#endif
+#if defined(SUPP_ZSTD)
+	case BRIDGE_COMPRESS_ZSTD: {
+		size_t n = ZSTD_decompress(dst, raw_len, src, len);
+
+		if (ZSTD_isError(n) || n != raw_len) {
+			return NNG_EPROTO;
+		}
+		return 0;
+	}
+#endif
+	default:
+		(void) src;
+		(void) len;
+		(void) dst;
+		(void) raw_len;
+		return NNG_ENOTSUP;
+	}
+}
+
+// count records filling the len bytes of b exactly, with cb called for
+// each when it is there
+static int
+walk_records(const uint8_t *b, size_t len, uint32_t count,
+    bridge_envelope_cb cb, void *arg)
+{
+	bridge_envelope_record rec;
+	size_t                 off = 0;
+	int                    rv;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t shift = 0;
+
+		if (len - off < RECORD_OVERHEAD_MIN) {
+			return NNG_EPROTO;
+		}
+		rec.qos       = b[off] & 0x03;
+		rec.retain    = (b[off] & 0x04) != 0;
+		rec.topic_len = get_u16(b + off + 1);
+		off += 3;
+		if (rec.qos > 2 || len - off < (size_t) rec.topic_len + 1) {
+			return NNG_EPROTO;
+		}
+		rec.topic = (const char *) b + off;
+		off += rec.topic_len;
+		rec.payload_len = 0;
+		do {
+			if (off == len || shift > 21) {
+				return NNG_EPROTO;
+			}
+			rec.payload_len |= (uint32_t) (b[off] & 0x7f) << shift;
+			shift += 7;
+		} while ((b[off++] & 0x80) != 0);
+		if (len - off < rec.payload_len) {
+			return NNG_EPROTO;
+		}
+		rec.payload = b + off;
+		off += rec.payload_len;
+		if (cb != NULL && (rv = cb(&rec, arg)) != 0) {
+			return rv;
+		}
+	}
+	return off == len ? 0 : NNG_EPROTO;
+}
+
+/**
+ * @brief call cb for each publish of the envelope in payload. The whole
+ *        envelope is checked first, cb sees none of a malformed one.
+ */
+int
+bridge_envelope_unpack(
+    const uint8_t *payload, size_t len, bridge_envelope_cb cb, void *arg)
+{
+	const uint8_t  *body = payload + BRIDGE_ENVELOPE_HEADER_LEN;
+	bridge_compress codec;
+	uint32_t        count, raw_len;
+	uint8_t        *raw = NULL;
+	int             rv;
+
+	if (!bridge_envelope_check(payload, len)) {
+		return NNG_EINVAL;
+	}
+	codec   = (bridge_compress) payload[5];
+	count   = get_u32(payload + 6);
+	raw_len = get_u32(payload + 10);
+	len -= BRIDGE_ENVELOPE_HEADER_LEN;
+	if (raw_len > ENVELOPE_RAW_MAX ||
+	    (uint64_t) count * RECORD_OVERHEAD_MIN > raw_len) {
+		return NNG_EPROTO;
+	}
+	if (codec == BRIDGE_COMPRESS_NONE) {
+		if (len != raw_len) {
+			return NNG_EPROTO;
+		}
+	} else if (codec == BRIDGE_COMPRESS_DEFLATE ||
+	    codec == BRIDGE_COMPRESS_ZSTD) {
+		if ((raw = nng_alloc(raw_len + 1)) == NULL) {
+			return NNG_ENOMEM;
+		}
+		if ((rv = decompress_body(codec, body, len, raw, raw_len)) !=
+		    0) {
+			nng_free(raw, raw_len + 1);
+			return rv;
+		}
+		body = raw;
+	} else {
+		return NNG_EPROTO;
+	}
+	if ((rv = walk_records(body, raw_len, count, NULL, NULL)) == 0) {
+		rv = walk_records(body, raw_len, count, cb, arg);
+	}
+	if (raw != NULL) {
+		nng_free(raw, raw_len + 1);
+	}
+	return rv;
+}
+
+// hand the open envelope to the send queue, under e->mtx so envelopes go
+// out in the order they were filled
+static void
+envelope_flush(bridge_envelope *e)
+{
+	nng_msg *payload, *msg;
+	uint32_t count = e->count;
+	size_t   raw_len;
+	int      rv;
+
+	if (e->raw == NULL) {
+		return;
+	}
+	raw_len  = nng_msg_len(e->raw) - BRIDGE_ENVELOPE_HEADER_LEN;
+	rv       = bridge_envelope_seal(
+            e->raw, count, e->codec, e->conf->level, &payload);
+	e->raw   = NULL;
+	e->count = 0;
+	if (rv != 0) {
+		log_error("bridge envelope of %u msgs dropped: %s", count,
+		    nng_strerror(rv));
+		return;
+	}
+	msg = bridge_publish_msg(e->conf->topic, nng_msg_body(payload),
+	    (uint32_t) nng_msg_len(payload), false, e->qos, false, NULL);
+	e->stats.envelopes++;
+	e->stats.msgs += count;
+	e->stats.raw_bytes += raw_len;
+	e->stats.wire_bytes += nng_msg_len(payload);
+	nng_msg_free(payload);
+	bridge_queue_put(e->q, msg);
+}
+
+static void
+envelope_timer_cb(void *arg)
+{
+	bridge_envelope *e = arg;
+	nng_time         now;
+
+	nng_mtx_lock(e->mtx);
+	e->sleeping = false;
+	if (e->closing || e->raw == NULL) {
+		nng_mtx_unlock(e->mtx);
+		return;
+	}
+	now = nng_clock();
+	if (now >= e->deadline) {
+		envelope_flush(e);
+	} else {
+		// the envelope the timer was set for went out on a limit
+		e->sleeping = true;
+		nng_sleep_aio((nng_duration) (e->deadline - now), e->timer);
+	}
+	nng_mtx_unlock(e->mtx);
+}
+
+int
+bridge_envelope_alloc(bridge_envelope **ep, const conf_bridge_envelope *conf,
+    bridge_queue *q)
+{
+	bridge_envelope *e;
+	int              rv;
+
+	if ((e = nng_zalloc(sizeof(*e))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	e->conf  = conf;
+	e->q     = q;
+	e->codec = conf->compress;
+#if !defined(SUPP_ZLIB)
+	if (e->codec == BRIDGE_COMPRESS_DEFLATE) {
+		log_warn("bridge envelope: deflate needs ENABLE_ZLIB, sent "
+		         "uncompressed");
+		e->codec = BRIDGE_COMPRESS_NONE;
+	}
+#endif
+#if !defined(SUPP_ZSTD)
+	if (e->codec == BRIDGE_COMPRESS_ZSTD) {
+		log_warn("bridge envelope: zstd needs ENABLE_ZSTD, sent "
+		         "uncompressed");
+		e->codec = BRIDGE_COMPRESS_NONE;
+	}
+#endif
+	if ((rv = nng_mtx_alloc(&e->mtx)) != 0 ||
+	    (rv = nng_aio_alloc(&e->timer, envelope_timer_cb, e)) != 0) {
+		if (e->mtx != NULL) {
+			nng_mtx_free(e->mtx);
+		}
+		nng_free(e, sizeof(*e));
+		return rv;
+	}
+	*ep = e;
+	return 0;
+}
+
+void
+bridge_envelope_free(bridge_envelope *e)
+{
+	nng_mtx_lock(e->mtx);
+	e->closing = true;
+	nng_mtx_unlock(e->mtx);
+	nng_aio_stop(e->timer);
+
+	nng_mtx_lock(e->mtx);
+	envelope_flush(e);
+	nng_mtx_unlock(e->mtx);
+
+	nng_aio_free(e->timer);
+	nng_mtx_free(e->mtx);
+	nng_free(e, sizeof(*e));
+}
+
+/**
+ * @brief pack msg into the open envelope, sealing it on whichever limit
+ *        of bridges.mqtt.<name>.envelope is reached first.
+ */
+int
+bridge_envelope_put(bridge_envelope *e, nng_msg *msg)
+{
+	const conf_bridge_envelope *conf = e->conf;
+	const char                 *topic;
+	uint8_t                    *payload;
+	uint32_t                    tlen, plen;
+	size_t                      len;
+	uint8_t                     qos;
+	int                         rv;
+
+	topic   = nng_mqtt_msg_get_publish_topic(msg, &tlen);
+	payload = nng_mqtt_msg_get_publish_payload(msg, &plen);
+	qos     = nng_mqtt_msg_get_publish_qos(msg);
+
+	nng_mtx_lock(e->mtx);
+	if (e->closing) {
+		nng_mtx_unlock(e->mtx);
+		nng_msg_free(msg);
+		return NNG_ECLOSED;
+	}
+	if (e->raw != NULL &&
+	    nng_msg_len(e->raw) - BRIDGE_ENVELOPE_HEADER_LEN +
+	            RECORD_OVERHEAD_MAX + tlen + plen >
+	        conf->max_bytes) {
+		envelope_flush(e);
+	}
+	if (e->raw == NULL) {
+		if ((rv = bridge_envelope_open(&e->raw, conf->max_bytes)) !=
+		    0) {
+			nng_mtx_unlock(e->mtx);
+			// on its own then
+			return bridge_queue_put(e->q, msg);
+		}
+		e->qos      = 0;
+		e->deadline = nng_clock() + conf->window;
+		if (!e->sleeping && conf->window > 0) {
+			e->sleeping = true;
+			nng_sleep_aio(conf->window, e->timer);
+		}
+	}
+	len = nng_msg_len(e->raw);
+	if ((rv = bridge_envelope_append(e->raw, qos,
+	         nng_mqtt_msg_get_publish_retain(msg), topic, tlen, payload,
+	         plen)) != 0) {
+		// the records before it are still whole
+		nng_msg_chop(e->raw, nng_msg_len(e->raw) - len);
+		nng_mtx_unlock(e->mtx);
+		nng_msg_free(msg);
+		return rv;
+	}
+	nng_msg_free(msg);
+	e->count++;
+	if (qos > e->qos) {
+		e->qos = qos;
+	}
+	if (e->count >= conf->max_msgs ||
+	    nng_msg_len(e->raw) - BRIDGE_ENVELOPE_HEADER_LEN >=
+	        conf->max_bytes ||
+	    conf->window == 0) {
+		envelope_flush(e);
+	}
+	nng_mtx_unlock(e->mtx);
+	return 0;
+}
+
+void
+bridge_envelope_get_stats(bridge_envelope *e, bridge_envelope_stats *stats)
+{
+	nng_mtx_lock(e->mtx);
+	*stats = e->stats;
+	nng_mtx_unlock(e->mtx);
+}
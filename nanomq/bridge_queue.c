@@ -0,0 +1,996 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/bridge.h"
+#include "include/bridge_queue.h"
+#include "include/bridge_sched.h"
+#include "include/conf_ext.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "nng/protocol/mqtt/mqtt_parser.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(NNG_SUPP_SQLITE)
+#include "nng/supplemental/sqlite/sqlite3.h"
+#endif
+
+#define BRIDGE_QUEUE_SEND_TIMEOUT 3000
+// rows taken back from the spill table at once
+#define BRIDGE_SPOOL_LOAD 64
+// the catchup pace lets this much of the backlog out at once, in ms
+#define BRIDGE_CATCHUP_BURST 100
+// shortest span the drain rate of the backlog is measured over, in ms
+#define BRIDGE_DRAIN_WINDOW 5000
+// stream of a message from the backlog, which no stream counts
+#define BRIDGE_STREAM_NONE UINT32_MAX
+
+typedef struct {
+	bridge_queue *q;
+	nng_aio      *aio;
+	size_t        len;    // msg_size() of the message in flight
+	uint32_t      stream; // it came from
+	nng_time      at;     // it was put
+} bridge_sender;
+
+struct bridge_queue {
+	conf_bridge_node          *node;
+	nng_socket                *sock;  // NULL for node->sock
+	uint32_t                   index; // of the connection of the node
+	const conf_bridge_queue   *conf;
+	const conf_bridge_catchup *catchup;
+	nng_mtx                   *mtx;
+	bridge_sched              *sched;   // messages in memory, by stream
+	nng_lmq                   *backlog; // rows back from the spill table
+	bool                       closing;
+	bool                       link_up; // always with catchup disabled
+	bridge_sender             *senders;
+	size_t                     nsenders;
+	bridge_sender            **idle; // senders without a message
+	size_t                     nidle;
+	// catchup pace of the backlog, tokens go below zero for a message
+	// bigger than what is left
+	nng_aio *pace;
+	bool     pacing; // pace is asleep until there are tokens again
+	nng_time pace_at;
+	double   msg_tokens;
+	double   byte_tokens;
+	// drain rate of the backlog since drain_at
+	nng_time drain_at;
+	uint64_t drain_mark;
+	// under mtx, queued, backlog and what follows are filled in by
+	// bridge_queue_get_stats()
+	bridge_queue_stats stats;
+#if defined(NNG_SUPP_SQLITE)
+	sqlite3      *db;
+	uint64_t      spool_max;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *select;
+	sqlite3_stmt *delete;
+	int64_t       front; // Id of the next row spool_put() puts first
+	// The database is only used by the spool thread, and by
+	// bridge_queue_free() once the thread is gone. Puts hand what spills
+	// over in spool_in, the senders ask for the backlog with spool_load.
+	nng_thread *spool_thr;
+	nng_cv     *spool_cv;
+	nng_lmq    *spool_in;
+	bool        spool_load;
+#endif
+};
+
+// what max_bytes counts, the message is not encoded yet
+static size_t
+msg_size(nng_msg *msg)
+{
+	uint32_t tlen = 0, plen = 0;
+
+	nng_mqtt_msg_get_publish_topic(msg, &tlen);
+	nng_mqtt_msg_get_publish_payload(msg, &plen);
+	return (size_t) tlen + plen;
+}
+
+#if defined(NNG_SUPP_SQLITE)
+
+static int
+spool_exec(bridge_queue *q, const char *sql)
+{
+	char *err_msg = NULL;
+
+	if (sqlite3_exec(q->db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+		log_error("bridge queue: %s: %s", sql, err_msg);
+		sqlite3_free(err_msg);
+		return NNG_EINTERNAL;
+	}
+	return 0;
+}
+
+static void spool_thread(void *arg);
+
+// once q->closing is set, the spool thread writes what was handed over
+// and goes
+static void
+spool_stop(bridge_queue *q)
+{
+	if (q->spool_thr != NULL) {
+		nng_mtx_lock(q->mtx);
+		nng_cv_wake(q->spool_cv);
+		nng_mtx_unlock(q->mtx);
+		nng_thread_destroy(q->spool_thr);
+		q->spool_thr = NULL;
+	}
+}
+
+static void
+spool_close(bridge_queue *q)
+{
+	nng_msg *msg;
+
+	spool_stop(q);
+	if (q->spool_in != NULL) {
+		while (nng_lmq_get(q->spool_in, &msg) == 0) {
+			nng_msg_free(msg);
+		}
+		nng_lmq_free(q->spool_in);
+		q->spool_in = NULL;
+	}
+	if (q->spool_cv != NULL) {
+		nng_cv_free(q->spool_cv);
+		q->spool_cv = NULL;
+	}
+	sqlite3_finalize(q->insert);
+	sqlite3_finalize(q->select);
+	sqlite3_finalize(q->delete);
+	sqlite3_close(q->db);
+	q->db = NULL;
+}
+
+// The table lives beside the cache of NanoSDK, whose database handle is
+// not reachable from here. Rows left by the last run are sent first.
+static int
+spool_open(bridge_queue *q, conf_sqlite *cache)
+{
+	const char   *dir  = cache->mounted_file_path != NULL
+	       ? cache->mounted_file_path
+	       : "/tmp/";
+	size_t        n    = strlen(dir);
+	sqlite3_stmt *stmt = NULL;
+	char         *path;
+
+	// the first connection keeps the name of a single connection node
+	path = q->index == 0
+	    ? sqlite3_mprintf("%s%sbridge_queue_%s.db", dir,
+	          n > 0 && dir[n - 1] == '/' ? "" : "/",
+	          q->node->name != NULL ? q->node->name : "mqtt")
+	    : sqlite3_mprintf("%s%sbridge_queue_%s_%u.db", dir,
+	          n > 0 && dir[n - 1] == '/' ? "" : "/",
+	          q->node->name != NULL ? q->node->name : "mqtt", q->index);
+	if (path == NULL) {
+		return NNG_ENOMEM;
+	}
+	if (sqlite3_open(path, &q->db) != SQLITE_OK) {
+		log_error("bridge queue: %s: %s", path, sqlite3_errmsg(q->db));
+		sqlite3_close(q->db);
+		q->db = NULL;
+		sqlite3_free(path);
+		return NNG_EINTERNAL;
+	}
+	sqlite3_free(path);
+	if (spool_exec(q, "PRAGMA journal_mode=WAL") != 0 ||
+	    spool_exec(q, "PRAGMA synchronous=NORMAL") != 0 ||
+	    spool_exec(q,
+	        "CREATE TABLE IF NOT EXISTS spool("
+	        "Id INTEGER PRIMARY KEY AUTOINCREMENT, Topic TEXT, "
+	        "Payload BLOB, Qos INT, Retain INT, Props BLOB)") != 0) {
+		spool_close(q);
+		return NNG_EINTERNAL;
+	}
+	if (sqlite3_prepare_v2(q->db,
+	        "INSERT INTO spool (Id, Topic, Payload, Qos, Retain, Props) "
+	        "VALUES (?, ?, ?, ?, ?, ?)",
+	        -1, &q->insert, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(q->db,
+	        "SELECT Id, Topic, Payload, Qos, Retain, Props FROM spool "
+	        "ORDER BY Id LIMIT ?",
+	        -1, &q->select, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(q->db, "DELETE FROM spool WHERE Id <= ?", -1,
+	        &q->delete, NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(q->db, "SELECT COUNT(*) FROM spool", -1,
+	        &stmt, NULL) != SQLITE_OK) {
+		log_error("bridge queue: %s", sqlite3_errmsg(q->db));
+		sqlite3_finalize(stmt);
+		spool_close(q);
+		return NNG_EINTERNAL;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		q->stats.spooled = (uint64_t) sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	q->spool_max = cache->disk_cache_size;
+	if (nng_cv_alloc(&q->spool_cv, q->mtx) != 0 ||
+	    nng_lmq_alloc(&q->spool_in, BRIDGE_SPOOL_LOAD) != 0 ||
+	    nng_thread_create(&q->spool_thr, spool_thread, q) != 0) {
+		spool_close(q);
+		return NNG_ENOMEM;
+	}
+	return 0;
+}
+
+// write one row, front puts it before every other, after spool_front()
+static int
+spool_put(bridge_queue *q, nng_msg *msg, bool front)
+{
+	const char *topic;
+	uint8_t    *payload;
+	uint32_t    tlen, plen;
+	property   *props;
+	nng_msg    *pmsg = NULL;
+	int         rv   = 0;
+
+	topic   = nng_mqtt_msg_get_publish_topic(msg, &tlen);
+	payload = nng_mqtt_msg_get_publish_payload(msg, &plen);
+	// MQTT v5 properties are kept as their wire encoding
+	if ((props = nng_mqtt_msg_get_publish_property(msg)) != NULL) {
+		if ((rv = nng_msg_alloc(&pmsg, 0)) != 0) {
+			return rv;
+		}
+		if (encode_properties(pmsg, props, CMD_PUBLISH) != 0) {
+			nng_msg_free(pmsg);
+			return NNG_EINVAL;
+		}
+	}
+	if (front) {
+		sqlite3_bind_int64(q->insert, 1, q->front++);
+	} else {
+		sqlite3_bind_null(q->insert, 1);
+	}
+	sqlite3_bind_text(q->insert, 2, topic, tlen, SQLITE_STATIC);
+	sqlite3_bind_blob(q->insert, 3, payload, plen, SQLITE_STATIC);
+	sqlite3_bind_int(q->insert, 4, nng_mqtt_msg_get_publish_qos(msg));
+	sqlite3_bind_int(q->insert, 5, nng_mqtt_msg_get_publish_retain(msg));
+	if (pmsg != NULL) {
+		sqlite3_bind_blob(q->insert, 6, nng_msg_body(pmsg),
+		    nng_msg_len(pmsg), SQLITE_STATIC);
+	} else {
+		sqlite3_bind_null(q->insert, 6);
+	}
+	if (sqlite3_step(q->insert) != SQLITE_DONE) {
+		log_error("bridge queue: %s", sqlite3_errmsg(q->db));
+		rv = NNG_EINTERNAL;
+	}
+	sqlite3_reset(q->insert);
+	sqlite3_clear_bindings(q->insert);
+	if (pmsg != NULL) {
+		nng_msg_free(pmsg);
+	}
+	return rv;
+}
+
+// make room for n rows in front of the spill table, which the messages
+// still in memory go to, they are older than every spilled one
+static void
+spool_front(bridge_queue *q, size_t n)
+{
+	sqlite3_stmt *stmt;
+
+	q->front = 1;
+	if (q->db == NULL ||
+	    sqlite3_prepare_v2(q->db, "SELECT MIN(Id) FROM spool", -1, &stmt,
+	        NULL) != SQLITE_OK) {
+		return;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW &&
+	    sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+		q->front = sqlite3_column_int64(stmt, 0) - (int64_t) n;
+	}
+	sqlite3_finalize(stmt);
+}
+
+static property *
+spool_props(const void *buf, int len)
+{
+	nng_msg  *pmsg;
+	property *props;
+	uint32_t  pos = 0, plen = 0;
+
+	if (len <= 0 || nng_msg_alloc(&pmsg, 0) != 0) {
+		return NULL;
+	}
+	if (nng_msg_append(pmsg, buf, len) != 0) {
+		nng_msg_free(pmsg);
+		return NULL;
+	}
+	props = decode_properties(pmsg, &pos, &plen, true);
+	nng_msg_free(pmsg);
+	return props;
+}
+
+// take the oldest rows out of the spill table, NULL for a row that did
+// not make a message. Returns the rows read.
+static size_t
+spool_load(bridge_queue *q, nng_msg **msgs, size_t max)
+{
+	sqlite3_stmt *stmt  = q->select;
+	int64_t       last  = -1;
+	size_t        count = 0;
+
+	sqlite3_bind_int(stmt, 1, (int) max);
+	while (count < max && sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *topic   = (const char *) sqlite3_column_text(stmt, 1);
+		const void *payload = sqlite3_column_blob(stmt, 2);
+		const void *props   = sqlite3_column_blob(stmt, 5);
+
+		last          = sqlite3_column_int64(stmt, 0);
+		msgs[count++] = bridge_publish_msg(topic, (uint8_t *) payload,
+		    (uint32_t) sqlite3_column_bytes(stmt, 2), false,
+		    (uint8_t) sqlite3_column_int(stmt, 3),
+		    sqlite3_column_int(stmt, 4) != 0,
+		    spool_props(props, sqlite3_column_bytes(stmt, 5)));
+	}
+	sqlite3_reset(stmt);
+	if (count == 0) {
+		return 0;
+	}
+	sqlite3_bind_int64(q->delete, 1, last);
+	if (sqlite3_step(q->delete) != SQLITE_DONE) {
+		log_error("bridge queue: %s", sqlite3_errmsg(q->db));
+	}
+	sqlite3_reset(q->delete);
+	return count;
+}
+
+static void queue_kick(bridge_queue *q);
+
+// Writes what puts handed over, a batch in one transaction, and refills
+// the backlog when it ran dry. q->mtx is only held to take and give back
+// messages.
+static void
+spool_thread(void *arg)
+{
+	bridge_queue *q = arg;
+	nng_msg      *msgs[BRIDGE_SPOOL_LOAD];
+	size_t        n, failed;
+	size_t        room;
+
+	nng_mtx_lock(q->mtx);
+	for (;;) {
+		if (!nng_lmq_empty(q->spool_in)) {
+			for (n = 0; n < BRIDGE_SPOOL_LOAD &&
+			     nng_lmq_get(q->spool_in, &msgs[n]) == 0;
+			     n++)
+				;
+			nng_mtx_unlock(q->mtx);
+			failed = 0;
+			spool_exec(q, "BEGIN");
+			for (size_t i = 0; i < n; i++) {
+				if (spool_put(q, msgs[i], false) != 0) {
+					failed++;
+				}
+				nng_msg_free(msgs[i]);
+			}
+			if (spool_exec(q, "COMMIT") != 0) {
+				failed = n;
+			}
+			nng_mtx_lock(q->mtx);
+			q->stats.spooled -= failed;
+			q->stats.spilled -= failed;
+			q->stats.dropped += failed;
+			continue;
+		}
+		if (q->spool_load && !q->closing) {
+			q->spool_load = false;
+			room          = nng_lmq_cap(q->backlog);
+			nng_mtx_unlock(q->mtx);
+			n = spool_load(q, msgs,
+			    room < BRIDGE_SPOOL_LOAD ? room : BRIDGE_SPOOL_LOAD);
+			nng_mtx_lock(q->mtx);
+			if (n == 0) {
+				// the table went away under us
+				q->stats.spooled = nng_lmq_len(q->spool_in);
+			}
+			for (size_t i = 0; i < n; i++) {
+				if (msgs[i] == NULL) {
+					q->stats.dropped++;
+					continue;
+				}
+				q->stats.bytes += msg_size(msgs[i]);
+				nng_lmq_put(q->backlog, msgs[i]);
+			}
+			q->stats.spooled -= n < q->stats.spooled ? n : q->stats.spooled;
+			queue_kick(q);
+			continue;
+		}
+		if (q->closing) {
+			break;
+		}
+		nng_cv_wait(q->spool_cv);
+	}
+	nng_mtx_unlock(q->mtx);
+}
+
+// keep msg in front of the spill table, the spool thread is stopped
+static int
+spool_keep(bridge_queue *q, nng_msg *msg)
+{
+	if (q->db == NULL) {
+		return NNG_ENOTSUP;
+	}
+	if (q->stats.spooled >= q->spool_max) {
+		return NNG_ENOSPC;
+	}
+	if (spool_put(q, msg, true) != 0) {
+		return NNG_EINTERNAL;
+	}
+	q->stats.spooled++;
+	return 0;
+}
+
+// hand msg over to the spool thread, with mtx held
+static int
+spool_offer(bridge_queue *q, nng_msg *msg)
+{
+	size_t cap;
+
+	if (q->db == NULL) {
+		return NNG_ENOTSUP;
+	}
+	if (q->stats.spooled >= q->spool_max) {
+		return NNG_ENOSPC;
+	}
+	if (nng_lmq_full(q->spool_in)) {
+		cap = nng_lmq_cap(q->spool_in);
+		if (nng_lmq_resize(q->spool_in, cap * 2) != 0) {
+			return NNG_ENOMEM;
+		}
+	}
+	nng_lmq_put(q->spool_in, msg);
+	q->stats.spooled++;
+	nng_cv_wake(q->spool_cv);
+	return 0;
+}
+
+// the backlog ran dry, with mtx held
+static void
+spool_request(bridge_queue *q)
+{
+	if (q->spool_thr != NULL && !q->spool_load) {
+		q->spool_load = true;
+		nng_cv_wake(q->spool_cv);
+	}
+}
+
+#else
+
+static int
+spool_open(bridge_queue *q, conf_sqlite *cache)
+{
+	(void) q;
+	(void) cache;
+	return NNG_ENOTSUP;
+}
+
+static void
+spool_stop(bridge_queue *q)
+{
+	(void) q;
+}
+
+static void
+spool_close(bridge_queue *q)
+{
+	(void) q;
+}
+
+static void
+spool_front(bridge_queue *q, size_t n)
+{
+	(void) q;
+	(void) n;
+}
+
+static int
+spool_offer(bridge_queue *q, nng_msg *msg)
+{
+	(void) q;
+	(void) msg;
+	return NNG_ENOTSUP;
+}
+
+static int
+spool_keep(bridge_queue *q, nng_msg *msg)
+{
+	(void) q;
+	(void) msg;
+	return NNG_ENOTSUP;
+}
+
+static void
+spool_request(bridge_queue *q)
+{
+	(void) q;
+}
+
+#endif
+
+static bool
+queue_full(bridge_queue *q, size_t len)
+{
+	if (bridge_sched_len(q->sched) >= q->conf->max_msgs) {
+		return true;
+	}
+	// one message over max_bytes still goes through an empty queue
+	return q->stats.bytes + len > q->conf->max_bytes &&
+	    bridge_sched_len(q->sched) > 0;
+}
+
+static bool
+backlog_empty(bridge_queue *q)
+{
+	return nng_lmq_empty(q->backlog) && q->stats.spooled == 0;
+}
+
+// new messages go after the backlog, so the messages of a topic keep
+// their order
+static bool
+in_order(bridge_queue *q)
+{
+	return !q->catchup->enable ||
+	    q->catchup->priority == BRIDGE_CATCHUP_ORDERED;
+}
+
+static void
+pace_refill(bridge_queue *q, nng_time now)
+{
+	const conf_bridge_catchup *c       = q->catchup;
+	double                     elapsed = (double) (now - q->pace_at) / 1000;
+	double                     burst;
+
+	q->pace_at = now;
+	if (c->rate > 0) {
+		burst = (double) c->rate * BRIDGE_CATCHUP_BURST / 1000;
+		q->msg_tokens += c->rate * elapsed;
+		if (q->msg_tokens > (burst < 1 ? 1 : burst)) {
+			q->msg_tokens = burst < 1 ? 1 : burst;
+		}
+	}
+	if (c->bandwidth > 0) {
+		burst = (double) c->bandwidth * BRIDGE_CATCHUP_BURST / 1000;
+		q->byte_tokens += c->bandwidth * elapsed;
+		if (q->byte_tokens > (burst < 1 ? 1 : burst)) {
+			q->byte_tokens = burst < 1 ? 1 : burst;
+		}
+	}
+}
+
+// whether the catchup pace lets one more message of the backlog out,
+// when it does not the pace aio kicks the queue once it will
+static bool
+pace_ready(bridge_queue *q)
+{
+	const conf_bridge_catchup *c    = q->catchup;
+	double                     wait = 0;
+
+	if (!c->enable || (c->rate == 0 && c->bandwidth == 0)) {
+		return true;
+	}
+	if (q->pacing) {
+		return false;
+	}
+	pace_refill(q, nng_clock());
+	if (c->rate > 0 && q->msg_tokens < 1) {
+		wait = (1 - q->msg_tokens) * 1000 / c->rate;
+	}
+	if (c->bandwidth > 0 && q->byte_tokens <= 0 &&
+	    (1 - q->byte_tokens) * 1000 / c->bandwidth > wait) {
+		wait = (1 - q->byte_tokens) * 1000 / c->bandwidth;
+	}
+	if (wait == 0) {
+		return true;
+	}
+	q->pacing = true;
+	nng_sleep_aio((nng_duration) wait + 1, q->pace);
+	return false;
+}
+
+static void
+pace_spend(bridge_queue *q, size_t len)
+{
+	q->msg_tokens -= 1;
+	q->byte_tokens -= (double) len;
+}
+
+// into the stream of its topic, msg is taken in every case
+static int
+queue_put(bridge_queue *q, nng_msg *msg, size_t len)
+{
+	const char *topic;
+	uint32_t    tlen;
+	int         rv;
+
+	topic = nng_mqtt_msg_get_publish_topic(msg, &tlen);
+	if ((rv = bridge_sched_put(q->sched,
+	         bridge_sched_stream(q->sched, topic, tlen), msg,
+	         (uint32_t) len, nng_clock())) != 0) {
+		q->stats.dropped++;
+		nng_msg_free(msg);
+		return rv;
+	}
+	q->stats.bytes += len;
+	return 0;
+}
+
+static nng_msg *
+queue_next(bridge_queue *q, bridge_sender *s)
+{
+	nng_msg *msg;
+	uint32_t len;
+
+	if (!q->link_up) {
+		// held until the connection is back
+		return NULL;
+	}
+	if (bridge_sched_len(q->sched) > 0) {
+		// in order the backlog is behind it, and so is its pace
+		if (in_order(q) && !backlog_empty(q) && !pace_ready(q)) {
+			return NULL;
+		}
+		msg = bridge_sched_get(q->sched, &s->stream, &len, &s->at);
+		if (in_order(q) && !backlog_empty(q)) {
+			pace_spend(q, len);
+		}
+	} else {
+		if (nng_lmq_empty(q->backlog) && q->stats.spooled > 0) {
+			// back from the spool thread, which kicks the queue
+			spool_request(q);
+		}
+		if (nng_lmq_empty(q->backlog) || !pace_ready(q)) {
+			return NULL;
+		}
+		nng_lmq_get(q->backlog, &msg);
+		len       = (uint32_t) msg_size(msg);
+		s->stream = BRIDGE_STREAM_NONE;
+		pace_spend(q, len);
+		q->stats.drained++;
+	}
+	q->stats.bytes -= len;
+	s->len = len;
+	return msg;
+}
+
+static void
+sender_send(bridge_sender *s, nng_socket sock, nng_msg *msg)
+{
+	nng_aio_set_timeout(s->aio, BRIDGE_QUEUE_SEND_TIMEOUT);
+	nng_aio_set_msg(s->aio, msg);
+	nng_send_aio(sock, s->aio);
+}
+
+// hand queued messages to the idle senders, with mtx held
+static void
+queue_kick(bridge_queue *q)
+{
+	bridge_sender *s;
+	nng_msg       *msg;
+	nng_socket     sock;
+
+	while (q->nidle > 0 && !q->closing &&
+	    (msg = queue_next(q, q->idle[q->nidle - 1])) != NULL) {
+		s = q->idle[--q->nidle];
+		// bridge_queue_set_sock() may swap it once we unlock
+		sock = q->sock != NULL ? *q->sock
+		                       : *(nng_socket *) q->node->sock;
+		nng_mtx_unlock(q->mtx);
+		sender_send(s, sock, msg);
+		nng_mtx_lock(q->mtx);
+	}
+}
+
+static void
+pace_cb(void *arg)
+{
+	bridge_queue *q = arg;
+
+	nng_mtx_lock(q->mtx);
+	q->pacing = false;
+	if (nng_aio_result(q->pace) == 0) {
+		queue_kick(q);
+	}
+	nng_mtx_unlock(q->mtx);
+}
+
+// a failed send leaves the message with us, with mtx held. The client
+// never took it when the send timed out, was canceled or the socket
+// closed, so it goes back in front of its stream, also for the backlog
+// it came from, and is sent again or spilled by bridge_queue_free().
+// On any other error the message is lost.
+static void
+sender_failed(bridge_queue *q, bridge_sender *s, nng_msg *msg, int rv)
+{
+	const char *topic;
+	uint32_t    tlen, stream = s->stream;
+
+	if (rv == NNG_ETIMEDOUT || rv == NNG_ECANCELED || rv == NNG_ECLOSED) {
+		if (stream == BRIDGE_STREAM_NONE) {
+			topic  = nng_mqtt_msg_get_publish_topic(msg, &tlen);
+			stream = bridge_sched_stream(q->sched, topic, tlen);
+		}
+		if (bridge_sched_requeue(q->sched, stream, msg,
+		        (uint32_t) s->len, s->at) == 0) {
+			q->stats.bytes += s->len;
+			q->stats.requeued++;
+			log_debug("bridging to %s send failed %d, requeued",
+			    q->node->address, rv);
+			return;
+		}
+	}
+	q->stats.failed++;
+	nng_msg_free(msg);
+	log_warn("bridging to %s send failed %d, msg lost", q->node->address,
+	    rv);
+}
+
+static void
+sender_cb(void *arg)
+{
+	bridge_sender *s = arg;
+	bridge_queue  *q = s->q;
+	nng_msg       *msg;
+	int            rv;
+
+	rv  = nng_aio_result(s->aio);
+	msg = rv != 0 ? nng_aio_get_msg(s->aio) : NULL;
+	nng_aio_set_msg(s->aio, NULL);
+
+	nng_mtx_lock(q->mtx);
+	if (rv == 0) {
+		q->stats.sent++;
+		q->stats.sent_bytes += s->len;
+	}
+	if (s->stream != BRIDGE_STREAM_NONE) {
+		bridge_sched_done(q->sched, s->stream, (uint32_t) s->len,
+		    (nng_duration) (nng_clock() - s->at), rv == 0);
+	}
+	if (msg != NULL) {
+		sender_failed(q, s, msg, rv);
+	}
+	q->idle[q->nidle++] = s;
+	// a closed socket fails the next send at once, wait for a put or
+	// bridge_queue_set_sock()
+	if (rv != NNG_ECLOSED) {
+		queue_kick(q);
+	}
+	nng_mtx_unlock(q->mtx);
+}
+
+/**
+ * @brief the send queue of a connection of a bridge node, with the send
+ *        aios and the spill table of conf_ext
+ *        bridges.mqtt.<name>.send_queue.
+ */
+int
+bridge_queue_alloc(bridge_queue **qp, conf_bridge_node *node,
+    nng_socket *sock, uint32_t index, conf_sqlite *cache)
+{
+	const conf_bridge_ext *ext = conf_ext_bridge(conf_ext_get(), node->name);
+	bridge_queue          *q;
+	int                    rv;
+
+	if ((q = nng_zalloc(sizeof(*q))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	q->node     = node;
+	q->sock     = sock;
+	q->index    = index;
+	q->conf     = &ext->send_queue;
+	q->catchup  = &ext->catchup;
+	q->link_up  = !q->catchup->enable;
+	q->nsenders = q->conf->aios;
+	q->pace_at  = nng_clock();
+	q->drain_at = q->pace_at;
+	if ((rv = nng_mtx_alloc(&q->mtx)) != 0 ||
+	    (rv = bridge_sched_alloc(&q->sched, ext->streams)) != 0 ||
+	    (rv = nng_lmq_alloc(&q->backlog, BRIDGE_SPOOL_LOAD)) != 0 ||
+	    (rv = nng_aio_alloc(&q->pace, pace_cb, q)) != 0) {
+		bridge_queue_free(q);
+		return rv;
+	}
+	q->senders = nng_zalloc(q->nsenders * sizeof(bridge_sender));
+	q->idle    = nng_zalloc(q->nsenders * sizeof(bridge_sender *));
+	if (q->senders == NULL || q->idle == NULL) {
+		bridge_queue_free(q);
+		return NNG_ENOMEM;
+	}
+	for (size_t i = 0; i < q->nsenders; i++) {
+		q->senders[i].q = q;
+		if ((rv = nng_aio_alloc(
+		         &q->senders[i].aio, sender_cb, &q->senders[i])) != 0) {
+			bridge_queue_free(q);
+			return rv;
+		}
+		q->idle[q->nidle++] = &q->senders[i];
+	}
+	if (cache != NULL && cache->enable && q->conf->spill &&
+	    spool_open(q, cache) != 0) {
+		log_warn("bridging to %s will drop instead of spill",
+		    node->address);
+	}
+
+	nng_mtx_lock(q->mtx);
+	queue_kick(q);
+	nng_mtx_unlock(q->mtx);
+	*qp = q;
+	return 0;
+}
+
+void
+bridge_queue_free(bridge_queue *q)
+{
+	nng_msg *msg;
+
+	if (q == NULL) {
+		return;
+	}
+	if (q->mtx != NULL) {
+		nng_mtx_lock(q->mtx);
+		q->closing = true;
+		nng_mtx_unlock(q->mtx);
+	}
+	if (q->pace != NULL) {
+		nng_aio_stop(q->pace);
+		nng_aio_free(q->pace);
+	}
+	for (size_t i = 0; q->senders != NULL && i < q->nsenders; i++) {
+		if (q->senders[i].aio != NULL) {
+			nng_aio_stop(q->senders[i].aio);
+		}
+	}
+	for (size_t i = 0; q->senders != NULL && i < q->nsenders; i++) {
+		if (q->senders[i].aio != NULL) {
+			nng_aio_free(q->senders[i].aio);
+		}
+	}
+	spool_stop(q);
+	if (q->sched != NULL && q->backlog != NULL) {
+		uint32_t stream, len;
+		nng_time at;
+
+		// kept for the next run when there is a spill table, the
+		// backlog first as it came from there
+		spool_front(
+		    q, nng_lmq_len(q->backlog) + bridge_sched_len(q->sched));
+		while (nng_lmq_get(q->backlog, &msg) == 0 ||
+		    (msg = bridge_sched_get(q->sched, &stream, &len, &at)) !=
+		        NULL) {
+			if (spool_keep(q, msg) == 0) {
+				q->stats.spilled++;
+			} else {
+				q->stats.dropped++;
+			}
+			nng_msg_free(msg);
+		}
+	}
+	if (q->backlog != NULL) {
+		nng_lmq_free(q->backlog);
+	}
+	if (q->sched != NULL) {
+		bridge_sched_free(q->sched);
+	}
+	spool_close(q);
+	if (q->senders != NULL) {
+		nng_free(q->senders, q->nsenders * sizeof(bridge_sender));
+	}
+	if (q->idle != NULL) {
+		nng_free(q->idle, q->nsenders * sizeof(bridge_sender *));
+	}
+	if (q->mtx != NULL) {
+		nng_mtx_free(q->mtx);
+	}
+	nng_free(q, sizeof(*q));
+}
+
+int
+bridge_queue_put(bridge_queue *q, nng_msg *msg)
+{
+	size_t len = msg_size(msg);
+	int    rv  = 0;
+
+	nng_mtx_lock(q->mtx);
+	if (q->closing) {
+		nng_mtx_unlock(q->mtx);
+		nng_msg_free(msg);
+		return NNG_ECLOSED;
+	}
+	// while the spill table holds messages new ones go after them, unless
+	// catchup lets them go first
+	if ((!in_order(q) || backlog_empty(q)) && !queue_full(q, len)) {
+		rv = queue_put(q, msg, len);
+	} else if (spool_offer(q, msg) == 0) {
+		q->stats.spilled++;
+	} else {
+		// in order, a message the spill table refuses behind a backlog
+		// is dropped too, queued it would go ahead of the backlog
+		q->stats.dropped++;
+		nng_msg_free(msg);
+		log_debug("bridging to %s %s, msg dropped", q->node->address,
+		    queue_full(q, len) ? "queue full" : "spill table full");
+		rv = NNG_EAGAIN;
+	}
+	queue_kick(q);
+	nng_mtx_unlock(q->mtx);
+	return rv;
+}
+
+void
+bridge_queue_set_sock(bridge_queue *q, nng_socket *sock)
+{
+	nng_mtx_lock(q->mtx);
+	q->sock = sock;
+	nng_mtx_unlock(q->mtx);
+}
+
+void
+bridge_queue_set_link(bridge_queue *q, bool up)
+{
+	nng_mtx_lock(q->mtx);
+	if (q->catchup->enable) {
+		q->link_up = up;
+	}
+	if (up) {
+		queue_kick(q);
+	}
+	nng_mtx_unlock(q->mtx);
+}
+
+void
+bridge_queue_get_stats(bridge_queue *q, bridge_queue_stats *stats)
+{
+	nng_time now;
+	double   rate;
+
+	nng_mtx_lock(q->mtx);
+	now = nng_clock();
+	if (now - q->drain_at >= BRIDGE_DRAIN_WINDOW) {
+		rate = (double) (q->stats.drained - q->drain_mark) * 1000 /
+		    (double) (now - q->drain_at);
+		// smoothed with the spans before
+		q->stats.drain_rate = q->stats.drain_rate == 0
+		    ? rate
+		    : (q->stats.drain_rate + rate) / 2;
+		q->drain_at   = now;
+		q->drain_mark = q->stats.drained;
+	}
+	*stats         = q->stats;
+	stats->queued  = bridge_sched_len(q->sched) + nng_lmq_len(q->backlog);
+	stats->backlog = q->stats.spooled + nng_lmq_len(q->backlog);
+	stats->link_up = q->link_up;
+	if (stats->backlog == 0) {
+		stats->time_to_empty = 0;
+	} else if (stats->drain_rate > 0) {
+		stats->time_to_empty =
+		    (int64_t) ((double) stats->backlog / stats->drain_rate);
+	} else {
+		stats->time_to_empty = -1;
+	}
+	nng_mtx_unlock(q->mtx);
+}
+
+uint32_t
+bridge_queue_streams(bridge_queue *q)
+{
+	return bridge_sched_streams(q->sched);
+}
+
+void
+bridge_queue_get_stream_stats(
+    bridge_queue *q, uint32_t stream, bridge_sched_stats *stats)
+{
+	nng_mtx_lock(q->mtx);
+	bridge_sched_get_stats(q->sched, stream, stats);
+	nng_mtx_unlock(q->mtx);
+}
@@ -0,0 +1,191 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include "include/bridge_route.h"
+#include "include/topic_trie.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+struct bridge_route {
+	topic_trie *topics; // forwards tagged with the node id
+	size_t      nodes;
+	// replaced routes, readers hold no reference so they live on until
+	// bridge_route_fini()
+	bridge_route *retired;
+};
+
+static struct {
+	nng_mtx      *mtx;
+	bridge_route *route;
+} route_state = { .mtx = NULL };
+
+static int
+insert_forwards(bridge_route *r, conf_bridge_node *node, uint32_t id)
+{
+	int rv = 0;
+
+	for (size_t i = 0; i < node->forwards_count && rv == 0; i++) {
+		rv = topic_trie_insert(r->topics, node->forwards[i], id);
+	}
+	return rv;
+}
+
+/**
+ * @brief compile the forwards of every bridge.nodes and aws_bridge.nodes
+ */
+int
+bridge_route_compile(bridge_route **rp, conf *config)
+{
+	bridge_route *r;
+	uint32_t      id = 0;
+	int           rv;
+
+	if ((r = nng_zalloc(sizeof(*r))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if ((rv = topic_trie_create(&r->topics)) != 0) {
+		goto fail;
+	}
+	for (size_t t = 0; t < config->bridge.count; t++, id++) {
+		conf_bridge_node *node = config->bridge.nodes[t];
+
+		// put_mqtt_bridge() replaces the forwards under it
+		nng_mtx_lock(node->mtx);
+		rv = insert_forwards(r, node, id);
+		nng_mtx_unlock(node->mtx);
+		if (rv != 0) {
+			goto fail;
+		}
+	}
+#if defined(SUPP_AWS_BRIDGE)
+	for (size_t t = 0; t < config->aws_bridge.count; t++, id++) {
+		if ((rv = insert_forwards(r, config->aws_bridge.nodes[t], id)) !=
+		    0) {
+			goto fail;
+		}
+	}
+#endif
+	r->nodes = id;
+	*rp      = r;
+	return 0;
+
+fail:
+	bridge_route_free(r);
+	return rv;
+}
+
+void
+bridge_route_free(bridge_route *r)
+{
+	if (r->topics != NULL) {
+		topic_trie_destroy(r->topics);
+	}
+	nng_free(r, sizeof(*r));
+}
+
+static void
+collect(uint32_t id, void *arg)
+{
+	uint32_t **ids = arg;
+
+	// a node with several matching forwards is reported for each
+	for (size_t i = 0; i < cvector_size(*ids); i++) {
+		if ((*ids)[i] == id) {
+			return;
+		}
+	}
+	cvector_push_back(*ids, id);
+}
+
+void
+bridge_route_match(bridge_route *r, const char *topic, uint32_t **ids)
+{
+	uint32_t *v;
+	size_t    n;
+
+	if (*ids != NULL) {
+		cvector_set_size(*ids, 0);
+	}
+	topic_trie_match(r->topics, topic, collect, ids);
+	v = *ids;
+	n = cvector_size(v);
+	// a handful of nodes, insertion sort
+	for (size_t i = 1; i < n; i++) {
+		uint32_t id = v[i];
+		size_t   j  = i;
+
+		while (j > 0 && v[j - 1] > id) {
+			v[j] = v[j - 1];
+			j--;
+		}
+		v[j] = id;
+	}
+}
+
+/**
+ * @brief compile the forwards of config and make it the route
+ *        bridge_route_get() returns. Called from broker() and after each
+ *        change of the forwards of a node.
+ */
+int
+bridge_route_load(conf *config)
+{
+	bridge_route *r;
+	int           rv;
+
+	if (route_state.mtx == NULL) {
+		// first call comes from broker() before any work runs
+		if ((rv = nng_mtx_alloc(&route_state.mtx)) != 0) {
+			return rv;
+		}
+	}
+	if ((rv = bridge_route_compile(&r, config)) != 0) {
+		log_error("bridge route compile failed: %d", rv);
+		return rv;
+	}
+	nng_mtx_lock(route_state.mtx);
+	r->retired        = route_state.route;
+	route_state.route = r;
+	nng_mtx_unlock(route_state.mtx);
+
+	log_info("bridge forwards compiled for %zu nodes", r->nodes);
+	return 0;
+}
+
+bridge_route *
+bridge_route_get(void)
+{
+	bridge_route *r;
+
+	if (route_state.mtx == NULL) {
+		return NULL;
+	}
+	nng_mtx_lock(route_state.mtx);
+	r = route_state.route;
+	nng_mtx_unlock(route_state.mtx);
+	return r;
+}
+
+void
+bridge_route_fini(void)
+{
+	bridge_route *r, *next;
+
+	if (route_state.mtx == NULL) {
+		return;
+	}
+	for (r = route_state.route; r != NULL; r = next) {
+		next = r->retired;
+		bridge_route_free(r);
+	}
+	route_state.route = NULL;
+	nng_mtx_free(route_state.mtx);
+	route_state.mtx = NULL;
+}
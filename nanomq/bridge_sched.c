@@ -0,0 +1,345 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/bridge_sched.h"
+#include "include/topic_trie.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/util/platform.h"
+
+// bytes a stream of weight 1 may send per round
+#define BRIDGE_SCHED_QUANTUM 1024
+// topics up to this long are matched without an allocation
+#define BRIDGE_SCHED_TOPIC_BUF 256
+
+typedef struct {
+	nng_msg *msg;
+	nng_time at;
+	uint32_t len;
+} sched_entry;
+
+typedef struct {
+	uint32_t           priority;
+	uint32_t           weight;
+	uint64_t           deficit;
+	sched_entry       *ring;
+	size_t             cap;
+	size_t             head;
+	size_t             len;
+	bridge_sched_stats stats;
+} sched_stream;
+
+struct bridge_sched {
+	topic_trie   *trie; // NULL with stream 0 alone
+	sched_stream *streams;
+	uint32_t      nstreams;
+	uint32_t      cur; // stream the round robin is at
+	size_t        len;
+};
+
+static int
+stream_grow(sched_stream *st)
+{
+	sched_entry *ring;
+	size_t       cap;
+
+	if (st->len == st->cap) {
+		cap = st->cap == 0 ? 16 : st->cap * 2;
+		if ((ring = nng_alloc(cap * sizeof(*ring))) == NULL) {
+			return NNG_ENOMEM;
+		}
+		// unwrapped into the new ring
+		for (size_t i = 0; i < st->len; i++) {
+			ring[i] = st->ring[(st->head + i) % st->cap];
+		}
+		if (st->ring != NULL) {
+			nng_free(st->ring, st->cap * sizeof(*ring));
+		}
+		st->ring = ring;
+		st->cap  = cap;
+		st->head = 0;
+	}
+	return 0;
+}
+
+static int
+stream_push(sched_stream *st, nng_msg *msg, uint32_t len, nng_time at)
+{
+	int rv;
+
+	if ((rv = stream_grow(st)) != 0) {
+		return rv;
+	}
+	st->ring[(st->head + st->len) % st->cap] =
+	    (sched_entry){ .msg = msg, .at = at, .len = len };
+	st->len++;
+	return 0;
+}
+
+static int
+stream_unshift(sched_stream *st, nng_msg *msg, uint32_t len, nng_time at)
+{
+	int rv;
+
+	if ((rv = stream_grow(st)) != 0) {
+		return rv;
+	}
+	st->head           = (st->head + st->cap - 1) % st->cap;
+	st->ring[st->head] = (sched_entry){ .msg = msg, .at = at, .len = len };
+	st->len++;
+	return 0;
+}
+
+static sched_entry
+stream_pop(sched_stream *st)
+{
+	sched_entry e = st->ring[st->head];
+
+	st->head = (st->head + 1) % st->cap;
+	st->len--;
+	return e;
+}
+
+int
+bridge_sched_alloc(bridge_sched **sp, const conf_bridge_stream *streams)
+{
+	bridge_sched *s;
+	int           rv;
+
+	if ((s = nng_zalloc(sizeof(*s))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	s->nstreams = 1 + (uint32_t) cvector_size(streams);
+	if ((s->streams = nng_zalloc(s->nstreams * sizeof(sched_stream))) ==
+	    NULL) {
+		bridge_sched_free(s);
+		return NNG_ENOMEM;
+	}
+	s->streams[0].weight = 1;
+	for (uint32_t i = 1; i < s->nstreams; i++) {
+		s->streams[i].priority = streams[i - 1].priority;
+		s->streams[i].weight   = streams[i - 1].weight;
+	}
+	if (s->nstreams == 1) {
+		*sp = s;
+		return 0;
+	}
+	if ((rv = topic_trie_create(&s->trie)) != 0) {
+		bridge_sched_free(s);
+		return rv;
+	}
+	for (uint32_t i = 1; i < s->nstreams; i++) {
+		for (size_t j = 0; j < cvector_size(streams[i - 1].topics);
+		     j++) {
+			if ((rv = topic_trie_insert(s->trie,
+			         streams[i - 1].topics[j], i)) != 0) {
+				bridge_sched_free(s);
+				return rv;
+			}
+		}
+	}
+	*sp = s;
+	return 0;
+}
+
+void
+bridge_sched_free(bridge_sched *s)
+{
+	if (s == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; s->streams != NULL && i < s->nstreams; i++) {
+		sched_stream *st = &s->streams[i];
+
+		while (st->len > 0) {
+			nng_msg_free(stream_pop(st).msg);
+		}
+		if (st->ring != NULL) {
+			nng_free(st->ring, st->cap * sizeof(sched_entry));
+		}
+	}
+	if (s->streams != NULL) {
+		nng_free(s->streams, s->nstreams * sizeof(sched_stream));
+	}
+	if (s->trie != NULL) {
+		topic_trie_destroy(s->trie);
+	}
+	nng_free(s, sizeof(*s));
+}
+
+uint32_t
+bridge_sched_streams(bridge_sched *s)
+{
+	return s->nstreams;
+}
+
+// a topic matching filters of several streams goes to the first listed
+static void
+stream_match_cb(uint32_t id, void *arg)
+{
+	uint32_t *stream = arg;
+
+	if (*stream == 0 || id < *stream) {
+		*stream = id;
+	}
+}
+
+uint32_t
+bridge_sched_stream(bridge_sched *s, const char *topic, uint32_t len)
+{
+	char     buf[BRIDGE_SCHED_TOPIC_BUF];
+	char    *t      = buf;
+	uint32_t stream = 0;
+
+	if (s->trie == NULL) {
+		return 0;
+	}
+	if (len >= sizeof(buf) && (t = nng_alloc(len + 1)) == NULL) {
+		return 0;
+	}
+	memcpy(t, topic, len);
+	t[len] = '\0';
+	topic_trie_match(s->trie, t, stream_match_cb, &stream);
+	if (t != buf) {
+		nng_free(t, len + 1);
+	}
+	return stream;
+}
+
+int
+bridge_sched_put(bridge_sched *s, uint32_t stream, nng_msg *msg,
+    uint32_t len, nng_time now)
+{
+	int rv;
+
+	if (stream >= s->nstreams) {
+		return NNG_EINVAL;
+	}
+	if ((rv = stream_push(&s->streams[stream], msg, len, now)) != 0) {
+		return rv;
+	}
+	s->len++;
+	return 0;
+}
+
+// a message got from stream goes back before the others it holds
+int
+bridge_sched_requeue(bridge_sched *s, uint32_t stream, nng_msg *msg,
+    uint32_t len, nng_time at)
+{
+	int rv;
+
+	if (stream >= s->nstreams) {
+		return NNG_EINVAL;
+	}
+	if ((rv = stream_unshift(&s->streams[stream], msg, len, at)) != 0) {
+		return rv;
+	}
+	s->len++;
+	return 0;
+}
+
+/**
+ * @brief the next message, from the highest priority streams holding
+ *        any. Those take turns: each turn a stream adds weight quanta to
+ *        its deficit and sends the messages that fit in it.
+ */
+nng_msg *
+bridge_sched_get(
+    bridge_sched *s, uint32_t *streamp, uint32_t *lenp, nng_time *atp)
+{
+	sched_stream *st;
+	sched_entry   e;
+	int64_t       top  = -1;
+	uint32_t      ntop = 0, last = 0;
+
+	for (uint32_t i = 0; i < s->nstreams; i++) {
+		if (s->streams[i].len == 0) {
+			continue;
+		}
+		if ((int64_t) s->streams[i].priority > top) {
+			top  = s->streams[i].priority;
+			ntop = 0;
+		}
+		if ((int64_t) s->streams[i].priority == top) {
+			last = i;
+			ntop++;
+		}
+	}
+	if (top < 0) {
+		return NULL;
+	}
+	if (ntop == 1) {
+		// nothing to share with
+		st          = &s->streams[last];
+		st->deficit = 0;
+		e           = stream_pop(st);
+		s->len--;
+		*streamp = last;
+		*lenp    = e.len;
+		*atp     = e.at;
+		return e.msg;
+	}
+	for (;;) {
+		st = &s->streams[s->cur];
+		if (st->len == 0 || (int64_t) st->priority != top) {
+			// an idle stream does not save up for later
+			if (st->len == 0) {
+				st->deficit = 0;
+			}
+			s->cur = (s->cur + 1) % s->nstreams;
+			continue;
+		}
+		if (st->deficit >= st->ring[st->head].len) {
+			break;
+		}
+		st->deficit += (uint64_t) BRIDGE_SCHED_QUANTUM * st->weight;
+		s->cur = (s->cur + 1) % s->nstreams;
+	}
+	e = stream_pop(st);
+	st->deficit -= e.len;
+	s->len--;
+	*streamp = s->cur;
+	*lenp    = e.len;
+	*atp     = e.at;
+	return e.msg;
+}
+
+size_t
+bridge_sched_len(bridge_sched *s)
+{
+	return s->len;
+}
+
+void
+bridge_sched_done(bridge_sched *s, uint32_t stream, uint32_t len,
+    nng_duration latency, bool sent)
+{
+	bridge_sched_stats *stats = &s->streams[stream].stats;
+
+	if (!sent) {
+		stats->failed++;
+		return;
+	}
+	stats->sent++;
+	stats->sent_bytes += len;
+	stats->latency_sum += (uint64_t) latency;
+	if ((uint64_t) latency > stats->latency_max) {
+		stats->latency_max = (uint64_t) latency;
+	}
+}
+
+void
+bridge_sched_get_stats(
+    bridge_sched *s, uint32_t stream, bridge_sched_stats *stats)
+{
+	*stats        = s->streams[stream].stats;
+	stats->queued = s->streams[stream].len;
+}
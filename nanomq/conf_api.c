@@ -1,4 +1,6 @@
 #include "conf_api.h"
+#include "include/acl_handler.h"
+#include "nng/supplemental/nanolib/log.h"
 
 static cJSON *get_auth_http_req_config(conf_auth_http_req *req);
 
@@ -1119,4 +1121,20 @@ reload_log_config(conf *old, conf *new)
 		nng_fatal("log_reload", rc);
 	}
 #endif
-}
\ No newline at end of file
+}
+
+void
+reload_acl_config(conf *cur_conf, conf *new_conf)
+{
+#ifdef ACL_SUPP
+	int rv;
+
+	if ((rv = acl_engine_reload(cur_conf, new_conf)) != 0) {
+		log_error("acl reload failed, the rules in use are kept: %d",
+		    rv);
+	}
+#else
+	(void) cur_conf;
+	(void) new_conf;
+#endif
+}
@@ -0,0 +1,604 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/conf_ext.h"
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/cJSON.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/file.h"
+#include "nng/supplemental/nanolib/hocon.h"
+#include "nng/supplemental/nanolib/log.h"
+
+static conf_ext g_conf_ext;
+
+conf_ext *
+conf_ext_get(void)
+{
+	return &g_conf_ext;
+}
+
+void
+conf_ext_init(conf_ext *ext)
+{
+	memset(ext, 0, sizeof(*ext));
+	ext->mqtt.batch_size    = 1;
+	ext->mqtt.batch_latency = 1;
+
+	ext->retain.backend          = RETAIN_BACKEND_MEMORY;
+	ext->retain.compact_interval = 60 * 1000;
+
+	ext->webhook.connections  = 4;
+	ext->webhook.max_inflight = 16;
+
+	ext->webhook.batch.max_events = 1;
+	ext->webhook.batch.max_bytes  = 1024 * 1024;
+	ext->webhook.batch.max_delay  = 20;
+
+	ext->rules.sink.queue_size = 8192;
+	ext->rules.sink.max_bytes  = 16 * 1024 * 1024;
+	ext->rules.sink.policy     = RULE_SINK_DROP;
+
+	ext->rules.sink.mysql.connections = 4;
+	ext->rules.sink.mysql.batch_size  = 256;
+	ext->rules.sink.mysql.max_delay   = 50;
+
+	ext->rules.sqlite.batch_size  = 512;
+	ext->rules.sqlite.max_delay   = 50;
+	ext->rules.sqlite.synchronous = RULE_SQLITE_SYNC_NORMAL;
+
+	ext->bridges.dflt.connections          = 1;
+	ext->bridges.dflt.send_queue.max_msgs  = 4096;
+	ext->bridges.dflt.send_queue.max_bytes = 8 * 1024 * 1024;
+	ext->bridges.dflt.send_queue.aios      = 8;
+	ext->bridges.dflt.send_queue.spill     = true;
+
+	ext->bridges.dflt.catchup.enable    = false;
+	ext->bridges.dflt.catchup.rate      = 0;
+	ext->bridges.dflt.catchup.bandwidth = 0;
+	ext->bridges.dflt.catchup.priority  = BRIDGE_CATCHUP_LIVE;
+
+	ext->bridges.dflt.envelope.enable    = false;
+	ext->bridges.dflt.envelope.topic     = CONF_EXT_BRIDGE_ENVELOPE_TOPIC;
+	ext->bridges.dflt.envelope.window    = 50;
+	ext->bridges.dflt.envelope.max_msgs  = 1000;
+	ext->bridges.dflt.envelope.max_bytes = 256 * 1024;
+	ext->bridges.dflt.envelope.compress  = BRIDGE_COMPRESS_NONE;
+	ext->bridges.dflt.envelope.level     = 0;
+
+	ext->bridges.dflt.adaptive.enable   = false;
+	ext->bridges.dflt.adaptive.interval = 1000;
+	ext->bridges.dflt.adaptive.window   = 30;
+	ext->bridges.dflt.adaptive.margin   = 20;
+	ext->bridges.dflt.adaptive.hold     = 5;
+	ext->bridges.dflt.adaptive.dwell    = 60 * 1000;
+}
+
+void
+conf_ext_fini(conf_ext *ext)
+{
+	if (ext->retain.path != NULL) {
+		nng_strfree(ext->retain.path);
+	}
+	for (size_t i = 0; i < cvector_size(ext->bridges.nodes); i++) {
+		nng_strfree(ext->bridges.nodes[i].name);
+		nng_strfree(ext->bridges.nodes[i].envelope.topic);
+		for (size_t j = 0;
+		     j < cvector_size(ext->bridges.nodes[i].streams); j++) {
+			conf_bridge_stream *stream =
+			    &ext->bridges.nodes[i].streams[j];
+
+			for (size_t k = 0; k < cvector_size(stream->topics);
+			     k++) {
+				nng_strfree(stream->topics[k]);
+			}
+			cvector_free(stream->topics);
+		}
+		cvector_free(ext->bridges.nodes[i].streams);
+	}
+	cvector_free(ext->bridges.nodes);
+	conf_ext_init(ext);
+}
+
+// HOCON durations come as plain numbers (ms) or "10ms", "1s", "1m"
+static uint64_t
+get_duration_ms(cJSON *item, uint64_t dflt)
+{
+	char    *unit;
+	uint64_t val;
+
+	if (cJSON_IsNumber(item)) {
+		return item->valuedouble < 0 ? dflt : (uint64_t) item->valuedouble;
+	}
+	if (!cJSON_IsString(item)) {
+		return dflt;
+	}
+	val = strtoull(item->valuestring, &unit, 10);
+	if (unit == item->valuestring) {
+		return dflt;
+	}
+	if (*unit == '\0' || strcmp(unit, "ms") == 0) {
+		return val;
+	} else if (strcmp(unit, "s") == 0) {
+		return val * 1000;
+	} else if (strcmp(unit, "m") == 0) {
+		return val * 60 * 1000;
+	}
+	log_warn("invalid duration %s", item->valuestring);
+	return dflt;
+}
+
+static void
+conf_mqtt_ext_parse(conf_mqtt_ext *mqtt, cJSON *jso)
+{
+	cJSON *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "batch_size");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		mqtt->batch_size = item->valueint > CONF_EXT_BATCH_SIZE_MAX
+		    ? CONF_EXT_BATCH_SIZE_MAX
+		    : (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "batch_latency");
+	if (item != NULL) {
+		mqtt->batch_latency =
+		    (uint32_t) get_duration_ms(item, mqtt->batch_latency);
+	}
+}
+
+static void
+conf_retain_ext_parse(conf_retain_ext *retain, cJSON *jso)
+{
+	cJSON *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "backend");
+	if (cJSON_IsString(item)) {
+		if (strcmp(item->valuestring, "log") == 0) {
+			retain->backend = RETAIN_BACKEND_LOG;
+		} else if (strcmp(item->valuestring, "memory") == 0) {
+			retain->backend = RETAIN_BACKEND_MEMORY;
+		} else {
+			log_warn("unknown retain backend %s", item->valuestring);
+		}
+	}
+	item = cJSON_GetObjectItem(jso, "path");
+	if (cJSON_IsString(item)) {
+		if (retain->path != NULL) {
+			nng_strfree(retain->path);
+		}
+		retain->path = nng_strdup(item->valuestring);
+	}
+	item = cJSON_GetObjectItem(jso, "compact_interval");
+	if (item != NULL) {
+		retain->compact_interval =
+		    (uint32_t) get_duration_ms(item, retain->compact_interval);
+	}
+}
+
+static void
+conf_webhook_batch_parse(conf_webhook_batch *batch, cJSON *jso)
+{
+	cJSON *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "max_events");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		batch->max_events = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_bytes");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		batch->max_bytes = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_delay");
+	if (item != NULL) {
+		batch->max_delay =
+		    (uint32_t) get_duration_ms(item, batch->max_delay);
+	}
+}
+
+static void
+conf_webhook_ext_parse(conf_webhook_ext *webhook, cJSON *jso)
+{
+	cJSON *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "connections");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		webhook->connections = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_inflight");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		webhook->max_inflight =
+		    item->valueint > CONF_EXT_WEBHOOK_INFLIGHT_MAX
+		    ? CONF_EXT_WEBHOOK_INFLIGHT_MAX
+		    : (uint32_t) item->valueint;
+	}
+	conf_webhook_batch_parse(
+	    &webhook->batch, cJSON_GetObjectItem(jso, "batch"));
+}
+
+static void
+conf_rule_sink_mysql_parse(conf_rule_sink_mysql *mysql, cJSON *jso)
+{
+	cJSON *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "connections");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		mysql->connections =
+		    item->valueint > CONF_EXT_RULE_MYSQL_CONNECTIONS_MAX
+		    ? CONF_EXT_RULE_MYSQL_CONNECTIONS_MAX
+		    : (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "batch_size");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		mysql->batch_size = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_delay");
+	if (item != NULL) {
+		mysql->max_delay =
+		    (uint32_t) get_duration_ms(item, mysql->max_delay);
+	}
+}
+
+static void
+conf_rule_sink_parse(conf_rule_sink *sink, cJSON *jso)
+{
+	cJSON *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "queue_size");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		sink->queue_size = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_bytes");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		sink->max_bytes = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "policy");
+	if (cJSON_IsString(item)) {
+		if (strcmp(item->valuestring, "block") == 0) {
+			sink->policy = RULE_SINK_BLOCK;
+		} else if (strcmp(item->valuestring, "drop") == 0) {
+			sink->policy = RULE_SINK_DROP;
+		} else {
+			log_warn("unknown rule sink policy %s", item->valuestring);
+		}
+	}
+	conf_rule_sink_mysql_parse(
+	    &sink->mysql, cJSON_GetObjectItem(jso, "mysql"));
+}
+
+// beside path and rules of rules.sqlite, which NanoNNG reads
+static void
+conf_rule_sqlite_parse(conf_rule_sqlite *sqlite, cJSON *jso)
+{
+	static const char *levels[] = { "off", "normal", "full", "extra" };
+	cJSON             *item;
+
+	if (jso == NULL) {
+		return;
+	}
+	item = cJSON_GetObjectItem(jso, "batch_size");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		sqlite->batch_size = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_delay");
+	if (item != NULL) {
+		sqlite->max_delay =
+		    (uint32_t) get_duration_ms(item, sqlite->max_delay);
+	}
+	item = cJSON_GetObjectItem(jso, "synchronous");
+	if (cJSON_IsString(item)) {
+		size_t i;
+		for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+			if (strcmp(item->valuestring, levels[i]) == 0) {
+				sqlite->synchronous = (rule_sqlite_sync) i;
+				break;
+			}
+		}
+		if (i == sizeof(levels) / sizeof(levels[0])) {
+			log_warn("unknown rules.sqlite.synchronous %s",
+			    item->valuestring);
+		}
+	}
+}
+
+static void
+conf_rules_ext_parse(conf_rules_ext *rules, cJSON *jso)
+{
+	if (jso == NULL) {
+		return;
+	}
+	conf_rule_sink_parse(&rules->sink, cJSON_GetObjectItem(jso, "sink"));
+	conf_rule_sqlite_parse(
+	    &rules->sqlite, cJSON_GetObjectItem(jso, "sqlite"));
+}
+
+static void
+conf_bridge_queue_parse(conf_bridge_queue *queue, cJSON *jso)
+{
+	cJSON *item;
+
+	item = cJSON_GetObjectItem(jso, "max_msgs");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		queue->max_msgs = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_bytes");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		queue->max_bytes = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "aios");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		queue->aios = item->valueint > CONF_EXT_BRIDGE_SEND_AIOS_MAX
+		    ? CONF_EXT_BRIDGE_SEND_AIOS_MAX
+		    : (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "spill");
+	if (cJSON_IsBool(item)) {
+		queue->spill = cJSON_IsTrue(item);
+	}
+}
+
+static void
+conf_bridge_catchup_parse(conf_bridge_catchup *catchup, cJSON *jso)
+{
+	cJSON *item;
+
+	item = cJSON_GetObjectItem(jso, "enable");
+	if (cJSON_IsBool(item)) {
+		catchup->enable = cJSON_IsTrue(item);
+	}
+	item = cJSON_GetObjectItem(jso, "rate");
+	if (cJSON_IsNumber(item) && item->valueint >= 0) {
+		catchup->rate = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "bandwidth");
+	if (cJSON_IsNumber(item) && item->valueint >= 0) {
+		catchup->bandwidth = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "priority");
+	if (cJSON_IsString(item)) {
+		if (strcmp(item->valuestring, "live") == 0) {
+			catchup->priority = BRIDGE_CATCHUP_LIVE;
+		} else if (strcmp(item->valuestring, "ordered") == 0) {
+			catchup->priority = BRIDGE_CATCHUP_ORDERED;
+		} else {
+			log_warn("unknown bridge catchup priority %s",
+			    item->valuestring);
+		}
+	}
+}
+
+static void
+conf_bridge_envelope_parse(conf_bridge_envelope *envelope, cJSON *jso)
+{
+	static const char *codecs[] = { "none", "deflate", "zstd" };
+	cJSON             *item;
+	size_t             i;
+
+	item = cJSON_GetObjectItem(jso, "enable");
+	if (cJSON_IsBool(item)) {
+		envelope->enable = cJSON_IsTrue(item);
+	}
+	item = cJSON_GetObjectItem(jso, "topic");
+	if (cJSON_IsString(item) && item->valuestring[0] != '\0') {
+		envelope->topic = item->valuestring;
+	}
+	item = cJSON_GetObjectItem(jso, "window");
+	if (item != NULL) {
+		envelope->window =
+		    (uint32_t) get_duration_ms(item, envelope->window);
+	}
+	item = cJSON_GetObjectItem(jso, "max_msgs");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		envelope->max_msgs = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "max_bytes");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		envelope->max_bytes = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "compress");
+	if (cJSON_IsString(item)) {
+		for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+			if (strcmp(item->valuestring, codecs[i]) == 0) {
+				envelope->compress = (bridge_compress) i;
+				break;
+			}
+		}
+		if (i == sizeof(codecs) / sizeof(codecs[0])) {
+			log_warn("unknown bridge envelope compress %s",
+			    item->valuestring);
+		}
+	}
+	item = cJSON_GetObjectItem(jso, "level");
+	if (cJSON_IsNumber(item)) {
+		envelope->level = item->valueint;
+	}
+}
+
+static void
+conf_bridge_adaptive_parse(conf_bridge_adaptive *adaptive, cJSON *jso)
+{
+	cJSON *item;
+
+	item = cJSON_GetObjectItem(jso, "enable");
+	if (cJSON_IsBool(item)) {
+		adaptive->enable = cJSON_IsTrue(item);
+	}
+	item = cJSON_GetObjectItem(jso, "interval");
+	if (item != NULL) {
+		adaptive->interval =
+		    (uint32_t) get_duration_ms(item, adaptive->interval);
+	}
+	if (adaptive->interval == 0) {
+		adaptive->interval = 1;
+	}
+	item = cJSON_GetObjectItem(jso, "window");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		adaptive->window = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "margin");
+	if (cJSON_IsNumber(item) && item->valueint >= 0) {
+		adaptive->margin = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "hold");
+	if (cJSON_IsNumber(item) && item->valueint > 0) {
+		adaptive->hold = (uint32_t) item->valueint;
+	}
+	item = cJSON_GetObjectItem(jso, "dwell");
+	if (item != NULL) {
+		adaptive->dwell =
+		    (uint32_t) get_duration_ms(item, adaptive->dwell);
+	}
+}
+
+static void
+conf_bridge_streams_parse(conf_bridge_stream **streams, cJSON *jso)
+{
+	cJSON             *item, *topic;
+	conf_bridge_stream stream;
+
+	cJSON_ArrayForEach(item, jso)
+	{
+		if (cvector_size(*streams) >= CONF_EXT_BRIDGE_STREAMS_MAX) {
+			log_warn("bridge streams past %d are ignored",
+			    CONF_EXT_BRIDGE_STREAMS_MAX);
+			break;
+		}
+		memset(&stream, 0, sizeof(stream));
+		stream.weight = 1;
+		cJSON_ArrayForEach(topic, cJSON_GetObjectItem(item, "topics"))
+		{
+			if (cJSON_IsString(topic)) {
+				cvector_push_back(stream.topics,
+				    nng_strdup(topic->valuestring));
+			}
+		}
+		if (stream.topics == NULL) {
+			log_warn("bridge stream without topics is ignored");
+			continue;
+		}
+		topic = cJSON_GetObjectItem(item, "priority");
+		if (cJSON_IsNumber(topic) && topic->valueint >= 0) {
+			stream.priority = (uint32_t) topic->valueint;
+		}
+		topic = cJSON_GetObjectItem(item, "weight");
+		if (cJSON_IsNumber(topic) && topic->valueint > 0) {
+			stream.weight = (uint32_t) topic->valueint;
+		}
+		cvector_push_back(*streams, stream);
+	}
+}
+
+// NanoNNG reads the rest of every bridges.mqtt node
+static void
+conf_bridges_ext_parse(conf_bridges_ext *bridges, cJSON *jso)
+{
+	cJSON          *node, *item, *queue, *catchup, *envelope, *streams;
+	cJSON          *adaptive;
+	conf_bridge_ext ext;
+
+	if (jso == NULL) {
+		return;
+	}
+	cJSON_ArrayForEach(node, cJSON_GetObjectItem(jso, "mqtt"))
+	{
+		item     = cJSON_GetObjectItem(node, "connections");
+		queue    = cJSON_GetObjectItem(node, "send_queue");
+		catchup  = cJSON_GetObjectItem(node, "catchup");
+		envelope = cJSON_GetObjectItem(node, "envelope");
+		streams  = cJSON_GetObjectItem(node, "streams");
+		adaptive = cJSON_GetObjectItem(node, "adaptive");
+		if ((!cJSON_IsNumber(item) && !cJSON_IsObject(queue) &&
+		        !cJSON_IsObject(catchup) && !cJSON_IsObject(envelope) &&
+		        !cJSON_IsArray(streams) && !cJSON_IsObject(adaptive)) ||
+		    node->string == NULL) {
+			continue;
+		}
+		ext      = bridges->dflt;
+		ext.name = nng_strdup(node->string);
+		if (cJSON_IsNumber(item) && item->valueint > 0) {
+			ext.connections =
+			    item->valueint > CONF_EXT_BRIDGE_CONNECTIONS_MAX
+			    ? CONF_EXT_BRIDGE_CONNECTIONS_MAX
+			    : (uint32_t) item->valueint;
+		}
+		conf_bridge_queue_parse(&ext.send_queue, queue);
+		conf_bridge_catchup_parse(&ext.catchup, catchup);
+		conf_bridge_envelope_parse(&ext.envelope, envelope);
+		// the cJSON tree goes away after conf_ext_parse()
+		ext.envelope.topic = nng_strdup(ext.envelope.topic);
+		conf_bridge_streams_parse(&ext.streams, streams);
+		conf_bridge_adaptive_parse(&ext.adaptive, adaptive);
+		cvector_push_back(bridges->nodes, ext);
+	}
+}
+
+const conf_bridge_ext *
+conf_ext_bridge(conf_ext *ext, const char *name)
+{
+	for (size_t i = 0; i < cvector_size(ext->bridges.nodes); i++) {
+		if (name != NULL &&
+		    strcmp(ext->bridges.nodes[i].name, name) == 0) {
+			return &ext->bridges.nodes[i];
+		}
+	}
+	return &ext->bridges.dflt;
+}
+
+/**
+ * @brief read the nanomq only options from the HOCON file the broker was
+ *        started with, same lookup order as conf_parse_ver2().
+ * @return 0 when the file was read or there is none to read
+ */
+int
+conf_ext_parse(conf_ext *ext, conf *config)
+{
+	const char *path = config->conf_file;
+	cJSON      *jso;
+
+	if (path == NULL || !nano_file_exists(path)) {
+		if (!nano_file_exists(CONF_PATH_NAME)) {
+			return 0;
+		}
+		path = CONF_PATH_NAME;
+	}
+	if ((jso = hocon_parse_file(path)) == NULL) {
+		log_warn("cannot parse %s, extended options use defaults", path);
+		return NNG_EINVAL;
+	}
+
+	conf_mqtt_ext_parse(&ext->mqtt, cJSON_GetObjectItem(jso, "mqtt"));
+	conf_retain_ext_parse(&ext->retain, cJSON_GetObjectItem(jso, "retain"));
+	conf_webhook_ext_parse(
+	    &ext->webhook, cJSON_GetObjectItem(jso, "webhook"));
+	conf_rules_ext_parse(&ext->rules, cJSON_GetObjectItem(jso, "rules"));
+	conf_bridges_ext_parse(
+	    &ext->bridges, cJSON_GetObjectItem(jso, "bridges"));
+
+	cJSON_Delete(jso);
+	return 0;
+}
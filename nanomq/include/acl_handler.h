@@ -8,5 +8,12 @@
 #ifdef ACL_SUPP
 extern bool auth_acl(
     conf *config, acl_action_type type, conn_param *param, const char *topic);
+extern bool auth_acl_pipe(conf *config, acl_action_type type, uint32_t pipe,
+    conn_param *param, const char *topic);
+extern int  acl_engine_load(conf *config);
+extern int  acl_engine_reload(conf *config, conf *new_conf);
+extern void acl_engine_quiesce(void);
+extern void acl_engine_fini(void);
+extern void acl_cache_drop(uint32_t pipe);
 #endif
 #endif
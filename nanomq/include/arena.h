@@ -0,0 +1,35 @@
+#ifndef NANOMQ_ARENA_H
+#define NANOMQ_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nng/nng.h"
+
+// Bump allocator owned by one nano_work. Everything allocated from it
+// during one RECV -> WAIT/SEND -> RECV cycle of the work is released at
+// once by nano_arena_reset(), individual allocations are never freed.
+
+#define NANO_ARENA_CHUNK_SIZE 16384
+// a grown primary chunk never exceeds this size
+#define NANO_ARENA_CHUNK_MAX (1024 * 1024)
+
+typedef struct nano_arena nano_arena;
+
+typedef struct {
+	uint64_t allocs; // allocations served by arenas
+	uint64_t bytes;  // bytes served by arenas
+	uint64_t chunks; // chunks taken from the global allocator
+	uint64_t resets; // completed work cycles
+} nano_arena_stats;
+
+extern int   nano_arena_init(nano_arena **arena, size_t chunk_size);
+extern void  nano_arena_fini(nano_arena *arena);
+extern void *nano_arena_alloc(nano_arena *arena, size_t size);
+extern void *nano_arena_zalloc(nano_arena *arena, size_t size);
+extern void *nano_arena_realloc(
+    nano_arena *arena, void *ptr, size_t old_size, size_t new_size);
+extern void  nano_arena_reset(nano_arena *arena);
+extern void  nano_arena_get_stats(nano_arena_stats *stats);
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef NANOMQ_BRIDGE_H
 #define NANOMQ_BRIDGE_H
 
+#include "bridge_adapt.h"
+#include "bridge_envelope.h"
+#include "bridge_queue.h"
 #include "nng/mqtt/mqtt_client.h"
 #include "nng/nng.h"
 #include "nng/supplemental/nanolib/conf.h"
@@ -8,6 +11,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+// One MQTT session a bridge node forwards over. conns[0] is the session
+// of the node itself, the others only publish, each under the clientid of
+// the node suffixed with "-<index>". A topic always goes over the same
+// one, so the order of the publishes of a topic holds.
+typedef struct {
+	uint32_t          index;
+	conf_bridge_node *node;
+	nng_socket       *sock; // NULL for node->sock
+	char             *clientid;
+	nng_msg          *connmsg;
+	bridge_queue     *queue; // what the broker forwards over it
+	bridge_envelope  *envelope; // packs the forwards, NULL when disabled
+	nng_atomic_u64   *connects;
+	nng_atomic_u64   *disconnects;
+	// id of the socket opened last, the callbacks of a socket it
+	// replaced on reload are ignored. 0 for the first connection
+	nng_atomic_u64   *sock_id;
+} bridge_conn;
+
+typedef struct bridge_prober bridge_prober;
+
 typedef struct {
 	nng_socket       *sock;
 	conf_bridge_node *config;		// bridge conf file
@@ -18,6 +42,10 @@ typedef struct {
 	nng_cv           *switch_cv;
 	nng_mtx          *exec_mtx;
 	nng_cv           *exec_cv;
+	bridge_conn      *conns;		// what the broker forwards goes over
+	size_t            nconns;
+	bridge_adapt     *adapt;		// hybrid bridges probing both ways
+	bridge_prober    *prober;		// sends the probes adapt scores
 } bridge_param;
 
 extern bool topic_filter(const char *origin, const char *input);
@@ -27,8 +55,16 @@ extern int hybrid_bridge_client(
     nng_socket *sock, conf *config, conf_bridge_node *node);
 extern nng_msg *bridge_publish_msg(const char *topic, uint8_t *payload,
     uint32_t len, bool dup, uint8_t qos, bool retain, property *props);
+// the wire image of a publish the broker received, for a bridge of its MQTT
+// version, topic replaces a topic alias. NULL when the image is malformed.
+extern nng_msg *bridge_wire_msg(nng_msg *msg, const char *topic);
 
 extern int  bridge_reload(nng_socket *sock, conf *config, conf_bridge_node *node);
+// queue msg on the connection of its topic, takes msg in every case
+extern int  bridge_forward(bridge_param *param, nng_msg *msg);
+// stops the probes of an adaptive hybrid bridge first, then frees the
+// send queues
+extern void bridge_conns_free(bridge_param *param);
 
 extern int bridge_subscribe(nng_socket *sock, conf_bridge_node *node,
     nng_mqtt_topic_qos *topic_qos, size_t sub_count, property *properties);
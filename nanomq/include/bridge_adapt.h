@@ -0,0 +1,58 @@
+#ifndef NANOMQ_BRIDGE_ADAPT_H
+#define NANOMQ_BRIDGE_ADAPT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conf_ext.h"
+#include "nng/nng.h"
+
+// Which transport a hybrid bridge should be on, from probes over both.
+// Each transport scores the time a message takes to get through over the
+// last conf_ext bridges.mqtt.<name>.adaptive.window probes, the mean RTT
+// stretched by the loss. The other transport takes over once it scores
+// margin percent and 10 ms better for hold probes in a row and the active
+// one has been on for dwell, so a noisy path does not flap.
+
+typedef enum {
+	BRIDGE_TRANSPORT_TCP = 0,
+	BRIDGE_TRANSPORT_QUIC,
+	BRIDGE_TRANSPORTS,
+} bridge_transport;
+
+typedef struct bridge_adapt bridge_adapt;
+
+typedef struct {
+	uint64_t probes;
+	uint64_t lost;
+	// of the probes in the window, scored only once it is full
+	bool     scored;
+	double   rtt;   // ms, of the answered ones
+	double   loss;  // 0 to 1
+	double   score; // ms, rtt / (1 - loss) up to the probe interval
+	// bytes/s forwarded over it while it was active
+	double   throughput;
+} bridge_adapt_stats;
+
+extern const char *bridge_transport_name(bridge_transport t);
+
+extern int  bridge_adapt_alloc(
+     bridge_adapt **ap, const conf_bridge_adaptive *conf);
+extern void bridge_adapt_free(bridge_adapt *a);
+// a probe over t was answered after rtt ms, or lost
+extern void bridge_adapt_sample(
+    bridge_adapt *a, bridge_transport t, bool lost, nng_duration rtt);
+// sent_bytes forwarded in total over the active transport by now
+extern void bridge_adapt_sent(
+    bridge_adapt *a, bridge_transport active, uint64_t sent_bytes,
+    nng_time now);
+// called once per probe with the transport active now, which the bridge
+// may have changed on its own. true when the other one should take over.
+extern bool bridge_adapt_decide(
+    bridge_adapt *a, bridge_transport active, nng_time now);
+extern void bridge_adapt_get_stats(
+    bridge_adapt *a, bridge_transport t, bridge_adapt_stats *stats);
+// proactive switches asked for by bridge_adapt_decide()
+extern uint64_t bridge_adapt_switches(bridge_adapt *a);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef NANOMQ_BRIDGE_ENVELOPE_H
+#define NANOMQ_BRIDGE_ENVELOPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bridge_queue.h"
+#include "conf_ext.h"
+#include "nng/nng.h"
+
+// The publishes a bridge connection forwards within conf_ext
+// bridges.mqtt.<name>.envelope.window go out as one publish on its topic,
+// the records optionally compressed. A nanomq bridging the envelope back
+// in unpacks it into the publishes it carries.
+//
+// Payload of an envelope, integers big endian:
+//   "NMQE" | version u8 | codec u8 | count u32 | raw length u32 | body
+// and body, compressed by codec, is count records of
+//   flags u8 (qos | retain << 2) | topic length u16 | topic |
+//   payload length as an MQTT variable byte integer | payload
+// MQTT v5 properties of the packed publishes are not carried.
+
+#define BRIDGE_ENVELOPE_VERSION 1
+#define BRIDGE_ENVELOPE_HEADER_LEN 14
+
+typedef struct bridge_envelope bridge_envelope;
+
+typedef struct {
+	uint64_t envelopes;  // handed to the send queue
+	uint64_t msgs;       // packed into them
+	uint64_t raw_bytes;  // of their records before compression
+	uint64_t wire_bytes; // of their payloads
+} bridge_envelope_stats;
+
+// a record of a publish that was unpacked
+typedef struct {
+	uint8_t        qos;
+	bool           retain;
+	const char    *topic;
+	uint16_t       topic_len;
+	const uint8_t *payload;
+	uint32_t       payload_len;
+} bridge_envelope_record;
+
+typedef int (*bridge_envelope_cb)(bridge_envelope_record *rec, void *arg);
+
+// seal envelopes of the forwards to q, taken over by q as they are sealed
+extern int  bridge_envelope_alloc(bridge_envelope **ep,
+     const conf_bridge_envelope *conf, bridge_queue *q);
+// seals what is left, before q is freed
+extern void bridge_envelope_free(bridge_envelope *e);
+// takes msg in every case
+extern int  bridge_envelope_put(bridge_envelope *e, nng_msg *msg);
+extern void bridge_envelope_get_stats(
+    bridge_envelope *e, bridge_envelope_stats *stats);
+
+// the codec, without the windows
+// room for cap bytes of records is made up front
+extern int  bridge_envelope_open(nng_msg **rawp, size_t cap);
+extern int  bridge_envelope_append(
+     nng_msg *raw, uint8_t qos, bool retain, const char *topic,
+     uint32_t topic_len, const uint8_t *payload, uint32_t payload_len);
+// payload of an envelope of the count records appended to raw, which is
+// taken and comes back as the payload when the codec does not make it
+// smaller
+extern int  bridge_envelope_seal(nng_msg *raw, uint32_t count,
+     bridge_compress codec, int level, nng_msg **payloadp);
+extern bool bridge_envelope_check(const uint8_t *payload, size_t len);
+// a record on topic is delivered, its qos capped, like a publish the
+// node subscribed to
+extern bool bridge_envelope_accept(
+    const conf_bridge_node *node, const char *topic, uint8_t *qos);
+// cb is called for each record in order, the first error it returns
+// stops the walk and is returned
+extern int bridge_envelope_unpack(const uint8_t *payload, size_t len,
+    bridge_envelope_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef NANOMQ_BRIDGE_QUEUE_H
+#define NANOMQ_BRIDGE_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bridge_sched.h"
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/conf.h"
+
+// The publishes a bridge node forwards go through a queue per connection
+// of the node, drained by conf_ext bridges.mqtt.<name>.send_queue.aios
+// send aios. A broker ctx never waits for the remote broker. When the queue is over
+// max_msgs or max_bytes, messages spill to a table next to the
+// bridges.mqtt.cache database, up to its disk_cache_size, and come back
+// in order as the queue drains. Without the cache they are dropped, and
+// so are those the table refuses while, in order, it holds messages put
+// before them. The table is written and read by a spool thread of the
+// queue, a put only hands the message over. A send the client did not
+// take, timed out, canceled or on a closed socket, goes back in front of
+// the stream of its topic, a send failing otherwise loses the message.
+//
+// With bridges.mqtt.<name>.catchup enabled, messages are held while the
+// connection is down and what spilled meanwhile is the backlog, drained
+// at the catchup rate and bandwidth once it is up again, after the live
+// messages or, with priority ordered, ahead of them.
+//
+// The messages in memory are split into the streams of
+// bridges.mqtt.<name>.streams by topic, see bridge_sched.h.
+
+typedef struct bridge_queue bridge_queue;
+
+typedef struct {
+	uint64_t queued;        // messages in memory
+	uint64_t bytes;         // topic and payload size of those messages
+	uint64_t spooled;       // messages in the spill table
+	uint64_t sent;
+	uint64_t sent_bytes;    // topic and payload size of the sent messages
+	uint64_t failed;        // a send failed and its message is lost
+	uint64_t requeued;      // a send failed and its message went back
+	uint64_t dropped;       // refused by a full queue
+	uint64_t spilled;       // written to the spill table
+	uint64_t backlog;       // messages taken back from or in the spill table
+	uint64_t drained;       // of the backlog
+	double   drain_rate;    // of the backlog in msgs/s
+	int64_t  time_to_empty; // of the backlog in s, -1 when not draining
+	bool     link_up;       // sends go out
+} bridge_queue_stats;
+
+// sock is the socket of connection index of the node, NULL for
+// node->sock. cache is bridges.mqtt.cache, NULL or disabled to never
+// spill.
+extern int  bridge_queue_alloc(bridge_queue **qp, conf_bridge_node *node,
+     nng_socket *sock, uint32_t index, conf_sqlite *cache);
+// messages still in memory are spilled when the cache is there
+extern void bridge_queue_free(bridge_queue *q);
+// takes msg in every case
+extern int  bridge_queue_put(bridge_queue *q, nng_msg *msg);
+// the connection was opened again, sends from now on go over sock
+extern void bridge_queue_set_sock(bridge_queue *q, nng_socket *sock);
+// the connection went up or down, only catchup holds messages while down
+extern void bridge_queue_set_link(bridge_queue *q, bool up);
+extern void bridge_queue_get_stats(bridge_queue *q, bridge_queue_stats *stats);
+// 1 without bridges.mqtt.<name>.streams, stream 0 takes the other topics
+extern uint32_t bridge_queue_streams(bridge_queue *q);
+extern void     bridge_queue_get_stream_stats(
+        bridge_queue *q, uint32_t stream, bridge_sched_stats *stats);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef NANOMQ_BRIDGE_ROUTE_H
+#define NANOMQ_BRIDGE_ROUTE_H
+
+#include <stdint.h>
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/conf.h"
+
+// The forwards of every bridge node compiled into one topic trie, so a
+// publish finds the nodes it goes to in a single walk instead of running
+// topic_filter() against each forward of each node. A filter is tagged
+// with the id of its node: t for bridge.nodes[t], bridge.count + t for
+// aws_bridge.nodes[t]. Rebuilt with bridge_route_load() whenever the
+// forwards of a node change, the nodes are untouched.
+
+typedef struct bridge_route bridge_route;
+
+extern int  bridge_route_compile(bridge_route **rp, conf *config);
+extern void bridge_route_free(bridge_route *r);
+// ids of the nodes with a forward matching topic, each once and in node
+// order, ids is a cvector reused across calls
+extern void bridge_route_match(
+    bridge_route *r, const char *topic, uint32_t **ids);
+
+extern int           bridge_route_load(conf *config);
+extern bridge_route *bridge_route_get(void);
+extern void          bridge_route_fini(void);
+
+#endif
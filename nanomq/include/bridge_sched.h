@@ -0,0 +1,56 @@
+#ifndef NANOMQ_BRIDGE_SCHED_H
+#define NANOMQ_BRIDGE_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conf_ext.h"
+#include "nng/nng.h"
+
+// The memory queue of a bridge connection, split into the streams of
+// conf_ext bridges.mqtt.<name>.streams by topic. Stream 0 takes the
+// topics no stream lists, stream i the topics of streams[i - 1]. The next
+// message comes from the highest priority stream holding one, streams of
+// the same priority share the send aios by weight in deficit round robin,
+// so a stream of bulky publishes does not hold back the small publishes
+// of another. A topic always goes to the same stream, keeping its order.
+// Not locked, the send queue serializes the calls.
+
+typedef struct bridge_sched bridge_sched;
+
+typedef struct {
+	uint64_t queued;
+	uint64_t sent;
+	uint64_t sent_bytes;  // topic and payload size of the sent messages
+	uint64_t failed;
+	uint64_t latency_sum; // ms from put to the send finishing, of the sent
+	uint64_t latency_max;
+} bridge_sched_stats;
+
+// streams is a cvector of conf_bridge_stream, NULL for stream 0 alone
+extern int      bridge_sched_alloc(
+         bridge_sched **sp, const conf_bridge_stream *streams);
+// the messages still held are freed
+extern void     bridge_sched_free(bridge_sched *s);
+extern uint32_t bridge_sched_streams(bridge_sched *s);
+// stream of topic, which need not be NUL terminated
+extern uint32_t bridge_sched_stream(
+    bridge_sched *s, const char *topic, uint32_t len);
+// len is what the deficit and the byte counters count
+extern int      bridge_sched_put(bridge_sched *s, uint32_t stream,
+         nng_msg *msg, uint32_t len, nng_time now);
+// msg goes first in stream, for a message whose send failed
+extern int      bridge_sched_requeue(bridge_sched *s, uint32_t stream,
+         nng_msg *msg, uint32_t len, nng_time at);
+// NULL when nothing is held, *atp is the now of its put
+extern nng_msg *bridge_sched_get(
+    bridge_sched *s, uint32_t *streamp, uint32_t *lenp, nng_time *atp);
+extern size_t   bridge_sched_len(bridge_sched *s);
+// the send of a message got from stream finished, latency in ms
+extern void bridge_sched_done(bridge_sched *s, uint32_t stream,
+    uint32_t len, nng_duration latency, bool sent);
+extern void bridge_sched_get_stats(
+    bridge_sched *s, uint32_t stream, bridge_sched_stats *stats);
+
+#endif
@@ -5,11 +5,14 @@
 
 #include "nng/supplemental/nanolib/conf.h"
 #include "nng/supplemental/nanolib/nanolib.h"
+#include "nng/supplemental/nanolib/cJSON.h"
 #include "nng/nng.h"
 #include "nng/protocol/mqtt/mqtt.h"
 #include "nng/supplemental/util/platform.h"
 #include "nng/mqtt/packet.h"
 #include "hashmap.h"
+#include "arena.h"
+#include "retain_store.h"
 
 #define PROTO_MQTT_BROKER 0x00
 #define PROTO_MQTT_BRIDGE 0x01
@@ -22,6 +25,24 @@
 	#undef STATISTICS
 #endif
 
+// a publish that went through handle_pub and waits for its batch to be
+// fanned out, see server_batch_flush()
+typedef struct {
+	nng_msg                  *msg;
+	nng_pipe                  pid;
+	conn_param               *cparam;
+	struct pub_packet_struct *pub_packet;
+	struct pipe_content      *pipe_ct;
+	uint8_t                   proto_ver;
+} pub_batch_entry;
+
+typedef struct {
+	pub_batch_entry *entries;
+	uint32_t         cap; // 0 when batching is off
+	uint32_t         len;
+	nng_time         deadline; // flush time of the oldest staged publish
+} pub_batch;
+
 typedef struct work nano_work;
 struct work {
 	enum {
@@ -46,7 +67,7 @@ struct work {
 	nng_ctx     extra_ctx; //  ctx for bridging/http post
 	nng_pipe    pid;
 	dbtree *    db;
-	dbtree *    db_ret;
+	retain_store *db_ret;
 	conf *      config;
 	reason_code code; // MQTT reason code
 
@@ -59,6 +80,27 @@ struct work {
 	packet_unsubscribe *      unsub_pkt;
 
 	void *sqlite_db;
+	// transient allocations of one publish, reset on return to RECV
+	nano_arena *arena;
+	// consecutive publishes staged by a broker ctx
+	pub_batch batch;
+	// output buffer of json_writer, reused by webhook and rule engine
+	nng_msg *json_buf;
+	// payload of the publish as JSON, parsed once for all rules
+	cJSON *payload_json;
+	bool   payload_parsed;
+	bool   payload_whole; // nothing but the JSON value in the payload
+	// cvector, indexes of the rules whose topic matches the publish
+	uint32_t *rule_ids;
+	// cvector, ids of the bridge nodes whose forwards match the publish,
+	// set by bridge_handler() for aws_bridge_forward() as well
+	uint32_t *bridge_ids;
+	// cvector, publishes unpacked from an envelope a bridge received,
+	// taken one by one from unpacked_next on
+	nng_msg **unpacked;
+	size_t    unpacked_next;
+	// the node a PROTO_MQTT_BRIDGE work receives for
+	conf_bridge_node *node;
 };
 
 struct client_ctx {
@@ -79,7 +121,6 @@ extern int  broker_stop(int argc, char **argv);
 extern int  broker_restart(int argc, char **argv);
 extern int  broker_reload(int argc, char **argv);
 extern int  broker_dflt(int argc, char **argv);
-extern void bridge_send_cb(void *arg);
 extern int  broker_start_with_conf(conf *nanomq_conf);
 
 #ifdef STATISTICS
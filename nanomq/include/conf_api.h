@@ -39,5 +39,6 @@ extern void reload_basic_config(conf *cur_conf, conf *new_conf);
 extern void reload_sqlite_config(conf_sqlite *cur_conf, conf_sqlite *new_conf);
 extern void reload_auth_config(conf_auth *cur_conf, conf_auth *new_conf);
 extern void reload_log_config(conf *cur_conf, conf *new_conf);
+extern void reload_acl_config(conf *cur_conf, conf *new_conf);
 
 #endif
@@ -0,0 +1,212 @@
+#ifndef NANOMQ_CONF_EXT_H
+#define NANOMQ_CONF_EXT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nng/supplemental/nanolib/conf.h"
+
+// Broker options that live in the HOCON file but are not part of the
+// conf struct shared with NanoNNG. They are read once at start-up, after
+// conf_parse_ver2(), and stay read-only afterwards.
+
+#define CONF_EXT_BATCH_SIZE_MAX 1024
+#define CONF_EXT_RETAIN_LOG_PATH "/tmp/nanomq_retain.log"
+#define CONF_EXT_WEBHOOK_INFLIGHT_MAX 256
+#define CONF_EXT_RULE_MYSQL_CONNECTIONS_MAX 64
+#define CONF_EXT_BRIDGE_SEND_AIOS_MAX 256
+#define CONF_EXT_BRIDGE_CONNECTIONS_MAX 32
+#define CONF_EXT_BRIDGE_ENVELOPE_TOPIC "nanomq/envelope"
+#define CONF_EXT_BRIDGE_STREAMS_MAX 16
+
+typedef struct {
+	// publishes one broker ctx coalesces before fanning out, 1 disables
+	uint32_t batch_size;
+	// longest a staged publish waits for the batch to fill, in ms
+	uint32_t batch_latency;
+} conf_mqtt_ext;
+
+typedef enum {
+	RETAIN_BACKEND_MEMORY = 0,
+	RETAIN_BACKEND_LOG,
+} retain_backend;
+
+typedef struct {
+	retain_backend backend;
+	char          *path; // file of the log backend
+	// how often the log backend considers a compaction, in ms
+	uint32_t compact_interval;
+} conf_retain_ext;
+
+typedef struct {
+	// events sent as one JSON array, 1 disables batching
+	uint32_t max_events;
+	// size limit of the array body
+	uint32_t max_bytes;
+	// longest the first event of a batch waits, in ms
+	uint32_t max_delay;
+} conf_webhook_batch;
+
+typedef struct {
+	// keep-alive connections to webhook.url
+	uint32_t connections;
+	// unanswered requests pipelined on one connection
+	uint32_t           max_inflight;
+	conf_webhook_batch batch;
+} conf_webhook_ext;
+
+typedef enum {
+	RULE_SINK_DROP = 0, // a full sink drops the new record
+	RULE_SINK_BLOCK,    // a full sink makes the broker ctx wait
+} rule_sink_policy;
+
+typedef struct {
+	// writer threads of the mysql sink, each with a connection of its
+	// own to every server the rules name
+	uint32_t connections;
+	// rows sent as one multi-row INSERT
+	uint32_t batch_size;
+	// longest a row waits for its INSERT to fill, in ms
+	uint32_t max_delay;
+} conf_rule_sink_mysql;
+
+typedef struct {
+	// records one sink holds before the policy applies
+	uint32_t queue_size;
+	// bytes one sink holds before the policy applies
+	uint32_t             max_bytes;
+	rule_sink_policy     policy;
+	conf_rule_sink_mysql mysql;
+} conf_rule_sink;
+
+// PRAGMA synchronous of the rule engine database, WAL is always on
+typedef enum {
+	RULE_SQLITE_SYNC_OFF = 0,
+	RULE_SQLITE_SYNC_NORMAL,
+	RULE_SQLITE_SYNC_FULL,
+	RULE_SQLITE_SYNC_EXTRA,
+} rule_sqlite_sync;
+
+typedef struct {
+	// rows the sqlite sink writes in one transaction
+	uint32_t batch_size;
+	// longest a transaction stays open for more rows, in ms
+	uint32_t         max_delay;
+	rule_sqlite_sync synchronous;
+} conf_rule_sqlite;
+
+typedef struct {
+	conf_rule_sink   sink;
+	conf_rule_sqlite sqlite;
+} conf_rules_ext;
+
+// bridges.mqtt.<name>.send_queue, the messages a bridge node holds while
+// its send aios are busy. Each connection of the node has its own.
+typedef struct {
+	// messages held in memory before they spill or drop
+	uint32_t max_msgs;
+	// bytes of topic and payload held in memory before they spill or drop
+	uint32_t max_bytes;
+	// sends in flight at once
+	uint32_t aios;
+	// spill to bridges.mqtt.cache when it is enabled, else drop
+	bool spill;
+} conf_bridge_queue;
+
+typedef enum {
+	BRIDGE_CATCHUP_LIVE = 0, // live messages go out before the backlog
+	BRIDGE_CATCHUP_ORDERED,  // everything in the order it was forwarded
+} bridge_catchup_priority;
+
+// bridges.mqtt.<name>.catchup, a connection holds its send queue while it
+// is down and drains what built up at a pace once it is back
+typedef struct {
+	bool enable;
+	// backlog messages sent per second, 0 for no limit
+	uint32_t rate;
+	// backlog bytes of topic and payload sent per second, 0 for no limit
+	uint32_t                bandwidth;
+	bridge_catchup_priority priority;
+} conf_bridge_catchup;
+
+typedef enum {
+	BRIDGE_COMPRESS_NONE = 0,
+	BRIDGE_COMPRESS_DEFLATE, // needs ENABLE_ZLIB
+	BRIDGE_COMPRESS_ZSTD,    // needs ENABLE_ZSTD
+} bridge_compress;
+
+// bridges.mqtt.<name>.envelope, the forwards of a window packed into one
+// publish on topic, see bridge_envelope.h
+typedef struct {
+	bool enable;
+	char *topic;
+	// longest the first message of an envelope waits, in ms
+	uint32_t window;
+	// messages one envelope holds
+	uint32_t max_msgs;
+	// bytes of the packed messages one envelope holds, before compression
+	uint32_t        max_bytes;
+	bridge_compress compress;
+	// of the codec, 0 for its default
+	int level;
+} conf_bridge_envelope;
+
+// bridges.mqtt.<name>.adaptive, a hybrid bridge probes QUIC and TCP and
+// switches to the other before the active one fails, see bridge_adapt.h
+typedef struct {
+	bool enable;
+	// between probes, a probe unanswered by the next one is lost, in ms
+	uint32_t interval;
+	// probes the RTT and loss of a transport are taken over
+	uint32_t window;
+	// percent the other transport must score better by, 10 ms at least
+	uint32_t margin;
+	// probes in a row it must stay better for
+	uint32_t hold;
+	// least time on a transport before switching away, in ms
+	uint32_t dwell;
+} conf_bridge_adaptive;
+
+// an entry of bridges.mqtt.<name>.streams, see bridge_sched.h
+typedef struct {
+	char **topics; // cvector of the filters going to this stream
+	// streams of a higher priority go first
+	uint32_t priority;
+	// share of this stream among the streams of its priority
+	uint32_t weight;
+} conf_bridge_stream;
+
+// bridges.mqtt.<name>
+typedef struct {
+	char *name; // of the node, NULL for the defaults
+	// MQTT sessions the forwards are sharded over by topic, TCP and TLS
+	// bridges only
+	uint32_t             connections;
+	conf_bridge_queue    send_queue;
+	conf_bridge_catchup  catchup;
+	conf_bridge_envelope envelope;
+	conf_bridge_stream  *streams; // cvector, NULL for a single stream
+	conf_bridge_adaptive adaptive;
+} conf_bridge_ext;
+
+typedef struct {
+	conf_bridge_ext  dflt;
+	conf_bridge_ext *nodes; // cvector, the nodes with options of their own
+} conf_bridges_ext;
+
+typedef struct {
+	conf_mqtt_ext    mqtt;
+	conf_retain_ext  retain;
+	conf_webhook_ext webhook;
+	conf_rules_ext   rules;
+	conf_bridges_ext bridges;
+} conf_ext;
+
+extern conf_ext *conf_ext_get(void);
+extern void      conf_ext_init(conf_ext *ext);
+extern void      conf_ext_fini(conf_ext *ext);
+extern int       conf_ext_parse(conf_ext *ext, conf *config);
+// the options of the bridges.mqtt node name
+extern const conf_bridge_ext *conf_ext_bridge(conf_ext *ext, const char *name);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef NANOMQ_JSON_WRITER_H
+#define NANOMQ_JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/cJSON.h"
+
+// Streaming JSON encoder writing straight into the body of an nng_msg.
+// Nothing is allocated besides growing the msg, so a msg kept per worker
+// and cleared before each document makes encoding allocation free once
+// it has grown to the usual size. Members are written in call order, the
+// caller is responsible for balancing begin/end. key is NULL for array
+// elements and the top level value.
+
+typedef struct {
+	nng_msg *msg;
+	bool     first; // nothing written yet in the current object/array
+	int      rv;    // first failure, later calls do nothing
+} json_writer;
+
+extern void json_writer_init(json_writer *w, nng_msg *msg);
+extern int  json_writer_finish(json_writer *w);
+
+extern void json_obj_begin(json_writer *w, const char *key);
+extern void json_obj_end(json_writer *w);
+extern void json_arr_begin(json_writer *w, const char *key);
+extern void json_arr_end(json_writer *w);
+
+extern void json_add_str(json_writer *w, const char *key, const char *val);
+extern void json_add_strn(
+    json_writer *w, const char *key, const char *val, size_t len);
+extern void json_add_int(json_writer *w, const char *key, int64_t val);
+extern void json_add_uint(json_writer *w, const char *key, uint64_t val);
+extern void json_add_double(json_writer *w, const char *key, double val);
+extern void json_add_bool(json_writer *w, const char *key, bool val);
+extern void json_add_null(json_writer *w, const char *key);
+// val must already be valid JSON
+extern void json_add_raw(
+    json_writer *w, const char *key, const char *val, size_t len);
+extern void json_add_cjson(json_writer *w, const char *key, cJSON *item);
+// encoded in place, an empty input is written as null
+extern void json_add_base64(
+    json_writer *w, const char *key, const uint8_t *data, size_t len);
+extern void json_add_base62(
+    json_writer *w, const char *key, const uint8_t *data, size_t len);
+
+#endif
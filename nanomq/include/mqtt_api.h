@@ -14,6 +14,7 @@ int nano_listen(
     nng_socket sid, const char *addr, nng_listener *lp, int flags, conf *conf);
 int init_listener_tls(nng_listener l, conf_tls *tls);
 
+extern conn_param *create_cparam(const char *clientid, uint8_t proto_ver);
 extern int decode_common_mqtt_msg(nng_msg **dest, nng_msg *src);
 extern int encode_common_mqtt_msg(
     nng_msg **dest, nng_msg *src, const char *clientid, uint8_t proto_ver);
@@ -41,6 +41,9 @@ union variable_header {
 	} pub_arrc, puback, pubrec, pubrel, pubcomp;
 };
 
+// topics up to this length are kept inside pub_packet_struct
+#define PUB_TOPIC_INLINE_LEN 128
+
 struct mqtt_payload {
 	uint8_t *data;
 	uint32_t len;
@@ -50,18 +53,33 @@ struct pub_packet_struct {
 	struct fixed_header   fixed_header;
 	union variable_header var_header;
 	struct mqtt_payload   payload;
+	// work->msg still carries the wire image of this packet, so every
+	// subscriber pipe can share it without encode_pub_message rebuilding it
+	bool                  encoded;
+	// payload is a view into the body of work->msg and lives as long as
+	// that msg, call pub_packet_payload_str() to own a copy of it
+	bool                  borrowed;
+	char                  topic_buf[PUB_TOPIC_INLINE_LEN];
+	// packet and its owned buffers come from this arena, NULL for heap
+	nano_arena           *arena;
 };
 
 struct pipe_content {
 	mqtt_msg_info *msg_infos;
+	uint32_t       msg_infos_len;
+	uint32_t       msg_infos_cap;
+	// msg_infos is carved from this arena, NULL for heap
+	nano_arena    *arena;
 };
 
 bool encode_pub_message(
     nng_msg *dest_msg, const nano_work *work, mqtt_control_packet_types cmd);
 reason_code decode_pub_message(nano_work *work, uint8_t proto);
 void free_pub_packet(struct pub_packet_struct *pub_packet);
+char *pub_packet_payload_str(struct pub_packet_struct *pub_packet);
 void free_msg_infos(mqtt_msg_info *msg_infos);
 void init_pipe_content(struct pipe_content *pipe_ct);
+void free_pipe_content(struct pipe_content *pipe_ct);
 void init_pub_packet_property(struct pub_packet_struct *pub_packet);
 bool check_msg_exp(nng_msg *msg, property *prop);
 
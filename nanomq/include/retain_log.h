@@ -0,0 +1,33 @@
+#ifndef NANOMQ_RETAIN_LOG_H
+#define NANOMQ_RETAIN_LOG_H
+
+#include <stdint.h>
+
+#include "nng/nng.h"
+
+// Append-only file behind the retain store. Every retained publish or
+// removal is appended as one record, on start-up the file is mapped and
+// replayed in a single sequential pass. A background thread rewrites the
+// file with only the live records once dead ones outnumber them.
+
+#define RETAIN_LOG_MAGIC 0x4e4d524c // "NMRL"
+// dead records tolerated before a compaction is worth it
+#define RETAIN_LOG_COMPACT_MIN 1024
+
+typedef struct retain_log   retain_log;
+typedef struct retain_store retain_store;
+
+typedef struct {
+	uint64_t records;     // records in the file
+	uint64_t bytes;       // size of the file
+	uint64_t compactions; // completed rewrites
+} retain_log_stats;
+
+extern int  retain_log_open(retain_log **log, const char *path,
+     retain_store *store, nng_duration compact_interval);
+extern void retain_log_close(retain_log *log);
+extern int  retain_log_append(retain_log *log, const char *topic, nng_msg *msg);
+extern int  retain_log_compact(retain_log *log);
+extern void retain_log_get_stats(retain_log *log, retain_log_stats *stats);
+
+#endif
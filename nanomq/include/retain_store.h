@@ -0,0 +1,27 @@
+#ifndef NANOMQ_RETAIN_STORE_H
+#define NANOMQ_RETAIN_STORE_H
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/mqtt_db.h"
+
+// Retained messages spread over several dbtrees by the hash of the first
+// topic level. A publish only locks the shard of its topic, a subscribe
+// reads the one shard of its first level, status/# included, and only a
+// filter starting with + or # reads every non-empty shard. Same ownership
+// rules as dbtree_*_retain.
+
+#define RETAIN_STORE_SHARDS 16
+
+typedef struct retain_store retain_store;
+typedef struct retain_log   retain_log;
+
+extern int       retain_store_create(retain_store **store);
+extern void      retain_store_destroy(retain_store *store);
+extern nng_msg  *retain_store_insert(
+     retain_store *store, char *topic, nng_msg *msg);
+extern nng_msg  *retain_store_delete(retain_store *store, char *topic);
+extern nng_msg **retain_store_find(retain_store *store, char *topic);
+extern uint64_t  retain_store_count(retain_store *store);
+extern void      retain_store_set_log(retain_store *store, retain_log *log);
+
+#endif
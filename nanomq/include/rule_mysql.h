@@ -0,0 +1,33 @@
+#ifndef NANOMQ_RULE_MYSQL_H
+#define NANOMQ_RULE_MYSQL_H
+
+#include <stddef.h>
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/conf.h"
+
+#if defined(SUPP_RULE_ENGINE) && defined(SUPP_MYSQL)
+
+// Writes the row records of the mysql sink. Each writer thread of the
+// sink owns one rule_mysql_writer, which keeps a connection of its own to
+// every server the rules name, so rules.sink.mysql.connections writers
+// make a pool of that many connections per database. Rows for the same
+// table and columns are appended to one multi-row INSERT, sent by
+// rule_mysql_writer_flush(). A lost connection is reopened on the next
+// row or flush, a missing table or column is added.
+
+typedef struct rule_mysql_writer rule_mysql_writer;
+
+// on the thread that uses the writer, db is the database of all rules
+extern int  rule_mysql_writer_alloc(rule_mysql_writer **wp, const char *db);
+extern void rule_mysql_writer_free(rule_mysql_writer *w);
+// mysql is the server of the rule, row what rule_row_*() composed
+extern int rule_mysql_writer_insert(
+    rule_mysql_writer *w, rule_mysql *mysql, nng_msg *row);
+// send every pending INSERT, returns the rows that failed since the last
+// flush
+extern size_t rule_mysql_writer_flush(rule_mysql_writer *w);
+
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef NANOMQ_RULE_PROG_H
+#define NANOMQ_RULE_PROG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/cJSON.h"
+#include "nng/supplemental/nanolib/conf.h"
+
+#if defined(SUPP_RULE_ENGINE)
+
+// The WHERE clause of each rule compiled into a short list of typed
+// instructions with the literals already parsed, and the rule topics
+// compiled into a topic trie so a publish is only checked against the
+// rules whose topic can match it. Rebuilt with rule_set_load() whenever
+// conf_rule.rules changes, the rules are untouched. A set keeps a copy of
+// each rule it compiled, the ids it matches index the set, never
+// conf_rule.rules. Works hold a reference on the set they use, a caller
+// freeing a rule it took out calls rule_set_quiesce() after the load and
+// rule_sink_sync() after that.
+
+typedef enum {
+	RULE_OP_REPUB_LOOP, // reject what the repub client published itself
+	RULE_OP_INT,        // integer field against num
+	RULE_OP_STR,        // string field against str
+	RULE_OP_PAYLOAD,    // reject an empty payload
+	RULE_OP_FIELDS,     // payload field filters, storing their values
+	RULE_OP_STORE,      // store the payload fields, never rejects
+} rule_opcode;
+
+typedef struct {
+	uint8_t op;
+	uint8_t field; // RULE_QOS .. RULE_PAYLOAD_ALL
+	uint8_t cmp;   // rule_cmp_type
+	int64_t num;
+	char   *str;
+	size_t  len;
+} rule_insn;
+
+// payload->filter of each rule_payload, parsed once
+typedef struct {
+	int64_t num;
+	char   *str;
+	size_t  len;
+	cJSON  *obj;
+} rule_payload_lit;
+
+typedef struct {
+	uint32_t          index; // position in conf_rule.rules
+	rule_insn        *code;
+	size_t            len;
+	rule_payload_lit *lits;
+	size_t            lit_count;
+} rule_prog;
+
+// what the instructions read from a publish
+typedef struct {
+	uint8_t        qos;
+	uint16_t       packet_id;
+	const char    *topic;
+	const char    *clientid;
+	const char    *username;
+	const char    *password;
+	const uint8_t *payload;
+	size_t         payload_len;
+	int64_t        now;
+	// the payload parsed as JSON, called at most when a rule needs it
+	cJSON *(*payload_json)(void *arg);
+	void *arg;
+} rule_input;
+
+typedef struct rule_set rule_set;
+
+extern int  rule_prog_compile(rule_prog *p, rule *r, uint32_t index);
+extern void rule_prog_fini(rule_prog *p);
+extern bool rule_prog_run(const rule_prog *p, rule *r, const rule_input *in);
+
+extern int        rule_set_compile(rule_set **sp, rule *rules);
+extern void       rule_set_free(rule_set *s);
+extern void       rule_set_match(rule_set *s, const char *topic, uint32_t **ids);
+extern rule_prog *rule_set_prog(rule_set *s, uint32_t id);
+extern rule      *rule_set_rule(rule_set *s, uint32_t id);
+extern size_t     rule_set_size(rule_set *s);
+
+extern int       rule_set_load(conf_rule *cr);
+extern rule_set *rule_set_get(void);
+extern void      rule_set_put(rule_set *s);
+extern void      rule_set_quiesce(void);
+extern void      rule_set_fini(void);
+
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef NANOMQ_RULE_SINK_H
+#define NANOMQ_RULE_SINK_H
+
+#include <stdint.h>
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/conf.h"
+
+#if defined(SUPP_RULE_ENGINE)
+
+// The rule engine matches on the broker ctx and hands what a rule
+// produced to the queue of its sink. Each sink has writer threads of its
+// own, so a slow database only backs up its own queue. A queue is bounded
+// by conf_ext rules.sink, when it is full the policy drops the record or
+// makes the broker ctx wait for room.
+
+// bucket i counts values below 2^i, the last bucket everything larger
+#define RULE_SINK_HIST_BUCKETS 16
+
+typedef enum {
+	RULE_SINK_SQLITE,
+	RULE_SINK_MYSQL,
+	RULE_SINK_FDB,
+	RULE_SINK_REPUB,
+	RULE_SINK_COUNT,
+} rule_sink_type;
+
+typedef struct {
+	uint64_t queued; // records waiting for the writer
+	uint64_t bytes;  // size of those records
+	uint64_t written;
+	uint64_t failed;
+	uint64_t dropped; // refused by a full queue
+	// ms from the broker ctx handing a record over until it is written
+	uint64_t latency[RULE_SINK_HIST_BUCKETS];
+} rule_sink_stats;
+
+// The sqlite and mysql sinks take row records: the table and the typed
+// value of each column. The sqlite writer binds them to a prepared
+// statement and commits a transaction after conf_ext
+// rules.sqlite.batch_size rows or max_delay ms. The mysql writers join
+// them into multi-row INSERTs, as rules.sink.mysql says.
+typedef enum {
+	RULE_COL_NULL,
+	RULE_COL_INT,
+	RULE_COL_TEXT,
+} rule_col_type;
+
+typedef struct {
+	const char   *name;
+	rule_col_type type;
+	int64_t       num;
+	const char   *str; // RULE_COL_TEXT, not NUL terminated
+	size_t        len;
+} rule_col;
+
+extern int rule_row_init(nng_msg *msg, const char *table);
+extern int rule_row_int(nng_msg *msg, const char *name, int64_t num);
+// a NULL str is a NULL column
+extern int rule_row_text(
+    nng_msg *msg, const char *name, const char *str, size_t len);
+// the names and strings point into msg, cols is a cvector kept between
+// calls
+extern int rule_row_parse(nng_msg *msg, const char **table, rule_col **cols);
+
+extern int  rule_sink_start(conf_rule *cr);
+extern void rule_sink_stop(void);
+// Takes msg in every case. The body is a row for sqlite and mysql, else
+// what the writer executes, target the repub_t or rule_mysql of the
+// rule, NULL for the other sinks.
+extern int  rule_sink_put(rule_sink_type type, void *target, nng_msg *msg);
+// wait until every record queued so far is written, before the rules
+// the records point to are changed or freed
+extern void rule_sink_sync(void);
+
+extern const char *rule_sink_name(rule_sink_type type);
+extern void rule_sink_get_stats(rule_sink_type type, rule_sink_stats *stats);
+
+#endif
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef NANOMQ_RULE_SQLITE_H
+#define NANOMQ_RULE_SQLITE_H
+
+#include "nng/nng.h"
+
+#if defined(SUPP_RULE_ENGINE) && defined(NNG_SUPP_SQLITE)
+
+// Writes the row records of the sqlite sink. Every distinct table and
+// column list gets an INSERT prepared once and kept, rows only bind their
+// values to it. Rows go into one open transaction until
+// rule_sqlite_commit(). A table or column missing from the database is
+// added on the first row that needs it. Used by the sink writer thread
+// only.
+
+typedef struct rule_sqlite rule_sqlite;
+
+extern int  rule_sqlite_alloc(rule_sqlite **sp, void *db);
+extern void rule_sqlite_free(rule_sqlite *s);
+extern int  rule_sqlite_insert(rule_sqlite *s, nng_msg *row);
+extern int  rule_sqlite_commit(rule_sqlite *s);
+
+#endif
+
+#endif
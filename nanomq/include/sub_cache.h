@@ -0,0 +1,45 @@
+#ifndef NANOMQ_SUB_CACHE_H
+#define NANOMQ_SUB_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Concrete topic -> subscriber pipes, in front of dbtree_find_clients.
+// A change of the subscription tree bumps the generation of the first
+// topic level its filter matches, or a global one when that level is a
+// wildcard. An entry stamped with an older generation of its topic is
+// treated as a miss, the topics under other levels stay cached.
+
+#define SUB_CACHE_BUCKETS 16384
+#define SUB_CACHE_LOCKS 64
+// generations the first topic levels are hashed into
+#define SUB_CACHE_LEVELS 256
+
+typedef enum {
+	SUB_CACHE_MISS = 0,
+	SUB_CACHE_HIT,
+	// hit, but shared subscribers still have to be picked from the tree
+	SUB_CACHE_HIT_SHARED,
+} sub_cache_result;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+} sub_cache_stats;
+
+typedef void (*sub_cache_cb)(uint32_t *pipes, size_t len, void *arg);
+
+extern int              sub_cache_init(size_t buckets);
+extern void             sub_cache_fini(void);
+extern uint64_t         sub_cache_generation(const char *topic);
+// filter was subscribed or unsubscribed, NULL when not known
+extern void             sub_cache_invalidate(const char *filter);
+extern sub_cache_result sub_cache_find(
+                const char *topic, sub_cache_cb cb, void *arg);
+extern void             sub_cache_put(const char *topic, uint64_t gen,
+                uint32_t *pipes, bool shared);
+extern void             sub_cache_get_stats(sub_cache_stats *stats);
+
+#endif
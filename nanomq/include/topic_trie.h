@@ -0,0 +1,24 @@
+#ifndef NANOMQ_TOPIC_TRIE_H
+#define NANOMQ_TOPIC_TRIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Topic filters compiled into a trie, each filter tagged with a caller
+// defined id. Matching a topic walks the trie once instead of running
+// topic_filter() against every filter. Built once, then read-only: any
+// number of threads may match concurrently, nobody may insert meanwhile.
+
+typedef struct topic_trie topic_trie;
+
+typedef void (*topic_trie_cb)(uint32_t id, void *arg);
+
+extern int  topic_trie_create(topic_trie **trie);
+extern void topic_trie_destroy(topic_trie *trie);
+extern int  topic_trie_insert(topic_trie *trie, const char *filter, uint32_t id);
+extern void topic_trie_match(
+    topic_trie *trie, const char *topic, topic_trie_cb cb, void *arg);
+extern bool topic_trie_empty(topic_trie *trie);
+
+#endif
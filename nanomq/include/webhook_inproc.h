@@ -3,10 +3,19 @@
 
 #include "nng/supplemental/nanolib/conf.h"
 #include "nng/nng.h"
+#include "webhook_pool.h"
 
 #define WEB_HOOK_INPROC_URL "inproc://webhook"
 
+typedef struct {
+	webhook_pool_stats pool;
+	uint64_t queued; // events waiting for a sender thread
+	// queue depth seen by each arriving event
+	uint64_t depth[WEBHOOK_HIST_BUCKETS];
+} webhook_stats;
+
 extern int start_webhook_service(conf *conf);
 extern int stop_webhook_service(void);
+extern void webhook_get_stats(webhook_stats *stats);
 
 #endif
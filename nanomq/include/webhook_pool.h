@@ -0,0 +1,47 @@
+#ifndef NANOMQ_WEBHOOK_POOL_H
+#define NANOMQ_WEBHOOK_POOL_H
+
+#include <stdint.h>
+
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/conf.h"
+
+// Persistent HTTP/1.1 connections to the webhook URL. Requests are written
+// back to back on a connection (pipelined) and answered in order, a
+// connection carries at most max_inflight unanswered requests, and only
+// one until the server sent a response of known length on it. A request
+// is written once: when a connection goes, the requests waiting on it
+// that were never written go to another one, those written and left
+// unanswered fail. Sending never waits, requests queue in the pool until
+// a connection has room. Lost connections are reopened on demand, failed
+// connects back off.
+
+// longest a request may wait in the queue or for its response, in ms
+#define WEBHOOK_POOL_TIMEOUT 5000
+#define WEBHOOK_POOL_BACKOFF_MIN 100
+#define WEBHOOK_POOL_BACKOFF_MAX 10000
+// bucket i counts values below 2^i, the last bucket everything larger
+#define WEBHOOK_HIST_BUCKETS 16
+
+typedef struct webhook_pool webhook_pool;
+
+typedef struct {
+	uint64_t connects; // connections established
+	uint64_t reuses;   // requests sent over an already used connection
+	uint64_t failures; // failed connects and requests
+	// ms from an event arriving until the request carrying it was
+	// answered
+	uint64_t latency[WEBHOOK_HIST_BUCKETS];
+} webhook_pool_stats;
+
+extern int  webhook_pool_create(webhook_pool **pool, conf_web_hook *conf,
+     uint32_t conns, uint32_t max_inflight);
+extern void webhook_pool_destroy(webhook_pool *pool);
+// enqueued is a cvector of the arrival time of each event in msg, the
+// pool takes both
+extern int  webhook_pool_send(
+     webhook_pool *pool, nng_msg *msg, nng_time *enqueued);
+extern void webhook_pool_get_stats(
+    webhook_pool *pool, webhook_pool_stats *stats);
+
+#endif
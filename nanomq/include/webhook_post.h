@@ -4,13 +4,14 @@
 #include "webhook_inproc.h"
 #include "broker.h"
 
-extern int webhook_msg_publish(nng_socket *sock, conf_web_hook *hook_conf,
-    pub_packet_struct *pub_packet, const char *username,
-    const char *client_id);
-extern int webhook_client_connack(nng_socket *sock, conf_web_hook *hook_conf,
-    uint8_t proto_ver, uint16_t keepalive, uint8_t reason,
+// buf is reused for the JSON document of the event
+extern int webhook_msg_publish(nng_socket *sock, nng_msg *buf,
+    conf_web_hook *hook_conf, pub_packet_struct *pub_packet,
     const char *username, const char *client_id);
-extern int webhook_client_disconnect(nng_socket *sock,
+extern int webhook_client_connack(nng_socket *sock, nng_msg *buf,
+    conf_web_hook *hook_conf, uint8_t proto_ver, uint16_t keepalive,
+    uint8_t reason, const char *username, const char *client_id);
+extern int webhook_client_disconnect(nng_socket *sock, nng_msg *buf,
     conf_web_hook *hook_conf, uint8_t proto_ver, uint16_t keepalive,
     uint8_t reason, const char *username, const char *client_id);
 extern int webhook_entry(nano_work *work, uint8_t reason);
@@ -0,0 +1,390 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/json_writer.h"
+#include "nng/supplemental/nanolib/base64.h"
+
+#define BASE62_ENCODE_OUT_SIZE(s) ((unsigned int) ((((s) *8) / 6) + 2))
+
+static void
+put(json_writer *w, const void *data, size_t len)
+{
+	int rv;
+
+	if (w->rv == 0 && (rv = nng_msg_append(w->msg, data, len)) != 0) {
+		w->rv = rv;
+	}
+}
+
+static void
+put_char(json_writer *w, char c)
+{
+	put(w, &c, 1);
+}
+
+static void
+put_escaped(json_writer *w, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char       *run   = s;
+	char              esc[6];
+
+	put_char(w, '"');
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) s[i];
+		size_t        n = 2;
+
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		// flush the plain run before the escape
+		put(w, run, s + i - run);
+		run    = s + i + 1;
+		esc[0] = '\\';
+		switch (c) {
+		case '"':
+		case '\\':
+			esc[1] = c;
+			break;
+		case '\b':
+			esc[1] = 'b';
+			break;
+		case '\f':
+			esc[1] = 'f';
+			break;
+		case '\n':
+			esc[1] = 'n';
+			break;
+		case '\r':
+			esc[1] = 'r';
+			break;
+		case '\t':
+			esc[1] = 't';
+			break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			n      = 6;
+			break;
+		}
+		put(w, esc, n);
+	}
+	put(w, run, s + len - run);
+	put_char(w, '"');
+}
+
+// separator and key of the next member
+static void
+put_key(json_writer *w, const char *key)
+{
+	if (!w->first) {
+		put_char(w, ',');
+	}
+	w->first = false;
+	if (key != NULL) {
+		put_escaped(w, key, strlen(key));
+		put_char(w, ':');
+	}
+}
+
+void
+json_writer_init(json_writer *w, nng_msg *msg)
+{
+	nng_msg_clear(msg);
+	w->msg   = msg;
+	w->first = true;
+	w->rv    = 0;
+}
+
+int
+json_writer_finish(json_writer *w)
+{
+	return w->rv;
+}
+
+void
+json_obj_begin(json_writer *w, const char *key)
+{
+	put_key(w, key);
+	put_char(w, '{');
+	w->first = true;
+}
+
+void
+json_obj_end(json_writer *w)
+{
+	put_char(w, '}');
+	w->first = false;
+}
+
+void
+json_arr_begin(json_writer *w, const char *key)
+{
+	put_key(w, key);
+	put_char(w, '[');
+	w->first = true;
+}
+
+void
+json_arr_end(json_writer *w)
+{
+	put_char(w, ']');
+	w->first = false;
+}
+
+void
+json_add_strn(json_writer *w, const char *key, const char *val, size_t len)
+{
+	put_key(w, key);
+	put_escaped(w, val, len);
+}
+
+void
+json_add_str(json_writer *w, const char *key, const char *val)
+{
+	if (val == NULL) {
+		json_add_null(w, key);
+		return;
+	}
+	json_add_strn(w, key, val, strlen(val));
+}
+
+void
+json_add_int(json_writer *w, const char *key, int64_t val)
+{
+	char buf[24];
+	int  n = snprintf(buf, sizeof(buf), "%" PRId64, val);
+
+	put_key(w, key);
+	put(w, buf, n);
+}
+
+void
+json_add_uint(json_writer *w, const char *key, uint64_t val)
+{
+	char buf[24];
+	int  n = snprintf(buf, sizeof(buf), "%" PRIu64, val);
+
+	put_key(w, key);
+	put(w, buf, n);
+}
+
+void
+json_add_double(json_writer *w, const char *key, double val)
+{
+	char buf[32];
+	int  n;
+
+	if (isnan(val) || isinf(val)) {
+		json_add_null(w, key);
+		return;
+	}
+	// shortest of the two that reads back the same, as cJSON prints it
+	n = snprintf(buf, sizeof(buf), "%1.15g", val);
+	if (strtod(buf, NULL) != val) {
+		n = snprintf(buf, sizeof(buf), "%1.17g", val);
+	}
+	put_key(w, key);
+	put(w, buf, n);
+}
+
+void
+json_add_bool(json_writer *w, const char *key, bool val)
+{
+	put_key(w, key);
+	if (val) {
+		put(w, "true", 4);
+	} else {
+		put(w, "false", 5);
+	}
+}
+
+void
+json_add_null(json_writer *w, const char *key)
+{
+	put_key(w, key);
+	put(w, "null", 4);
+}
+
+void
+json_add_raw(json_writer *w, const char *key, const char *val, size_t len)
+{
+	put_key(w, key);
+	put(w, val, len);
+}
+
+void
+json_add_cjson(json_writer *w, const char *key, cJSON *item)
+{
+	cJSON *child;
+
+	if (item == NULL) {
+		json_add_null(w, key);
+		return;
+	}
+	switch (item->type & 0xff) {
+	case cJSON_False:
+		json_add_bool(w, key, false);
+		break;
+	case cJSON_True:
+		json_add_bool(w, key, true);
+		break;
+	case cJSON_Number:
+		json_add_double(w, key, item->valuedouble);
+		break;
+	case cJSON_String:
+		json_add_str(w, key, item->valuestring);
+		break;
+	case cJSON_Raw:
+		json_add_raw(w, key, item->valuestring, strlen(item->valuestring));
+		break;
+	case cJSON_Array:
+		json_arr_begin(w, key);
+		for (child = item->child; child != NULL; child = child->next) {
+			json_add_cjson(w, NULL, child);
+		}
+		json_arr_end(w);
+		break;
+	case cJSON_Object:
+		json_obj_begin(w, key);
+		for (child = item->child; child != NULL; child = child->next) {
+			json_add_cjson(w, child->string, child);
+		}
+		json_obj_end(w);
+		break;
+	default:
+		json_add_null(w, key);
+		break;
+	}
+}
+
+// Make room for cap bytes at the end of the body and return where they
+// start, json_commit() gives back what the encoder did not use.
+static char *
+json_reserve(json_writer *w, size_t cap)
+{
+	size_t len = nng_msg_len(w->msg);
+	int    rv;
+
+	if (w->rv != 0) {
+		return NULL;
+	}
+	if ((rv = nng_msg_realloc(w->msg, len + cap)) != 0) {
+		w->rv = rv;
+		return NULL;
+	}
+	return (char *) nng_msg_body(w->msg) + len;
+}
+
+static void
+json_commit(json_writer *w, size_t cap, size_t used)
+{
+	nng_msg_chop(w->msg, cap - used);
+}
+
+void
+json_add_base64(
+    json_writer *w, const char *key, const uint8_t *data, size_t len)
+{
+	size_t cap = BASE64_ENCODE_OUT_SIZE(len);
+	char  *out;
+
+	if (len == 0) {
+		json_add_null(w, key);
+		return;
+	}
+	put_key(w, key);
+	put_char(w, '"');
+	if ((out = json_reserve(w, cap)) == NULL) {
+		return;
+	}
+	json_commit(w, cap, base64_encode(data, len, out));
+	put_char(w, '"');
+}
+
+static void
+base62_set_char(char *out, unsigned int *index, char c)
+{
+	unsigned int idx = *index;
+	switch (c) {
+	case 'i':
+		out[idx++] = 'i';
+		// out[idx++] = 'a';
+		break;
+	case '+':
+		// out[idx++] = 'i';
+		// out[idx++] = 'b';
+		out[idx++] = 'A';
+		break;
+	case '/':
+		// out[idx++] = 'i';
+		// out[idx++] = 'c';
+		out[idx++] = 'B';
+		break;
+	default:
+		out[idx++] = c;
+		break;
+	}
+
+	*index = idx;
+}
+
+static unsigned int
+base62_encode(const unsigned char *in, unsigned int inlen, char *out)
+{
+	unsigned int i;
+	unsigned int j;
+	unsigned int pos = 0, val = 0;
+	const char   base62en[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	for (i = j = 0; i < inlen; i++) {
+		val = (val << 8) | (in[i] & 0xFF);
+		pos += 8;
+		while (pos > 5) {
+			char c = base62en[val >> (pos -= 6)];
+			base62_set_char(out, &j, c);
+			val &= ((1 << pos) - 1);
+		}
+	}
+	if (pos > 0) {
+		char c = base62en[val << (6 - pos)];
+		base62_set_char(out, &j, c);
+	}
+	return j;
+}
+
+void
+json_add_base62(
+    json_writer *w, const char *key, const uint8_t *data, size_t len)
+{
+	size_t cap = BASE62_ENCODE_OUT_SIZE(len);
+	char  *out;
+
+	if (len == 0) {
+		json_add_null(w, key);
+		return;
+	}
+	put_key(w, key);
+	put_char(w, '"');
+	if ((out = json_reserve(w, cap)) == NULL) {
+		return;
+	}
+	json_commit(w, cap, base62_encode(data, len, out));
+	put_char(w, '"');
+}
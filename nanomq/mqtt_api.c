@@ -96,7 +96,7 @@ out:
 	return (rv);
 }
 
-static conn_param *
+conn_param *
 create_cparam(const char *clientid, uint8_t proto_ver)
 {
 	conn_param *cparam;
@@ -9,6 +9,7 @@
 #include "nng/supplemental/nanolib/cvector.h"
 #include "nng/supplemental/nanolib/utils.h"
 
+#include "include/conf_ext.h"
 #include "include/nanomq.h"
 
 #if defined(SUPP_RULE_ENGINE)
@@ -130,7 +131,67 @@ nano_client(nng_socket *sock, repub_t *repub)
 }
 
 
+#if defined(NNG_SUPP_SQLITE) || defined(SUPP_MYSQL)
+// CREATE TABLE IF NOT EXISTS table(key, <selected columns>), sized for
+// them, nng_strfree() it
+static char *
+create_table_sql(rule *r, const char *table, const char *key)
+{
+	char  *sql, *p;
+	size_t len;
+
+	len = strlen("CREATE TABLE IF NOT EXISTS ();") + strlen(table) +
+	    strlen(key) + 1;
+	for (int index = 0; index < 8; index++) {
+		if (r->flag[index]) {
+			len += strlen(", ") +
+			    strlen(r->as[index] ? r->as[index] : key_arr[index]) +
+			    strlen(type_arr[index]);
+		}
+	}
+	if ((sql = nng_alloc(len)) == NULL) {
+		return NULL;
+	}
+	p = sql;
+	p += sprintf(p, "CREATE TABLE IF NOT EXISTS %s(%s", table, key);
+	for (int index = 0; index < 8; index++) {
+		if (!r->flag[index])
+			continue;
+		p += sprintf(p, ", %s%s",
+		    r->as[index] ? r->as[index] : key_arr[index],
+		    type_arr[index]);
+	}
+	strcpy(p, ");");
+	return sql;
+}
+#endif
+
 #if defined(NNG_SUPP_SQLITE)
+// The sqlite sink commits a batch of rows per transaction. WAL lets those
+// commits append to the log instead of rewriting pages, and with
+// synchronous NORMAL it only syncs at checkpoints.
+static void
+sqlite_pragmas(sqlite3 *sdb)
+{
+	static const char *levels[] = { "OFF", "NORMAL", "FULL", "EXTRA" };
+	char              *sql, *err_msg = NULL;
+
+	if (sqlite3_exec(sdb, "PRAGMA journal_mode=WAL;", 0, 0, &err_msg) !=
+	    SQLITE_OK) {
+		log_warn("rule sqlite WAL: %s", err_msg);
+		sqlite3_free(err_msg);
+		err_msg = NULL;
+	}
+	sql = sqlite3_mprintf("PRAGMA synchronous=%s;",
+	    levels[conf_ext_get()->rules.sqlite.synchronous]);
+	if (sql != NULL &&
+	    sqlite3_exec(sdb, sql, 0, 0, &err_msg) != SQLITE_OK) {
+		log_warn("rule sqlite synchronous: %s", err_msg);
+		sqlite3_free(err_msg);
+	}
+	sqlite3_free(sql);
+}
+
 int
 nanomq_client_sqlite(conf_rule *cr, bool init_last)
 {
@@ -147,43 +208,29 @@ nanomq_client_sqlite(conf_rule *cr, bool init_last)
 			sqlite3_close(sdb);
 			return 1;
 		}
+		sqlite_pragmas(sdb);
 		cr->rdb[0] = (void *) sdb;
 	}
 
-	char sqlite_table[1024];
 	for (int i = 0; i < cvector_size(cr->rules); i++) {
 		if (init_last && i != cvector_size(cr->rules) - 1) {
 			continue;
 		}
 		if (RULE_FORWORD_SQLITE == cr->rules[i].forword_type) {
-			int  index      = 0;
-			char table[256] = { 0 };
+			char *table = create_table_sql(&cr->rules[i],
+			    cr->rules[i].sqlite_table,
+			    "RowId INTEGER PRIMARY KEY AUTOINCREMENT");
+			if (table == NULL) {
+				return 1;
+			}
 
-			snprintf(table, 128,
-			    "CREATE TABLE IF NOT EXISTS %s("
-			    "RowId INTEGER PRIMARY KEY AUTOINCREMENT",
-			    cr->rules[i].sqlite_table);
 			char *err_msg = NULL;
-			bool  first   = true;
-
-			for (; index < 8; index++) {
-				if (!cr->rules[i].flag[index])
-					continue;
-
-				strcat(table, ", ");
-				strcat(table,
-				    cr->rules[i].as[index]
-				        ? cr->rules[i].as[index]
-				        : key_arr[index]);
-				strcat(table, type_arr[index]);
-			}
-			strcat(table, ");");
-			// puts(table);
 			rc = sqlite3_exec(cr->rdb[0], table, 0, 0, &err_msg);
+			nng_strfree(table);
 			if (rc != SQLITE_OK) {
+				// the sink writer still uses the database
 				log_error("SQL error: %s\n", err_msg);
 				sqlite3_free(err_msg);
-				sqlite3_close(sdb);
 				return 1;
 			}
 		}
@@ -218,55 +265,42 @@ nanomq_client_mysql(conf_rule *cr, bool init_last)
 	    ? cr->mysql_db
 	    : "mysql_rule_db";
 
-	char mysql_table[1024];
 	for (int i = 0; i < cvector_size(cr->rules); i++) {
 		if (init_last && i != cvector_size(cr->rules) - 1) {
 			continue;
 		}
 		if (RULE_FORWORD_MYSQL == cr->rules[i].forword_type) {
-			int  index      = 0;
-			char table[256] = { 0 };
-
-			snprintf(table, 128,
-			    "CREATE TABLE IF NOT EXISTS %s("
-			    "idx INT PRIMARY KEY AUTO_INCREMENT",
-			    cr->rules[i].mysql->table);
-			char *err_msg = NULL;
-			bool  first   = true;
-
-			for (; index < 8; index++) {
-				if (!cr->rules[i].flag[index])
-					continue;
-
-				strcat(table, ", ");
-				strcat(table,
-				    cr->rules[i].as[index]
-				        ? cr->rules[i].as[index]
-				        : key_arr[index]);
-				strcat(table, type_arr[index]);
+			rule_mysql *mysql = cr->rules[i].mysql;
+			char       *table = create_table_sql(&cr->rules[i],
+			          mysql->table, "idx INT PRIMARY KEY AUTO_INCREMENT");
+			if (table == NULL) {
+				return -1;
 			}
-			strcat(table, ");");
 
-			rule_mysql *mysql = cr->rules[i].mysql;
 			MYSQL *con = mysql_init(NULL);
-			mysql->conn = con;
 			if (con == NULL) {
+				nng_strfree(table);
 				rc = finish_with_error(con, cr->rules, i--);
 				continue;
 			}
 
 			if (mysql_real_connect(con, mysql->host, mysql->username, mysql->password,
 			        mysql_db, 0, NULL, 0) == NULL) {
+				nng_strfree(table);
 				rc = finish_with_error(con, cr->rules, i--);
 				continue;
 			}
 
 
 			if (mysql_query(con, table)) {
+				nng_strfree(table);
 				rc = finish_with_error(con, cr->rules, i--);
 				continue;
 			}
-
+			nng_strfree(table);
+			// only checks the server and the table, the writers of
+			// the mysql sink keep connections of their own
+			mysql_close(con);
 		}
 	}
 
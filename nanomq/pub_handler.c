@@ -24,6 +24,10 @@
 #include "include/pub_handler.h"
 #include "include/sub_handler.h"
 #include "include/acl_handler.h"
+#include "include/json_writer.h"
+#include "include/rule_prog.h"
+#include "include/rule_sink.h"
+#include "include/sub_cache.h"
 #include "nng/protocol/mqtt/mqtt_parser.h"
 #include "nng/supplemental/util/platform.h"
 #include "nng/supplemental/sqlite/sqlite3.h"
@@ -32,8 +36,6 @@
 #define ENABLE_RETAIN 1
 #define SUPPORT_MQTT5_0 1
 
-static nng_mtx *rule_mutex = NULL;
-
 #ifdef STATISTICS
 typedef struct {
 	bool            initialed;
@@ -85,25 +87,63 @@ init_pipe_content(struct pipe_content *pipe_ct)
 {
 	log_debug("pub_handler: init pipe_info");
 	pipe_ct->msg_infos     = NULL;
+	pipe_ct->msg_infos_len = 0;
+	pipe_ct->msg_infos_cap = 0;
+	pipe_ct->arena         = NULL;
 }
 
-static void
-foreach_client(
-    uint32_t *cli_ctx_list, nano_work *pub_work, struct pipe_content *pipe_ct)
+void
+free_pipe_content(struct pipe_content *pipe_ct)
+{
+	if (pipe_ct->arena == NULL && pipe_ct->msg_infos != NULL) {
+		nng_free(pipe_ct->msg_infos,
+		    pipe_ct->msg_infos_cap * sizeof(mqtt_msg_info));
+	}
+	init_pipe_content(pipe_ct);
+}
+
+static int
+pipe_content_grow(struct pipe_content *pipe_ct, size_t need)
 {
-	uint32_t pids;
-	int      ctx_list_len;
+	mqtt_msg_info *infos;
+	size_t         cap      = (size_t) pipe_ct->msg_infos_cap * 2;
+	size_t         old_size = pipe_ct->msg_infos_cap * sizeof(mqtt_msg_info);
 
-	ctx_list_len = cvector_size(cli_ctx_list);
+	if (cap < need) {
+		cap = need;
+	}
+	if (pipe_ct->arena != NULL) {
+		infos = nano_arena_realloc(pipe_ct->arena, pipe_ct->msg_infos,
+		    old_size, cap * sizeof(mqtt_msg_info));
+	} else if ((infos = nng_alloc(cap * sizeof(mqtt_msg_info))) != NULL &&
+	    pipe_ct->msg_infos != NULL) {
+		memcpy(infos, pipe_ct->msg_infos,
+		    pipe_ct->msg_infos_len * sizeof(mqtt_msg_info));
+		nng_free(pipe_ct->msg_infos, old_size);
+	}
+	if (infos == NULL) {
+		log_error("alloc fail!");
+		return NNG_ENOMEM;
+	}
+	pipe_ct->msg_infos     = infos;
+	pipe_ct->msg_infos_cap = cap;
+	return 0;
+}
 
-	// Dont using msg info buf, Just for Cheat Compiler
-	mqtt_msg_info *msg_info     = NULL;
-	mqtt_msg_info  msg_info_buf = { 0 };
+static void
+foreach_client(
+    uint32_t *cli_ctx_list, size_t ctx_list_len, struct pipe_content *pipe_ct)
+{
+	uint32_t       pids;
+	mqtt_msg_info *msg_info;
 
-	cvector(mqtt_msg_info) msg_infos = pipe_ct->msg_infos;
-	cvector_grow(msg_infos, ctx_list_len);
+	if (pipe_ct->msg_infos_len + ctx_list_len > pipe_ct->msg_infos_cap &&
+	    pipe_content_grow(pipe_ct,
+	        pipe_ct->msg_infos_len + ctx_list_len) != 0) {
+		return;
+	}
 
-	for (int i = 0; i < ctx_list_len; i++) {
+	for (size_t i = 0; i < ctx_list_len; i++) {
 		pids = cli_ctx_list[i];
 
 #ifdef STATISTICS
@@ -116,284 +156,96 @@ foreach_client(
 		}
 
 		// TODO using pid instead of msg_info
-		cvector_push_back(msg_infos, msg_info_buf);
-		size_t csize = cvector_size(msg_infos);
-		msg_info     = (mqtt_msg_info *) &msg_infos[csize - 1];
-
+		msg_info = &pipe_ct->msg_infos[pipe_ct->msg_infos_len++];
+		memset(msg_info, 0, sizeof(*msg_info));
 		msg_info->pipe = pids;
 	}
-	pipe_ct->msg_infos = msg_infos;
 }
 
-#if defined(SUPP_RULE_ENGINE)
-static bool
-cmp_int(int value_checked, int value_seted, rule_cmp_type type)
+static void
+foreach_cached_client(uint32_t *pipes, size_t len, void *arg)
 {
-	bool filter = true;
-	switch (type)
-	{
-	case RULE_CMP_EQUAL:
-		if (value_checked != value_seted) {
-			filter = false;
-		}
-		break;
-	case RULE_CMP_UNEQUAL:
-		if (value_checked == value_seted) {
-			filter = false;
-		}
-		break;
-
-	case RULE_CMP_GREATER:
-		if (value_checked <= value_seted) {
-			filter = false;
-		}
-		break;
-	case RULE_CMP_LESS:
-		if (value_checked >= value_seted) {
-			filter = false;
-		}
-		break;
-	case RULE_CMP_GREATER_AND_EQUAL:
-		if (value_checked < value_seted) {
-			filter = false;
-		}
-		break;
-	case RULE_CMP_LESS_AND_EQUAL:
-		if (value_checked > value_seted) {
-			filter = false;
-		}
-		break;
-	
-	default:
-		break;
-	}
-	return filter;
+	foreach_client(pipes, len, (struct pipe_content *) arg);
 }
 
-static bool
-cmp_str(
-    const char *value_checked, int len, char *value_seted, rule_cmp_type type)
+// buffers owned by a packet follow the packet into the arena
+static void *
+pub_packet_alloc(struct pub_packet_struct *pub_packet, size_t size)
 {
-	if (value_checked == NULL) {
-		return false;
-	}
-
-	bool filter = true;
-	switch (type) {
-	case RULE_CMP_EQUAL:
-		if (strncmp(value_checked, value_seted, len)) {
-			filter = false;
-		}
-		break;
-	case RULE_CMP_UNEQUAL:
-		if (!strncmp(value_checked, value_seted, len)) {
-			filter = false;
-		}
-		break;
-	default:
-		log_debug("Unsupport compare symbol, string only support equal "
-		        "and unequal!");
-		break;
+	if (pub_packet->arena != NULL) {
+		return nano_arena_alloc(pub_packet->arena, size);
 	}
-	return filter;
+	return nng_alloc(size);
 }
 
-static bool
-payload_filter(pub_packet_struct *pp, rule *info)
+#if defined(SUPP_RULE_ENGINE)
+// The payload parsed as JSON, shared by all rules a publish is checked
+// against. Parsed on first use, NULL if it is not JSON.
+static cJSON *
+payload_json(nano_work *work)
 {
-	bool   filter = true;
-	cJSON *jp = cJSON_ParseWithLength(pp->payload.data, pp->payload.len);
-	cJSON *jp_reset = jp;
-	// info->payload size equal 0, implicit there is no
-	// payload filter need to be check, so filter is true.
-	for (int pi = 0; pi < cvector_size(info->payload); pi++) {
-		jp                    = jp_reset; // reset jp;
-		rule_payload *payload = info->payload[pi];
-		for (int k = 0; k < cvector_size(payload->psa); k++) {
-			if (jp == NULL) {
-				filter = false;
-				break;
-			}
-			jp = cJSON_GetObjectItem(jp, payload->psa[k]);
-		}
-
-		if (jp == NULL || filter == false) {
-			filter = false;
-			break;
-		}
-
-		switch (jp->type) {
-		case cJSON_Number:;
-			long num = cJSON_GetNumberValue(jp);
-
-			if (payload->filter && !cmp_int(num, atoi(payload->filter), payload->cmp_type)) {
-				filter = false;
-			} else {
-				payload->value = (void *) num;
-				payload->type  = cJSON_Number;
-			}
-			break;
-		case cJSON_String:;
-			char *str = cJSON_GetStringValue(jp);
-			if (payload->filter && !cmp_str(str, strlen(str), payload->filter, payload->cmp_type)) {
-				filter = false;
-			} else {
-				if (payload->value)
-					free(payload->value);
-				payload->value = nng_strdup(str);
-				payload->type  = cJSON_String;
-			}
-			break;
-		case cJSON_Object:;
-			cJSON *filter = cJSON_Parse(payload->filter);
-			if (!payload->is_store && filter && !cJSON_Compare(jp, filter, true)) {
-				filter = false;
-			} else {
-				// if (payload->value)
-				// 	cJSON_Delete((cJSON*) payload->value);
-				payload->value = cJSON_Duplicate(jp, 1);
-				payload->type  = cJSON_Object;
-			}
-			break;
+	pub_packet_struct *pp = work->pub_packet;
+	const char        *data, *end = NULL;
 
-		default:
-			break;
+	if (work->payload_parsed) {
+		return work->payload_json;
+	}
+	work->payload_parsed = true;
+	work->payload_whole  = false;
+	if (pp->payload.data == NULL || pp->payload.len == 0) {
+		return NULL;
+	}
+	data               = (const char *) pp->payload.data;
+	work->payload_json = cJSON_ParseWithLengthOpts(
+	    data, pp->payload.len, &end, false);
+	if (work->payload_json != NULL) {
+		while (end < data + pp->payload.len &&
+		    (*end == ' ' || *end == '\t' || *end == '\r' ||
+		        *end == '\n')) {
+			end++;
 		}
+		work->payload_whole = end == data + pp->payload.len;
 	}
-	cJSON_Delete(jp_reset);
-
-
-	return filter;
+	return work->payload_json;
 }
 
-static bool
-rule_engine_filter(nano_work *work, rule *info)
+static void
+payload_json_release(nano_work *work)
 {
-	pub_packet_struct *pp     = work->pub_packet;
-	char	      *topic  = pp->var_header.publish.topic_name.body;
-	conn_param        *cp     = work->cparam;
-	bool               filter = true;
-	if (RULE_FORWORD_REPUB == info->forword_type) {
-		const char *cid = (const char *) conn_param_get_clientid(cp);
-		if (info->repub->clientid && cmp_str(cid, strlen(cid), info->repub->clientid,
-		        RULE_CMP_EQUAL)) {
-			return false;
-		}
+	if (work->payload_json != NULL) {
+		cJSON_Delete(work->payload_json);
 	}
+	work->payload_json   = NULL;
+	work->payload_parsed = false;
+	work->payload_whole  = false;
+}
 
-	if (topic_filter(info->topic, topic)) {
-		if (info->filter) {
-			for (size_t j = 0; j < 9; j++) {
-				char *val = NULL;
-				if (j < 8) {
-					val = info->filter[j];
-				}
-				if (val != NULL || j == RULE_PAYLOAD_FIELD) {
-					switch (j) {
-					case RULE_QOS:
-						filter = cmp_int(
-						    pp->fixed_header.qos,
-						    atoi(val),
-						    info->cmp_type[j]);
-						break;
-					case RULE_ID:
-						filter = cmp_int(
-						    pp->var_header.publish
-						        .packet_id,
-						    atoi(val),
-						    info->cmp_type[j]);
-						break;
-					case RULE_TOPIC:
-						filter = cmp_str(topic,
-						    strlen(topic), val,
-						    info->cmp_type[j]);
-						break;
-					case RULE_CLIENTID:;
-						const char *cid = (const char
-						        *)
-						    conn_param_get_clientid(
-						        cp);
-						filter = cmp_str(cid,
-						    strlen(cid), val,
-						    info->cmp_type[j]);
-
-						break;
-					case RULE_USERNAME:;
-						const char *username =
-						    (const char *)
-						        conn_param_get_username(
-						            cp);
-						filter = cmp_str(username,
-						    strlen(username), val,
-						    info->cmp_type[j]);
-						break;
-					case RULE_PASSWORD:;
-						const char *password =
-						    (const char *)
-						        conn_param_get_password(
-						            cp);
-						filter = cmp_str(password,
-						    strlen(password), val,
-						    info->cmp_type[j]);
-						break;
-					case RULE_TIMESTAMP:
-						filter = cmp_int(
-						    (unsigned long) time(NULL),
-						    atoi(val),
-						    info->cmp_type[j]);
-						break;
-					case RULE_PAYLOAD_ALL:
-						if (!pp->payload.data ||
-						    pp->payload.len <= 0) {
-							filter = false;
-							break;
-						}
-
-						if (val != NULL) {
-							filter = cmp_str(
-							    pp->payload.data,
-							    pp->payload.len,
-							    val,
-							    info->cmp_type[j]);
-						}
-
-						break;
-					case RULE_PAYLOAD_FIELD:
-						if (!pp->payload.data ||
-						    pp->payload.len <= 0) {
-							filter = false;
-							break;
-						}
-
-						filter =
-						    payload_filter(pp, info);
-						break;
-					default:
-						break;
-					}
-					if (filter == false) {
-						break;
-					}
-				}
-			}
-		} else {
-			if (!pp->payload.data || pp->payload.len <= 0) {
-				filter = false;
-			}
+static cJSON *
+payload_json_cb(void *arg)
+{
+	return payload_json(arg);
+}
 
-			payload_filter(pp, info);
-			filter = true;
-		}
-	} else {
-		// printf("MISMATCH filter: %s, topic: %s\n", info->topic,
-		// topic);
-		filter = false;
-	}
+// the fields of the publish the compiled rule filters read
+static void
+rule_input_init(rule_input *in, nano_work *work)
+{
+	pub_packet_struct *pp = work->pub_packet;
+	conn_param        *cp = work->cparam;
 
-	return filter;
+	in->qos          = pp->fixed_header.qos;
+	in->packet_id    = pp->var_header.publish.packet_id;
+	in->topic        = pp->var_header.publish.topic_name.body;
+	in->clientid     = (const char *) conn_param_get_clientid(cp);
+	in->username     = (const char *) conn_param_get_username(cp);
+	in->password     = (const char *) conn_param_get_password(cp);
+	in->payload      = pp->payload.data;
+	in->payload_len  = pp->payload.len;
+	in->now          = (int64_t) time(NULL);
+	in->payload_json = payload_json_cb;
+	in->arg          = work;
 }
 
-
 static char*
 generate_key(rule *info, int j, nano_work *work)
 {
@@ -463,7 +315,7 @@ generate_key(rule *info, int j, nano_work *work)
 			}
 			break;
 		case RULE_PAYLOAD_ALL:;
-			char *payload = pp->payload.data;
+			char *payload = pub_packet_payload_str(pp);
 			if (info->key->auto_inc) {
 				sprintf(str, "%s%d", payload, index++);
 			} else {
@@ -471,13 +323,16 @@ generate_key(rule *info, int j, nano_work *work)
 			}
 			break;
 		case RULE_PAYLOAD_FIELD:;
-			cJSON *jp = cJSON_ParseWithLength(pp->payload.data, pp->payload.len);
+			cJSON *jp = payload_json(work);
 			for (int k = 0; k < cvector_size(info->key->key_arr); k++) {
 				if (jp == NULL) {
 					break;
 				}
 				jp = cJSON_GetObjectItem(jp, info->key->key_arr[k]);
 			}
+			if (jp == NULL) {
+				break;
+			}
 
 			switch (jp->type)
 			{
@@ -516,94 +371,57 @@ generate_key(rule *info, int j, nano_work *work)
 
 
 static int
-add_info_to_json(rule *info, cJSON *jso, int j, nano_work *work)
+add_info_to_json(rule *info, json_writer *jw, int j, nano_work *work)
 {
 	pub_packet_struct *pp = work->pub_packet;
 	conn_param        *cp = work->cparam;
 	if (info->flag[j]) {
 		switch (j) {
 		case RULE_QOS:
-			if (info->as[j]) {
-				cJSON_AddNumberToObject(
-				    jso, info->as[j], pp->fixed_header.qos);
-			} else {
-				cJSON_AddNumberToObject(
-				    jso, "qos", pp->fixed_header.qos);
-			}
+			json_add_uint(jw, info->as[j] ? info->as[j] : "qos",
+			    pp->fixed_header.qos);
 			break;
 		case RULE_ID:
-			if (info->as[j]) {
-				cJSON_AddNumberToObject(jso, info->as[j],
-				    pp->var_header.publish.packet_id);
-			} else {
-				cJSON_AddNumberToObject(jso, "id",
-				    pp->var_header.publish.packet_id);
-			}
+			json_add_uint(jw, info->as[j] ? info->as[j] : "id",
+			    pp->var_header.publish.packet_id);
 			break;
 		case RULE_TOPIC:;
 			char *topic = pp->var_header.publish.topic_name.body;
-			if (info->as[j]) {
-				cJSON_AddStringToObject(
-				    jso, info->as[j], topic);
-			} else {
-				cJSON_AddStringToObject(jso, "topic", topic);
-			}
+			json_add_str(
+			    jw, info->as[j] ? info->as[j] : "topic", topic);
 			break;
 		case RULE_CLIENTID:;
 			char *cid = (char *) conn_param_get_clientid(cp);
-			if (info->as[j]) {
-				cJSON_AddStringToObject(jso, info->as[j], cid);
-			} else {
-				cJSON_AddStringToObject(jso, "clientid", cid);
-			}
+			json_add_str(
+			    jw, info->as[j] ? info->as[j] : "clientid", cid);
 			break;
 		case RULE_USERNAME:;
 			char *username = (char *) conn_param_get_username(cp);
-			if (info->as[j]) {
-				cJSON_AddStringToObject(
-				    jso, info->as[j], username);
-			} else {
-				cJSON_AddStringToObject(
-				    jso, "username", username);
-			}
+			json_add_str(jw, info->as[j] ? info->as[j] : "username",
+			    username);
 			break;
 		case RULE_PASSWORD:;
 			char *password = (char *) conn_param_get_password(cp);
-			if (info->as[j]) {
-				cJSON_AddStringToObject(
-				    jso, info->as[j], password);
-			} else {
-				cJSON_AddStringToObject(
-				    jso, "password", password);
-			}
+			json_add_str(jw, info->as[j] ? info->as[j] : "password",
+			    password);
 			break;
 		case RULE_TIMESTAMP:
-			if (info->as[j]) {
-				cJSON_AddNumberToObject(jso, info->as[j],
-				    (unsigned long)time(NULL));
-			} else {
-				cJSON_AddNumberToObject(jso, "timestamp",
-				    (unsigned long)time(NULL));
-			}
+			json_add_uint(jw,
+			    info->as[j] ? info->as[j] : "timestamp",
+			    (unsigned long) time(NULL));
 			break;
 		case RULE_PAYLOAD_ALL:;
-			char *payload = pp->payload.data;
-			cJSON *jp = cJSON_ParseWithLength(payload, pp->payload.len);
-
-			if (info->as[j]) {
-				if (jp) {
-					cJSON_AddItemToObject(jso, info->as[j], jp);
-				} else {
-					cJSON_AddStringToObject(
-					    jso, info->as[j], payload);
-				}
+			char *payload = (char *) pp->payload.data;
+			// a JSON payload is embedded as is, anything else as
+			// a string
+			if (payload_json(work) != NULL && work->payload_whole) {
+				json_add_raw(jw,
+				    info->as[j] ? info->as[j] : "payload",
+				    payload, pp->payload.len);
 			} else {
-				if (jp) {
-					cJSON_AddItemToObject(jso, "payload", jp);
-				} else {
-					cJSON_AddStringToObject(
-					    jso, "payload", payload);
-				}
+				json_add_strn(jw,
+				    info->as[j] ? info->as[j] : "payload",
+				    payload, pp->payload.len);
 			}
 			break;
 		case RULE_PAYLOAD_FIELD:
@@ -613,7 +431,7 @@ add_info_to_json(rule *info, cJSON *jso, int j, nano_work *work)
 					switch (info->payload[pi]->type) {
 					case cJSON_Number:
 						if (info->payload[pi]->pas) {
-							cJSON_AddNumberToObject(jso,
+							json_add_int(jw,
 							    info->payload[pi]->pas,
 							    (long) info->payload[pi]->value);
 
@@ -621,14 +439,14 @@ add_info_to_json(rule *info, cJSON *jso, int j, nano_work *work)
 						break;
 					case cJSON_String:
 						if (info->payload[pi]->pas) {
-							cJSON_AddStringToObject(jso,
+							json_add_str(jw,
 							    info->payload[pi]->pas,
 							    (char *) info->payload[pi]->value);
 						}
 						break;
 					case cJSON_Object:
 						if (info->payload[pi]->pas) {
-							cJSON_AddItemToObject(jso,
+							json_add_cjson(jw,
 							    info->payload[pi]->pas,
 							    (cJSON*) info->payload[pi]->value);
 						}
@@ -648,418 +466,235 @@ add_info_to_json(rule *info, cJSON *jso, int j, nano_work *work)
 	return 0;
 }
 
-static char *
-compose_sql_clause(rule *info, char *key, char *value, bool is_need_set, int j, nano_work *work)
+#if defined(NNG_SUPP_SQLITE) || defined(SUPP_MYSQL)
+// the columns of the fields a rule selects, unless renamed with AS
+static const char *row_columns[] = {
+	"Qos",
+	"Id",
+	"Topic",
+	"Clientid",
+	"Username",
+	"Password",
+	"Timestamp",
+	"Payload",
+};
+
+static int
+row_str(nng_msg *row, const char *name, const char *str)
+{
+	return rule_row_text(row, name, str, str != NULL ? strlen(str) : 0);
+}
+
+// the payload fields the rule selected, as rule_prog_run() stored them
+static int
+row_payload_fields(nng_msg *row, rule *info)
+{
+	int rv = 0;
+
+	for (size_t pi = 0; pi < cvector_size(info->payload) && rv == 0;
+	     pi++) {
+		rule_payload *pl = info->payload[pi];
+
+		if (!pl->is_store || pl->pas == NULL) {
+			continue;
+		}
+		switch (pl->type) {
+		case cJSON_Number:
+			rv = rule_row_int(row, pl->pas, (long) pl->value);
+			break;
+		case cJSON_String:
+			rv = row_str(row, pl->pas, pl->value);
+			break;
+		case cJSON_Object:;
+			char *obj = cJSON_PrintUnformatted(pl->value);
+			rv        = row_str(row, pl->pas, obj);
+			cJSON_free(obj);
+			break;
+		default:
+			break;
+		}
+	}
+	return rv;
+}
+
+// the selected fields of the publish as a row of the rule's table
+static void
+rule_put_row(rule *info, rule_sink_type type, const char *table,
+    void *target, nano_work *work)
 {
 	pub_packet_struct *pp = work->pub_packet;
 	conn_param        *cp = work->cparam;
-	char *ret = NULL;
+	nng_msg           *row;
+	const char        *name;
+	int                rv;
 
-
-	if (info->flag[j]) {
+	if (nng_msg_alloc(&row, 0) != 0) {
+		return;
+	}
+	rv = rule_row_init(row, table);
+	for (int j = 0; j < 9 && rv == 0; j++) {
+		if (!info->flag[j]) {
+			continue;
+		}
+		name = NULL;
+		if (j < 8) {
+			name = info->as[j] ? info->as[j] : row_columns[j];
+		}
 		switch (j) {
 		case RULE_QOS:
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Qos");
-			}
-			sprintf(value, "%s%d", value, pp->fixed_header.qos);
+			rv = rule_row_int(row, name, pp->fixed_header.qos);
 			break;
 		case RULE_ID:
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Id");
-			}
-			sprintf(value, "%s\'%d\'", value, pp->var_header.publish.packet_id);
+			rv = rule_row_int(
+			    row, name, pp->var_header.publish.packet_id);
 			break;
-		case RULE_TOPIC:;
-			char *topic = pp->var_header.publish.topic_name.body;
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Topic");
-			}
-			sprintf(value, "%s\'%s\'", value, topic);
+		case RULE_TOPIC:
+			rv = row_str(
+			    row, name, pp->var_header.publish.topic_name.body);
 			break;
-		case RULE_CLIENTID:;
-			char *cid = (char *) conn_param_get_clientid(cp);
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Clientid");
-			}
-			sprintf(value, "%s\'%s\'", value, cid);
+		case RULE_CLIENTID:
+			rv = row_str(row, name,
+			    (const char *) conn_param_get_clientid(cp));
 			break;
-		case RULE_USERNAME:;
-			char *username = (char *) conn_param_get_username(cp);
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Username");
-			}
-			sprintf(value, "%s\'%s\'", value, username);
+		case RULE_USERNAME:
+			rv = row_str(row, name,
+			    (const char *) conn_param_get_username(cp));
 			break;
-		case RULE_PASSWORD:;
-			char *password = (char *) conn_param_get_password(cp);
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Password");
-			}
-			sprintf(value, "%s\'%s\'", value, password);
+		case RULE_PASSWORD:
+			rv = row_str(row, name,
+			    (const char *) conn_param_get_password(cp));
 			break;
 		case RULE_TIMESTAMP:
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Timestamp");
-			}
-
-			sprintf(value, "%s%lu", value, (unsigned long) time(NULL));
+			rv = rule_row_int(row, name, (int64_t) time(NULL));
 			break;
-		case RULE_PAYLOAD_ALL:;
-			char *payload = pp->payload.data;
-
-			if (info->as[j]) {
-				strcat(key, info->as[j]);
-			} else {
-				strcat(key, "Payload");
-			}
-
-			sprintf(value, "%s\'%s\'", value, payload);
+		case RULE_PAYLOAD_ALL:
+			rv = rule_row_text(row, name,
+			    pp->payload.data != NULL
+			        ? (const char *) pp->payload.data
+			        : "",
+			    pp->payload.len);
 			break;
-
-		case RULE_PAYLOAD_FIELD:;
-
-			char ret_key[512] = { 0 };
-			char tmp_key[128] = { 0 };
-
-			for (int pi = 0; pi < cvector_size(info->payload);
-			     pi++) {
-				if (info->payload[pi]->is_store) {
-					if (info->payload[pi]->pas) {
-
-						switch (info->payload[pi]->type) {
-						case cJSON_Number:
-								if (is_need_set) {
-									  if (RULE_FORWORD_SQLITE == info->forword_type) {
-										snprintf(tmp_key, 128, "ALTER TABLE %s ADD %s INT;\n", info->sqlite_table, info->payload[pi]->pas);
-									  } else if (RULE_FORWORD_MYSQL == info->forword_type) {
-										snprintf(tmp_key, 128, "ALTER TABLE %s ADD %s INT;\n", info->mysql->table, info->payload[pi]->pas);
-									  }
-								}
-								strcat(key, info->payload[pi]->pas);
-								strcat(key, ", ");
-								if (strlen(value) > strlen("VALUES (")) {
-									sprintf(value, "%s, %ld", value, (long) info->payload[pi]->value);
-								} else {
-									sprintf(value, "%s %ld", value, (long) info->payload[pi]->value);
-								}
-							break;
-						case cJSON_String:
-							if (info->payload[pi]->pas) {
-								if (is_need_set) {
-									  if (RULE_FORWORD_SQLITE == info->forword_type) {
-										snprintf(tmp_key, 128, "ALTER TABLE %s ADD %s TEXT;\n", info->sqlite_table, info->payload[pi]->pas);
-									  } else if (RULE_FORWORD_MYSQL == info->forword_type) {
-										snprintf(tmp_key, 128, "ALTER TABLE %s ADD %s TEXT;\n", info->mysql->table, info->payload[pi]->pas);
-									  }
-								}
-								strcat(key, info->payload[pi]->pas);
-								strcat(key, ", ");
-								if (strlen(value) > strlen("VALUES (")) {
-									sprintf(value, "%s, \'%s\'", value, (char*) info->payload[pi]->value);
-								} else {
-									sprintf(value, "%s \'%s\'", value, (char*) info->payload[pi]->value);
-								}
-							}
-							break;
-						case cJSON_Object:
-							if (info->payload[pi]->pas) {
-								if (is_need_set) {
-									  if (RULE_FORWORD_SQLITE == info->forword_type) {
-										snprintf(tmp_key, 128, "ALTER TABLE %s ADD %s TEXT;\n", info->sqlite_table, info->payload[pi]->pas);
-									  } else if (RULE_FORWORD_MYSQL == info->forword_type) {
-										snprintf(tmp_key, 128, "ALTER TABLE %s ADD %s TEXT;\n", info->mysql->table, info->payload[pi]->pas);
-									  }
-								}
-								strcat(key, info->payload[pi]->pas);
-								strcat(key, ", ");
-								char *tmp = cJSON_PrintUnformatted((cJSON*) info->payload[pi]->value);
-								if (strlen(value) > strlen("VALUES (")) {
-									sprintf(value, "%s, \'%s\'", value, tmp);
-								} else {
-									sprintf(value, "%s \'%s\'", value, tmp);
-								}
-								cJSON_free(tmp);
-							}
-							break;
-						default:
-							break;
-						}
-
-						strcat(ret_key, tmp_key);
-						memset(tmp_key, 0, 128);
-
-					}
-				}
-			}
-
-			if (strlen(ret_key)) {
-				ret = nng_strdup(ret_key);
-
-			}
+		case RULE_PAYLOAD_FIELD:
+			rv = row_payload_fields(row, info);
 			break;
-
 		default:
 			break;
 		}
-		if (j != RULE_PAYLOAD_FIELD) {
-			strcat(key, ", ");
-		}
-		strcat(value, ", ");
 	}
-
-	return ret;
+	if (rv != 0) {
+		nng_msg_free(row);
+		return;
+	}
+	rule_sink_put(type, target, row);
 }
+#endif
 
+/**
+ * @brief match the publish against the rules and queue what each
+ *        matching rule produces on its sink. Nothing here waits for a
+ *        database, the writers of rule_sink.c do.
+ */
 int
 rule_engine_insert_sql(nano_work *work)
 {
-	rule  *rules = work->config->rule_eng.rules;
-	size_t             rule_size  = cvector_size(rules);
 	pub_packet_struct *pp         = work->pub_packet;
 	conn_param        *cp         = work->cparam;
-	static uint32_t    index      = 0;
-	static bool is_first_time = true;
-	bool is_need_set = false;
-	static bool is_first_time_mysql = true;
-	bool is_need_set_mysql = false;
 
-	if (rule_mutex == NULL) {
-		nng_mtx_alloc(&rule_mutex);
+	rule_set          *set        = rule_set_get();
+	rule_input         in;
+
+	if (set == NULL) {
+		return 0;
 	}
 
-	for (size_t i = 0; i < rule_size; i++) {
-		if (true == rules[i].enabled && rule_engine_filter(work, &rules[i])) {
+	// only the rules whose topic matches, in rule order
+	rule_input_init(&in, work);
+	rule_set_match(set, in.topic, &work->rule_ids);
+	for (size_t k = 0; k < cvector_size(work->rule_ids); k++) {
+		uint32_t i = work->rule_ids[k];
+		// the set's own copy, conf_rule.rules may have moved on
+		rule    *r = rule_set_rule(set, i);
+		if (true == r->enabled &&
+		    rule_prog_run(rule_set_prog(set, i), r, &in)) {
 #if defined(FDB_SUPPORT)
-			char fdb_key[pp->var_header.publish.topic_name.len+sizeof(uint64_t)];
-			if (RULE_ENG_FDB & work->config->rule_eng.option && RULE_FORWORD_FDB == rules[i].forword_type) {
-				cJSON *jso = NULL;
-				jso        = cJSON_CreateObject();
-
+			if (RULE_ENG_FDB & work->config->rule_eng.option && RULE_FORWORD_FDB == r->forword_type) {
+				json_writer jw;
+				json_writer_init(&jw, work->json_buf);
+				json_obj_begin(&jw, NULL);
 				for (size_t j = 0; j < 9; j++) {
 					add_info_to_json(
-					    &rules[i], jso, j, work);
+					    r, &jw, j, work);
 				}
+				json_obj_end(&jw);
+				// NUL terminated for the logs and the writer
+				nng_msg_append(work->json_buf, "", 1);
 
 				char *key = NULL;
 				for (size_t j = 0; j < 9; j++) {
-					key = generate_key(&rules[i], j, work);
+					key = generate_key(r, j, work);
 					if (key != NULL) {
 						break;
 					}
 				}
 
-				char *dest = cJSON_PrintUnformatted(jso);
+				char *dest = nng_msg_body(work->json_buf);
 				log_debug("%s", key);
 				log_debug("%s", dest);
 
-				FDBTransaction *tr = NULL;
-				fdb_error_t     e =
-				    fdb_database_create_transaction(
-				        work->config->rule_eng.rdb[1], &tr);
-				if (e) {
-					fprintf(stderr, "%s\n", fdb_get_error(e));
+				// key and value, both NUL terminated
+				nng_msg *rec;
+				if (key != NULL && nng_msg_alloc(&rec, 0) == 0) {
+					nng_msg_append(rec, key, strlen(key) + 1);
+					nng_msg_append(rec, dest,
+					    nng_msg_len(work->json_buf));
+					rule_sink_put(RULE_SINK_FDB, NULL, rec);
 				}
 
-				fdb_transaction_set(tr, key,
-				    strlen(key), dest, strlen(dest));
-				FDBFuture *f = fdb_transaction_commit(tr);
-
-				e = fdb_future_block_until_ready(f);
-				if (e) {
-					fprintf(stderr, "%s\n", fdb_get_error(e));
-				}
-
-				fdb_future_destroy(f);
-				fdb_transaction_clear(tr, fdb_key, strlen(fdb_key));
-				fdb_transaction_destroy(tr);
-
 				free(key);
-				cJSON_free(dest);
-				cJSON_Delete(jso);
 			}
 #endif
 
-			if (RULE_ENG_RPB & work->config->rule_eng.option && RULE_FORWORD_REPUB == rules[i].forword_type) {
-				cJSON *jso = NULL;
-				jso        = cJSON_CreateObject();
-
+			if (RULE_ENG_RPB & work->config->rule_eng.option && RULE_FORWORD_REPUB == r->forword_type) {
+				json_writer jw;
+				json_writer_init(&jw, work->json_buf);
+				json_obj_begin(&jw, NULL);
 				for (size_t j = 0; j < 9; j++) {
 					add_info_to_json(
-					    &rules[i], jso, j, work);
+					    r, &jw, j, work);
 				}
+				json_obj_end(&jw);
 
-				char *dest = cJSON_PrintUnformatted(jso);
-				repub_t *repub = rules[i].repub;
+				char   *dest     = nng_msg_body(work->json_buf);
+				size_t  dest_len = nng_msg_len(work->json_buf);
+				repub_t *repub   = r->repub;
+				nng_msg *rec;
 
-				nano_client_publish(repub->sock, repub->topic, dest, strlen(dest), 0, NULL);
 				log_debug("%s", repub->topic);
-				log_debug("%s", dest);
-
-				cJSON_free(dest);
-				cJSON_Delete(jso);
+				log_debug("%.*s", (int) dest_len, dest);
+				if (nng_msg_dup(&rec, work->json_buf) == 0) {
+					rule_sink_put(RULE_SINK_REPUB, repub, rec);
+				}
 			}
 
 #if defined(NNG_SUPP_SQLITE)
-			if (RULE_ENG_SDB & work->config->rule_eng.option && RULE_FORWORD_SQLITE == rules[i].forword_type) {
-				char sql_clause[1024] = "INSERT INTO ";
-				char key[128]         = { 0 };
-				snprintf(key, 128, "%s (", rules[i].sqlite_table);
-				char value[800]       = "VALUES (";
-				for (size_t j = 0; j < 9; j++) {
-					nng_mtx_lock(rule_mutex);
-					if (true == is_first_time) {
-						is_need_set   = true;
-					}
-					char *ret =
-					    compose_sql_clause(&rules[i],
-					        key, value, is_need_set, j, work);
-					if (ret) {
-						log_debug("%s", ret);
-						log_debug("%s", ret);
-						sqlite3 *sdb =
-						    (sqlite3 *) work->config
-						        ->rule_eng.rdb[0];
-						char *err_msg = NULL;
-						int   rc      = sqlite3_exec(
-						           sdb, ret, 0, 0, &err_msg);
-						// FIXME: solve in a more
-						// elegant way 
-						if (rc != SQLITE_OK) {
-							// fprintf(stderr, "SQL error: num %d %s\n",
-							//     rc, err_msg);
-							sqlite3_free(err_msg);
-							// sqlite3_close(sdb);
-							// return 1;
-						}
-
-						free(ret);
-						ret = NULL;
-					}
-
-					if (true == is_first_time) {
-						is_first_time = false;
-					}
-
-					nng_mtx_unlock(rule_mutex);
-				}
-
-				
-
-				log_debug("%s", key);
-				log_debug("%s", value);
-				char *p = strrchr(key, ',');
-				*p      = ')';
-				p       = strrchr(value, ',');
-				*p      = ')';
-				strcat(sql_clause, key);
-				strcat(sql_clause, value);
-				strcat(sql_clause, ";");
-
-				log_debug("%s", sql_clause);
-				log_debug("%s", sql_clause);
-				sqlite3 *sdb = (sqlite3 *) work->config->rule_eng.rdb[0];
-				char    *err_msg = NULL;
-				int      rc      = sqlite3_exec(
-				              sdb, sql_clause, 0, 0, &err_msg);
-				if (rc != SQLITE_OK) {
-					fprintf(stderr, "SQL error: %s\n",
-					    err_msg);
-					sqlite3_free(err_msg);
-					sqlite3_close(sdb);
-
-					return 1;
-				}
-
+			if (RULE_ENG_SDB & work->config->rule_eng.option && RULE_FORWORD_SQLITE == r->forword_type) {
+				rule_put_row(r, RULE_SINK_SQLITE,
+				    r->sqlite_table, NULL, work);
 			}
-
 #endif
 
 
 #if defined(SUPP_MYSQL)
-			if (RULE_ENG_MDB & work->config->rule_eng.option && RULE_FORWORD_MYSQL == rules[i].forword_type) {
-				char sql_clause[1024] = "INSERT INTO ";
-				char key[128]         = { 0 };
-				snprintf(key, 128, "%s (", rules[i].mysql->table);
-				char value[800]       = "VALUES (";
-				for (size_t j = 0; j < 9; j++) {
-					nng_mtx_lock(rule_mutex);
-					if (true == is_first_time_mysql) {
-						is_need_set_mysql   = true;
-					}
-					char *ret =
-					    compose_sql_clause(&rules[i],
-					        key, value, is_need_set_mysql, j, work);
-
-					if (ret && is_need_set_mysql) {
-						is_need_set_mysql = false;
-						log_debug("%s", ret);
-
-						char *p   = ret;
-						char *p_b = ret;
-
-						while (NULL != p) {
-							char *p = strchr(p_b, '\n');
-							if (NULL != p) {
-								*p = '\0';
-  								if (mysql_query(rules[i].mysql->conn, p_b)) {
-  									// fprintf(stderr, "%s\n", mysql_error(rules[i].mysql->conn));
-  								}
-								p_b = ++p;
-
-							} else {
-								break;
-							}
-						}
-
-						free(ret);
-						ret = NULL;
-					}
-
-					if (true == is_first_time_mysql) {
-						is_first_time_mysql = false;
-					}
-
-					nng_mtx_unlock(rule_mutex);
-				}
-
-				
-
-				log_debug("%s", key);
-				log_debug("%s", value);
-				char *p = strrchr(key, ',');
-				*p      = ')';
-				p       = strrchr(value, ',');
-				*p      = ')';
-				strcat(sql_clause, key);
-				strcat(sql_clause, value);
-				strcat(sql_clause, ";");
-
-				log_debug("%s", sql_clause);
-  				if (mysql_query(rules[i].mysql->conn, sql_clause)) {
-  					fprintf(stderr, "%s\n", mysql_error(rules[i].mysql->conn));
-  					mysql_close(rules[i].mysql->conn);
-  					exit(1);
-  				}
+			if (RULE_ENG_MDB & work->config->rule_eng.option && RULE_FORWORD_MYSQL == r->forword_type) {
+				rule_put_row(r, RULE_SINK_MYSQL,
+				    r->mysql->table, r->mysql, work);
 			}
 #endif
 		}
 	}
 
+	payload_json_release(work);
+	rule_set_put(set);
 	return 0;
 }
 
@@ -1075,7 +710,9 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct, uint8_t proto,
 	uint32_t   *cli_ctx_list    = NULL;
 	uint32_t   *shared_cli_list = NULL;
 	char       *topic           = NULL;
-	pipe_ct->msg_infos          = NULL;
+
+	init_pipe_content(pipe_ct);
+	pipe_ct->arena = work->arena;
 
 #ifdef STATISTICS
 	if (!g_msg.initialed) {
@@ -1084,8 +721,18 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct, uint8_t proto,
 	nng_atomic_inc64(g_msg.msg_in);
 #endif
 
-	work->pub_packet = (struct pub_packet_struct *) nng_zalloc(
-	    sizeof(struct pub_packet_struct));
+	if (work->arena != NULL) {
+		work->pub_packet = nano_arena_zalloc(
+		    work->arena, sizeof(struct pub_packet_struct));
+	} else {
+		work->pub_packet = (struct pub_packet_struct *) nng_zalloc(
+		    sizeof(struct pub_packet_struct));
+	}
+	if (work->pub_packet == NULL) {
+		log_error("alloc fail!");
+		return UNSPECIFIED_ERROR;
+	}
+	work->pub_packet->arena = work->arena;
 
 	result = decode_pub_message(work, proto);
 	if (SUCCESS != result) {
@@ -1115,12 +762,16 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct, uint8_t proto,
 				const char *tp = dbhash_find_atpair(
 				    work->pid.id, pdata->p_value.u16);
 				if (tp) {
-					topic = work->pub_packet->var_header
-					            .publish.topic_name.body =
-					    nng_strdup(tp);
-					len = work->pub_packet->var_header
-					          .publish.topic_name.len =
-					    strlen(tp);
+					len   = strlen(tp);
+					topic = pub_packet_alloc(
+					    work->pub_packet, len + 1);
+					memcpy(topic, tp, len + 1);
+					work->pub_packet->var_header.publish
+					    .topic_name.body = topic;
+					work->pub_packet->var_header.publish
+					    .topic_name.len = len;
+					// wire image lacks the topic name
+					work->pub_packet->encoded = false;
 				} else {
 					log_error("could not find "
 					          "topic by alias: %d",
@@ -1138,8 +789,8 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct, uint8_t proto,
 #ifdef ACL_SUPP
 	if (!is_event && work->cparam) {
 		if (work->config->acl.enable) {
-			bool rv = auth_acl(
-			    work->config, ACL_PUB, work->cparam, topic);
+			bool rv = auth_acl_pipe(work->config, ACL_PUB,
+			    work->pid.id, work->cparam, topic);
 			if (!rv) {
 				log_warn("acl deny");
 				if (work->config->acl_deny_action ==
@@ -1156,27 +807,38 @@ handle_pub(nano_work *work, struct pipe_content *pipe_ct, uint8_t proto,
 		}
 	}
 #endif
-	cli_ctx_list = dbtree_find_clients(work->db, topic);
+	// generation has to be read before the tree is walked
+	uint64_t         gen = sub_cache_generation(topic);
+	sub_cache_result hit =
+	    sub_cache_find(topic, foreach_cached_client, pipe_ct);
+
+	if (hit == SUB_CACHE_MISS) {
+		cli_ctx_list    = dbtree_find_clients(work->db, topic);
+		shared_cli_list = dbtree_find_shared_clients(work->db, topic);
+		sub_cache_put(topic, gen, cli_ctx_list, shared_cli_list != NULL);
+		if (cli_ctx_list != NULL) {
+			foreach_client(cli_ctx_list, cvector_size(cli_ctx_list),
+			    pipe_ct);
+		}
+		cvector_free(cli_ctx_list);
+	} else if (hit == SUB_CACHE_HIT_SHARED) {
+		// shared subscriptions rotate members, never cache the pick
+		shared_cli_list = dbtree_find_shared_clients(work->db, topic);
+	}
+	log_debug("pipe_info size: [%u]", pipe_ct->msg_infos_len);
 
-	shared_cli_list = dbtree_find_shared_clients(work->db, topic);
+	if (shared_cli_list != NULL) {
+		foreach_client(shared_cli_list, cvector_size(shared_cli_list),
+		    pipe_ct);
+	}
+	cvector_free(shared_cli_list);
 
 #ifdef STATISTICS
-	if (cli_ctx_list == NULL && shared_cli_list == NULL) {
+	if (pipe_ct->msg_infos_len == 0) {
 		nng_atomic_inc64(g_msg.msg_drop);
 	}
 #endif
 
-	if (cli_ctx_list != NULL) {
-		foreach_client(cli_ctx_list, work, pipe_ct);
-	}
-	log_debug("pipe_info size: [%ld]", cvector_size(cli_ctx_list));
-	cvector_free(cli_ctx_list);
-
-	if (shared_cli_list != NULL) {
-		foreach_client(shared_cli_list, work, pipe_ct);
-	}
-	cvector_free(shared_cli_list);
-
 #if ENABLE_RETAIN
 	handle_pub_retain(work, topic);
 #endif
@@ -1219,10 +881,10 @@ static void inline handle_pub_retain_dbtree(const nano_work *work, char *topic)
 					nng_mqttv5_msg_decode(work->msg);
 				}
 			}
-			ret = dbtree_insert_retain(work->db_ret, topic, work->msg);
+			ret = retain_store_insert(work->db_ret, topic, work->msg);
 		} else {
 			log_debug("delete retain message");
-			ret = dbtree_delete_retain(work->db_ret, topic);
+			ret = retain_store_delete(work->db_ret, topic);
 		}
 
 
@@ -1252,8 +914,11 @@ free_pub_packet(struct pub_packet_struct *pub_packet)
 {
 	if (pub_packet != NULL) {
 		if (pub_packet->fixed_header.packet_type == PUBLISH) {
-			if (pub_packet->var_header.publish.topic_name.body !=
+			if (pub_packet->arena == NULL &&
+			    pub_packet->var_header.publish.topic_name.body !=
 			        NULL &&
+			    pub_packet->var_header.publish.topic_name.body !=
+			        pub_packet->topic_buf &&
 			    pub_packet->var_header.publish.topic_name.len >
 			        0) {
 				nng_free(pub_packet->var_header.publish
@@ -1275,7 +940,8 @@ free_pub_packet(struct pub_packet_struct *pub_packet)
 				log_debug("free properties");
 			}
 
-			if (pub_packet->payload.len > 0 &&
+			if (pub_packet->arena == NULL && !pub_packet->borrowed &&
+			    pub_packet->payload.len > 0 &&
 			    pub_packet->payload.data != NULL) {
 				nng_free(pub_packet->payload.data,
 				    pub_packet->payload.len + 1);
@@ -1285,12 +951,44 @@ free_pub_packet(struct pub_packet_struct *pub_packet)
 			}
 		}
 
-		nng_free(pub_packet, sizeof(struct pub_packet_struct));
+		// arena memory goes away with nano_arena_reset()
+		if (pub_packet->arena == NULL) {
+			nng_free(pub_packet, sizeof(struct pub_packet_struct));
+		}
 		pub_packet = NULL;
 		log_debug("free pub_packet");
 	}
 }
 
+/**
+ * @brief get the payload as a NUL-terminated string. A borrowed payload is
+ *        copied on first use, for consumers that need to own it or to keep
+ *        it beyond the lifetime of work->msg.
+ * @param pub_packet decoded packet
+ * @return char* payload, NULL if there is none
+ */
+char *
+pub_packet_payload_str(struct pub_packet_struct *pub_packet)
+{
+	uint8_t *data;
+
+	if (pub_packet->borrowed) {
+		if (pub_packet->payload.len > 0) {
+			if ((data = pub_packet_alloc(pub_packet,
+			         pub_packet->payload.len + 1)) == NULL) {
+				log_error("alloc fail!");
+				return NULL;
+			}
+			memcpy(data, pub_packet->payload.data,
+			    pub_packet->payload.len);
+			data[pub_packet->payload.len] = '\0';
+			pub_packet->payload.data      = data;
+		}
+		pub_packet->borrowed = false;
+	}
+	return (char *) pub_packet->payload.data;
+}
+
 void
 free_msg_infos(mqtt_msg_info *msg_infos)
 {
@@ -1332,6 +1030,20 @@ encode_pub_message(
 
 	log_debug("start encode message");
 
+	if (cmd == PUBLISH && dest_msg == work->msg &&
+	    work->pub_packet->encoded) {
+		// decode_pub_message left the received packet untouched, the
+		// same wire image is shared by every subscriber and the
+		// protocol layer patches packet id/QoS per pipe on its way out
+		log_debug("reuse encoded publish");
+		return true;
+	}
+
+	if (cmd == PUBLISH && dest_msg == work->msg) {
+		// the payload view would be overwritten while rebuilding
+		pub_packet_payload_str(work->pub_packet);
+	}
+
 	nng_msg_clear(dest_msg);
 	nng_msg_header_clear(dest_msg);
 	if (nng_msg_cmd_type(dest_msg) == CMD_PUBLISH_V5) {
@@ -1403,6 +1115,7 @@ encode_pub_message(
 		log_debug("header len [%ld] remain len [%d]\n",
 		    nng_msg_header_len(dest_msg),
 		    work->pub_packet->fixed_header.remain_len);
+		work->pub_packet->encoded = true;
 		break;
 
 	case PUBREL:
@@ -1456,6 +1169,29 @@ encode_pub_message(
 	return true;
 }
 
+/**
+ * @brief check whether msg is a complete PUBLISH wire image that matches
+ *        pub_packet, i.e. it can be sent again without being rebuilt.
+ * @param msg nng_msg
+ * @param pub_packet decoded packet
+ * @return bool
+ */
+static bool
+pub_wire_intact(nng_msg *msg, struct pub_packet_struct *pub_packet)
+{
+	uint8_t *header = nng_msg_header(msg);
+
+	// fixed header byte plus at least one byte of remaining length
+	if (nng_msg_header_len(msg) < 2 || (header[0] >> 4) != PUBLISH) {
+		return false;
+	}
+	// an alias-only publish has to get its topic back first
+	if (pub_packet->var_header.publish.topic_name.len == 0) {
+		return false;
+	}
+	return pub_packet->fixed_header.remain_len == nng_msg_len(msg);
+}
+
 /**
  * @brief decode work->msg to fill work->pub_packet.
  * @param work nano_work
@@ -1467,7 +1203,8 @@ decode_pub_message(nano_work *work, uint8_t proto)
 {
 	uint32_t pos      = 0;
 	uint32_t used_pos = 0;
-	uint32_t len, len_of_varint;
+	int32_t  len;
+	char    *topic = NULL;
 
 	nng_msg                  *msg        = work->msg;
 	struct pub_packet_struct *pub_packet = work->pub_packet;
@@ -1496,34 +1233,40 @@ decode_pub_message(nano_work *work, uint8_t proto)
 	case PUBLISH:
 		// variable header
 		// topic length
-		pub_packet->var_header.publish.topic_name.body =
-		    (char *) copyn_utf8_str(msg_body, &pos, (int *) &len, msg_len);
-		if (len >= 0)
-			// topic could be NULL here (topic alias)
-			pub_packet->var_header.publish.topic_name.len = len;
-		else {
+		if (msg_len < 2) {
 			log_warn("Invalid msg: Protocol error!");
 			return PROTOCOL_ERROR;
 		}
-
-		if (pub_packet->var_header.publish.topic_name.body != NULL) {
-			if (strchr(
-			        pub_packet->var_header.publish.topic_name.body,
-			        '+') != NULL ||
-			    strchr(
-			        pub_packet->var_header.publish.topic_name.body,
-			        '#') != NULL) {
-
+		NNI_GET16(msg_body, len);
+		if ((size_t) len + 2 > msg_len ||
+		    get_utf8_str(&topic, msg_body, &pos) == -1) {
+			log_warn("Invalid msg: Protocol error!");
+			return PROTOCOL_ERROR;
+		}
+		// topic could be NULL here (topic alias)
+		pub_packet->var_header.publish.topic_name.len = len;
+		if (topic != NULL) {
+			if (memchr(topic, '+', len) != NULL ||
+			    memchr(topic, '#', len) != NULL) {
 				// protocol error
-				log_error(
-				    "protocol error in topic:[%s], len: [%d]",
-				    pub_packet->var_header.publish.topic_name
-				        .body,
-				    pub_packet->var_header.publish.topic_name
-				        .len);
-
+				log_error("protocol error in topic:[%.*s], "
+				          "len: [%d]",
+				    len, topic, len);
 				return PROTOCOL_ERROR;
 			}
+			// topic is handed around as a C string, only copy it
+			// to the heap when it does not fit inline
+			if (len < PUB_TOPIC_INLINE_LEN) {
+				pub_packet->var_header.publish.topic_name.body =
+				    pub_packet->topic_buf;
+			} else {
+				pub_packet->var_header.publish.topic_name.body =
+				    pub_packet_alloc(pub_packet, len + 1);
+			}
+			memcpy(pub_packet->var_header.publish.topic_name.body,
+			    topic, len);
+			pub_packet->var_header.publish.topic_name.body[len] =
+			    '\0';
 		}
 
 		// TODO if topic_len = 0 && mqtt_version = 5.0, search topic
@@ -1577,15 +1320,15 @@ decode_pub_message(nano_work *work, uint8_t proto)
 		pub_packet->payload.len =
 		    (uint32_t) (msg_len - (size_t) used_pos);
 
+		// payload is only viewed, the msg outlives pub_packet
+		pub_packet->borrowed = true;
 		if (pub_packet->payload.len > 0) {
-			pub_packet->payload.data =
-			    nng_zalloc(pub_packet->payload.len + 1);
-			memcpy(pub_packet->payload.data,
-			    (uint8_t *) (msg_body + pos),
+			pub_packet->payload.data = msg_body + pos;
+			log_debug("payload: [%.*s], len = %u",
+			    pub_packet->payload.len, pub_packet->payload.data,
 			    pub_packet->payload.len);
-			log_debug("payload: [%s], len = %u",
-			    pub_packet->payload.data, pub_packet->payload.len);
 		}
+		pub_packet->encoded = pub_wire_intact(msg, pub_packet);
 		break;
 
 	case PUBACK:
@@ -9,6 +9,7 @@
 
 #include "include/rest_api.h"
 #include "include/bridge.h"
+#include "include/bridge_route.h"
 #include "include/conf_api.h"
 #include "nng/supplemental/nanolib/base64.h"
 #include "nng/supplemental/nanolib/cJSON.h"
@@ -17,7 +18,11 @@
 #include "include/broker.h"
 #include "include/nanomq.h"
 #include "include/nanomq_rule.h"
+#include "include/rule_prog.h"
+#include "include/rule_sink.h"
 #include "include/sub_handler.h"
+#include "include/sub_cache.h"
+#include "include/webhook_inproc.h"
 #include "include/version.h"
 
 #include "nng/nng.h"
@@ -1475,6 +1480,236 @@ out:
 	return res;
 }
 
+static void
+metrics_add_arena(cJSON *metrics)
+{
+	nano_arena_stats stats;
+	cJSON           *item = cJSON_CreateObject();
+
+	nano_arena_get_stats(&stats);
+	cJSON_AddStringToObject(item, "name", "publish_arena");
+	cJSON_AddNumberToObject(item, "allocations", stats.allocs);
+	cJSON_AddNumberToObject(item, "bytes", stats.bytes);
+	cJSON_AddNumberToObject(item, "heap_chunks", stats.chunks);
+	cJSON_AddNumberToObject(item, "cycles", stats.resets);
+	cJSON_AddItemToArray(metrics, item);
+}
+
+static void
+metrics_add_sub_cache(cJSON *metrics)
+{
+	sub_cache_stats stats;
+	cJSON          *item = cJSON_CreateObject();
+
+	sub_cache_get_stats(&stats);
+	cJSON_AddStringToObject(item, "name", "subscriber_cache");
+	cJSON_AddNumberToObject(item, "hits", stats.hits);
+	cJSON_AddNumberToObject(item, "misses", stats.misses);
+	cJSON_AddNumberToObject(item, "invalidations", stats.invalidations);
+	cJSON_AddItemToArray(metrics, item);
+}
+
+static cJSON *
+metrics_histogram(uint64_t *buckets, size_t n)
+{
+	cJSON *hist = cJSON_CreateObject();
+	char   bound[24];
+
+	// keyed by the exclusive upper bound of each bucket
+	for (size_t i = 0; i < n - 1; i++) {
+		snprintf(bound, sizeof(bound), "%llu", 1ull << i);
+		cJSON_AddNumberToObject(hist, bound, buckets[i]);
+	}
+	cJSON_AddNumberToObject(hist, "inf", buckets[n - 1]);
+	return hist;
+}
+
+static void
+metrics_add_webhook(cJSON *metrics)
+{
+	webhook_stats stats;
+	cJSON        *item = cJSON_CreateObject();
+
+	webhook_get_stats(&stats);
+	cJSON_AddStringToObject(item, "name", "webhook");
+	cJSON_AddNumberToObject(item, "connects", stats.pool.connects);
+	cJSON_AddNumberToObject(item, "reuses", stats.pool.reuses);
+	cJSON_AddNumberToObject(item, "failures", stats.pool.failures);
+	cJSON_AddNumberToObject(item, "queued", stats.queued);
+	cJSON_AddItemToObject(item, "queue_depth",
+	    metrics_histogram(stats.depth, WEBHOOK_HIST_BUCKETS));
+	cJSON_AddItemToObject(item, "latency_ms",
+	    metrics_histogram(stats.pool.latency, WEBHOOK_HIST_BUCKETS));
+	cJSON_AddItemToArray(metrics, item);
+}
+
+static void
+metrics_add_rule_sinks(cJSON *metrics)
+{
+#if defined(SUPP_RULE_ENGINE)
+	rule_sink_stats stats;
+	cJSON          *item;
+
+	for (int i = 0; i < RULE_SINK_COUNT; i++) {
+		rule_sink_get_stats(i, &stats);
+		item = cJSON_CreateObject();
+		cJSON_AddStringToObject(item, "name", "rule_sink");
+		cJSON_AddStringToObject(item, "sink", rule_sink_name(i));
+		cJSON_AddNumberToObject(item, "queued", stats.queued);
+		cJSON_AddNumberToObject(item, "queued_bytes", stats.bytes);
+		cJSON_AddNumberToObject(item, "written", stats.written);
+		cJSON_AddNumberToObject(item, "failed", stats.failed);
+		cJSON_AddNumberToObject(item, "dropped", stats.dropped);
+		cJSON_AddItemToObject(item, "latency_ms",
+		    metrics_histogram(stats.latency, RULE_SINK_HIST_BUCKETS));
+		cJSON_AddItemToArray(metrics, item);
+	}
+#else
+	(void) metrics;
+#endif
+}
+
+// stream 0 takes the topics bridges.mqtt.<name>.streams does not list
+static void
+metrics_add_bridge_streams(cJSON *item, bridge_queue *q)
+{
+	cJSON             *streams = cJSON_CreateArray();
+	cJSON             *stream;
+	bridge_sched_stats stats;
+
+	for (uint32_t i = 0; i < bridge_queue_streams(q); i++) {
+		bridge_queue_get_stream_stats(q, i, &stats);
+		stream = cJSON_CreateObject();
+		cJSON_AddNumberToObject(stream, "stream", i);
+		cJSON_AddNumberToObject(stream, "queued", stats.queued);
+		cJSON_AddNumberToObject(stream, "sent", stats.sent);
+		cJSON_AddNumberToObject(stream, "sent_bytes", stats.sent_bytes);
+		cJSON_AddNumberToObject(stream, "failed", stats.failed);
+		cJSON_AddNumberToObject(stream, "latency_avg",
+		    stats.sent == 0 ? 0
+		                    : (double) stats.latency_sum / stats.sent);
+		cJSON_AddNumberToObject(
+		    stream, "latency_max", stats.latency_max);
+		cJSON_AddItemToArray(streams, stream);
+	}
+	cJSON_AddItemToObject(item, "streams", streams);
+}
+
+// which transport a hybrid bridge is on and how the probes over each score
+static void
+metrics_add_bridge_adapt(cJSON *item, bridge_param *param)
+{
+	cJSON             *adaptive = cJSON_CreateObject();
+	cJSON             *transport;
+	bridge_adapt_stats stats;
+	const char        *addr = param->config->address;
+
+	cJSON_AddStringToObject(adaptive, "transport",
+	    0 == strncmp(addr, "mqtt-quic", strlen("mqtt-quic")) ? "quic"
+	                                                         : "tcp");
+	cJSON_AddNumberToObject(
+	    adaptive, "switches", bridge_adapt_switches(param->adapt));
+	for (int t = 0; t < BRIDGE_TRANSPORTS; t++) {
+		bridge_adapt_get_stats(param->adapt, t, &stats);
+		transport = cJSON_CreateObject();
+		cJSON_AddNumberToObject(transport, "probes", stats.probes);
+		cJSON_AddNumberToObject(transport, "lost", stats.lost);
+		cJSON_AddBoolToObject(transport, "scored", stats.scored);
+		cJSON_AddNumberToObject(transport, "rtt", stats.rtt);
+		cJSON_AddNumberToObject(transport, "loss", stats.loss);
+		cJSON_AddNumberToObject(transport, "score", stats.score);
+		cJSON_AddNumberToObject(
+		    transport, "throughput", stats.throughput);
+		cJSON_AddItemToObject(
+		    adaptive, bridge_transport_name(t), transport);
+	}
+	cJSON_AddItemToObject(item, "adaptive", adaptive);
+}
+
+static void
+metrics_add_bridges(cJSON *metrics)
+{
+	conf              *config = get_global_conf();
+	bridge_queue_stats stats;
+	cJSON             *item;
+
+	if (!config->bridge_mode) {
+		return;
+	}
+	for (size_t t = 0; t < config->bridge.count; t++) {
+		conf_bridge_node *node  = config->bridge.nodes[t];
+		bridge_param     *param = node->bridge_arg;
+
+		if (!node->enable || param == NULL) {
+			continue;
+		}
+		// one item per connection of the node
+		for (size_t i = 0; i < param->nconns; i++) {
+			bridge_conn *c = &param->conns[i];
+			uint64_t     connects, disconnects;
+
+			if (c->queue == NULL) {
+				continue;
+			}
+			bridge_queue_get_stats(c->queue, &stats);
+			connects    = nng_atomic_get64(c->connects);
+			disconnects = nng_atomic_get64(c->disconnects);
+			item        = cJSON_CreateObject();
+			cJSON_AddStringToObject(item, "name", "bridge");
+			cJSON_AddStringOrNullToObject(item, "bridge", node->name);
+			cJSON_AddNumberToObject(item, "connection", i);
+			cJSON_AddStringOrNullToObject(item, "clientid",
+			    i == 0 ? node->clientid : c->clientid);
+			cJSON_AddBoolToObject(
+			    item, "connected", connects > disconnects);
+			cJSON_AddNumberToObject(item, "connects", connects);
+			cJSON_AddNumberToObject(item, "disconnects", disconnects);
+			cJSON_AddNumberToObject(item, "queued", stats.queued);
+			cJSON_AddNumberToObject(
+			    item, "queued_bytes", stats.bytes);
+			cJSON_AddNumberToObject(item, "spooled", stats.spooled);
+			cJSON_AddNumberToObject(item, "sent", stats.sent);
+			cJSON_AddNumberToObject(
+			    item, "sent_bytes", stats.sent_bytes);
+			cJSON_AddNumberToObject(item, "failed", stats.failed);
+			cJSON_AddNumberToObject(
+			    item, "requeued", stats.requeued);
+			cJSON_AddNumberToObject(item, "dropped", stats.dropped);
+			cJSON_AddNumberToObject(item, "spilled", stats.spilled);
+			cJSON_AddNumberToObject(item, "backlog", stats.backlog);
+			cJSON_AddNumberToObject(item, "drained", stats.drained);
+			cJSON_AddNumberToObject(
+			    item, "drain_rate", stats.drain_rate);
+			if (stats.time_to_empty < 0) {
+				cJSON_AddNullToObject(item, "time_to_empty");
+			} else {
+				cJSON_AddNumberToObject(
+				    item, "time_to_empty", stats.time_to_empty);
+			}
+			if (bridge_queue_streams(c->queue) > 1) {
+				metrics_add_bridge_streams(item, c->queue);
+			}
+			if (i == 0 && param->adapt != NULL) {
+				metrics_add_bridge_adapt(item, param);
+			}
+			if (c->envelope != NULL) {
+				bridge_envelope_stats es;
+
+				// sent and the rest above count envelopes then
+				bridge_envelope_get_stats(c->envelope, &es);
+				cJSON_AddNumberToObject(
+				    item, "envelopes", es.envelopes);
+				cJSON_AddNumberToObject(item, "packed", es.msgs);
+				cJSON_AddNumberToObject(
+				    item, "packed_bytes", es.raw_bytes);
+				cJSON_AddNumberToObject(
+				    item, "envelope_bytes", es.wire_bytes);
+			}
+			cJSON_AddItemToArray(metrics, item);
+		}
+	}
+}
+
 static http_msg
 get_metrics(http_msg *msg, kv **params, size_t param_num,
     const char *client_id, const char *username, nng_socket *broker_sock)
@@ -1493,6 +1728,12 @@ get_metrics(http_msg *msg, kv **params, size_t param_num,
 	snprintf(cpu, 16, "%.2f%%", stats.cpu_percent);
 	snprintf(mem, 64, "%ld", stats.memory);
 
+	metrics_add_arena(metrics);
+	metrics_add_sub_cache(metrics);
+	metrics_add_webhook(metrics);
+	metrics_add_rule_sinks(metrics);
+	metrics_add_bridges(metrics);
+
 	cJSON_AddItemToObject(res_obj, "metrics", metrics);
 	cJSON_AddStringToObject(res_obj, "cpuinfo", cpu);
 	cJSON_AddStringToObject(res_obj, "memory", mem);
@@ -1849,12 +2090,15 @@ post_rules(http_msg *msg)
 			log_error("Unsupport forword type !");
 			rc = PLUGIN_IS_CLOSED;
 		error:
+			// actions before the failed one were added
+			rule_set_load(cr);
 			cJSON_Delete(req);
 			cJSON_Delete(res_obj);
 			return error_response(
 			    msg, NNG_HTTP_STATUS_BAD_REQUEST, rc);
 		}
 	}
+	rule_set_load(cr);
 
 	cJSON *jso_desc = cJSON_GetObjectItem(req, "description");
 	if (jso_desc) {
@@ -2117,42 +2361,47 @@ put_rules(http_msg *msg, kv **params, size_t param_num, const char *rule_id)
 		rc = REQ_PARAM_ERROR;
 		goto error;
 	}
+	// The rule leaves the published set before it changes, no work
+	// holds a set with it past rule_set_quiesce(), then the records
+	// queued for it, which point to its repub and mysql, are written.
+	// It comes back as the last rule.
+	rule old = *old_rule;
+	cvector_erase(cr->rules, i);
+	rule_set_load(cr);
+	rule_set_quiesce();
+	rule_sink_sync();
 
 	cJSON *jso_sql = cJSON_GetObjectItem(req, "rawsql");
 	if (NULL != jso_sql) {
 		char *rawsql = cJSON_GetStringValue(jso_sql);
 		rule_sql_parse(cr, rawsql);
 		new_rule = &cr->rules[cvector_size(cr->rules) - 1];
-		new_rule->forword_type = cr->rules[i].forword_type;
+		new_rule->forword_type = old.forword_type;
 		new_rule->raw_sql = nng_strdup(rawsql);
 		new_rule->enabled = true;
 		new_rule->rule_id = id;
 
-		switch (cr->rules[i].forword_type)
+		switch (old.forword_type)
 		{
 		case RULE_FORWORD_REPUB:
-			new_rule->repub = cr->rules[i].repub;
+			new_rule->repub = old.repub;
 			break;
 		case RULE_FORWORD_MYSQL:
-			new_rule->mysql = cr->rules[i].mysql;
+			new_rule->mysql = old.mysql;
 			break;
 		case RULE_FORWORD_SQLITE:
-			new_rule->sqlite_table = cr->rules[i].sqlite_table;
+			new_rule->sqlite_table = old.sqlite_table;
 			break;
 		default:
 			break;
 		}
-
-		// Maybe cvector_push_back() will realloc,
-		// so for safety reassign it.
-		old_rule = &cr->rules[i];
-		rule_free(old_rule);
-		cvector_erase(cr->rules, i);
+		rule_free(&old);
 	} else {
-		if (old_rule->repub) {
-			nng_close(*(nng_socket*) old_rule->repub->sock);
+		if (old.repub) {
+			nng_close(*(nng_socket*) old.repub->sock);
 		}
-		new_rule = old_rule;
+		cvector_push_back(cr->rules, old);
+		new_rule = &cr->rules[cvector_size(cr->rules) - 1];
 	}
 
 	cJSON *jso_enabled = cJSON_GetObjectItem(req, "enabled");
@@ -2190,6 +2439,8 @@ put_rules(http_msg *msg, kv **params, size_t param_num, const char *rule_id)
 			// TODO nng_mqtt_disconnct()
 		}
 	}
+	// the repub client id is part of the compiled filter
+	rule_set_load(cr);
 
 	// cJSON *jso_desc = cJSON_GetObjectItem(req, "description");
 	// char *desc= cJSON_GetStringValue(jso_desc);
@@ -2236,20 +2487,26 @@ delete_rules(http_msg *msg, kv **params, size_t param_num, const char *rule_id)
 		size_t     size   = cvector_size(cr->rules);
 		for (; i < size; i++) {
 			if (cr->rules[i].rule_id == id) {
-				rule *re = &cr->rules[i];
-				switch (re->forword_type)
+				rule re = cr->rules[i];
+				// no new records once no work holds a set
+				// with the rule, the queued ones point to its
+				// repub and mysql
+				cvector_erase(cr->rules, i);
+				rule_set_load(cr);
+				rule_set_quiesce();
+				rule_sink_sync();
+				switch (re.forword_type)
 				{
 				case RULE_FORWORD_MYSQL:
-					rule_mysql_free(re->mysql);
+					rule_mysql_free(re.mysql);
 					break;
 				case RULE_FORWORD_REPUB:
-					rule_repub_free(re->repub);
+					rule_repub_free(re.repub);
 					break;
 				default:
 					break;
 				}
-				rule_free(re);
-				cvector_erase(cr->rules, i);
+				rule_free(&re);
 				break;
 			}
 		}
@@ -3107,6 +3364,7 @@ handle_subscribe_msg(cJSON *sub_obj, nng_socket *sock)
 			topic_exist = dbhash_check_topic(pid, topic_str);
 			if (!topic_exist) {
 				dbtree_insert_client(db, topic_str, pid);
+				sub_cache_invalidate(topic_str);
 
 				dbhash_insert_topic(pid, topic_str, qos);
 			}
@@ -3294,6 +3552,8 @@ put_mqtt_bridge(http_msg *msg, const char *name)
 		conf_bridge_node_parse(node, &bridge->sqlite, node_obj);
 		node->parallel = parallel;
 		nng_mtx_unlock(node->mtx);
+		// the forwards may have changed
+		bridge_route_load(config);
 
 		found = true;
 		// restart bridge client, parameters: config, node, node->sock
@@ -0,0 +1,573 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/retain_log.h"
+#include "include/retain_store.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "nng/protocol/mqtt/mqtt_parser.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+#ifndef NANO_PLATFORM_WINDOWS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FNV_INIT 2166136261u
+
+// followed by topic, msg header and msg body
+typedef struct {
+	uint32_t magic;
+	uint32_t sum; // FNV-1a of everything behind the record header
+	uint16_t topic_len;
+	uint8_t  cmd; // cmd type of the msg, 0 removes the retained msg
+	uint8_t  reserved;
+	uint32_t hdr_len;
+	uint32_t body_len;
+} rec_hdr;
+
+#define REC_DATA_LEN(h) \
+	((uint64_t) (h)->topic_len + (h)->hdr_len + (h)->body_len)
+
+struct retain_log {
+	char         *path;
+	int           fd;
+	uint64_t      size;
+	uint64_t      records;
+	uint64_t      compactions;
+	retain_store *store;
+	nng_mtx      *mtx; // fd, size and records
+	nng_mtx      *compact_mtx;
+	nng_cv       *cv;
+	nng_thread   *thr;
+	nng_duration  interval;
+	bool          closing;
+};
+
+typedef void (*rec_cb)(const rec_hdr *h, const uint8_t *data, uint64_t off,
+    void *arg);
+
+static uint32_t
+fnv(uint32_t h, const uint8_t *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Walk the records of a mapped log, stop at the first one that is torn
+// or corrupted. Returns the length of the valid prefix.
+static uint64_t
+log_scan(const uint8_t *base, uint64_t size, rec_cb cb, void *arg)
+{
+	uint64_t off = 0;
+	uint64_t len;
+	rec_hdr  h;
+
+	while (size - off >= sizeof(h)) {
+		memcpy(&h, base + off, sizeof(h));
+		len = REC_DATA_LEN(&h);
+		if (h.magic != RETAIN_LOG_MAGIC || h.topic_len == 0 ||
+		    len > size - off - sizeof(h) ||
+		    fnv(FNV_INIT, base + off + sizeof(h), len) != h.sum) {
+			break;
+		}
+		cb(&h, base + off + sizeof(h), off, arg);
+		off += sizeof(h) + len;
+	}
+	return off;
+}
+
+static nng_msg *
+record_msg(const rec_hdr *h, const uint8_t *p)
+{
+	nng_msg *msg;
+
+	if (nng_msg_alloc(&msg, h->body_len) != 0) {
+		return NULL;
+	}
+	memcpy(nng_msg_body(msg), p + h->hdr_len, h->body_len);
+	if (nng_msg_header_append(msg, p, h->hdr_len) != 0) {
+		nng_msg_free(msg);
+		return NULL;
+	}
+	// same shape handle_pub_retain_dbtree() stores
+	nng_msg_set_cmd_type(msg, h->cmd);
+	nng_mqtt_msg_proto_data_alloc(msg);
+	if (h->cmd == CMD_PUBLISH_V5) {
+		nng_mqttv5_msg_decode(msg);
+	}
+	return msg;
+}
+
+static void
+replay_record(const rec_hdr *h, const uint8_t *data, uint64_t off, void *arg)
+{
+	retain_log *log = arg;
+	char        buf[256];
+	char       *topic = buf;
+	nng_msg    *msg, *old = NULL;
+
+	(void) off;
+	if (h->topic_len >= sizeof(buf) &&
+	    (topic = nng_alloc(h->topic_len + 1)) == NULL) {
+		return;
+	}
+	memcpy(topic, data, h->topic_len);
+	topic[h->topic_len] = '\0';
+
+	if (h->cmd == 0) {
+		old = retain_store_delete(log->store, topic);
+	} else if ((msg = record_msg(h, data + h->topic_len)) != NULL) {
+		old = retain_store_insert(log->store, topic, msg);
+	}
+	if (old != NULL) {
+		nng_msg_free(old);
+	}
+	log->records++;
+
+	if (topic != buf) {
+		nng_free(topic, h->topic_len + 1);
+	}
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t        n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) <= 0) {
+			return NNG_EINTERNAL;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * @brief append the retained msg of topic, msg NULL records its removal.
+ */
+int
+retain_log_append(retain_log *log, const char *topic, nng_msg *msg)
+{
+	rec_hdr      h   = { 0 };
+	struct iovec iov[4];
+	int          cnt = 2;
+	size_t       total;
+	ssize_t      n;
+
+	h.magic     = RETAIN_LOG_MAGIC;
+	h.topic_len = (uint16_t) strlen(topic);
+	if (h.topic_len == 0) {
+		return NNG_EINVAL;
+	}
+	iov[1].iov_base = (void *) topic;
+	iov[1].iov_len  = h.topic_len;
+	if (msg != NULL) {
+		h.cmd           = nng_msg_cmd_type(msg);
+		h.hdr_len       = nng_msg_header_len(msg);
+		h.body_len      = nng_msg_len(msg);
+		iov[2].iov_base = nng_msg_header(msg);
+		iov[2].iov_len  = h.hdr_len;
+		iov[3].iov_base = nng_msg_body(msg);
+		iov[3].iov_len  = h.body_len;
+		cnt             = 4;
+	}
+	h.sum = FNV_INIT;
+	for (int i = 1; i < cnt; i++) {
+		h.sum = fnv(h.sum, iov[i].iov_base, iov[i].iov_len);
+	}
+	iov[0].iov_base = &h;
+	iov[0].iov_len  = sizeof(h);
+	total           = sizeof(h) + REC_DATA_LEN(&h);
+
+	nng_mtx_lock(log->mtx);
+	n = writev(log->fd, iov, cnt);
+	if (n != (ssize_t) total) {
+		// never leave a torn record in front of the next one
+		if (n > 0 && ftruncate(log->fd, log->size) != 0) {
+			log_error("retain log %s is corrupted", log->path);
+		}
+		nng_mtx_unlock(log->mtx);
+		log_error("retain log append failed: %s", strerror(errno));
+		return NNG_EINTERNAL;
+	}
+	log->size += total;
+	log->records++;
+	nng_mtx_unlock(log->mtx);
+	return 0;
+}
+
+// topic -> latest record, for one compaction pass
+typedef struct {
+	const uint8_t *topic;
+	uint64_t       off;
+	uint16_t       topic_len;
+	bool           live;
+} live_ent;
+
+typedef struct {
+	live_ent *ents;
+	size_t    cap;
+	size_t    used;
+	int       err;
+} live_map;
+
+static live_ent *
+live_map_slot(live_ent *ents, size_t cap, const uint8_t *topic, uint16_t len)
+{
+	size_t i = fnv(FNV_INIT, topic, len) & (cap - 1);
+
+	while (ents[i].topic != NULL &&
+	    (ents[i].topic_len != len || memcmp(ents[i].topic, topic, len) != 0)) {
+		i = (i + 1) & (cap - 1);
+	}
+	return &ents[i];
+}
+
+static int
+live_map_grow(live_map *m)
+{
+	size_t    cap = m->cap == 0 ? 1024 : m->cap * 2;
+	live_ent *ents;
+
+	if ((ents = nng_zalloc(cap * sizeof(live_ent))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	for (size_t i = 0; i < m->cap; i++) {
+		if (m->ents[i].topic != NULL) {
+			*live_map_slot(ents, cap, m->ents[i].topic,
+			    m->ents[i].topic_len) = m->ents[i];
+		}
+	}
+	if (m->ents != NULL) {
+		nng_free(m->ents, m->cap * sizeof(live_ent));
+	}
+	m->ents = ents;
+	m->cap  = cap;
+	return 0;
+}
+
+static void
+collect_record(const rec_hdr *h, const uint8_t *data, uint64_t off, void *arg)
+{
+	live_map *m = arg;
+	live_ent *e;
+
+	if (m->err != 0) {
+		return;
+	}
+	if ((m->used + 1) * 2 > m->cap && (m->err = live_map_grow(m)) != 0) {
+		return;
+	}
+	e = live_map_slot(m->ents, m->cap, data, h->topic_len);
+	if (e->topic == NULL) {
+		e->topic     = data;
+		e->topic_len = h->topic_len;
+		m->used++;
+	}
+	e->off  = off;
+	e->live = h->cmd != 0;
+}
+
+/**
+ * @brief rewrite the log with the latest record of every retained topic.
+ *        Appends are only blocked while the records written during the
+ *        rewrite are copied over.
+ */
+int
+retain_log_compact(retain_log *log)
+{
+	live_map  map = { 0 };
+	uint64_t  end, records, live = 0, size = 0;
+	uint8_t  *base;
+	uint8_t   buf[8192];
+	char     *tmp;
+	size_t    tmp_len = strlen(log->path) + sizeof(".tmp");
+	int       fd, rv = 0;
+	ssize_t   n;
+	rec_hdr   h;
+
+	nng_mtx_lock(log->compact_mtx);
+	nng_mtx_lock(log->mtx);
+	end     = log->size;
+	records = log->records;
+	nng_mtx_unlock(log->mtx);
+	if (end == 0) {
+		nng_mtx_unlock(log->compact_mtx);
+		return 0;
+	}
+
+	base = mmap(NULL, end, PROT_READ, MAP_PRIVATE, log->fd, 0);
+	if (base == MAP_FAILED) {
+		nng_mtx_unlock(log->compact_mtx);
+		return NNG_ENOMEM;
+	}
+	log_scan(base, end, collect_record, &map);
+	if ((rv = map.err) != 0) {
+		goto out;
+	}
+
+	if ((tmp = nng_alloc(tmp_len)) == NULL) {
+		rv = NNG_ENOMEM;
+		goto out;
+	}
+	snprintf(tmp, tmp_len, "%s.tmp", log->path);
+	if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644)) <
+	    0) {
+		log_error("cannot open %s: %s", tmp, strerror(errno));
+		nng_free(tmp, tmp_len);
+		rv = NNG_EINTERNAL;
+		goto out;
+	}
+	for (size_t i = 0; i < map.cap && rv == 0; i++) {
+		if (map.ents[i].topic == NULL || !map.ents[i].live) {
+			continue;
+		}
+		memcpy(&h, base + map.ents[i].off, sizeof(h));
+		rv = write_all(
+		    fd, base + map.ents[i].off, sizeof(h) + REC_DATA_LEN(&h));
+		size += sizeof(h) + REC_DATA_LEN(&h);
+		live++;
+	}
+
+	nng_mtx_lock(log->mtx);
+	// records appended meanwhile follow verbatim, replay is last wins
+	for (uint64_t off = end; rv == 0 && off < log->size; off += n) {
+		n = pread(log->fd, buf,
+		    log->size - off < sizeof(buf) ? log->size - off
+		                                  : sizeof(buf),
+		    off);
+		if (n <= 0) {
+			rv = NNG_EINTERNAL;
+			break;
+		}
+		rv = write_all(fd, buf, n);
+	}
+	if (rv == 0 && (fsync(fd) != 0 || rename(tmp, log->path) != 0)) {
+		rv = NNG_EINTERNAL;
+	}
+	if (rv == 0) {
+		close(log->fd);
+		log->fd      = fd;
+		log->records = live + log->records - records;
+		log_info("retain log compacted from %llu to %llu bytes",
+		    (unsigned long long) log->size,
+		    (unsigned long long) (size + log->size - end));
+		log->size = size + log->size - end;
+		log->compactions++;
+	} else {
+		log_error("retain log compaction failed: %s", strerror(errno));
+		close(fd);
+		unlink(tmp);
+	}
+	nng_mtx_unlock(log->mtx);
+	nng_free(tmp, tmp_len);
+
+out:
+	if (map.ents != NULL) {
+		nng_free(map.ents, map.cap * sizeof(live_ent));
+	}
+	munmap(base, end);
+	nng_mtx_unlock(log->compact_mtx);
+	return rv;
+}
+
+static void
+compact_thread(void *arg)
+{
+	retain_log *log = arg;
+	uint64_t    live, dead;
+
+	nng_mtx_lock(log->mtx);
+	while (!log->closing) {
+		nng_cv_until(log->cv, nng_clock() + log->interval);
+		if (log->closing) {
+			break;
+		}
+		live = retain_store_count(log->store);
+		dead = log->records > live ? log->records - live : 0;
+		if (dead < RETAIN_LOG_COMPACT_MIN || dead < live) {
+			continue;
+		}
+		nng_mtx_unlock(log->mtx);
+		retain_log_compact(log);
+		nng_mtx_lock(log->mtx);
+	}
+	nng_mtx_unlock(log->mtx);
+}
+
+/**
+ * @brief open the log at path, replay it into store and attach it, so
+ *        that every later change of the store is appended.
+ * @param compact_interval how often compaction is considered, 0 never
+ */
+int
+retain_log_open(retain_log **logp, const char *path, retain_store *store,
+    nng_duration compact_interval)
+{
+	retain_log *log;
+	struct stat st;
+	uint8_t    *base;
+	uint64_t    valid = 0;
+	int         rv;
+
+	if ((log = nng_zalloc(sizeof(*log))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	log->store    = store;
+	log->interval = compact_interval;
+	if ((log->path = nng_strdup(path)) == NULL) {
+		nng_free(log, sizeof(*log));
+		return NNG_ENOMEM;
+	}
+	if ((log->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 ||
+	    fstat(log->fd, &st) != 0) {
+		log_error("cannot open retain log %s: %s", path,
+		    strerror(errno));
+		if (log->fd >= 0) {
+			close(log->fd);
+		}
+		nng_strfree(log->path);
+		nng_free(log, sizeof(*log));
+		return NNG_EINVAL;
+	}
+
+	if (st.st_size > 0) {
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, log->fd, 0);
+		if (base == MAP_FAILED) {
+			log_error("cannot map retain log %s", path);
+		} else {
+			valid = log_scan(base, st.st_size, replay_record, log);
+			munmap(base, st.st_size);
+		}
+		if (valid < (uint64_t) st.st_size) {
+			log_warn("retain log %s: dropping %llu bytes of torn "
+			         "records",
+			    path, (unsigned long long) (st.st_size - valid));
+			if (ftruncate(log->fd, valid) != 0) {
+				log_error("cannot truncate %s", path);
+			}
+		}
+	}
+	log->size = valid;
+	log_info("retain log %s: %llu records replayed", path,
+	    (unsigned long long) log->records);
+
+	if ((rv = nng_mtx_alloc(&log->mtx)) != 0 ||
+	    (rv = nng_mtx_alloc(&log->compact_mtx)) != 0 ||
+	    (rv = nng_cv_alloc(&log->cv, log->mtx)) != 0) {
+		retain_log_close(log);
+		return rv;
+	}
+	if (compact_interval > 0 &&
+	    (rv = nng_thread_create(&log->thr, compact_thread, log)) != 0) {
+		retain_log_close(log);
+		return rv;
+	}
+	retain_store_set_log(store, log);
+	*logp = log;
+	return 0;
+}
+
+void
+retain_log_close(retain_log *log)
+{
+	if (log == NULL) {
+		return;
+	}
+	if (log->thr != NULL) {
+		nng_mtx_lock(log->mtx);
+		log->closing = true;
+		nng_cv_wake(log->cv);
+		nng_mtx_unlock(log->mtx);
+		nng_thread_destroy(log->thr);
+	}
+	retain_store_set_log(log->store, NULL);
+	if (log->cv != NULL) {
+		nng_cv_free(log->cv);
+	}
+	if (log->compact_mtx != NULL) {
+		nng_mtx_free(log->compact_mtx);
+	}
+	if (log->mtx != NULL) {
+		nng_mtx_free(log->mtx);
+	}
+	fsync(log->fd);
+	close(log->fd);
+	nng_strfree(log->path);
+	nng_free(log, sizeof(*log));
+}
+
+void
+retain_log_get_stats(retain_log *log, retain_log_stats *stats)
+{
+	nng_mtx_lock(log->mtx);
+	stats->records     = log->records;
+	stats->bytes       = log->size;
+	stats->compactions = log->compactions;
+	nng_mtx_unlock(log->mtx);
+}
+
+#else
+
+int
+retain_log_open(retain_log **logp, const char *path, retain_store *store,
+    nng_duration compact_interval)
+{
+	(void) logp;
+	(void) path;
+	(void) store;
+	(void) compact_interval;
+	log_error("retain log is not supported on this platform");
+	return NNG_ENOTSUP;
+}
+
+void
+retain_log_close(retain_log *log)
+{
+	(void) log;
+}
+
+int
+retain_log_append(retain_log *log, const char *topic, nng_msg *msg)
+{
+	(void) log;
+	(void) topic;
+	(void) msg;
+	return NNG_ENOTSUP;
+}
+
+int
+retain_log_compact(retain_log *log)
+{
+	(void) log;
+	return NNG_ENOTSUP;
+}
+
+void
+retain_log_get_stats(retain_log *log, retain_log_stats *stats)
+{
+	(void) log;
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
@@ -0,0 +1,218 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/retain_log.h"
+#include "include/retain_store.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+typedef struct {
+	dbtree *tree;
+	// retained msgs in the tree, lets wildcard lookups skip empty
+	// shards without taking the tree lock
+	nng_atomic_u64 *count;
+	// a change of the tree and its log record happen as one, so the log
+	// replays the changes of a topic in the order the tree saw them
+	nng_mtx *mtx;
+} retain_shard;
+
+struct retain_store {
+	retain_shard shards[RETAIN_STORE_SHARDS];
+	// persists every change when the log backend is selected
+	retain_log *log;
+};
+
+// by the first level only, every topic a filter with a plain first level
+// can match is in the same shard
+static uint32_t
+topic_shard(const char *topic)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+
+	for (; *topic != '\0' && *topic != '/'; topic++) {
+		h ^= (uint8_t) *topic;
+		h *= 16777619u;
+	}
+	return h % RETAIN_STORE_SHARDS;
+}
+
+// the one shard a filter reads, -1 for a wildcard first level
+static int
+filter_shard(const char *filter)
+{
+	if (strncmp(filter, "$share/", strlen("$share/")) == 0) {
+		// the group is not part of what is matched
+		filter = strchr(filter + strlen("$share/"), '/');
+		if (filter == NULL) {
+			return -1;
+		}
+		filter++;
+	} else if (strncmp(filter, "$queue/", strlen("$queue/")) == 0) {
+		filter += strlen("$queue/");
+	}
+	if (filter[0] == '+' || filter[0] == '#') {
+		return -1;
+	}
+	return (int) topic_shard(filter);
+}
+
+int
+retain_store_create(retain_store **store)
+{
+	retain_store *s;
+
+	if ((s = nng_zalloc(sizeof(*s))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	for (int i = 0; i < RETAIN_STORE_SHARDS; i++) {
+		dbtree_create(&s->shards[i].tree);
+		if (s->shards[i].tree == NULL) {
+			retain_store_destroy(s);
+			return NNG_ENOMEM;
+		}
+		nng_atomic_alloc64(&s->shards[i].count);
+		if (nng_mtx_alloc(&s->shards[i].mtx) != 0) {
+			retain_store_destroy(s);
+			return NNG_ENOMEM;
+		}
+	}
+	*store = s;
+	return 0;
+}
+
+void
+retain_store_destroy(retain_store *store)
+{
+	if (store == NULL) {
+		return;
+	}
+	for (int i = 0; i < RETAIN_STORE_SHARDS; i++) {
+		if (store->shards[i].tree != NULL) {
+			dbtree_destory(store->shards[i].tree);
+		}
+		if (store->shards[i].count != NULL) {
+			nng_atomic_free64(store->shards[i].count);
+		}
+		if (store->shards[i].mtx != NULL) {
+			nng_mtx_free(store->shards[i].mtx);
+		}
+	}
+	nng_free(store, sizeof(*store));
+}
+
+/**
+ * @brief store msg as the retained msg of topic, the store takes over
+ *        the reference held by the caller.
+ * @return the msg it replaces, to be freed by the caller
+ */
+nng_msg *
+retain_store_insert(retain_store *store, char *topic, nng_msg *msg)
+{
+	retain_shard *shard = &store->shards[topic_shard(topic)];
+	nng_msg      *old;
+
+	if (store->log != NULL) {
+		// the append reads msg, which the tree owns from here on
+		nng_msg_clone(msg);
+	}
+	nng_mtx_lock(shard->mtx);
+	old = dbtree_insert_retain(shard->tree, topic, msg);
+	if (old == NULL) {
+		nng_atomic_inc64(shard->count);
+	}
+	if (store->log != NULL) {
+		retain_log_append(store->log, topic, msg);
+	}
+	nng_mtx_unlock(shard->mtx);
+	if (store->log != NULL) {
+		nng_msg_free(msg);
+	}
+	return old;
+}
+
+/**
+ * @return the removed msg, to be freed by the caller
+ */
+nng_msg *
+retain_store_delete(retain_store *store, char *topic)
+{
+	retain_shard *shard = &store->shards[topic_shard(topic)];
+	nng_msg      *old;
+
+	nng_mtx_lock(shard->mtx);
+	if ((old = dbtree_delete_retain(shard->tree, topic)) != NULL) {
+		nng_atomic_dec64_nv(shard->count);
+		if (store->log != NULL) {
+			retain_log_append(store->log, topic, NULL);
+		}
+	}
+	nng_mtx_unlock(shard->mtx);
+	return old;
+}
+
+/**
+ * @brief retained msgs matching a subscription filter.
+ * @return cvector of msgs the caller holds a reference to, NULL if none
+ */
+nng_msg **
+retain_store_find(retain_store *store, char *topic)
+{
+	nng_msg **ret = NULL;
+	nng_msg **part;
+	int       i;
+
+	if ((i = filter_shard(topic)) >= 0) {
+		retain_shard *shard = &store->shards[i];
+		if (nng_atomic_get64(shard->count) == 0) {
+			return NULL;
+		}
+		return dbtree_find_retain(shard->tree, topic);
+	}
+
+	for (i = 0; i < RETAIN_STORE_SHARDS; i++) {
+		if (nng_atomic_get64(store->shards[i].count) == 0) {
+			continue;
+		}
+		part = dbtree_find_retain(store->shards[i].tree, topic);
+		if (part == NULL) {
+			continue;
+		}
+		if (ret == NULL) {
+			ret = part;
+			continue;
+		}
+		for (size_t j = 0; j < cvector_size(part); j++) {
+			cvector_push_back(ret, part[j]);
+		}
+		cvector_free(part);
+	}
+	return ret;
+}
+
+// set once at start-up, before any publish is handled
+void
+retain_store_set_log(retain_store *store, retain_log *log)
+{
+	store->log = log;
+}
+
+uint64_t
+retain_store_count(retain_store *store)
+{
+	uint64_t n = 0;
+
+	for (int i = 0; i < RETAIN_STORE_SHARDS; i++) {
+		n += nng_atomic_get64(store->shards[i].count);
+	}
+	return n;
+}
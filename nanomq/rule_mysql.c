@@ -0,0 +1,490 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/rule_mysql.h"
+#include "include/rule_sink.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(SUPP_RULE_ENGINE) && defined(SUPP_MYSQL)
+
+#include <errmsg.h>
+#include <mysql.h>
+#include <mysqld_error.h>
+
+// an INSERT grows up to this before it is sent without waiting for the
+// flush, well below the smallest max_allowed_packet of a server
+#define RULE_MYSQL_STMT_MAX (1024 * 1024)
+// a server that refused a connection is not tried again before this
+#define RULE_MYSQL_RETRY 1000
+#define RULE_MYSQL_CONNECT_TIMEOUT 5
+
+typedef struct {
+	char   *buf;
+	size_t  len;
+	size_t  cap;
+} sql_buf;
+
+// the rows of one table and column list waiting for the flush
+typedef struct {
+	sql_buf  sql;        // the INSERT up to VALUES, then the rows
+	size_t   prefix_len; // where the rows start
+	size_t   rows;
+	char    *table;
+	char   **names; // cvector, to add columns the table lacks
+	uint8_t *types;
+} mysql_batch;
+
+typedef struct {
+	char         *host;
+	char         *username;
+	char         *password;
+	MYSQL        *conn;
+	nng_time      retry; // no connect attempt before this
+	mysql_batch **batches;
+} mysql_conn;
+
+struct rule_mysql_writer {
+	char        *db;
+	mysql_conn **conns;
+	rule_col    *cols;   // columns of the current row
+	sql_buf      prefix; // INSERT of the current row up to VALUES
+	size_t       failed; // rows lost since the last flush
+};
+
+static int
+buf_reserve(sql_buf *b, size_t n)
+{
+	size_t cap = b->cap != 0 ? b->cap : 256;
+	char  *buf;
+
+	if (b->len + n + 1 <= b->cap) {
+		return 0;
+	}
+	while (b->len + n + 1 > cap) {
+		cap *= 2;
+	}
+	if ((buf = realloc(b->buf, cap)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	b->buf = buf;
+	b->cap = cap;
+	return 0;
+}
+
+static int
+buf_append(sql_buf *b, const char *str, size_t n)
+{
+	int rv;
+
+	if ((rv = buf_reserve(b, n)) != 0) {
+		return rv;
+	}
+	memcpy(b->buf + b->len, str, n);
+	b->len += n;
+	b->buf[b->len] = '\0';
+	return 0;
+}
+
+static int
+buf_str(sql_buf *b, const char *str)
+{
+	return buf_append(b, str, strlen(str));
+}
+
+static bool
+str_same(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+static char *
+str_dup(const char *s)
+{
+	return s != NULL ? nng_strdup(s) : NULL;
+}
+
+static void
+batch_free(mysql_batch *b)
+{
+	for (size_t i = 0; i < cvector_size(b->names); i++) {
+		nng_strfree(b->names[i]);
+	}
+	cvector_free(b->names);
+	cvector_free(b->types);
+	nng_strfree(b->table);
+	free(b->sql.buf);
+	nng_free(b, sizeof(*b));
+}
+
+static void
+conn_close(mysql_conn *c)
+{
+	if (c->conn != NULL) {
+		mysql_close(c->conn);
+		c->conn = NULL;
+	}
+}
+
+static int
+conn_open(rule_mysql_writer *w, mysql_conn *c)
+{
+	unsigned int timeout = RULE_MYSQL_CONNECT_TIMEOUT;
+	nng_time     now     = nng_clock();
+
+	if (c->conn != NULL) {
+		return 0;
+	}
+	if (now < c->retry) {
+		return NNG_ECONNREFUSED;
+	}
+	if ((c->conn = mysql_init(NULL)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	mysql_options(c->conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+	if (mysql_real_connect(c->conn, c->host, c->username, c->password,
+	        w->db, 0, NULL, 0) == NULL) {
+		log_warn("rule mysql %s: %s", c->host != NULL ? c->host : "",
+		    mysql_error(c->conn));
+		conn_close(c);
+		c->retry = now + RULE_MYSQL_RETRY;
+		return NNG_ECONNREFUSED;
+	}
+	// a batch is only there once batch_send() commits it
+	if (mysql_autocommit(c->conn, 0) != 0) {
+		log_warn("rule mysql: %s", mysql_error(c->conn));
+		conn_close(c);
+		return NNG_ECONNREFUSED;
+	}
+	return 0;
+}
+
+static mysql_conn *
+conn_get(rule_mysql_writer *w, rule_mysql *mysql)
+{
+	mysql_conn *c;
+
+	for (size_t i = 0; i < cvector_size(w->conns); i++) {
+		c = w->conns[i];
+		if (str_same(c->host, mysql->host) &&
+		    str_same(c->username, mysql->username) &&
+		    str_same(c->password, mysql->password)) {
+			return c;
+		}
+	}
+	if ((c = nng_zalloc(sizeof(*c))) == NULL) {
+		return NULL;
+	}
+	// the rule_mysql may be freed once its records are written
+	c->host     = str_dup(mysql->host);
+	c->username = str_dup(mysql->username);
+	c->password = str_dup(mysql->password);
+	cvector_push_back(w->conns, c);
+	return c;
+}
+
+// INSERT INTO table (a, b) VALUES
+static int
+prefix_build(rule_mysql_writer *w, const char *table)
+{
+	sql_buf *b = &w->prefix;
+	int      rv;
+
+	b->len = 0;
+	if ((rv = buf_str(b, "INSERT INTO ")) != 0 ||
+	    (rv = buf_str(b, table)) != 0 || (rv = buf_str(b, " (")) != 0) {
+		return rv;
+	}
+	for (size_t i = 0; i < cvector_size(w->cols); i++) {
+		if ((rv = buf_str(b, i == 0 ? "" : ", ")) != 0 ||
+		    (rv = buf_str(b, w->cols[i].name)) != 0) {
+			return rv;
+		}
+	}
+	return buf_str(b, ") VALUES ");
+}
+
+static mysql_batch *
+batch_get(rule_mysql_writer *w, mysql_conn *c, const char *table)
+{
+	mysql_batch *b;
+
+	for (size_t i = 0; i < cvector_size(c->batches); i++) {
+		b = c->batches[i];
+		if (b->prefix_len == w->prefix.len &&
+		    memcmp(b->sql.buf, w->prefix.buf, b->prefix_len) == 0) {
+			return b;
+		}
+	}
+	if ((b = nng_zalloc(sizeof(*b))) == NULL) {
+		return NULL;
+	}
+	if (buf_append(&b->sql, w->prefix.buf, w->prefix.len) != 0 ||
+	    (b->table = nng_strdup(table)) == NULL) {
+		batch_free(b);
+		return NULL;
+	}
+	b->prefix_len = w->prefix.len;
+	for (size_t i = 0; i < cvector_size(w->cols); i++) {
+		cvector_push_back(b->names, nng_strdup(w->cols[i].name));
+		cvector_push_back(b->types, (uint8_t) w->cols[i].type);
+	}
+	cvector_push_back(c->batches, b);
+	return b;
+}
+
+// (1, 'text', NULL) with the strings escaped for the connection
+static int
+batch_row(mysql_batch *b, MYSQL *conn, rule_col *cols)
+{
+	char num[32];
+	int  rv;
+
+	if ((rv = buf_str(&b->sql, b->rows == 0 ? "(" : ", (")) != 0) {
+		return rv;
+	}
+	for (size_t i = 0; i < cvector_size(cols); i++) {
+		if (i > 0 && (rv = buf_str(&b->sql, ", ")) != 0) {
+			return rv;
+		}
+		switch (cols[i].type) {
+		case RULE_COL_INT:
+			snprintf(num, sizeof(num), "%lld", (long long) cols[i].num);
+			rv = buf_str(&b->sql, num);
+			break;
+		case RULE_COL_TEXT:
+			if ((rv = buf_reserve(&b->sql, 2 * cols[i].len + 2)) !=
+			    0) {
+				return rv;
+			}
+			b->sql.buf[b->sql.len++] = '\'';
+			b->sql.len += mysql_real_escape_string(conn,
+			    b->sql.buf + b->sql.len, cols[i].str, cols[i].len);
+			b->sql.buf[b->sql.len++] = '\'';
+			b->sql.buf[b->sql.len]   = '\0';
+			break;
+		default:
+			rv = buf_str(&b->sql, "NULL");
+			break;
+		}
+		if (rv != 0) {
+			return rv;
+		}
+	}
+	if ((rv = buf_str(&b->sql, ")")) != 0) {
+		return rv;
+	}
+	b->rows++;
+	return 0;
+}
+
+// The table or a column of the batch is not there yet, payload fields only
+// show their type with the first publish. Columns already there fail to
+// be added, which is expected.
+static void
+schema_add(mysql_conn *c, mysql_batch *b)
+{
+	sql_buf sql = { 0 };
+
+	if (buf_str(&sql, "CREATE TABLE IF NOT EXISTS ") == 0 &&
+	    buf_str(&sql, b->table) == 0 &&
+	    buf_str(&sql, "(idx INT PRIMARY KEY AUTO_INCREMENT)") == 0 &&
+	    mysql_real_query(c->conn, sql.buf, sql.len) != 0) {
+		log_warn("rule mysql: %s", mysql_error(c->conn));
+	}
+	for (size_t i = 0; i < cvector_size(b->names); i++) {
+		sql.len = 0;
+		if (buf_str(&sql, "ALTER TABLE ") != 0 ||
+		    buf_str(&sql, b->table) != 0 ||
+		    buf_str(&sql, " ADD ") != 0 ||
+		    buf_str(&sql, b->names[i]) != 0 ||
+		    buf_str(&sql,
+		        b->types[i] == RULE_COL_INT ? " INT" : " TEXT") != 0) {
+			break;
+		}
+		if (mysql_real_query(c->conn, sql.buf, sql.len) == 0) {
+			log_info("rule mysql: %s", sql.buf);
+		}
+	}
+	free(sql.buf);
+}
+
+static bool
+conn_lost(unsigned int err)
+{
+#if defined(ER_CONNECTION_KILLED)
+	// MariaDB answers the first query after a KILL with this
+	if (err == ER_CONNECTION_KILLED) {
+		return true;
+	}
+#endif
+	return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+}
+
+// send the INSERT of the batch and commit it, reconnecting or adding what
+// the table lacks once. The server rolls back a transaction whose
+// connection is lost, so only a batch known not to be there is sent again:
+// one whose commit was lost on the way may or may not be, and is counted
+// as failed rather than risking its rows twice.
+static void
+batch_send(rule_mysql_writer *w, mysql_conn *c, mysql_batch *b)
+{
+	unsigned int err = 0;
+
+	if (b->rows == 0) {
+		return;
+	}
+	for (int tries = 0; tries < 2; tries++) {
+		if (conn_open(w, c) != 0) {
+			err = CR_SERVER_GONE_ERROR;
+			break;
+		}
+		if (mysql_real_query(c->conn, b->sql.buf, b->sql.len) == 0) {
+			if (mysql_commit(c->conn) == 0) {
+				err = 0;
+				break;
+			}
+			err = mysql_errno(c->conn);
+			log_error("rule mysql: commit: %s", mysql_error(c->conn));
+			if (conn_lost(err)) {
+				conn_close(c);
+				break;
+			}
+			mysql_rollback(c->conn);
+			continue;
+		}
+		err = mysql_errno(c->conn);
+		log_error("rule mysql: %s", mysql_error(c->conn));
+		if (conn_lost(err)) {
+			conn_close(c);
+		} else if (err == ER_NO_SUCH_TABLE || err == ER_BAD_FIELD_ERROR) {
+			schema_add(c, b);
+		} else {
+			mysql_rollback(c->conn);
+			break;
+		}
+	}
+	if (err != 0) {
+		w->failed += b->rows;
+	}
+	b->sql.len             = b->prefix_len;
+	b->sql.buf[b->sql.len] = '\0';
+	b->rows                = 0;
+}
+
+int
+rule_mysql_writer_alloc(rule_mysql_writer **wp, const char *db)
+{
+	rule_mysql_writer *w;
+
+	if ((w = nng_zalloc(sizeof(*w))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if ((w->db = nng_strdup(db)) == NULL) {
+		nng_free(w, sizeof(*w));
+		return NNG_ENOMEM;
+	}
+	mysql_thread_init();
+	*wp = w;
+	return 0;
+}
+
+void
+rule_mysql_writer_free(rule_mysql_writer *w)
+{
+	rule_mysql_writer_flush(w);
+	for (size_t i = 0; i < cvector_size(w->conns); i++) {
+		mysql_conn *c = w->conns[i];
+
+		for (size_t j = 0; j < cvector_size(c->batches); j++) {
+			batch_free(c->batches[j]);
+		}
+		cvector_free(c->batches);
+		conn_close(c);
+		nng_strfree(c->host);
+		nng_strfree(c->username);
+		nng_strfree(c->password);
+		nng_free(c, sizeof(*c));
+	}
+	cvector_free(w->conns);
+	cvector_free(w->cols);
+	free(w->prefix.buf);
+	nng_strfree(w->db);
+	nng_free(w, sizeof(*w));
+	mysql_thread_end();
+}
+
+/**
+ * @brief add a row record to the pending INSERT of its table on the
+ *        connection to the rule's server.
+ */
+int
+rule_mysql_writer_insert(
+    rule_mysql_writer *w, rule_mysql *mysql, nng_msg *row)
+{
+	const char  *table;
+	mysql_conn  *c;
+	mysql_batch *b;
+	size_t       len;
+	int          rv;
+
+	if ((rv = rule_row_parse(row, &table, &w->cols)) != 0) {
+		log_error("rule mysql: bad row %d", rv);
+		return rv;
+	}
+	if ((c = conn_get(w, mysql)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	// the strings are escaped for the connection they go to
+	if ((rv = conn_open(w, c)) != 0) {
+		return rv;
+	}
+	if ((rv = prefix_build(w, table)) != 0 ||
+	    (b = batch_get(w, c, table)) == NULL) {
+		return rv != 0 ? rv : NNG_ENOMEM;
+	}
+	len = b->sql.len;
+	if ((rv = batch_row(b, c->conn, w->cols)) != 0) {
+		// drop the partial row
+		b->sql.len          = len;
+		b->sql.buf[b->sql.len] = '\0';
+		return rv;
+	}
+	if (b->sql.len >= RULE_MYSQL_STMT_MAX) {
+		batch_send(w, c, b);
+	}
+	return 0;
+}
+
+size_t
+rule_mysql_writer_flush(rule_mysql_writer *w)
+{
+	size_t failed;
+
+	for (size_t i = 0; i < cvector_size(w->conns); i++) {
+		mysql_conn *c = w->conns[i];
+
+		for (size_t j = 0; j < cvector_size(c->batches); j++) {
+			batch_send(w, c, c->batches[j]);
+		}
+	}
+	failed    = w->failed;
+	w->failed = 0;
+	return failed;
+}
+
+#endif
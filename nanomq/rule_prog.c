@@ -0,0 +1,639 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/rule_prog.h"
+#include "include/topic_trie.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(SUPP_RULE_ENGINE)
+
+// longest program: repub loop, 8 filters, payload check, payload fields
+#define RULE_PROG_MAX 12
+
+struct rule_set {
+	rule_prog  *progs; // by rule index
+	// the compiled rules as they were, so a worker holding the set never
+	// reads conf_rule.rules, which REST calls change under it. The strings,
+	// payload descriptors and sink targets they point to stay the rule's.
+	rule       *rules;
+	size_t      cap;
+	size_t      count; // compiled so far
+	topic_trie *topics; // rule topics tagged with the rule index
+	uint32_t    refs;   // works between rule_set_get() and rule_set_put()
+	rule_set   *retired;
+};
+
+static struct {
+	nng_mtx  *mtx;
+	nng_cv   *cv; // a retired set dropped its last reference
+	rule_set *set;
+	rule_set *retired; // replaced sets, freed by rule_set_quiesce()
+} rule_state = { .mtx = NULL };
+
+static bool
+cmp_int(int64_t value_checked, int64_t value_seted, uint8_t type)
+{
+	switch (type) {
+	case RULE_CMP_EQUAL:
+		return value_checked == value_seted;
+	case RULE_CMP_UNEQUAL:
+		return value_checked != value_seted;
+	case RULE_CMP_GREATER:
+		return value_checked > value_seted;
+	case RULE_CMP_LESS:
+		return value_checked < value_seted;
+	case RULE_CMP_GREATER_AND_EQUAL:
+		return value_checked >= value_seted;
+	case RULE_CMP_LESS_AND_EQUAL:
+		return value_checked <= value_seted;
+	default:
+		return true;
+	}
+}
+
+// strings only support equal and unequal, anything else passes
+static bool
+cmp_str(const char *value_checked, size_t len, const char *value_seted,
+    size_t seted_len, uint8_t type)
+{
+	bool equal;
+
+	if (value_checked == NULL) {
+		return false;
+	}
+	equal = len == seted_len && memcmp(value_checked, value_seted, len) == 0;
+	switch (type) {
+	case RULE_CMP_EQUAL:
+		return equal;
+	case RULE_CMP_UNEQUAL:
+		return !equal;
+	default:
+		return true;
+	}
+}
+
+static int
+emit(rule_prog *p, uint8_t op, uint8_t field, uint8_t cmp, const char *lit)
+{
+	rule_insn *insn = &p->code[p->len++];
+
+	insn->op    = op;
+	insn->field = field;
+	insn->cmp   = cmp;
+	if (lit == NULL) {
+		return 0;
+	}
+	insn->num = strtoll(lit, NULL, 10);
+	insn->len = strlen(lit);
+	if ((insn->str = nng_strdup(lit)) == NULL) {
+		return NNG_ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * @brief compile the filters of r, found at index in conf_rule.rules.
+ *        The topic is not part of the program, see rule_set_compile().
+ */
+int
+rule_prog_compile(rule_prog *p, rule *r, uint32_t index)
+{
+	size_t fields = cvector_size(r->payload);
+	bool   empty  = true;
+	int    rv     = 0;
+
+	memset(p, 0, sizeof(*p));
+	p->index = index;
+	if ((p->code = nng_zalloc(RULE_PROG_MAX * sizeof(rule_insn))) ==
+	    NULL) {
+		return NNG_ENOMEM;
+	}
+	if (fields > 0 &&
+	    (p->lits = nng_zalloc(fields * sizeof(rule_payload_lit))) ==
+	        NULL) {
+		rv = NNG_ENOMEM;
+		goto fail;
+	}
+	p->lit_count = fields;
+	for (size_t i = 0; i < fields; i++) {
+		const char       *filter = r->payload[i]->filter;
+		rule_payload_lit *lit    = &p->lits[i];
+
+		if (filter == NULL) {
+			continue;
+		}
+		lit->num = strtoll(filter, NULL, 10);
+		lit->len = strlen(filter);
+		lit->obj = cJSON_Parse(filter);
+		if ((lit->str = nng_strdup(filter)) == NULL) {
+			rv = NNG_ENOMEM;
+			goto fail;
+		}
+	}
+
+	if (r->forword_type == RULE_FORWORD_REPUB && r->repub != NULL &&
+	    r->repub->clientid != NULL &&
+	    (rv = emit(p, RULE_OP_REPUB_LOOP, RULE_CLIENTID, RULE_CMP_EQUAL,
+	         r->repub->clientid)) != 0) {
+		goto fail;
+	}
+
+	if (r->filter == NULL) {
+		if (fields > 0) {
+			rv = emit(p, RULE_OP_STORE, RULE_PAYLOAD_FIELD, 0, NULL);
+		}
+		goto done;
+	}
+	for (uint8_t j = 0; j < RULE_PAYLOAD_FIELD; j++) {
+		const char *val = r->filter[j];
+		uint8_t     cmp = r->cmp_type[j];
+
+		if (val == NULL) {
+			continue;
+		}
+		switch (j) {
+		case RULE_QOS:
+		case RULE_ID:
+		case RULE_TIMESTAMP:
+			rv = emit(p, RULE_OP_INT, j, cmp, val);
+			break;
+		case RULE_PAYLOAD_ALL:
+			if (empty) {
+				emit(p, RULE_OP_PAYLOAD, j, 0, NULL);
+				empty = false;
+			}
+			rv = emit(p, RULE_OP_STR, j, cmp, val);
+			break;
+		default:
+			rv = emit(p, RULE_OP_STR, j, cmp, val);
+			break;
+		}
+		if (rv != 0) {
+			goto fail;
+		}
+	}
+	// a WHERE clause always needs a payload, whatever it tests
+	if (empty) {
+		emit(p, RULE_OP_PAYLOAD, RULE_PAYLOAD_ALL, 0, NULL);
+	}
+	if (fields > 0) {
+		rv = emit(p, RULE_OP_FIELDS, RULE_PAYLOAD_FIELD, 0, NULL);
+	}
+
+done:
+	if (rv == 0) {
+		return 0;
+	}
+fail:
+	rule_prog_fini(p);
+	return rv;
+}
+
+void
+rule_prog_fini(rule_prog *p)
+{
+	if (p->code != NULL) {
+		for (size_t i = 0; i < p->len; i++) {
+			nng_strfree(p->code[i].str);
+		}
+		nng_free(p->code, RULE_PROG_MAX * sizeof(rule_insn));
+	}
+	if (p->lits != NULL) {
+		for (size_t i = 0; i < p->lit_count; i++) {
+			nng_strfree(p->lits[i].str);
+			if (p->lits[i].obj != NULL) {
+				cJSON_Delete(p->lits[i].obj);
+			}
+		}
+		nng_free(p->lits, p->lit_count * sizeof(rule_payload_lit));
+	}
+	memset(p, 0, sizeof(*p));
+}
+
+// Check the payload fields and keep their values in r->payload for the
+// sinks. With store set nothing is compared, the values are just kept.
+static bool
+run_fields(const rule_prog *p, rule *r, const rule_input *in, bool store)
+{
+	cJSON *root = in->payload_json(in->arg);
+
+	for (size_t pi = 0; pi < p->lit_count; pi++) {
+		rule_payload           *payload = r->payload[pi];
+		const rule_payload_lit *lit     = &p->lits[pi];
+		cJSON                  *jp      = root;
+		bool                    test    = !store && lit->str != NULL;
+
+		for (size_t k = 0; k < cvector_size(payload->psa); k++) {
+			if (jp == NULL) {
+				break;
+			}
+			jp = cJSON_GetObjectItem(jp, payload->psa[k]);
+		}
+		if (jp == NULL) {
+			return false;
+		}
+
+		switch (jp->type) {
+		case cJSON_Number:;
+			long num = cJSON_GetNumberValue(jp);
+			if (test && !cmp_int(num, lit->num, payload->cmp_type)) {
+				return false;
+			}
+			payload->value = (void *) num;
+			payload->type  = cJSON_Number;
+			break;
+		case cJSON_String:;
+			char *str = cJSON_GetStringValue(jp);
+			if (test &&
+			    !cmp_str(str, strlen(str), lit->str, lit->len,
+			        payload->cmp_type)) {
+				return false;
+			}
+			if (payload->value)
+				free(payload->value);
+			payload->value = nng_strdup(str);
+			payload->type  = cJSON_String;
+			break;
+		case cJSON_Object:
+			if (test && !payload->is_store && lit->obj != NULL &&
+			    !cJSON_Compare(jp, lit->obj, true)) {
+				return false;
+			}
+			payload->value = cJSON_Duplicate(jp, 1);
+			payload->type  = cJSON_Object;
+			break;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+static const char *
+input_str(const rule_input *in, uint8_t field, size_t *len)
+{
+	const char *s;
+
+	switch (field) {
+	case RULE_TOPIC:
+		s = in->topic;
+		break;
+	case RULE_CLIENTID:
+		s = in->clientid;
+		break;
+	case RULE_USERNAME:
+		s = in->username;
+		break;
+	case RULE_PASSWORD:
+		s = in->password;
+		break;
+	case RULE_PAYLOAD_ALL:
+		*len = in->payload_len;
+		return (const char *) in->payload;
+	default:
+		return NULL;
+	}
+	*len = s != NULL ? strlen(s) : 0;
+	return s;
+}
+
+static int64_t
+input_int(const rule_input *in, uint8_t field)
+{
+	switch (field) {
+	case RULE_QOS:
+		return in->qos;
+	case RULE_ID:
+		return in->packet_id;
+	case RULE_TIMESTAMP:
+		return in->now;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief run the program of r against a publish whose topic already
+ *        matched r->topic.
+ * @return true if the publish passes every filter of the rule
+ */
+bool
+rule_prog_run(const rule_prog *p, rule *r, const rule_input *in)
+{
+	const char *s;
+	size_t      len;
+
+	for (size_t i = 0; i < p->len; i++) {
+		const rule_insn *insn = &p->code[i];
+
+		switch (insn->op) {
+		case RULE_OP_REPUB_LOOP:
+			s = input_str(in, insn->field, &len);
+			if (cmp_str(s, len, insn->str, insn->len, insn->cmp)) {
+				return false;
+			}
+			break;
+		case RULE_OP_INT:
+			if (!cmp_int(input_int(in, insn->field), insn->num,
+			        insn->cmp)) {
+				return false;
+			}
+			break;
+		case RULE_OP_STR:
+			s = input_str(in, insn->field, &len);
+			if (!cmp_str(s, len, insn->str, insn->len, insn->cmp)) {
+				return false;
+			}
+			break;
+		case RULE_OP_PAYLOAD:
+			if (in->payload == NULL || in->payload_len == 0) {
+				return false;
+			}
+			break;
+		case RULE_OP_FIELDS:
+			if (!run_fields(p, r, in, false)) {
+				return false;
+			}
+			break;
+		case RULE_OP_STORE:
+			run_fields(p, r, in, true);
+			break;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief compile every rule of the cvector rules
+ */
+int
+rule_set_compile(rule_set **sp, rule *rules)
+{
+	rule_set *s;
+	size_t    n = cvector_size(rules);
+	int       rv;
+
+	if ((s = nng_zalloc(sizeof(*s))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if ((rv = topic_trie_create(&s->topics)) != 0) {
+		goto fail;
+	}
+	if (n > 0 &&
+	    ((s->progs = nng_zalloc(n * sizeof(rule_prog))) == NULL ||
+	        (s->rules = nng_alloc(n * sizeof(rule))) == NULL)) {
+		rv = NNG_ENOMEM;
+		goto fail;
+	}
+	s->cap = n;
+	for (uint32_t i = 0; i < n; i++) {
+		s->rules[i] = rules[i];
+		if ((rv = rule_prog_compile(&s->progs[i], &s->rules[i], i)) !=
+		    0) {
+			goto fail;
+		}
+		s->count++;
+		if (rules[i].topic != NULL &&
+		    (rv = topic_trie_insert(s->topics, rules[i].topic, i)) !=
+		        0) {
+			goto fail;
+		}
+	}
+	*sp = s;
+	return 0;
+
+fail:
+	rule_set_free(s);
+	return rv;
+}
+
+void
+rule_set_free(rule_set *s)
+{
+	for (size_t i = 0; i < s->count; i++) {
+		rule_prog_fini(&s->progs[i]);
+	}
+	if (s->progs != NULL) {
+		nng_free(s->progs, s->cap * sizeof(rule_prog));
+	}
+	if (s->rules != NULL) {
+		nng_free(s->rules, s->cap * sizeof(rule));
+	}
+	if (s->topics != NULL) {
+		topic_trie_destroy(s->topics);
+	}
+	nng_free(s, sizeof(*s));
+}
+
+static void
+collect(uint32_t id, void *arg)
+{
+	uint32_t **ids = arg;
+
+	cvector_push_back(*ids, id);
+}
+
+/**
+ * @brief the indexes of the rules whose topic matches, in rule order.
+ * @param ids cvector reused across calls, emptied first
+ */
+void
+rule_set_match(rule_set *s, const char *topic, uint32_t **ids)
+{
+	uint32_t *v;
+	size_t    n, k = 0;
+
+	if (*ids != NULL) {
+		cvector_set_size(*ids, 0);
+	}
+	topic_trie_match(s->topics, topic, collect, ids);
+	v = *ids;
+	n = cvector_size(v);
+	// few candidates, insertion sort and drop duplicates
+	for (size_t i = 1; i < n; i++) {
+		uint32_t id = v[i];
+		size_t   j  = i;
+
+		while (j > 0 && v[j - 1] > id) {
+			v[j] = v[j - 1];
+			j--;
+		}
+		v[j] = id;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (k == 0 || v[k - 1] != v[i]) {
+			v[k++] = v[i];
+		}
+	}
+	if (v != NULL) {
+		cvector_set_size(v, k);
+	}
+}
+
+rule_prog *
+rule_set_prog(rule_set *s, uint32_t id)
+{
+	return id < s->count ? &s->progs[id] : NULL;
+}
+
+// the rule compiled into the program of id, as it was then
+rule *
+rule_set_rule(rule_set *s, uint32_t id)
+{
+	return id < s->count ? &s->rules[id] : NULL;
+}
+
+size_t
+rule_set_size(rule_set *s)
+{
+	return s->count;
+}
+
+/**
+ * @brief compile cr->rules and make it the set rule_set_get() returns.
+ *        Called from broker() and after each change of the rules.
+ */
+int
+rule_set_load(conf_rule *cr)
+{
+	rule_set *s;
+	int       rv;
+
+	if (rule_state.mtx == NULL) {
+		// first call comes from broker() before any work runs
+		if ((rv = nng_mtx_alloc(&rule_state.mtx)) != 0) {
+			return rv;
+		}
+		if ((rv = nng_cv_alloc(&rule_state.cv, rule_state.mtx)) != 0) {
+			nng_mtx_free(rule_state.mtx);
+			rule_state.mtx = NULL;
+			return rv;
+		}
+	}
+	if ((rv = rule_set_compile(&s, cr->rules)) != 0) {
+		// the current set may hold rules the caller is about to free,
+		// so no rule runs until the next load succeeds
+		log_error("rule compile failed: %d", rv);
+		s = NULL;
+	}
+	nng_mtx_lock(rule_state.mtx);
+	if (rule_state.set != NULL) {
+		rule_state.set->retired = rule_state.retired;
+		rule_state.retired      = rule_state.set;
+	}
+	rule_state.set = s;
+	nng_mtx_unlock(rule_state.mtx);
+
+	if (s != NULL) {
+		log_info("rules compiled: %zu", s->count);
+	}
+	return rv;
+}
+
+/**
+ * @brief the current set with a reference taken, NULL when there is none.
+ *        Release it with rule_set_put() once nothing reads it anymore.
+ */
+rule_set *
+rule_set_get(void)
+{
+	rule_set *s;
+
+	if (rule_state.mtx == NULL) {
+		return NULL;
+	}
+	nng_mtx_lock(rule_state.mtx);
+	if ((s = rule_state.set) != NULL) {
+		s->refs++;
+	}
+	nng_mtx_unlock(rule_state.mtx);
+	return s;
+}
+
+void
+rule_set_put(rule_set *s)
+{
+	nng_mtx_lock(rule_state.mtx);
+	if (--s->refs == 0 && s != rule_state.set) {
+		nng_cv_wake(rule_state.cv);
+	}
+	nng_mtx_unlock(rule_state.mtx);
+}
+
+/**
+ * @brief wait until no work holds a set replaced by rule_set_load() and
+ *        free them. Past this point nothing matches, runs or queues
+ *        records for a rule that is no longer in conf_rule.rules, what
+ *        is still queued is left to rule_sink_sync().
+ */
+void
+rule_set_quiesce(void)
+{
+	rule_set  *s, *done = NULL;
+	rule_set **pp;
+	bool       busy;
+
+	if (rule_state.mtx == NULL) {
+		return;
+	}
+	nng_mtx_lock(rule_state.mtx);
+	for (;;) {
+		busy = false;
+		pp   = &rule_state.retired;
+		while ((s = *pp) != NULL) {
+			if (s->refs == 0) {
+				*pp        = s->retired;
+				s->retired = done;
+				done       = s;
+			} else {
+				busy = true;
+				pp   = &s->retired;
+			}
+		}
+		if (!busy) {
+			break;
+		}
+		nng_cv_wait(rule_state.cv);
+	}
+	nng_mtx_unlock(rule_state.mtx);
+
+	for (; done != NULL; done = s) {
+		s = done->retired;
+		rule_set_free(done);
+	}
+}
+
+void
+rule_set_fini(void)
+{
+	rule_set *s, *next;
+
+	if (rule_state.mtx == NULL) {
+		return;
+	}
+	if (rule_state.set != NULL) {
+		rule_set_free(rule_state.set);
+	}
+	for (s = rule_state.retired; s != NULL; s = next) {
+		next = s->retired;
+		rule_set_free(s);
+	}
+	rule_state.set     = NULL;
+	rule_state.retired = NULL;
+	nng_cv_free(rule_state.cv);
+	nng_mtx_free(rule_state.mtx);
+	rule_state.mtx = NULL;
+}
+
+#endif
@@ -0,0 +1,690 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#if defined(SUPP_MYSQL)
+#include <mysql.h>
+#endif
+
+#include "include/conf_ext.h"
+#include "include/nanomq_rule.h"
+#include "include/rule_mysql.h"
+#include "include/rule_sink.h"
+#include "include/rule_sqlite.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(FDB_SUPPORT)
+#include "include/db_cli.h"
+#endif
+
+#if defined(SUPP_RULE_ENGINE)
+
+// sink_write() took the record into the open batch, sink_commit() ends it
+#define SINK_PENDING (-1)
+
+typedef struct rule_sink rule_sink;
+
+// one writer thread of a sink, the fields are its own
+typedef struct {
+	rule_sink  *sink;
+	nng_thread *thread;
+	// enqueue times of the records in the open batch
+	nng_time *batch;
+	nng_time  deadline; // when the open batch is committed
+	void     *ctx;      // rule_sqlite or rule_mysql_writer
+} sink_writer;
+
+struct rule_sink {
+	rule_sink_type type;
+	bool           started;
+	bool           closing;
+	int            busy; // writers holding records
+	nng_mtx       *mtx;
+	nng_cv        *cv;   // a record arrived, or closing
+	nng_cv        *room; // a record was taken, or a writer went idle
+	nng_lmq       *lmq;
+	sink_writer   *writers;
+	size_t         nwriters;
+	uint64_t       bytes;
+	// under mtx, queued and bytes are filled in by rule_sink_get_stats()
+	rule_sink_stats stats;
+};
+
+static struct {
+	conf_rule *cr;
+	rule_sink  sinks[RULE_SINK_COUNT];
+} sink_state;
+
+static const char *sink_names[RULE_SINK_COUNT] = {
+	[RULE_SINK_SQLITE] = "sqlite",
+	[RULE_SINK_MYSQL]  = "mysql",
+	[RULE_SINK_FDB]    = "fdb",
+	[RULE_SINK_REPUB]  = "repub",
+};
+
+static void
+hist_add(uint64_t *hist, uint64_t val)
+{
+	size_t i = 0;
+
+	while (i < RULE_SINK_HIST_BUCKETS - 1 && val >= (1ull << i)) {
+		i++;
+	}
+	hist[i]++;
+}
+
+// the header carries the enqueue time and the target of the record
+static void
+record_header(nng_msg *msg, nng_time *enqueued, void **target)
+{
+	uint64_t ts = 0, ptr = 0;
+
+	if (nng_msg_header_len(msg) == 2 * sizeof(uint64_t)) {
+		nng_msg_header_trim_u64(msg, &ts);
+		nng_msg_header_trim_u64(msg, &ptr);
+	}
+	*enqueued = ts;
+	*target   = (void *) (uintptr_t) ptr;
+}
+
+/**
+ * @brief start a row record for table, columns follow with
+ *        rule_row_int() and rule_row_text().
+ */
+int
+rule_row_init(nng_msg *msg, const char *table)
+{
+	nng_msg_clear(msg);
+	return nng_msg_append(msg, table, strlen(table) + 1);
+}
+
+// a column is its type, its NUL terminated name and its value
+static int
+row_col(nng_msg *msg, const char *name, char type)
+{
+	int rv;
+
+	if ((rv = nng_msg_append(msg, &type, 1)) != 0) {
+		return rv;
+	}
+	return nng_msg_append(msg, name, strlen(name) + 1);
+}
+
+int
+rule_row_int(nng_msg *msg, const char *name, int64_t num)
+{
+	int rv;
+
+	if ((rv = row_col(msg, name, RULE_COL_INT)) != 0) {
+		return rv;
+	}
+	return nng_msg_append_u64(msg, (uint64_t) num);
+}
+
+int
+rule_row_text(nng_msg *msg, const char *name, const char *str, size_t len)
+{
+	int rv;
+
+	if (str == NULL) {
+		return row_col(msg, name, RULE_COL_NULL);
+	}
+	if (len > UINT32_MAX) {
+		return NNG_EMSGSIZE;
+	}
+	if ((rv = row_col(msg, name, RULE_COL_TEXT)) != 0 ||
+	    (rv = nng_msg_append_u32(msg, (uint32_t) len)) != 0) {
+		return rv;
+	}
+	return nng_msg_append(msg, str, len);
+}
+
+// the integers are in network byte order, as nng_msg_append_u64 writes
+static uint64_t
+row_get(const uint8_t *p, size_t n)
+{
+	uint64_t v = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+int
+rule_row_parse(nng_msg *msg, const char **table, rule_col **cols)
+{
+	const uint8_t *p   = nng_msg_body(msg);
+	const uint8_t *end = p + nng_msg_len(msg);
+	const uint8_t *nul;
+	rule_col       col;
+
+	cvector_set_size(*cols, 0);
+	if ((nul = memchr(p, '\0', end - p)) == NULL) {
+		return NNG_EINVAL;
+	}
+	*table = (const char *) p;
+	p      = nul + 1;
+	while (p < end) {
+		memset(&col, 0, sizeof(col));
+		col.type = *p++;
+		if ((nul = memchr(p, '\0', end - p)) == NULL) {
+			return NNG_EINVAL;
+		}
+		col.name = (const char *) p;
+		p        = nul + 1;
+		switch (col.type) {
+		case RULE_COL_NULL:
+			break;
+		case RULE_COL_INT:
+			if (end - p < 8) {
+				return NNG_EINVAL;
+			}
+			col.num = (int64_t) row_get(p, 8);
+			p += 8;
+			break;
+		case RULE_COL_TEXT:
+			if (end - p < 4) {
+				return NNG_EINVAL;
+			}
+			col.len = (size_t) row_get(p, 4);
+			p += 4;
+			if ((size_t) (end - p) < col.len) {
+				return NNG_EINVAL;
+			}
+			col.str = (const char *) p;
+			p += col.len;
+			break;
+		default:
+			return NNG_EINVAL;
+		}
+		cvector_push_back(*cols, col);
+	}
+	return 0;
+}
+
+#if defined(NNG_SUPP_SQLITE)
+// into the transaction of the writer, rule_sqlite_commit() ends it
+static int
+write_sqlite(sink_writer *w, nng_msg *msg)
+{
+	void *db = sink_state.cr->rdb[0];
+	int   rv;
+
+	// opened by nanomq_client_sqlite(), maybe only by a later REST call
+	if (db == NULL) {
+		return NNG_ECLOSED;
+	}
+	if (w->ctx == NULL &&
+	    (rv = rule_sqlite_alloc((rule_sqlite **) &w->ctx, db)) != 0) {
+		return rv;
+	}
+	if ((rv = rule_sqlite_insert(w->ctx, msg)) != 0) {
+		return rv;
+	}
+	return SINK_PENDING;
+}
+#endif
+
+#if defined(SUPP_MYSQL)
+// into the pending INSERT of the table, rule_mysql_writer_flush() sends it
+static int
+write_mysql(sink_writer *w, rule_mysql *mysql, nng_msg *msg)
+{
+	const char *db = sink_state.cr->mysql_db != NULL
+	    ? sink_state.cr->mysql_db
+	    : "mysql_rule_db";
+	int rv;
+
+	if (w->ctx == NULL &&
+	    (rv = rule_mysql_writer_alloc(
+	         (rule_mysql_writer **) &w->ctx, db)) != 0) {
+		return rv;
+	}
+	if ((rv = rule_mysql_writer_insert(w->ctx, mysql, msg)) != 0) {
+		return rv;
+	}
+	return SINK_PENDING;
+}
+#endif
+
+#if defined(FDB_SUPPORT)
+// the body is the key and the value, both NUL terminated
+static int
+write_fdb(nng_msg *msg)
+{
+	const char     *key = nng_msg_body(msg);
+	const char     *val = key + strlen(key) + 1;
+	FDBTransaction *tr  = NULL;
+	FDBFuture      *f;
+	fdb_error_t     e;
+
+	if ((e = fdb_database_create_transaction(
+	         sink_state.cr->rdb[1], &tr)) != 0) {
+		log_error("rule fdb: %s", fdb_get_error(e));
+		return NNG_EINTERNAL;
+	}
+	fdb_transaction_set(tr, (const uint8_t *) key, strlen(key),
+	    (const uint8_t *) val, strlen(val));
+	f = fdb_transaction_commit(tr);
+	if ((e = fdb_future_block_until_ready(f)) == 0) {
+		e = fdb_future_get_error(f);
+	}
+	fdb_future_destroy(f);
+	fdb_transaction_destroy(tr);
+	if (e != 0) {
+		log_error("rule fdb: %s", fdb_get_error(e));
+		return NNG_EINTERNAL;
+	}
+	return 0;
+}
+#endif
+
+static int
+sink_write(sink_writer *w, void *target, nng_msg *msg)
+{
+	switch (w->sink->type) {
+#if defined(NNG_SUPP_SQLITE)
+	case RULE_SINK_SQLITE:
+		return write_sqlite(w, msg);
+#endif
+#if defined(SUPP_MYSQL)
+	case RULE_SINK_MYSQL:
+		return write_mysql(w, target, msg);
+#endif
+#if defined(FDB_SUPPORT)
+	case RULE_SINK_FDB:
+		return write_fdb(msg);
+#endif
+	case RULE_SINK_REPUB:;
+		repub_t *repub = target;
+		return nano_client_publish(repub->sock, repub->topic,
+		    nng_msg_body(msg), nng_msg_len(msg), 0, NULL);
+	default:
+		return NNG_ENOTSUP;
+	}
+}
+
+// ends the open batch of n records, returns how many of them failed
+static size_t
+sink_commit(sink_writer *w, size_t n)
+{
+	switch (w->sink->type) {
+#if defined(NNG_SUPP_SQLITE)
+	case RULE_SINK_SQLITE:
+		return rule_sqlite_commit(w->ctx) == 0 ? 0 : n;
+#endif
+#if defined(SUPP_MYSQL)
+	case RULE_SINK_MYSQL:
+		return rule_mysql_writer_flush(w->ctx);
+#endif
+	default:
+		return n;
+	}
+}
+
+// on the writer thread, as it exits
+static void
+sink_writer_fini(sink_writer *w)
+{
+	if (w->ctx == NULL) {
+		return;
+	}
+	switch (w->sink->type) {
+#if defined(NNG_SUPP_SQLITE)
+	case RULE_SINK_SQLITE:
+		rule_sqlite_free(w->ctx);
+		break;
+#endif
+#if defined(SUPP_MYSQL)
+	case RULE_SINK_MYSQL:
+		rule_mysql_writer_free(w->ctx);
+		break;
+#endif
+	default:
+		break;
+	}
+	w->ctx = NULL;
+}
+
+// rows per batch and how long a batch stays open, for the sinks that
+// batch their records
+static void
+sink_batch_conf(rule_sink_type type, uint32_t *size, uint32_t *delay)
+{
+	conf_rules_ext *c = &conf_ext_get()->rules;
+
+	switch (type) {
+	case RULE_SINK_MYSQL:
+		*size  = c->sink.mysql.batch_size;
+		*delay = c->sink.mysql.max_delay;
+		break;
+	default:
+		*size  = c->sqlite.batch_size;
+		*delay = c->sqlite.max_delay;
+		break;
+	}
+}
+
+// with mtx held
+static void
+sink_done(rule_sink *s, int rv, nng_time enqueued)
+{
+	if (rv == 0) {
+		s->stats.written++;
+	} else {
+		s->stats.failed++;
+	}
+	hist_add(s->stats.latency, nng_clock() - enqueued);
+}
+
+// with mtx held, commits the open batch and counts its records
+static void
+sink_flush(sink_writer *w)
+{
+	rule_sink *s = w->sink;
+	size_t     n = cvector_size(w->batch);
+	size_t     failed;
+
+	if (n == 0) {
+		return;
+	}
+	nng_mtx_unlock(s->mtx);
+	failed = sink_commit(w, n);
+	nng_mtx_lock(s->mtx);
+	for (size_t i = 0; i < n; i++) {
+		sink_done(s, i < failed ? NNG_EINTERNAL : 0, w->batch[i]);
+	}
+	cvector_set_size(w->batch, 0);
+}
+
+static void
+sink_thread(void *arg)
+{
+	sink_writer *w    = arg;
+	rule_sink   *s    = w->sink;
+	bool         busy = false;
+	nng_msg     *msg;
+	nng_time     enqueued;
+	void        *target;
+	uint32_t     batch_size, max_delay;
+	int          rv;
+
+	sink_batch_conf(s->type, &batch_size, &max_delay);
+	nng_mtx_lock(s->mtx);
+	for (;;) {
+		while (nng_lmq_empty(s->lmq) && !s->closing) {
+			if (cvector_size(w->batch) > 0) {
+				// the open batch waits for more records until
+				// its deadline, it stays busy until committed
+				if (nng_cv_until(s->cv, w->deadline) ==
+				    NNG_ETIMEDOUT) {
+					sink_flush(w);
+				}
+				continue;
+			}
+			if (busy) {
+				busy = false;
+				s->busy--;
+				nng_cv_wake(s->room);
+			}
+			nng_cv_wait(s->cv);
+		}
+		if (nng_lmq_get(s->lmq, &msg) != 0) {
+			// closing and nothing left
+			break;
+		}
+		if (!busy) {
+			busy = true;
+			s->busy++;
+		}
+		s->bytes -= nng_msg_len(msg);
+		nng_cv_wake(s->room);
+		nng_mtx_unlock(s->mtx);
+
+		record_header(msg, &enqueued, &target);
+		rv = sink_write(w, target, msg);
+		nng_msg_free(msg);
+
+		nng_mtx_lock(s->mtx);
+		if (rv != SINK_PENDING) {
+			sink_done(s, rv, enqueued);
+			continue;
+		}
+		if (cvector_size(w->batch) == 0) {
+			w->deadline = nng_clock() + max_delay;
+		}
+		cvector_push_back(w->batch, enqueued);
+		if (cvector_size(w->batch) >= batch_size) {
+			sink_flush(w);
+		}
+	}
+	sink_flush(w);
+	if (busy) {
+		s->busy--;
+	}
+	nng_cv_wake(s->room);
+	nng_mtx_unlock(s->mtx);
+	sink_writer_fini(w);
+}
+
+static bool
+sink_full(rule_sink *s, size_t len)
+{
+	conf_rule_sink *c = &conf_ext_get()->rules.sink;
+
+	if (nng_lmq_len(s->lmq) >= c->queue_size) {
+		return true;
+	}
+	// one record larger than max_bytes still goes through on its own
+	return s->bytes + len > c->max_bytes && !nng_lmq_empty(s->lmq);
+}
+
+/**
+ * @brief hand a record to the writer of a sink, waiting for room or
+ *        dropping it as rules.sink.policy says.
+ */
+int
+rule_sink_put(rule_sink_type type, void *target, nng_msg *msg)
+{
+	rule_sink *s   = &sink_state.sinks[type];
+	size_t     len = nng_msg_len(msg);
+
+	if (!s->started) {
+		nng_msg_free(msg);
+		return NNG_ECLOSED;
+	}
+	nng_msg_header_clear(msg);
+	nng_msg_header_append_u64(msg, nng_clock());
+	nng_msg_header_append_u64(msg, (uint64_t) (uintptr_t) target);
+
+	nng_mtx_lock(s->mtx);
+	while (!s->closing && sink_full(s, len)) {
+		if (conf_ext_get()->rules.sink.policy == RULE_SINK_DROP) {
+			s->stats.dropped++;
+			nng_mtx_unlock(s->mtx);
+			nng_msg_free(msg);
+			return NNG_EAGAIN;
+		}
+		nng_cv_wait(s->room);
+	}
+	if (s->closing || nng_lmq_put(s->lmq, msg) != 0) {
+		nng_mtx_unlock(s->mtx);
+		nng_msg_free(msg);
+		return NNG_ECLOSED;
+	}
+	s->bytes += len;
+	nng_cv_wake1(s->cv);
+	nng_mtx_unlock(s->mtx);
+	return 0;
+}
+
+void
+rule_sink_sync(void)
+{
+	for (int i = 0; i < RULE_SINK_COUNT; i++) {
+		rule_sink *s = &sink_state.sinks[i];
+
+		if (!s->started) {
+			continue;
+		}
+		nng_mtx_lock(s->mtx);
+		while (!nng_lmq_empty(s->lmq) || s->busy > 0) {
+			nng_cv_wait(s->room);
+		}
+		nng_mtx_unlock(s->mtx);
+	}
+}
+
+static int
+sink_start(rule_sink *s, rule_sink_type type, size_t nwriters)
+{
+	int rv;
+
+	s->type = type;
+	if ((rv = nng_mtx_alloc(&s->mtx)) != 0 ||
+	    (rv = nng_cv_alloc(&s->cv, s->mtx)) != 0 ||
+	    (rv = nng_cv_alloc(&s->room, s->mtx)) != 0 ||
+	    (rv = nng_lmq_alloc(
+	         &s->lmq, conf_ext_get()->rules.sink.queue_size)) != 0) {
+		return rv;
+	}
+	if ((s->writers = nng_zalloc(nwriters * sizeof(sink_writer))) ==
+	    NULL) {
+		return NNG_ENOMEM;
+	}
+	s->nwriters = nwriters;
+	// stopped by rule_sink_stop() either way
+	s->started = true;
+	for (size_t i = 0; i < nwriters; i++) {
+		s->writers[i].sink = s;
+		if ((rv = nng_thread_create(&s->writers[i].thread,
+		         sink_thread, &s->writers[i])) != 0) {
+			return rv;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief start a writer for every sink this build supports, rules added
+ *        over REST may use any of them later.
+ */
+int
+rule_sink_start(conf_rule *cr)
+{
+	size_t nwriters;
+	int    rv;
+
+	sink_state.cr = cr;
+#if defined(SUPP_MYSQL)
+	// not thread safe, before any writer calls mysql_init()
+	mysql_library_init(0, NULL, NULL);
+#endif
+	for (int i = 0; i < RULE_SINK_COUNT; i++) {
+		switch (i) {
+#if !defined(NNG_SUPP_SQLITE)
+		case RULE_SINK_SQLITE:
+			continue;
+#endif
+#if !defined(SUPP_MYSQL)
+		case RULE_SINK_MYSQL:
+			continue;
+#endif
+#if !defined(FDB_SUPPORT)
+		case RULE_SINK_FDB:
+			continue;
+#endif
+		default:
+			break;
+		}
+		// a pool of connections to each mysql server, one per writer
+		nwriters = i == RULE_SINK_MYSQL
+		    ? conf_ext_get()->rules.sink.mysql.connections
+		    : 1;
+		if ((rv = sink_start(&sink_state.sinks[i], i, nwriters)) != 0) {
+			log_error("rule sink %s: %d", sink_names[i], rv);
+			return rv;
+		}
+	}
+	return 0;
+}
+
+void
+rule_sink_stop(void)
+{
+	nng_msg *msg;
+
+	for (int i = 0; i < RULE_SINK_COUNT; i++) {
+		rule_sink *s = &sink_state.sinks[i];
+
+		if (s->mtx == NULL) {
+			continue;
+		}
+		if (s->started) {
+			nng_mtx_lock(s->mtx);
+			s->closing = true;
+			nng_cv_wake(s->cv);
+			nng_cv_wake(s->room);
+			nng_mtx_unlock(s->mtx);
+			// the writers empty the queue before they return
+			for (size_t j = 0; j < s->nwriters; j++) {
+				if (s->writers[j].thread != NULL) {
+					nng_thread_destroy(s->writers[j].thread);
+				}
+				cvector_free(s->writers[j].batch);
+			}
+		}
+		if (s->writers != NULL) {
+			nng_free(s->writers,
+			    s->nwriters * sizeof(sink_writer));
+		}
+		if (s->lmq != NULL) {
+			while (nng_lmq_get(s->lmq, &msg) == 0) {
+				nng_msg_free(msg);
+			}
+			nng_lmq_free(s->lmq);
+		}
+		if (s->room != NULL) {
+			nng_cv_free(s->room);
+		}
+		if (s->cv != NULL) {
+			nng_cv_free(s->cv);
+		}
+		nng_mtx_free(s->mtx);
+		memset(s, 0, sizeof(*s));
+	}
+}
+
+const char *
+rule_sink_name(rule_sink_type type)
+{
+	return sink_names[type];
+}
+
+void
+rule_sink_get_stats(rule_sink_type type, rule_sink_stats *stats)
+{
+	rule_sink *s = &sink_state.sinks[type];
+
+	memset(stats, 0, sizeof(*stats));
+	if (!s->started) {
+		return;
+	}
+	nng_mtx_lock(s->mtx);
+	*stats        = s->stats;
+	stats->queued = nng_lmq_len(s->lmq);
+	stats->bytes  = s->bytes;
+	nng_mtx_unlock(s->mtx);
+}
+
+#endif
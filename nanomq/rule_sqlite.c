@@ -0,0 +1,319 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/rule_sink.h"
+#include "include/rule_sqlite.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+
+#if defined(SUPP_RULE_ENGINE) && defined(NNG_SUPP_SQLITE)
+
+#include "nng/supplemental/sqlite/sqlite3.h"
+
+#define RULE_SQLITE_BUCKETS 64
+// rules come and go over REST, past this the cache starts over
+#define RULE_SQLITE_STMT_MAX 256
+
+typedef struct rule_stmt rule_stmt;
+struct rule_stmt {
+	rule_stmt    *next;
+	uint32_t      hash;
+	char         *sql;
+	sqlite3_stmt *stmt;
+};
+
+struct rule_sqlite {
+	sqlite3   *db;
+	bool       in_txn;
+	rule_stmt *buckets[RULE_SQLITE_BUCKETS];
+	size_t     count;
+	rule_col  *cols; // columns of the current row
+	char      *sql;  // INSERT of the current row
+	size_t     len;
+	size_t     cap;
+};
+
+static int
+sql_append(rule_sqlite *s, const char *str)
+{
+	size_t n = strlen(str);
+
+	if (s->len + n + 1 > s->cap) {
+		size_t cap = s->cap != 0 ? s->cap : 256;
+		char  *sql;
+
+		while (s->len + n + 1 > cap) {
+			cap *= 2;
+		}
+		if ((sql = realloc(s->sql, cap)) == NULL) {
+			return NNG_ENOMEM;
+		}
+		s->sql = sql;
+		s->cap = cap;
+	}
+	memcpy(s->sql + s->len, str, n + 1);
+	s->len += n;
+	return 0;
+}
+
+// INSERT INTO table (a, b) VALUES (?, ?)
+static int
+sql_insert(rule_sqlite *s, const char *table)
+{
+	size_t n = cvector_size(s->cols);
+	int    rv;
+
+	s->len = 0;
+	if ((rv = sql_append(s, "INSERT INTO ")) != 0 ||
+	    (rv = sql_append(s, table)) != 0 ||
+	    (rv = sql_append(s, " (")) != 0) {
+		return rv;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if ((rv = sql_append(s, i == 0 ? "" : ", ")) != 0 ||
+		    (rv = sql_append(s, s->cols[i].name)) != 0) {
+			return rv;
+		}
+	}
+	if ((rv = sql_append(s, ") VALUES (")) != 0) {
+		return rv;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if ((rv = sql_append(s, i == 0 ? "?" : ", ?")) != 0) {
+			return rv;
+		}
+	}
+	return sql_append(s, ")");
+}
+
+static uint32_t
+sql_hash(const char *str)
+{
+	uint32_t h = 2166136261u;
+
+	while (*str != '\0') {
+		h = (h ^ (uint8_t) *str++) * 16777619u;
+	}
+	return h;
+}
+
+static int
+sql_exec(rule_sqlite *s, const char *sql)
+{
+	char *err_msg = NULL;
+
+	if (sqlite3_exec(s->db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+		log_error("rule sqlite: %s: %s", sql, err_msg);
+		sqlite3_free(err_msg);
+		return NNG_EINTERNAL;
+	}
+	return 0;
+}
+
+static void
+stmt_clear(rule_sqlite *s)
+{
+	rule_stmt *st;
+
+	for (int i = 0; i < RULE_SQLITE_BUCKETS; i++) {
+		while ((st = s->buckets[i]) != NULL) {
+			s->buckets[i] = st->next;
+			sqlite3_finalize(st->stmt);
+			nng_strfree(st->sql);
+			nng_free(st, sizeof(*st));
+		}
+	}
+	s->count = 0;
+}
+
+// The table or a column of the row is not there yet. The payload fields
+// a rule selects only show their type with the first publish, so the
+// columns are added as rows need them. Columns already there fail to be
+// added, which is expected.
+static void
+schema_add(rule_sqlite *s, const char *table)
+{
+	char *sql, *err_msg;
+
+	sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS %s("
+	                      "RowId INTEGER PRIMARY KEY AUTOINCREMENT)",
+	    table);
+	if (sql != NULL) {
+		sql_exec(s, sql);
+		sqlite3_free(sql);
+	}
+	for (size_t i = 0; i < cvector_size(s->cols); i++) {
+		sql = sqlite3_mprintf("ALTER TABLE %s ADD %s %s", table,
+		    s->cols[i].name,
+		    s->cols[i].type == RULE_COL_INT ? "INT" : "TEXT");
+		if (sql == NULL) {
+			continue;
+		}
+		err_msg = NULL;
+		if (sqlite3_exec(s->db, sql, 0, 0, &err_msg) == SQLITE_OK) {
+			log_info("rule sqlite: %s", sql);
+		}
+		sqlite3_free(err_msg);
+		sqlite3_free(sql);
+	}
+}
+
+// the prepared INSERT for the table and columns of the current row
+static int
+stmt_get(rule_sqlite *s, const char *table, sqlite3_stmt **stp)
+{
+	rule_stmt *st;
+	uint32_t   h;
+	int        rv;
+
+	if ((rv = sql_insert(s, table)) != 0) {
+		return rv;
+	}
+	h = sql_hash(s->sql);
+	for (st = s->buckets[h % RULE_SQLITE_BUCKETS]; st != NULL;
+	     st = st->next) {
+		if (st->hash == h && strcmp(st->sql, s->sql) == 0) {
+			*stp = st->stmt;
+			return 0;
+		}
+	}
+
+	if (s->count >= RULE_SQLITE_STMT_MAX) {
+		stmt_clear(s);
+	}
+	if ((st = nng_zalloc(sizeof(*st))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if ((st->sql = nng_strdup(s->sql)) == NULL) {
+		nng_free(st, sizeof(*st));
+		return NNG_ENOMEM;
+	}
+	if (sqlite3_prepare_v2(s->db, st->sql, -1, &st->stmt, NULL) !=
+	    SQLITE_OK) {
+		schema_add(s, table);
+		if (sqlite3_prepare_v2(s->db, st->sql, -1, &st->stmt, NULL) !=
+		    SQLITE_OK) {
+			log_error("rule sqlite: %s: %s", st->sql,
+			    sqlite3_errmsg(s->db));
+			nng_strfree(st->sql);
+			nng_free(st, sizeof(*st));
+			return NNG_EINTERNAL;
+		}
+	}
+	st->hash = h;
+	st->next = s->buckets[h % RULE_SQLITE_BUCKETS];
+	s->buckets[h % RULE_SQLITE_BUCKETS] = st;
+	s->count++;
+	*stp = st->stmt;
+	return 0;
+}
+
+int
+rule_sqlite_alloc(rule_sqlite **sp, void *db)
+{
+	rule_sqlite *s;
+
+	if ((s = nng_zalloc(sizeof(*s))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	s->db = db;
+	*sp   = s;
+	return 0;
+}
+
+void
+rule_sqlite_free(rule_sqlite *s)
+{
+	if (s->in_txn) {
+		rule_sqlite_commit(s);
+	}
+	stmt_clear(s);
+	cvector_free(s->cols);
+	free(s->sql);
+	nng_free(s, sizeof(*s));
+}
+
+/**
+ * @brief bind a row record to its prepared INSERT and step it, in the
+ *        open transaction or a new one.
+ */
+int
+rule_sqlite_insert(rule_sqlite *s, nng_msg *row)
+{
+	const char   *table;
+	sqlite3_stmt *stmt;
+	rule_col     *col;
+	bool          begun = false;
+	int           rv;
+
+	if ((rv = rule_row_parse(row, &table, &s->cols)) != 0) {
+		log_error("rule sqlite: bad row %d", rv);
+		return rv;
+	}
+	if ((rv = stmt_get(s, table, &stmt)) != 0) {
+		return rv;
+	}
+	if (!s->in_txn) {
+		if ((rv = sql_exec(s, "BEGIN")) != 0) {
+			return rv;
+		}
+		s->in_txn = true;
+		begun     = true;
+	}
+	for (size_t i = 0; i < cvector_size(s->cols); i++) {
+		col = &s->cols[i];
+		switch (col->type) {
+		case RULE_COL_INT:
+			sqlite3_bind_int64(stmt, i + 1, col->num);
+			break;
+		case RULE_COL_TEXT:
+			// the row outlives the step
+			sqlite3_bind_text(
+			    stmt, i + 1, col->str, col->len, SQLITE_STATIC);
+			break;
+		default:
+			sqlite3_bind_null(stmt, i + 1);
+			break;
+		}
+	}
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		log_error("rule sqlite: %s", sqlite3_errmsg(s->db));
+		rv = NNG_EINTERNAL;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	if (rv != 0 && begun) {
+		// the transaction stays open for pending rows only
+		rule_sqlite_commit(s);
+	}
+	return rv;
+}
+
+int
+rule_sqlite_commit(rule_sqlite *s)
+{
+	int rv;
+
+	if (s == NULL || !s->in_txn) {
+		return 0;
+	}
+	s->in_txn = false;
+	if ((rv = sql_exec(s, "COMMIT")) != 0) {
+		// a failed COMMIT may leave the transaction open
+		if (!sqlite3_get_autocommit(s->db)) {
+			sql_exec(s, "ROLLBACK");
+		}
+	}
+	return rv;
+}
+
+#endif
@@ -0,0 +1,286 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/sub_cache.h"
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+typedef struct {
+	uint64_t  gen;
+	uint32_t  hash;
+	char     *topic; // NULL for an empty bucket
+	size_t    topic_len;
+	uint32_t *pipes; // frozen copy of the dbtree result
+	size_t    len;
+	bool      shared;
+} sub_cache_entry;
+
+static struct {
+	sub_cache_entry *entries;
+	size_t           mask;
+	nng_mtx         *locks[SUB_CACHE_LOCKS];
+	nng_atomic_u64  *gen; // bumped by filters with a wildcard first level
+	nng_atomic_u64  *levels[SUB_CACHE_LEVELS];
+	nng_atomic_u64  *hits;
+	nng_atomic_u64  *misses;
+	nng_atomic_u64  *invalidations;
+} sub_cache = { .entries = NULL };
+
+static uint32_t
+topic_hash(const char *topic, size_t *len)
+{
+	// FNV-1a
+	uint32_t    h = 2166136261u;
+	const char *p = topic;
+
+	for (; *p != '\0'; p++) {
+		h ^= (uint8_t) *p;
+		h *= 16777619u;
+	}
+	*len = p - topic;
+	return h;
+}
+
+static uint32_t
+level_index(const char *topic)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+
+	for (; *topic != '\0' && *topic != '/'; topic++) {
+		h ^= (uint8_t) *topic;
+		h *= 16777619u;
+	}
+	return h % SUB_CACHE_LEVELS;
+}
+
+// the level a filter can match topics under, -1 for a wildcard first level
+static int
+filter_level(const char *filter)
+{
+	if (strncmp(filter, "$share/", strlen("$share/")) == 0) {
+		// the group is not part of what is matched
+		filter = strchr(filter + strlen("$share/"), '/');
+		if (filter == NULL) {
+			return -1;
+		}
+		filter++;
+	} else if (strncmp(filter, "$queue/", strlen("$queue/")) == 0) {
+		filter += strlen("$queue/");
+	}
+	if (filter[0] == '+' || filter[0] == '#') {
+		return -1;
+	}
+	return (int) level_index(filter);
+}
+
+static void
+entry_clear(sub_cache_entry *e)
+{
+	if (e->topic != NULL) {
+		nng_free(e->topic, e->topic_len + 1);
+	}
+	if (e->pipes != NULL) {
+		nng_free(e->pipes, e->len * sizeof(uint32_t));
+	}
+	memset(e, 0, sizeof(*e));
+}
+
+int
+sub_cache_init(size_t buckets)
+{
+	size_t n = 1;
+	int    rv;
+
+	if (sub_cache.entries != NULL) {
+		return 0;
+	}
+	// round up to a power of two
+	while (n < buckets) {
+		n <<= 1;
+	}
+	if ((sub_cache.entries = nng_zalloc(n * sizeof(sub_cache_entry))) ==
+	    NULL) {
+		return NNG_ENOMEM;
+	}
+	sub_cache.mask = n - 1;
+	for (size_t i = 0; i < SUB_CACHE_LOCKS; i++) {
+		if ((rv = nng_mtx_alloc(&sub_cache.locks[i])) != 0) {
+			return rv;
+		}
+	}
+	nng_atomic_alloc64(&sub_cache.gen);
+	for (size_t i = 0; i < SUB_CACHE_LEVELS; i++) {
+		nng_atomic_alloc64(&sub_cache.levels[i]);
+	}
+	nng_atomic_alloc64(&sub_cache.hits);
+	nng_atomic_alloc64(&sub_cache.misses);
+	nng_atomic_alloc64(&sub_cache.invalidations);
+	// generation 0 marks empty buckets
+	nng_atomic_set64(sub_cache.gen, 1);
+	log_info("subscriber cache with %zu buckets", n);
+	return 0;
+}
+
+void
+sub_cache_fini(void)
+{
+	if (sub_cache.entries == NULL) {
+		return;
+	}
+	for (size_t i = 0; i <= sub_cache.mask; i++) {
+		entry_clear(&sub_cache.entries[i]);
+	}
+	nng_free(sub_cache.entries,
+	    (sub_cache.mask + 1) * sizeof(sub_cache_entry));
+	sub_cache.entries = NULL;
+	for (size_t i = 0; i < SUB_CACHE_LOCKS; i++) {
+		nng_mtx_free(sub_cache.locks[i]);
+	}
+	nng_atomic_free64(sub_cache.gen);
+	for (size_t i = 0; i < SUB_CACHE_LEVELS; i++) {
+		nng_atomic_free64(sub_cache.levels[i]);
+	}
+	nng_atomic_free64(sub_cache.hits);
+	nng_atomic_free64(sub_cache.misses);
+	nng_atomic_free64(sub_cache.invalidations);
+}
+
+/**
+ * @brief generation of a concrete topic, the sum of the global one and
+ *        that of its first level. Both only grow, so the sum read before
+ *        a tree walk is still current afterwards only when neither moved.
+ */
+uint64_t
+sub_cache_generation(const char *topic)
+{
+	if (sub_cache.entries == NULL) {
+		return 0;
+	}
+	return nng_atomic_get64(sub_cache.gen) +
+	    nng_atomic_get64(sub_cache.levels[level_index(topic)]);
+}
+
+void
+sub_cache_invalidate(const char *filter)
+{
+	int level;
+
+	if (sub_cache.entries == NULL) {
+		return;
+	}
+	level = filter == NULL ? -1 : filter_level(filter);
+	if (level < 0) {
+		nng_atomic_inc64(sub_cache.gen);
+	} else {
+		nng_atomic_inc64(sub_cache.levels[level]);
+	}
+	nng_atomic_inc64(sub_cache.invalidations);
+}
+
+/**
+ * @brief look a concrete topic up, cb gets the cached subscribers while the
+ *        bucket is locked, it must copy what it keeps.
+ * @return SUB_CACHE_MISS if the caller has to walk the tree
+ */
+sub_cache_result
+sub_cache_find(const char *topic, sub_cache_cb cb, void *arg)
+{
+	sub_cache_entry *e;
+	sub_cache_result rv = SUB_CACHE_MISS;
+	size_t           len;
+	uint32_t         hash;
+	nng_mtx         *mtx;
+
+	if (sub_cache.entries == NULL) {
+		return SUB_CACHE_MISS;
+	}
+	hash = topic_hash(topic, &len);
+	e    = &sub_cache.entries[hash & sub_cache.mask];
+	mtx  = sub_cache.locks[(hash & sub_cache.mask) % SUB_CACHE_LOCKS];
+
+	nng_mtx_lock(mtx);
+	if (e->topic != NULL && e->gen == sub_cache_generation(topic) &&
+	    e->hash == hash && e->topic_len == len &&
+	    memcmp(e->topic, topic, len) == 0) {
+		if (e->len > 0) {
+			cb(e->pipes, e->len, arg);
+		}
+		rv = e->shared ? SUB_CACHE_HIT_SHARED : SUB_CACHE_HIT;
+	}
+	nng_mtx_unlock(mtx);
+
+	nng_atomic_inc64(rv == SUB_CACHE_MISS ? sub_cache.misses
+	                                      : sub_cache.hits);
+	return rv;
+}
+
+/**
+ * @brief remember the result of a tree walk.
+ * @param gen generation of topic read before the walk started, a walk
+ *        that raced with a subscription change is stored already stale
+ * @param pipes cvector returned by dbtree_find_clients, copied
+ * @param shared whether the topic has shared subscribers
+ */
+void
+sub_cache_put(const char *topic, uint64_t gen, uint32_t *pipes, bool shared)
+{
+	sub_cache_entry *e;
+	size_t           len, n = cvector_size(pipes);
+	uint32_t         hash;
+	nng_mtx         *mtx;
+	char            *t  = NULL;
+	uint32_t        *pa = NULL;
+
+	if (sub_cache.entries == NULL || gen != sub_cache_generation(topic)) {
+		return;
+	}
+	hash = topic_hash(topic, &len);
+	if ((t = nng_alloc(len + 1)) == NULL ||
+	    (n > 0 && (pa = nng_alloc(n * sizeof(uint32_t))) == NULL)) {
+		if (t != NULL) {
+			nng_free(t, len + 1);
+		}
+		return;
+	}
+	memcpy(t, topic, len + 1);
+	if (n > 0) {
+		memcpy(pa, pipes, n * sizeof(uint32_t));
+	}
+
+	e   = &sub_cache.entries[hash & sub_cache.mask];
+	mtx = sub_cache.locks[(hash & sub_cache.mask) % SUB_CACHE_LOCKS];
+	nng_mtx_lock(mtx);
+	// direct mapped, the newest topic of a bucket wins
+	entry_clear(e);
+	e->gen       = gen;
+	e->hash      = hash;
+	e->topic     = t;
+	e->topic_len = len;
+	e->pipes     = pa;
+	e->len       = n;
+	e->shared    = shared;
+	nng_mtx_unlock(mtx);
+}
+
+void
+sub_cache_get_stats(sub_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (sub_cache.entries == NULL) {
+		return;
+	}
+	stats->hits          = nng_atomic_get64(sub_cache.hits);
+	stats->misses        = nng_atomic_get64(sub_cache.misses);
+	stats->invalidations = nng_atomic_get64(sub_cache.invalidations);
+}
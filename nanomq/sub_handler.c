@@ -16,6 +16,7 @@
 #include "include/broker.h"
 #include "include/nanomq.h"
 #include "include/pub_handler.h"
+#include "include/sub_cache.h"
 #include "include/sub_handler.h"
 #include "include/acl_handler.h"
 
@@ -252,8 +253,8 @@ sub_ctx_handle(nano_work *work)
 #ifdef ACL_SUPP
 		/* Add items which not included in dbhash */
 		if (work->config->acl.enable) {
-			bool auth_result = auth_acl(
-			    work->config, ACL_SUB, work->cparam, topic_str);
+			bool auth_result = auth_acl_pipe(work->config,
+			    ACL_SUB, work->pid.id, work->cparam, topic_str);
 			if (!auth_result) {
 				log_warn("acl deny");
 				tn->reason_code = NMQ_AUTH_SUB_ERROR;
@@ -275,6 +276,7 @@ sub_ctx_handle(nano_work *work)
 		if (!topic_exist) {
 			dbtree_insert_client(
 			    work->db, topic_str, work->pid.id);
+			sub_cache_invalidate(topic_str);
 
 			dbhash_insert_topic(work->pid.id, topic_str, tn->qos);
 		}
@@ -310,7 +312,7 @@ sub_ctx_handle(nano_work *work)
 		}
 #endif
 		if (rh == 0 || (rh == 1 && !topic_exist))
-			retain = dbtree_find_retain(work->db_ret, topic_str);
+			retain = retain_store_find(work->db_ret, topic_str);
 		work->msg_ret = (work->msg_ret == NULL) ? retain : work->msg_ret;
 
 		for (size_t i = 0; retain != NULL &&
@@ -344,6 +346,7 @@ int
 sub_ctx_del(void *db, char *topic, uint32_t pid)
 {
 	dbtree_delete_client((dbtree *)db, topic, pid);
+	sub_cache_invalidate(topic);
 
 	dbhash_del_topic(pid, topic);
 
@@ -356,6 +359,7 @@ destroy_sub_client_cb(void *args, char *topic)
 	sub_destroy_info *des = (sub_destroy_info *) args;
 
 	dbtree_delete_client(des->db, topic, des->pid);
+	sub_cache_invalidate(topic);
 
 	return NULL;
 }
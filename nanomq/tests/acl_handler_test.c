@@ -0,0 +1,91 @@
+#include <assert.h>
+#include <string.h>
+
+#include "include/acl_handler.h"
+#include "include/mqtt_api.h"
+#include "nng/supplemental/util/platform.h"
+
+#ifdef ACL_SUPP
+
+static acl_rule *
+clientid_rule(const char *clientid, const char *topic, acl_permit permit)
+{
+	acl_rule *r = nng_zalloc(sizeof(*r));
+
+	r->permit                = permit;
+	r->rule_type             = ACL_CLIENTID;
+	r->rule_ct.ct.type       = ACL_RULE_SINGLE_STRING;
+	r->rule_ct.ct.value.str  = nng_strdup(clientid);
+	r->action                = ACL_PUB;
+	r->topic_count           = 1;
+	r->topics                = nng_zalloc(sizeof(char *));
+	r->topics[0]             = nng_strdup(topic);
+	return r;
+}
+
+static void
+rules_set(conf_acl *acl, acl_rule *r)
+{
+	acl->enable     = true;
+	acl->rule_count = 1;
+	acl->rules      = nng_zalloc(sizeof(acl_rule *));
+	acl->rules[0]   = r;
+}
+
+// the test made them, the test frees them
+static void
+rules_free(conf_acl *acl)
+{
+	for (size_t i = 0; i < acl->rule_count; i++) {
+		acl_rule *r = acl->rules[i];
+		nng_strfree(r->rule_ct.ct.value.str);
+		nng_strfree(r->topics[0]);
+		nng_free(r->topics, sizeof(char *));
+		nng_free(r, sizeof(*r));
+	}
+	nng_free(acl->rules, acl->rule_count * sizeof(acl_rule *));
+	memset(acl, 0, sizeof(*acl));
+}
+
+int
+main()
+{
+	conf       *config   = nng_zalloc(sizeof(conf));
+	conf       *new_conf = nng_zalloc(sizeof(conf));
+	conn_param *cp       = create_cparam("c1", 4);
+
+	config->acl_nomatch = ACL_ALLOW;
+	rules_set(&config->acl, clientid_rule("c1", "a/#", ACL_DENY));
+	assert(acl_engine_load(config) == 0);
+	assert(!auth_acl_pipe(config, ACL_PUB, 1, cp, "a/b"));
+	assert(auth_acl_pipe(config, ACL_PUB, 1, cp, "b"));
+
+	// reloaded, the verdict the pipe cached goes
+	new_conf->acl_nomatch = ACL_ALLOW;
+	rules_set(&new_conf->acl, clientid_rule("c1", "a/#", ACL_ALLOW));
+	assert(acl_engine_reload(config, new_conf) == 0);
+	assert(auth_acl_pipe(config, ACL_PUB, 1, cp, "a/b"));
+	// the old rules are handed back, the engine kept none of them
+	rules_free(&new_conf->acl);
+	rules_free(&config->acl);
+	assert(auth_acl_pipe(config, ACL_PUB, 1, cp, "a/c"));
+
+	// nothing replaced since, nothing to wait for
+	acl_engine_quiesce();
+	acl_cache_drop(1);
+	acl_engine_fini();
+	conn_param_free(cp);
+	nng_free(new_conf, sizeof(conf));
+	nng_free(config, sizeof(conf));
+	return 0;
+}
+
+#else
+
+int
+main()
+{
+	return 0;
+}
+
+#endif
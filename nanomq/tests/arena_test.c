@@ -0,0 +1,55 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/arena.h"
+
+int
+main()
+{
+	nano_arena      *arena;
+	nano_arena_stats stats;
+	uint8_t         *p, *q;
+
+	assert(nano_arena_init(&arena, 256) == 0);
+
+	// zeroed and aligned allocations from one chunk
+	p = nano_arena_zalloc(arena, 10);
+	assert(p != NULL);
+	for (int i = 0; i < 10; i++) {
+		assert(p[i] == 0);
+	}
+	q = nano_arena_alloc(arena, 3);
+	assert(q != NULL && q != p);
+	assert(((uintptr_t) q & 15) == 0);
+
+	// latest allocation grows in place, older ones are copied
+	memcpy(q, "abc", 3);
+	assert(nano_arena_realloc(arena, q, 3, 64) == q);
+	p = nano_arena_realloc(arena, p, 10, 20);
+	assert(p != NULL && memcmp(p, "\0\0\0\0\0\0\0\0\0\0", 10) == 0);
+
+	// overflow goes to an extra chunk
+	p = nano_arena_alloc(arena, 1000);
+	assert(p != NULL);
+	memset(p, 0xff, 1000);
+	nano_arena_reset(arena);
+
+	nano_arena_get_stats(&stats);
+	assert(stats.allocs == 4);
+	assert(stats.resets == 1);
+	// initial, overflow and the merged chunk
+	assert(stats.chunks == 3);
+
+	// the merged chunk now holds a whole cycle like the last one
+	p = nano_arena_alloc(arena, 1000);
+	q = nano_arena_alloc(arena, 64);
+	assert(p != NULL && q != NULL);
+	nano_arena_reset(arena);
+	nano_arena_get_stats(&stats);
+	assert(stats.chunks == 3);
+	assert(stats.resets == 2);
+
+	nano_arena_fini(arena);
+	return 0;
+}
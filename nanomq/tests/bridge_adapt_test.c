@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/bridge_adapt.h"
+#include "nng/supplemental/util/platform.h"
+
+// probes are simulated over paths like the ones tc netem makes: a delay,
+// a jitter around it and a loss rate
+typedef struct {
+	uint32_t delay;  // ms
+	uint32_t jitter; // ms, either way
+	uint32_t loss;   // percent
+} path;
+
+typedef struct {
+	bridge_adapt    *a;
+	bridge_transport active;
+	nng_time         now;
+	uint32_t         rng;
+	uint64_t         switches;
+} run;
+
+// the defaults
+static const conf_bridge_adaptive adaptive = {
+	.enable   = true,
+	.interval = 1000,
+	.window   = 30,
+	.margin   = 20,
+	.hold     = 5,
+	.dwell    = 60 * 1000,
+};
+
+static uint32_t
+next_rand(run *r)
+{
+	r->rng = r->rng * 1103515245u + 12345u;
+	return (r->rng >> 8) % 10000;
+}
+
+static void
+probe(run *r, bridge_transport t, const path *p)
+{
+	int32_t rtt = (int32_t) p->delay;
+
+	if (next_rand(r) % 100 < p->loss) {
+		bridge_adapt_sample(r->a, t, true, 0);
+		return;
+	}
+	if (p->jitter > 0) {
+		rtt += (int32_t) (next_rand(r) % (2 * p->jitter + 1)) -
+		    (int32_t) p->jitter;
+	}
+	bridge_adapt_sample(r->a, t, false, rtt < 0 ? 0 : rtt);
+}
+
+// rounds of one probe per transport, the switch taking effect at once as
+// the hybrid bridge does it
+static void
+rounds(run *r, uint32_t n, const path *tcp, const path *quic)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		r->now += adaptive.interval;
+		probe(r, BRIDGE_TRANSPORT_TCP, tcp);
+		probe(r, BRIDGE_TRANSPORT_QUIC, quic);
+		if (bridge_adapt_decide(r->a, r->active, r->now)) {
+			r->active = r->active == BRIDGE_TRANSPORT_TCP
+			    ? BRIDGE_TRANSPORT_QUIC
+			    : BRIDGE_TRANSPORT_TCP;
+			r->switches++;
+		}
+	}
+}
+
+static void
+run_init(run *r)
+{
+	memset(r, 0, sizeof(*r));
+	assert(bridge_adapt_alloc(&r->a, &adaptive) == 0);
+	r->active = BRIDGE_TRANSPORT_QUIC;
+	r->now    = 1;
+	r->rng    = 42;
+}
+
+static void
+test_stable(void)
+{
+	run        r;
+	const path p = { .delay = 20, .jitter = 15, .loss = 2 };
+
+	// the same path both ways, noise alone never switches
+	run_init(&r);
+	rounds(&r, 5000, &p, &p);
+	assert(r.switches == 0);
+	assert(r.active == BRIDGE_TRANSPORT_QUIC);
+	bridge_adapt_free(r.a);
+}
+
+static void
+test_degrade(void)
+{
+	run                r;
+	bridge_adapt_stats stats;
+	const path         good = { .delay = 20, .jitter = 5, .loss = 0 };
+	const path         bad  = { .delay = 150, .jitter = 20, .loss = 10 };
+	nng_time           at;
+
+	run_init(&r);
+	rounds(&r, 60, &good, &good);
+	assert(r.switches == 0);
+
+	// netem on the QUIC port, over to TCP within window and hold probes
+	at = r.now;
+	while (r.active == BRIDGE_TRANSPORT_QUIC && r.now - at < 60000) {
+		rounds(&r, 1, &good, &bad);
+	}
+	printf("quic degraded, on tcp after %llu s\n",
+	    (unsigned long long) (r.now - at) / 1000);
+	assert(r.active == BRIDGE_TRANSPORT_TCP);
+	assert(r.now - at <= adaptive.hold * adaptive.interval * 2);
+
+	// the window full of the degraded path
+	rounds(&r, adaptive.window, &good, &bad);
+	bridge_adapt_get_stats(r.a, BRIDGE_TRANSPORT_QUIC, &stats);
+	assert(stats.scored && stats.rtt > 100 && stats.loss > 0);
+	bridge_adapt_get_stats(r.a, BRIDGE_TRANSPORT_TCP, &stats);
+	assert(stats.scored && stats.rtt < 30 && stats.loss == 0);
+
+	// netem moved to the TCP port, back to QUIC once dwell is over
+	at = r.now;
+	while (r.active == BRIDGE_TRANSPORT_TCP && r.now - at < 120000) {
+		rounds(&r, 1, &bad, &good);
+	}
+	printf("tcp degraded, on quic after %llu s\n",
+	    (unsigned long long) (r.now - at) / 1000);
+	assert(r.active == BRIDGE_TRANSPORT_QUIC);
+	assert(r.now - at >=
+	    adaptive.dwell - adaptive.interval * (adaptive.window + 1));
+	assert(bridge_adapt_switches(r.a) == 2);
+	bridge_adapt_free(r.a);
+}
+
+static void
+test_flap(void)
+{
+	run        r;
+	const path good = { .delay = 20, .jitter = 5, .loss = 0 };
+	const path bad  = { .delay = 300, .jitter = 0, .loss = 30 };
+
+	// the bad path moving every 10 s, dwell caps the switches
+	run_init(&r);
+	for (int i = 0; i < 60; i++) {
+		rounds(&r, 10, i % 2 ? &good : &bad, i % 2 ? &bad : &good);
+	}
+	printf("bad path moving every 10 s for 600 s: %llu switches\n",
+	    (unsigned long long) r.switches);
+	assert(r.switches <= 600000 / adaptive.dwell + 1);
+	bridge_adapt_free(r.a);
+}
+
+static void
+test_failover(void)
+{
+	run        r;
+	const path good = { .delay = 20, .jitter = 5, .loss = 0 };
+	const path dead = { .delay = 0, .jitter = 0, .loss = 100 };
+
+	run_init(&r);
+	rounds(&r, 60, &good, &good);
+	// the bridge failed over on its own, dwell starts over from there
+	r.active = BRIDGE_TRANSPORT_TCP;
+	rounds(&r, adaptive.dwell / adaptive.interval - 10, &dead, &good);
+	assert(r.active == BRIDGE_TRANSPORT_TCP && r.switches == 0);
+	rounds(&r, 20, &dead, &good);
+	assert(r.active == BRIDGE_TRANSPORT_QUIC && r.switches == 1);
+	bridge_adapt_free(r.a);
+}
+
+int
+main()
+{
+	test_stable();
+	test_degrade();
+	test_flap();
+	test_failover();
+	return 0;
+}
@@ -0,0 +1,278 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/bridge.h"
+#include "include/bridge_envelope.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "nng/supplemental/util/platform.h"
+
+#define BENCH_MSGS 100000
+#define BENCH_WINDOW 500
+
+typedef struct {
+	uint32_t n;
+	uint64_t bytes;
+} unpacked;
+
+static void
+test_msg(uint32_t i, char *topic, size_t tsz, char *payload, size_t psz)
+{
+	snprintf(topic, tsz, "site/%u/dev/%u/telemetry", i % 8, i % 1000);
+	snprintf(payload, psz,
+	    "{\"id\":\"dev-%04u\",\"ts\":%u,\"temp\":%u.%u,\"hum\":%u}",
+	    i % 1000, 1690000000u + i, 20 + i % 10, i % 10, 40 + i % 20);
+}
+
+static int
+check_record(bridge_envelope_record *rec, void *arg)
+{
+	unpacked *u = arg;
+	char      topic[64], payload[128];
+
+	test_msg(u->n, topic, sizeof(topic), payload, sizeof(payload));
+	assert(rec->topic_len == strlen(topic));
+	assert(memcmp(rec->topic, topic, rec->topic_len) == 0);
+	assert(rec->payload_len == strlen(payload));
+	assert(memcmp(rec->payload, payload, rec->payload_len) == 0);
+	assert(rec->qos == u->n % 3);
+	assert(rec->retain == (u->n % 5 == 0));
+	u->n++;
+	u->bytes += rec->payload_len;
+	return 0;
+}
+
+static nng_msg *
+pack(uint32_t first, uint32_t count, bridge_compress codec)
+{
+	nng_msg *raw, *payload;
+	char     topic[64], body[128];
+
+	assert(bridge_envelope_open(&raw, count * 96) == 0);
+	for (uint32_t i = first; i < first + count; i++) {
+		test_msg(i, topic, sizeof(topic), body, sizeof(body));
+		assert(bridge_envelope_append(raw, i % 3, i % 5 == 0, topic,
+		           strlen(topic), (uint8_t *) body, strlen(body)) == 0);
+	}
+	assert(bridge_envelope_seal(raw, count, codec, 0, &payload) == 0);
+	return payload;
+}
+
+static void
+test_round_trip(bridge_compress codec)
+{
+	nng_msg *payload = pack(0, 200, codec);
+	nng_msg *raw;
+	unpacked u = { 0 };
+
+	assert(bridge_envelope_check(
+	    nng_msg_body(payload), nng_msg_len(payload)));
+	assert(bridge_envelope_unpack(nng_msg_body(payload),
+	           nng_msg_len(payload), check_record, &u) == 0);
+	assert(u.n == 200);
+	nng_msg_free(payload);
+
+	// nothing to compress in a single short record, it goes as it is
+	assert(bridge_envelope_open(&raw, 0) == 0);
+	assert(bridge_envelope_append(
+	           raw, 0, false, "t", 1, (uint8_t *) "x", 1) == 0);
+	assert(bridge_envelope_seal(raw, 1, codec, 0, &payload) == 0);
+	assert(((uint8_t *) nng_msg_body(payload))[5] ==
+	    BRIDGE_COMPRESS_NONE);
+	assert(nng_msg_len(payload) == BRIDGE_ENVELOPE_HEADER_LEN + 6);
+	nng_msg_free(payload);
+}
+
+static int
+count_record(bridge_envelope_record *rec, void *arg)
+{
+	(void) rec;
+	(*(uint32_t *) arg)++;
+	return 0;
+}
+
+static void
+test_malformed(void)
+{
+	nng_msg *payload = pack(0, 10, BRIDGE_COMPRESS_NONE);
+	uint8_t *b       = nng_msg_body(payload);
+	size_t   len     = nng_msg_len(payload);
+	uint32_t n       = 0;
+
+	assert(!bridge_envelope_check((uint8_t *) "NMQ", 3));
+	assert(!bridge_envelope_check((uint8_t *) "{\"temp\":23.4}", 13));
+	assert(bridge_envelope_unpack((uint8_t *) "{\"temp\":23.4}", 13,
+	           count_record, &n) == NNG_EINVAL);
+
+	// cut short, no record is handed out
+	assert(bridge_envelope_unpack(b, len - 1, count_record, &n) != 0);
+	assert(n == 0);
+
+	// one record more than there is
+	b[9]++;
+	assert(bridge_envelope_unpack(b, len, count_record, &n) != 0);
+	assert(n == 0);
+	b[9]--;
+
+	// unknown codec
+	b[5] = 0x7f;
+	assert(bridge_envelope_unpack(b, len, count_record, &n) != 0);
+	b[5] = BRIDGE_COMPRESS_NONE;
+
+	assert(bridge_envelope_unpack(b, len, count_record, &n) == 0);
+	assert(n == 10);
+	nng_msg_free(payload);
+}
+
+typedef struct {
+	conf_bridge_node *node;
+	uint32_t          kept[4];
+	uint8_t           qos[4];
+	uint32_t          nkept;
+	uint32_t          dropped;
+} accepted;
+
+// what envelope_record_cb() of the broker does with each record
+static int
+accept_record(bridge_envelope_record *rec, void *arg)
+{
+	accepted *a   = arg;
+	uint8_t   qos = rec->qos;
+	char      topic[64];
+	unsigned  site, dev;
+
+	memcpy(topic, rec->topic, rec->topic_len);
+	topic[rec->topic_len] = '\0';
+	if (!bridge_envelope_accept(a->node, topic, &qos)) {
+		a->dropped++;
+		return 0;
+	}
+	assert(sscanf(topic, "site/%u/dev/%u/", &site, &dev) == 2);
+	assert(a->nkept < 4);
+	a->kept[a->nkept]  = dev;
+	a->qos[a->nkept++] = qos;
+	return 0;
+}
+
+// records on topics the node did not subscribe to never get in
+static void
+test_accept(void)
+{
+	nng_msg          *payload = pack(0, 16, BRIDGE_COMPRESS_NONE);
+	topics            site1   = { .topic = "site/1/#", .qos = 1 };
+	topics            site2   = { .topic = "$share/g/site/2/+/+/telemetry",
+		           .qos   = 0 };
+	topics           *subs[]  = { &site1, &site2 };
+	conf_bridge_node  node    = { .sub_list = subs, .sub_count = 2 };
+	accepted          a       = { .node = &node };
+	uint8_t           qos     = 2;
+
+	assert(bridge_envelope_unpack(nng_msg_body(payload),
+	           nng_msg_len(payload), accept_record, &a) == 0);
+	assert(a.nkept == 4 && a.dropped == 12);
+	// in order, qos i % 3 capped by the subscription
+	assert(a.kept[0] == 1 && a.qos[0] == 1);
+	assert(a.kept[1] == 2 && a.qos[1] == 0);
+	assert(a.kept[2] == 9 && a.qos[2] == 0);
+	assert(a.kept[3] == 10 && a.qos[3] == 0);
+	nng_msg_free(payload);
+
+	node.sub_count = 0;
+	assert(!bridge_envelope_accept(&node, "site/1/dev/1/telemetry", &qos));
+}
+
+static size_t
+wire_len(nng_msg *msg)
+{
+	nng_mqtt_msg_encode(msg);
+	return nng_msg_header_len(msg) + nng_msg_len(msg);
+}
+
+// one publish per message, what the bridge sends without envelopes
+static void
+bench_publish(void)
+{
+	char     topic[64], payload[128];
+	uint64_t bytes = 0;
+	clock_t  start = clock();
+
+	for (uint32_t i = 0; i < BENCH_MSGS; i++) {
+		nng_msg *msg;
+
+		test_msg(i, topic, sizeof(topic), payload, sizeof(payload));
+		msg = bridge_publish_msg(topic, (uint8_t *) payload,
+		    strlen(payload), false, 0, false, NULL);
+		bytes += wire_len(msg);
+		nng_msg_free(msg);
+	}
+	printf("publish per msg: %d msgs, %llu bytes on the wire, %.1f ms "
+	       "cpu\n",
+	    BENCH_MSGS, (unsigned long long) bytes,
+	    (double) (clock() - start) * 1000 / CLOCKS_PER_SEC);
+}
+
+static void
+bench_envelope(bridge_compress codec, const char *name)
+{
+	uint64_t bytes = 0;
+	unpacked u     = { 0 };
+	clock_t  start = clock();
+	clock_t  packing, unpacking = 0;
+
+	for (uint32_t i = 0; i < BENCH_MSGS; i += BENCH_WINDOW) {
+		nng_msg *payload = pack(i, BENCH_WINDOW, codec);
+		nng_msg *msg;
+
+		msg = bridge_publish_msg(CONF_EXT_BRIDGE_ENVELOPE_TOPIC,
+		    nng_msg_body(payload), nng_msg_len(payload), false, 0,
+		    false, NULL);
+
+		bytes += wire_len(msg);
+		nng_msg_free(msg);
+		nng_msg_free(payload);
+	}
+	packing = clock() - start;
+
+	// and what the receiving side spends on them
+	for (uint32_t i = 0; i < BENCH_MSGS; i += BENCH_WINDOW) {
+		nng_msg *payload = pack(i, BENCH_WINDOW, codec);
+
+		start = clock();
+		assert(bridge_envelope_unpack(nng_msg_body(payload),
+		           nng_msg_len(payload), check_record, &u) == 0);
+		unpacking += clock() - start;
+		nng_msg_free(payload);
+	}
+	assert(u.n == BENCH_MSGS);
+	printf("envelope %-7s: %d msgs in %d envelopes, %llu bytes on the "
+	       "wire, %.1f ms cpu to pack, %.1f ms to unpack\n",
+	    name, BENCH_MSGS, BENCH_MSGS / BENCH_WINDOW,
+	    (unsigned long long) bytes,
+	    (double) packing * 1000 / CLOCKS_PER_SEC,
+	    (double) unpacking * 1000 / CLOCKS_PER_SEC);
+}
+
+int
+main()
+{
+	test_round_trip(BRIDGE_COMPRESS_NONE);
+#if defined(SUPP_ZLIB)
+	test_round_trip(BRIDGE_COMPRESS_DEFLATE);
+#endif
+#if defined(SUPP_ZSTD)
+	test_round_trip(BRIDGE_COMPRESS_ZSTD);
+#endif
+	test_malformed();
+	test_accept();
+
+	bench_publish();
+	bench_envelope(BRIDGE_COMPRESS_NONE, "none");
+#if defined(SUPP_ZLIB)
+	bench_envelope(BRIDGE_COMPRESS_DEFLATE, "deflate");
+#endif
+#if defined(SUPP_ZSTD)
+	bench_envelope(BRIDGE_COMPRESS_ZSTD, "zstd");
+#endif
+	return 0;
+}
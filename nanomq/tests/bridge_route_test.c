@@ -0,0 +1,151 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/bridge_route.h"
+#include "nng/supplemental/nanolib/conf.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/util/platform.h"
+
+#define NODES 6
+#define FORWARDS 200
+#define BENCH_MSGS 100000
+
+static conf_bridge_node  nodes[NODES];
+static conf_bridge_node *node_list[NODES];
+static char             *forwards[NODES][FORWARDS];
+
+// node t forwards "site/<t>/dev/<i>/+" and, for the last two nodes, "#"
+// or "site/+/alarm" too
+static void
+nodes_init(conf *config)
+{
+	char topic[64];
+
+	memset(config, 0, sizeof(*config));
+	for (int t = 0; t < NODES; t++) {
+		conf_bridge_node *node = &nodes[t];
+
+		memset(node, 0, sizeof(*node));
+		assert(nng_mtx_alloc(&node->mtx) == 0);
+		node->enable = true;
+		for (int i = 0; i < FORWARDS - 1; i++) {
+			snprintf(topic, sizeof(topic), "site/%d/dev/%d/+", t, i);
+			forwards[t][i] = nng_strdup(topic);
+		}
+		forwards[t][FORWARDS - 1] = nng_strdup(
+		    t == NODES - 1 ? "#" : t == NODES - 2 ? "site/+/alarm"
+		                                          : "site/x/y");
+		node->forwards       = forwards[t];
+		node->forwards_count = FORWARDS;
+		node_list[t]         = node;
+	}
+	config->bridge.nodes = node_list;
+	config->bridge.count = NODES;
+}
+
+static void
+nodes_fini(void)
+{
+	for (int t = 0; t < NODES; t++) {
+		for (int i = 0; i < FORWARDS; i++) {
+			nng_strfree(forwards[t][i]);
+		}
+		nng_mtx_free(nodes[t].mtx);
+	}
+}
+
+static void
+test_match(conf *config)
+{
+	bridge_route *r;
+	uint32_t     *ids = NULL;
+
+	assert(bridge_route_compile(&r, config) == 0);
+
+	// forward of node 2 and the "#" of node 5
+	bridge_route_match(r, "site/2/dev/17/temp", &ids);
+	assert(cvector_size(ids) == 2);
+	assert(ids[0] == 2 && ids[1] == 5);
+
+	// "site/+/alarm" and "#", each node once
+	bridge_route_match(r, "site/3/alarm", &ids);
+	assert(cvector_size(ids) == 2);
+	assert(ids[0] == 4 && ids[1] == 5);
+
+	// last level missing, only "#"
+	bridge_route_match(r, "site/2/dev/17", &ids);
+	assert(cvector_size(ids) == 1 && ids[0] == 5);
+
+	// a node matching several forwards is returned once
+	bridge_route_match(r, "site/5/dev/3/temp", &ids);
+	assert(cvector_size(ids) == 1 && ids[0] == 5);
+
+	bridge_route_free(r);
+
+	cvector_free(ids);
+}
+
+static void
+test_reload(conf *config)
+{
+	bridge_route *first;
+	uint32_t     *ids = NULL;
+
+	assert(bridge_route_get() == NULL);
+	assert(bridge_route_load(config) == 0);
+	assert((first = bridge_route_get()) != NULL);
+
+	// node 5 stops forwarding everything
+	forwards[NODES - 1][FORWARDS - 1][0] = 'z';
+	assert(bridge_route_load(config) == 0);
+	assert(bridge_route_get() != first);
+	bridge_route_match(bridge_route_get(), "site/2/dev/17/temp", &ids);
+	assert(cvector_size(ids) == 1 && ids[0] == 2);
+
+	// the old route is still there for who holds it
+	bridge_route_match(first, "site/2/dev/17/temp", &ids);
+	assert(cvector_size(ids) == 2);
+	forwards[NODES - 1][FORWARDS - 1][0] = '#';
+
+	bridge_route_fini();
+	assert(bridge_route_get() == NULL);
+	cvector_free(ids);
+}
+
+static void
+bench(conf *config)
+{
+	bridge_route *r;
+	uint32_t     *ids = NULL;
+	char          topic[64];
+	nng_time      start;
+	nng_time      ms;
+
+	assert(bridge_route_compile(&r, config) == 0);
+	start = nng_clock();
+	for (int i = 0; i < BENCH_MSGS; i++) {
+		snprintf(topic, sizeof(topic), "site/%d/dev/%d/temp",
+		    i % NODES, i % FORWARDS);
+		bridge_route_match(r, topic, &ids);
+		assert(cvector_size(ids) >= 1);
+	}
+	ms = nng_clock() - start;
+	printf("bridge route: %d nodes, %d forwards, %d msgs in %llu ms\n",
+	    NODES, NODES * FORWARDS, BENCH_MSGS, (unsigned long long) ms);
+	bridge_route_free(r);
+	cvector_free(ids);
+}
+
+int
+main()
+{
+	conf config;
+
+	nodes_init(&config);
+	test_match(&config);
+	test_reload(&config);
+	bench(&config);
+	nodes_fini();
+	return 0;
+}
@@ -0,0 +1,307 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/bridge_sched.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/util/platform.h"
+
+// the head-of-line run: a burst of bulky publishes then a small control
+// publish every CTRL_PERIOD, over a link of LINK_BW bytes per us sending
+// one message at a time. Time is simulated, in us.
+#define LINK_BW 10
+#define BULK_MSGS 100
+#define BULK_LEN 65536
+#define CTRL_MSGS 250
+#define CTRL_PERIOD 2000
+#define CTRL_LEN 64
+
+typedef struct {
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+} latency;
+
+static conf_bridge_stream *
+streams_add(conf_bridge_stream *streams, const char *topic,
+    uint32_t priority, uint32_t weight)
+{
+	conf_bridge_stream stream = { .priority = priority, .weight = weight };
+
+	cvector_push_back(stream.topics, nng_strdup(topic));
+	cvector_push_back(streams, stream);
+	return streams;
+}
+
+static void
+streams_free(conf_bridge_stream *streams)
+{
+	for (size_t i = 0; i < cvector_size(streams); i++) {
+		for (size_t j = 0; j < cvector_size(streams[i].topics); j++) {
+			nng_strfree(streams[i].topics[j]);
+		}
+		cvector_free(streams[i].topics);
+	}
+	cvector_free(streams);
+}
+
+static nng_msg *
+seq_msg(uint32_t seq)
+{
+	nng_msg *msg;
+
+	assert(nng_msg_alloc(&msg, sizeof(seq)) == 0);
+	memcpy(nng_msg_body(msg), &seq, sizeof(seq));
+	return msg;
+}
+
+static uint32_t
+msg_seq(nng_msg *msg)
+{
+	uint32_t seq;
+
+	memcpy(&seq, nng_msg_body(msg), sizeof(seq));
+	return seq;
+}
+
+static void
+test_streams(void)
+{
+	conf_bridge_stream *streams = NULL;
+	bridge_sched       *s;
+
+	streams = streams_add(streams, "ctrl/#", 1, 1);
+	streams = streams_add(streams, "bulk/+/video", 0, 4);
+	cvector_push_back(streams[1].topics, nng_strdup("ctrl/bulk"));
+	assert(bridge_sched_alloc(&s, streams) == 0);
+	assert(bridge_sched_streams(s) == 3);
+
+	assert(bridge_sched_stream(s, "ctrl/reboot", 11) == 1);
+	assert(bridge_sched_stream(s, "bulk/cam1/video", 15) == 2);
+	assert(bridge_sched_stream(s, "bulk/cam1/audio", 15) == 0);
+	// not NUL terminated, only len counts
+	assert(bridge_sched_stream(s, "ctrl/xyz", 3) == 0);
+	// matching two streams, the first listed wins
+	assert(bridge_sched_stream(s, "ctrl/bulk", 9) == 1);
+	bridge_sched_free(s);
+
+	// no streams, everything in stream 0
+	assert(bridge_sched_alloc(&s, NULL) == 0);
+	assert(bridge_sched_streams(s) == 1);
+	assert(bridge_sched_stream(s, "ctrl/reboot", 11) == 0);
+	bridge_sched_free(s);
+	streams_free(streams);
+}
+
+static void
+test_priority(void)
+{
+	conf_bridge_stream *streams = NULL;
+	bridge_sched       *s;
+	nng_msg            *msg;
+	uint32_t            stream, len;
+	nng_time            at;
+
+	streams = streams_add(streams, "ctrl/#", 1, 1);
+	assert(bridge_sched_alloc(&s, streams) == 0);
+	for (uint32_t i = 0; i < 10; i++) {
+		assert(bridge_sched_put(s, 0, seq_msg(i), 100, i) == 0);
+	}
+	assert(bridge_sched_put(s, 1, seq_msg(100), 10, 10) == 0);
+	assert(bridge_sched_put(s, 1, seq_msg(101), 10, 11) == 0);
+	assert(bridge_sched_len(s) == 12);
+
+	// the higher priority stream first, each stream in order
+	for (uint32_t i = 0; i < 12; i++) {
+		msg = bridge_sched_get(s, &stream, &len, &at);
+		assert(msg != NULL);
+		assert(msg_seq(msg) == (i < 2 ? 100 + i : i - 2));
+		assert(stream == (i < 2 ? 1u : 0u));
+		assert(len == (i < 2 ? 10u : 100u));
+		bridge_sched_done(s, stream, len, 5, true);
+		nng_msg_free(msg);
+	}
+	assert(bridge_sched_get(s, &stream, &len, &at) == NULL);
+
+	bridge_sched_stats stats;
+	bridge_sched_get_stats(s, 0, &stats);
+	assert(stats.sent == 10 && stats.sent_bytes == 1000);
+	assert(stats.latency_sum == 50 && stats.latency_max == 5);
+	assert(stats.queued == 0);
+
+	// what is left is freed with it
+	assert(bridge_sched_put(s, 0, seq_msg(0), 100, 0) == 0);
+	bridge_sched_free(s);
+	streams_free(streams);
+}
+
+static void
+test_weight(void)
+{
+	conf_bridge_stream *streams = NULL;
+	bridge_sched       *s;
+	nng_msg            *msg;
+	uint32_t            stream, len, next[3] = { 0 };
+	uint64_t            bytes[3]             = { 0 };
+	nng_time            at;
+
+	streams = streams_add(streams, "a/#", 0, 3);
+	streams = streams_add(streams, "b/#", 0, 1);
+	assert(bridge_sched_alloc(&s, streams) == 0);
+	for (uint32_t i = 0; i < 1000; i++) {
+		assert(bridge_sched_put(s, 0, seq_msg(i), 512, 0) == 0);
+		assert(bridge_sched_put(s, 1, seq_msg(i), 512, 0) == 0);
+		assert(bridge_sched_put(s, 2, seq_msg(i), 512, 0) == 0);
+	}
+	// while all three are busy they share 1:3:1
+	for (uint32_t i = 0; i < 1000; i++) {
+		msg = bridge_sched_get(s, &stream, &len, &at);
+		assert(msg_seq(msg) == next[stream]++);
+		bytes[stream] += len;
+		nng_msg_free(msg);
+	}
+	printf("weights 1:3:1 sent %llu:%llu:%llu bytes\n",
+	    (unsigned long long) bytes[0], (unsigned long long) bytes[1],
+	    (unsigned long long) bytes[2]);
+	assert(bytes[1] > bytes[0] * 28 / 10 && bytes[1] < bytes[0] * 32 / 10);
+	assert(bytes[0] > bytes[2] * 9 / 10 && bytes[0] < bytes[2] * 11 / 10);
+	bridge_sched_free(s);
+	streams_free(streams);
+}
+
+static void
+latency_add(latency *l, uint64_t us)
+{
+	l->n++;
+	l->sum += us;
+	if (us > l->max) {
+		l->max = us;
+	}
+}
+
+// control messages are told apart from the bulky ones by their length
+static void
+run_link(const conf_bridge_stream *streams, const char *name, latency *ctrl)
+{
+	bridge_sched *s;
+	nng_msg      *msg, *inflight = NULL;
+	uint32_t      stream, len, in_stream = 0, in_len = 0;
+	nng_time      at, in_at = 0, now = 0, busy_until = 0;
+	nng_time      next_ctrl = 0;
+	uint32_t      nctrl     = 0;
+	latency       bulk      = { 0 };
+	uint32_t      ctrl_stream, bulk_stream;
+
+	assert(bridge_sched_alloc(&s, streams) == 0);
+	ctrl_stream = bridge_sched_stream(s, "ctrl/reboot", 11);
+	bulk_stream = bridge_sched_stream(s, "bulk/cam1/video", 15);
+	for (uint32_t i = 0; i < BULK_MSGS; i++) {
+		assert(bridge_sched_put(
+		           s, bulk_stream, seq_msg(i), BULK_LEN, 0) == 0);
+	}
+	memset(ctrl, 0, sizeof(*ctrl));
+	for (;;) {
+		if (inflight != NULL &&
+		    (nctrl == CTRL_MSGS || busy_until <= next_ctrl)) {
+			now = busy_until;
+			latency_add(
+			    in_len == CTRL_LEN ? ctrl : &bulk, now - in_at);
+			bridge_sched_done(s, in_stream, in_len,
+			    (nng_duration) ((now - in_at) / 1000), true);
+			nng_msg_free(inflight);
+			inflight = NULL;
+		} else if (nctrl < CTRL_MSGS) {
+			now = next_ctrl;
+			assert(bridge_sched_put(s, ctrl_stream, seq_msg(nctrl),
+			           CTRL_LEN, now) == 0);
+			next_ctrl += CTRL_PERIOD;
+			nctrl++;
+		} else if (inflight == NULL && bridge_sched_len(s) == 0) {
+			break;
+		}
+		if (inflight == NULL &&
+		    (msg = bridge_sched_get(s, &stream, &len, &at)) != NULL) {
+			inflight   = msg;
+			in_stream  = stream;
+			in_len     = len;
+			in_at      = at;
+			busy_until = now + len / LINK_BW;
+		}
+	}
+	assert(ctrl->n == CTRL_MSGS && bulk.n == BULK_MSGS);
+	printf("%-24s control avg %6.2f ms max %6.2f ms, bulk avg %6.2f ms "
+	       "max %6.2f ms, done at %.1f ms\n",
+	    name, (double) ctrl->sum / ctrl->n / 1000,
+	    (double) ctrl->max / 1000, (double) bulk.sum / bulk.n / 1000,
+	    (double) bulk.max / 1000, (double) now / 1000);
+	bridge_sched_free(s);
+}
+
+// head-of-line blocking of small control publishes behind a burst of
+// bulky ones, one queue against streams
+static void
+bench_hol(void)
+{
+	conf_bridge_stream *prio = NULL, *fair = NULL;
+	latency             fifo, by_prio, by_weight;
+
+	prio = streams_add(prio, "ctrl/#", 1, 1);
+	fair = streams_add(fair, "ctrl/#", 0, 1);
+	run_link(NULL, "one stream", &fifo);
+	run_link(prio, "ctrl priority 1", &by_prio);
+	run_link(fair, "ctrl weight 1, same prio", &by_weight);
+
+	// at most one bulky message in flight ahead of a control message
+	assert(by_prio.max <= BULK_LEN / LINK_BW + CTRL_LEN / LINK_BW);
+	assert(by_weight.max < fifo.max / 10);
+	assert(by_prio.max < fifo.max / 10);
+	streams_free(prio);
+	streams_free(fair);
+}
+
+// a failed send goes back in front, the stream keeps its order
+static void
+test_requeue(void)
+{
+	bridge_sched *s;
+	nng_msg      *msgs[3];
+	nng_msg      *msg;
+	uint32_t      stream, len;
+	nng_time      at;
+
+	assert(bridge_sched_alloc(&s, NULL) == 0);
+	for (uint32_t i = 0; i < 16; i++) {
+		assert(bridge_sched_put(s, 0, seq_msg(i), 100, i) == 0);
+	}
+	for (int i = 0; i < 3; i++) {
+		msgs[i] = bridge_sched_get(s, &stream, &len, &at);
+		assert(msg_seq(msgs[i]) == (uint32_t) i);
+	}
+	// one more than the ring holds, wrapped and grown
+	for (int i = 2; i >= 0; i--) {
+		assert(bridge_sched_requeue(s, 0, msgs[i], 100, i) == 0);
+	}
+	assert(bridge_sched_requeue(s, 0, seq_msg(99), 100, 0) == 0);
+	msg = seq_msg(0);
+	assert(bridge_sched_requeue(s, 1, msg, 100, 0) == NNG_EINVAL);
+	nng_msg_free(msg);
+	assert(bridge_sched_len(s) == 17);
+	for (uint32_t i = 0; i < 17; i++) {
+		msg = bridge_sched_get(s, &stream, &len, &at);
+		assert(msg_seq(msg) == (i == 0 ? 99 : i - 1));
+		nng_msg_free(msg);
+	}
+	assert(bridge_sched_get(s, &stream, &len, &at) == NULL);
+	bridge_sched_free(s);
+}
+
+int
+main()
+{
+	test_streams();
+	test_priority();
+	test_weight();
+	test_requeue();
+	bench_hol();
+	return 0;
+}
@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <string.h>
+
+#include "include/bridge.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "nng/protocol/mqtt/mqtt_parser.h"
+
+// QoS 1, topic abc/d, packet id 7, payload hello
+static const uint8_t v311_hdr[]  = { 0x32, 14 };
+static const uint8_t v311_body[] = { 0x00, 0x05, 'a', 'b', 'c', '/', 'd',
+	0x00, 0x07, 'h', 'e', 'l', 'l', 'o' };
+
+// the same with a payload format indicator and a user property k=v
+static const uint8_t v5_hdr[]  = { 0x32, 24 };
+static const uint8_t v5_body[] = { 0x00, 0x05, 'a', 'b', 'c', '/', 'd', 0x00,
+	0x07, 9, 0x01, 0x01, 0x26, 0x00, 0x01, 'k', 0x00, 0x01, 'v', 'h', 'e',
+	'l', 'l', 'o' };
+
+// only a topic alias in place of the topic, set by an earlier publish
+static const uint8_t alias_hdr[]  = { 0x32, 22 };
+static const uint8_t alias_body[] = { 0x00, 0x00, 0x00, 0x07, 12, 0x23, 0x00,
+	0x05, 0x01, 0x01, 0x26, 0x00, 0x01, 'k', 0x00, 0x01, 'v', 'h', 'e', 'l',
+	'l', 'o' };
+
+// as the broker receives it
+static nng_msg *
+inbound(const uint8_t *hdr, size_t hlen, const uint8_t *body, size_t blen,
+    uint8_t cmd)
+{
+	nng_msg *msg;
+
+	assert(nng_msg_alloc(&msg, 0) == 0);
+	assert(nng_msg_header_append(msg, hdr, hlen) == 0);
+	assert(nng_msg_append(msg, body, blen) == 0);
+	nng_msg_set_cmd_type(msg, cmd);
+	return msg;
+}
+
+static void
+check_bytes(nng_msg *msg, const uint8_t *hdr, size_t hlen,
+    const uint8_t *body, size_t blen)
+{
+	assert(nng_msg_header_len(msg) == hlen);
+	assert(memcmp(nng_msg_header(msg), hdr, hlen) == 0);
+	assert(nng_msg_len(msg) == blen);
+	assert(memcmp(nng_msg_body(msg), body, blen) == 0);
+}
+
+// what the bridge client puts on the wire is what came in
+static void
+check_forward(nng_msg *in, const char *topic, bool v5, const uint8_t *hdr,
+    size_t hlen, const uint8_t *body, size_t blen)
+{
+	nng_msg    *fwd;
+	const char *t;
+	uint8_t    *payload;
+	uint32_t    len;
+
+	assert((fwd = bridge_wire_msg(in, topic)) != NULL);
+	check_bytes(fwd, hdr, hlen, body, blen);
+
+	t = nng_mqtt_msg_get_publish_topic(fwd, &len);
+	assert(len == 5 && memcmp(t, "abc/d", 5) == 0);
+	payload = nng_mqtt_msg_get_publish_payload(fwd, &len);
+	assert(len == 5 && memcmp(payload, "hello", 5) == 0);
+	assert(nng_mqtt_msg_get_publish_qos(fwd) == 1);
+
+	// the client encodes on every send, retransmits included
+	for (int i = 0; i < 2; i++) {
+		if (v5) {
+			assert(nng_mqttv5_msg_encode(fwd) == 0);
+		} else {
+			assert(nng_mqtt_msg_encode(fwd) == 0);
+		}
+		check_bytes(fwd, hdr, hlen, body, blen);
+	}
+	nng_msg_free(fwd);
+}
+
+static void
+test_v311(void)
+{
+	nng_msg *in = inbound(v311_hdr, sizeof(v311_hdr), v311_body,
+	    sizeof(v311_body), CMD_PUBLISH);
+
+	check_forward(in, NULL, false, v311_hdr, sizeof(v311_hdr), v311_body,
+	    sizeof(v311_body));
+	nng_msg_free(in);
+}
+
+static void
+test_v5(void)
+{
+	nng_msg *in = inbound(
+	    v5_hdr, sizeof(v5_hdr), v5_body, sizeof(v5_body), CMD_PUBLISH_V5);
+
+	check_forward(in, NULL, true, v5_hdr, sizeof(v5_hdr), v5_body,
+	    sizeof(v5_body));
+	nng_msg_free(in);
+}
+
+// the alias goes, the topic it stands for comes back
+static void
+test_alias(void)
+{
+	nng_msg *in = inbound(alias_hdr, sizeof(alias_hdr), alias_body,
+	    sizeof(alias_body), CMD_PUBLISH_V5);
+
+	assert(bridge_wire_msg(in, NULL) == NULL);
+	check_forward(in, "abc/d", true, v5_hdr, sizeof(v5_hdr), v5_body,
+	    sizeof(v5_body));
+	nng_msg_free(in);
+}
+
+static void
+test_malformed(void)
+{
+	nng_msg *in;
+
+	// cut in the user property
+	in = inbound(v5_hdr, sizeof(v5_hdr), v5_body, 14, CMD_PUBLISH_V5);
+	assert(bridge_wire_msg(in, NULL) == NULL);
+	nng_msg_free(in);
+	// cut in the packet id
+	in = inbound(v311_hdr, sizeof(v311_hdr), v311_body, 8, CMD_PUBLISH);
+	assert(bridge_wire_msg(in, NULL) == NULL);
+	nng_msg_free(in);
+}
+
+int
+main(void)
+{
+	test_v311();
+	test_v5();
+	test_alias();
+	test_malformed();
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/json_writer.h"
+#include "nng/supplemental/nanolib/base64.h"
+#include "nng/supplemental/nanolib/cJSON.h"
+#include "nng/supplemental/util/platform.h"
+
+static const char payload[] =
+    "{\"temp\":21.5,\"hum\":40,\"loc\":\"room \\\"a\\\"\"}";
+
+static void
+check(nng_msg *msg, const char *expect)
+{
+	assert(nng_msg_len(msg) == strlen(expect));
+	assert(memcmp(nng_msg_body(msg), expect, strlen(expect)) == 0);
+}
+
+// the webhook message_publish event, the way webhook_post.c did it
+static char *
+publish_cjson(const char *topic, const char *client_id, uint64_t ts)
+{
+	cJSON *obj = cJSON_CreateObject();
+	size_t len = strlen(payload);
+	char  *encode, *json;
+
+	cJSON_AddNumberToObject(obj, "ts", ts);
+	cJSON_AddStringToObject(obj, "topic", topic);
+	cJSON_AddBoolToObject(obj, "retain", false);
+	cJSON_AddNumberToObject(obj, "qos", 1);
+	cJSON_AddStringToObject(obj, "action", "message_publish");
+	cJSON_AddStringToObject(obj, "from_username", "undefined");
+	cJSON_AddStringToObject(obj, "from_client_id", client_id);
+	encode = nng_zalloc(BASE64_ENCODE_OUT_SIZE(len));
+	base64_encode((const unsigned char *) payload, len, encode);
+	cJSON_AddStringToObject(obj, "payload", encode);
+	nng_strfree(encode);
+	json = cJSON_PrintUnformatted(obj);
+	cJSON_Delete(obj);
+	return json;
+}
+
+static void
+publish_writer(
+    nng_msg *msg, const char *topic, const char *client_id, uint64_t ts)
+{
+	json_writer w;
+
+	json_writer_init(&w, msg);
+	json_obj_begin(&w, NULL);
+	json_add_uint(&w, "ts", ts);
+	json_add_str(&w, "topic", topic);
+	json_add_bool(&w, "retain", false);
+	json_add_uint(&w, "qos", 1);
+	json_add_str(&w, "action", "message_publish");
+	json_add_str(&w, "from_username", "undefined");
+	json_add_str(&w, "from_client_id", client_id);
+	json_add_base64(&w, "payload", (const uint8_t *) payload,
+	    strlen(payload));
+	json_obj_end(&w);
+	assert(json_writer_finish(&w) == 0);
+}
+
+static void
+test_values(nng_msg *msg)
+{
+	json_writer w;
+
+	json_writer_init(&w, msg);
+	json_obj_begin(&w, NULL);
+	json_add_int(&w, "i", -42);
+	json_add_double(&w, "d", 0.5);
+	json_add_null(&w, "n");
+	json_add_str(&w, "s", NULL);
+	json_add_str(&w, "e", "a\"b\\c\n\x01");
+	json_arr_begin(&w, "a");
+	json_add_bool(&w, NULL, true);
+	json_obj_begin(&w, NULL);
+	json_obj_end(&w);
+	json_add_raw(&w, NULL, "[1,2]", 5);
+	json_arr_end(&w);
+	json_add_base64(&w, "empty", NULL, 0);
+	json_add_base62(&w, "b62", (const uint8_t *) "hi", 2);
+	json_obj_end(&w);
+	assert(json_writer_finish(&w) == 0);
+	check(msg,
+	    "{\"i\":-42,\"d\":0.5,\"n\":null,\"s\":null,"
+	    "\"e\":\"a\\\"b\\\\c\\n\\u0001\",\"a\":[true,{},[1,2]],"
+	    "\"empty\":null,\"b62\":\"aGk\"}");
+}
+
+// a parsed tree written back gives what cJSON prints
+static void
+test_cjson(nng_msg *msg)
+{
+	json_writer w;
+	cJSON      *jso = cJSON_Parse(payload);
+	char       *expect;
+
+	assert(jso != NULL);
+	json_writer_init(&w, msg);
+	json_add_cjson(&w, NULL, jso);
+	assert(json_writer_finish(&w) == 0);
+	expect = cJSON_PrintUnformatted(jso);
+	check(msg, expect);
+	cJSON_free(expect);
+	cJSON_Delete(jso);
+}
+
+static void
+test_publish(nng_msg *msg)
+{
+	char *expect = publish_cjson("sensor/1", "client-1", 1700000000123);
+
+	publish_writer(msg, "sensor/1", "client-1", 1700000000123);
+	check(msg, expect);
+	cJSON_free(expect);
+}
+
+// run with -b for a longer comparison of both paths
+static void
+bench(nng_msg *msg, int rounds)
+{
+	nng_time start, cjson_ms, writer_ms;
+	char    *json;
+
+	start = nng_clock();
+	for (int i = 0; i < rounds; i++) {
+		json = publish_cjson("sensor/1", "client-1", i);
+		cJSON_free(json);
+	}
+	cjson_ms = nng_clock() - start;
+
+	start = nng_clock();
+	for (int i = 0; i < rounds; i++) {
+		publish_writer(msg, "sensor/1", "client-1", i);
+	}
+	writer_ms = nng_clock() - start;
+
+	printf("%d publish events: cJSON %llu ms, json_writer %llu ms\n",
+	    rounds, (unsigned long long) cjson_ms,
+	    (unsigned long long) writer_ms);
+}
+
+int
+main(int argc, char **argv)
+{
+	nng_msg *msg;
+
+	assert(nng_msg_alloc(&msg, 0) == 0);
+	test_values(msg);
+	test_cjson(msg);
+	test_publish(msg);
+	bench(msg, argc > 1 && strcmp(argv[1], "-b") == 0 ? 1000000 : 10000);
+	nng_msg_free(msg);
+	return 0;
+}
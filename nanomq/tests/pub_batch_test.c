@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "include/conf_ext.h"
+#include "nng/mqtt/mqtt_client.h"
+#include "tests_api.h"
+
+// mqtt.batch_size = 1 against BATCH_SIZE, each on a broker of its own in
+// a child process. The publisher sends BURST publishes back to back and
+// the next burst once the subscriber has them all, the bursty load of
+// docs/en_US/toolkit/bench.md. A burst fits into the queue of the
+// subscriber pipe, so none is dropped at QoS 0. -b runs longer.
+
+#define BENCH_URL "mqtt-tcp://127.0.0.1:1881"
+#define BENCH_TOPIC "bench/batch"
+#define BATCH_SIZE 64
+#define BURST 64
+
+typedef struct {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t ms;
+} bench_result;
+
+static struct {
+	nng_mtx *mtx;
+	nng_cv  *cv;
+	uint64_t received;
+} sub_state;
+
+static void
+sub_recv(void *arg)
+{
+	nng_socket *sock = arg;
+	nng_msg    *msg;
+
+	// ends when the socket is closed
+	while (nng_recvmsg(*sock, &msg, 0) == 0) {
+		nng_msg_free(msg);
+		nng_mtx_lock(sub_state.mtx);
+		sub_state.received++;
+		nng_cv_wake(sub_state.cv);
+		nng_mtx_unlock(sub_state.mtx);
+	}
+}
+
+static void
+client_open(nng_socket *sock, const char *clientid)
+{
+	nng_dialer dialer;
+	nng_msg   *connmsg;
+
+	assert(nng_mqtt_client_open(sock) == 0);
+	assert(nng_dialer_create(&dialer, *sock, BENCH_URL) == 0);
+	assert(nng_mqtt_msg_alloc(&connmsg, 0) == 0);
+	nng_mqtt_msg_set_packet_type(connmsg, NNG_MQTT_CONNECT);
+	nng_mqtt_msg_set_connect_proto_version(
+	    connmsg, MQTT_PROTOCOL_VERSION_v311);
+	nng_mqtt_msg_set_connect_keep_alive(connmsg, 60);
+	nng_mqtt_msg_set_connect_clean_session(connmsg, true);
+	nng_mqtt_msg_set_connect_client_id(connmsg, clientid);
+	nng_dialer_set_ptr(dialer, NNG_OPT_MQTT_CONNMSG, connmsg);
+	assert(nng_dialer_start(dialer, 0) == 0);
+}
+
+static nng_msg *
+publish_msg(void)
+{
+	static uint8_t payload[16] = "batched publish";
+	nng_msg       *msg;
+
+	assert(nng_mqtt_msg_alloc(&msg, 0) == 0);
+	nng_mqtt_msg_set_packet_type(msg, NNG_MQTT_PUBLISH);
+	nng_mqtt_msg_set_publish_topic(msg, BENCH_TOPIC);
+	nng_mqtt_msg_set_publish_qos(msg, 0);
+	nng_mqtt_msg_set_publish_payload(msg, payload, sizeof(payload));
+	nng_mqtt_msg_encode(msg);
+	return msg;
+}
+
+// the clients, in a child process too, nng does not survive a fork
+static void
+bench_clients(int rounds, bench_result *res)
+{
+	nng_socket         sub, pub;
+	nng_thread        *thr;
+	nng_time           start, deadline;
+	nng_mqtt_topic_qos topic_qos[] = {
+		{ .qos = 0,
+		    .topic = { .buf = (uint8_t *) BENCH_TOPIC,
+		        .length     = strlen(BENCH_TOPIC) } },
+	};
+
+	assert(nng_mtx_alloc(&sub_state.mtx) == 0);
+	assert(nng_cv_alloc(&sub_state.cv, sub_state.mtx) == 0);
+	client_open(&sub, "batch-sub");
+	client_open(&pub, "batch-pub");
+	nng_msleep(200); // connacks
+	assert(nng_mqtt_subscribe(sub, topic_qos, 1, NULL) == 0);
+	assert(nng_thread_create(&thr, sub_recv, &sub) == 0);
+	nng_msleep(200); // suback
+
+	memset(res, 0, sizeof(*res));
+	start = nng_clock();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < BURST; i++) {
+			assert(nng_sendmsg(pub, publish_msg(), 0) == 0);
+			res->sent++;
+		}
+		deadline = nng_clock() + 5000;
+		nng_mtx_lock(sub_state.mtx);
+		while (sub_state.received < res->sent &&
+		    nng_cv_until(sub_state.cv, deadline) != NNG_ETIMEDOUT)
+			;
+		res->received = sub_state.received;
+		nng_mtx_unlock(sub_state.mtx);
+		if (res->received < res->sent) {
+			break;
+		}
+	}
+	res->ms = nng_clock() - start;
+
+	nng_close(pub);
+	nng_close(sub);
+	nng_thread_destroy(thr);
+}
+
+static void
+bench_run(uint32_t batch_size, int rounds, bench_result *res)
+{
+	pid_t broker, clients;
+	int   fds[2];
+	int   status;
+
+	if ((broker = fork()) == 0) {
+		conf *conf    = get_dflt_conf();
+		conf->msq_len = BURST * 4;
+		conf_ext_init(conf_ext_get());
+		conf_ext_get()->mqtt.batch_size    = batch_size;
+		conf_ext_get()->mqtt.batch_latency = 1;
+		broker_start_with_conf(conf);
+		_exit(0);
+	}
+	assert(broker > 0);
+	sleep(1); // wait a while for broker to init
+
+	assert(pipe(fds) == 0);
+	if ((clients = fork()) == 0) {
+		close(fds[0]);
+		bench_clients(rounds, res);
+		assert(write(fds[1], res, sizeof(*res)) == sizeof(*res));
+		_exit(0);
+	}
+	assert(clients > 0);
+	close(fds[1]);
+	assert(read(fds[0], res, sizeof(*res)) == sizeof(*res));
+	close(fds[0]);
+	waitpid(clients, &status, 0);
+
+	kill(broker, SIGKILL);
+	waitpid(broker, &status, 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t     sizes[] = { 1, BATCH_SIZE };
+	bench_result res[2];
+	int          rounds = 200;
+
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		rounds = 5000;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		bench_run(sizes[i], rounds, &res[i]);
+		printf("batch_size %u: %llu of %llu publishes in %llu ms, "
+		       "%.0f msg/s\n",
+		    sizes[i], (unsigned long long) res[i].received,
+		    (unsigned long long) res[i].sent,
+		    (unsigned long long) res[i].ms,
+		    res[i].ms > 0 ? res[i].received * 1000.0 / res[i].ms : 0);
+		assert(res[i].sent == (uint64_t) rounds * BURST);
+		assert(res[i].received == res[i].sent);
+	}
+	return 0;
+}
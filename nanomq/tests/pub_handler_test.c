@@ -12,6 +12,7 @@ test_handler_pub()
 	nano_work *work;
 	work            = nng_alloc(sizeof(*work));
 	work->config    = NULL;
+	work->arena     = NULL;
 	work->pipe_ct   = nng_alloc(sizeof(struct pipe_content));
 	work->proto_ver = MQTT_PROTOCOL_VERSION_v311;
 	dbtree_create(&work->db);
@@ -137,8 +138,11 @@ main()
 	assert(work->pub_packet->var_header.publish.topic_name.len == 5);
 	assert(strcmp(work->pub_packet->var_header.publish.topic_name.body, "$MQTT") == 0);
 	assert(work->pub_packet->payload.len == 4);
-	assert(strcmp(pub_packet->payload.data, "data") == 0);
+	assert(work->pub_packet->borrowed == true);
+	assert(memcmp(pub_packet->payload.data, "data", 4) == 0);
 	assert(work->pub_packet->var_header.publish.packet_id == 5);
+	// untouched wire image can be shared by fan-out as is
+	assert(work->pub_packet->encoded == true);
 
 	// test for wrong topic body
 	work->msg = tpcError_msg;
@@ -184,6 +188,10 @@ main()
 	assert(strcmp(dest_data, "data") == 0);
 
 
+	/* test for pub_packet_payload_str() */
+	assert(strcmp(pub_packet_payload_str(pub_packet), "data") == 0);
+	assert(pub_packet->borrowed == false);
+
 	/* test for free_pub_packet() */
 	free_pub_packet(pub_packet);
 	free_pub_packet(tpcError_pub_packet);
@@ -0,0 +1,134 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "include/retain_store.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/util/platform.h"
+
+static size_t
+find_count(retain_store *store, char *topic)
+{
+	nng_msg **msgs = retain_store_find(store, topic);
+	size_t    n    = cvector_size(msgs);
+
+	for (size_t i = 0; i < n; i++) {
+		nng_msg_free(msgs[i]);
+	}
+	cvector_free(msgs);
+	return n;
+}
+
+static size_t
+tree_find_count(dbtree *tree, char *topic)
+{
+	nng_msg **msgs = dbtree_find_retain(tree, topic);
+	size_t    n    = cvector_size(msgs);
+
+	for (size_t i = 0; i < n; i++) {
+		nng_msg_free(msgs[i]);
+	}
+	cvector_free(msgs);
+	return n;
+}
+
+#define BENCH_SITES 16
+#define BENCH_DEVS 256
+#define BENCH_FINDS 2000
+
+// wildcard subscribes on the store against one dbtree holding the same
+// retained msgs, the way the broker kept them before the store
+static void
+bench_wildcard(void)
+{
+	retain_store *store;
+	dbtree       *tree;
+	nng_msg      *msg;
+	char          topic[32];
+	nng_time      start;
+	uint64_t      store_ms, tree_ms;
+
+	assert(retain_store_create(&store) == 0);
+	dbtree_create(&tree);
+	for (int i = 0; i < BENCH_SITES; i++) {
+		for (int j = 0; j < BENCH_DEVS; j++) {
+			snprintf(topic, sizeof(topic), "site%d/dev%d", i, j);
+			assert(nng_msg_alloc(&msg, 0) == 0);
+			assert(retain_store_insert(store, topic, msg) == NULL);
+			assert(nng_msg_alloc(&msg, 0) == 0);
+			assert(dbtree_insert_retain(tree, topic, msg) == NULL);
+		}
+	}
+
+	start = nng_clock();
+	for (int k = 0; k < BENCH_FINDS; k++) {
+		snprintf(topic, sizeof(topic), "site%d/#", k % BENCH_SITES);
+		assert(find_count(store, topic) == BENCH_DEVS);
+	}
+	store_ms = nng_clock() - start;
+
+	start = nng_clock();
+	for (int k = 0; k < BENCH_FINDS; k++) {
+		snprintf(topic, sizeof(topic), "site%d/#", k % BENCH_SITES);
+		assert(tree_find_count(tree, topic) == BENCH_DEVS);
+	}
+	tree_ms = nng_clock() - start;
+
+	printf("%d wildcard finds over %d retained msgs: store %llu ms, "
+	       "single dbtree %llu ms\n",
+	    BENCH_FINDS, BENCH_SITES * BENCH_DEVS,
+	    (unsigned long long) store_ms, (unsigned long long) tree_ms);
+	// one shard per filter, never a walk of all of them
+	assert(store_ms <= 2 * tree_ms + 10);
+
+	dbtree_destory(tree);
+	retain_store_destroy(store);
+}
+
+int
+main()
+{
+	retain_store *store;
+	nng_msg      *msg;
+	char          topic[32];
+
+	assert(retain_store_create(&store) == 0);
+
+	// enough topics to land in every shard
+	for (int i = 0; i < 64; i++) {
+		snprintf(topic, sizeof(topic), "status/%d", i);
+		assert(nng_msg_alloc(&msg, 0) == 0);
+		assert(retain_store_insert(store, topic, msg) == NULL);
+	}
+	assert(retain_store_count(store) == 64);
+
+	// replacing hands the old msg back
+	assert(nng_msg_alloc(&msg, 0) == 0);
+	msg = retain_store_insert(store, "status/7", msg);
+	assert(msg != NULL);
+	nng_msg_free(msg);
+	assert(retain_store_count(store) == 64);
+
+	assert(find_count(store, "status/7") == 1);
+	assert(find_count(store, "status/100") == 0);
+	assert(find_count(store, "status/#") == 64);
+	assert(find_count(store, "+/1") == 1);
+
+	msg = retain_store_delete(store, "status/7");
+	assert(msg != NULL);
+	nng_msg_free(msg);
+	assert(retain_store_delete(store, "status/7") == NULL);
+	assert(retain_store_count(store) == 63);
+	assert(find_count(store, "status/#") == 63);
+
+	// a first level of their own, whatever shard it lands in
+	assert(nng_msg_alloc(&msg, 0) == 0);
+	assert(retain_store_insert(store, "alarm/1", msg) == NULL);
+	assert(find_count(store, "status/#") == 63);
+	assert(find_count(store, "alarm/#") == 1);
+	assert(find_count(store, "#") == 64);
+
+	retain_store_destroy(store);
+
+	bench_wildcard();
+	return 0;
+}
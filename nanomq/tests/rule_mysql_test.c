@@ -0,0 +1,170 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/rule_mysql.h"
+#include "include/rule_sink.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(SUPP_RULE_ENGINE) && defined(SUPP_MYSQL)
+
+#include <mysql.h>
+
+// Runs against a MySQL or MariaDB server on loopback, set with
+// NANOMQ_TEST_MYSQL_HOST, _USER, _PASSWORD and _DB. Skipped when there is
+// no server to connect to.
+
+#define TEST_TABLE "nanomq_rule_test"
+#define BENCH_ROWS 20000
+#define BENCH_BATCH 256
+
+static const char *
+env(const char *name, const char *def)
+{
+	const char *val = getenv(name);
+
+	return val != NULL ? val : def;
+}
+
+static rule_mysql server;
+static const char *db;
+static MYSQL      *probe;
+
+static long long
+count_rows(void)
+{
+	MYSQL_RES *res;
+	MYSQL_ROW  row;
+	long long  n;
+
+	assert(mysql_query(probe, "SELECT COUNT(*) FROM " TEST_TABLE) == 0);
+	assert((res = mysql_store_result(probe)) != NULL);
+	assert((row = mysql_fetch_row(res)) != NULL);
+	n = atoll(row[0]);
+	mysql_free_result(res);
+	return n;
+}
+
+static void
+put_row(rule_mysql_writer *w, int id, const char *topic)
+{
+	nng_msg *row;
+
+	assert(nng_msg_alloc(&row, 0) == 0);
+	assert(rule_row_init(row, TEST_TABLE) == 0);
+	assert(rule_row_int(row, "Id", id) == 0);
+	assert(rule_row_text(row, "Topic", topic, strlen(topic)) == 0);
+	assert(rule_row_text(row, "Username", NULL, 0) == 0);
+	assert(rule_mysql_writer_insert(w, &server, row) == 0);
+	nng_msg_free(row);
+}
+
+static void
+test_insert(rule_mysql_writer *w)
+{
+	MYSQL_RES *res;
+	MYSQL_ROW  row;
+
+	// the table is created on the first flush
+	put_row(w, 1, "a'b\\c");
+	put_row(w, 2, "t");
+	put_row(w, 3, "t");
+	assert(rule_mysql_writer_flush(w) == 0);
+	assert(count_rows() == 3);
+
+	assert(mysql_query(probe,
+	           "SELECT Topic, Username FROM " TEST_TABLE
+	           " WHERE Id = 1") == 0);
+	assert((res = mysql_store_result(probe)) != NULL);
+	assert((row = mysql_fetch_row(res)) != NULL);
+	assert(strcmp(row[0], "a'b\\c") == 0);
+	assert(row[1] == NULL);
+	mysql_free_result(res);
+}
+
+static void
+test_reconnect(rule_mysql_writer *w)
+{
+	MYSQL_RES *res;
+	MYSQL_ROW  row;
+	char       sql[64];
+
+	// kill the connection of the writer under it
+	assert(mysql_query(probe,
+	           "SELECT ID FROM information_schema.PROCESSLIST "
+	           "WHERE ID != CONNECTION_ID() AND DB = DATABASE()") == 0);
+	assert((res = mysql_store_result(probe)) != NULL);
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		snprintf(sql, sizeof(sql), "KILL %s", row[0]);
+		mysql_query(probe, sql);
+	}
+	mysql_free_result(res);
+
+	put_row(w, 4, "t");
+	assert(rule_mysql_writer_flush(w) == 0);
+	assert(count_rows() == 4);
+}
+
+static void
+bench(rule_mysql_writer *w)
+{
+	nng_time start = nng_clock();
+	nng_time ms;
+
+	for (int i = 0; i < BENCH_ROWS; i++) {
+		put_row(w, i, "bench/topic");
+		if ((i + 1) % BENCH_BATCH == 0) {
+			assert(rule_mysql_writer_flush(w) == 0);
+		}
+	}
+	assert(rule_mysql_writer_flush(w) == 0);
+	ms = nng_clock() - start;
+	assert(count_rows() == 4 + BENCH_ROWS);
+	printf("rule mysql: %d rows in %llu ms, %llu rows/s\n", BENCH_ROWS,
+	    (unsigned long long) ms,
+	    (unsigned long long) (BENCH_ROWS * 1000ull / (ms != 0 ? ms : 1)));
+}
+
+int
+main()
+{
+	rule_mysql_writer *w;
+
+	server.host     = (char *) env("NANOMQ_TEST_MYSQL_HOST", "127.0.0.1");
+	server.username = (char *) env("NANOMQ_TEST_MYSQL_USER", "root");
+	server.password = (char *) env("NANOMQ_TEST_MYSQL_PASSWORD", "");
+	server.table    = TEST_TABLE;
+	db              = env("NANOMQ_TEST_MYSQL_DB", "nanomq_test");
+
+	mysql_library_init(0, NULL, NULL);
+	probe = mysql_init(NULL);
+	if (mysql_real_connect(probe, server.host, server.username,
+	        server.password, db, 0, NULL, 0) == NULL) {
+		printf("rule mysql: skipped, %s\n", mysql_error(probe));
+		mysql_close(probe);
+		return 0;
+	}
+	assert(mysql_query(probe, "DROP TABLE IF EXISTS " TEST_TABLE) == 0);
+
+	assert(rule_mysql_writer_alloc(&w, db) == 0);
+	test_insert(w);
+	test_reconnect(w);
+	bench(w);
+	rule_mysql_writer_free(w);
+
+	mysql_query(probe, "DROP TABLE IF EXISTS " TEST_TABLE);
+	mysql_close(probe);
+	mysql_library_end();
+	return 0;
+}
+
+#else
+
+int
+main()
+{
+	return 0;
+}
+
+#endif
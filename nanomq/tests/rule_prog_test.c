@@ -0,0 +1,292 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "include/rule_prog.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/util/platform.h"
+
+#if defined(SUPP_RULE_ENGINE)
+
+static cJSON *json;
+
+static cJSON *
+get_json(void *arg)
+{
+	const char *payload = arg;
+
+	if (json == NULL) {
+		json = cJSON_Parse(payload);
+	}
+	return json;
+}
+
+static void
+input(rule_input *in, const char *topic, const char *payload)
+{
+	if (json != NULL) {
+		cJSON_Delete(json);
+		json = NULL;
+	}
+	memset(in, 0, sizeof(*in));
+	in->qos          = 1;
+	in->packet_id    = 7;
+	in->topic        = topic;
+	in->clientid     = "client-1";
+	in->username     = "alice";
+	in->payload      = (const uint8_t *) payload;
+	in->payload_len  = payload != NULL ? strlen(payload) : 0;
+	in->now          = 1700000000;
+	in->payload_json = get_json;
+	in->arg          = (void *) payload;
+}
+
+static void
+rule_init(rule *r, char *topic)
+{
+	memset(r, 0, sizeof(*r));
+	r->topic   = topic;
+	r->enabled = true;
+}
+
+static void
+rule_where(rule *r, char **filter, int field, char *val, rule_cmp_type cmp)
+{
+	r->filter          = filter;
+	filter[field]      = val;
+	r->cmp_type[field] = cmp;
+}
+
+static bool
+run(rule *r, rule_input *in)
+{
+	rule_prog p;
+	bool      ok;
+
+	assert(rule_prog_compile(&p, r, 0) == 0);
+	ok = rule_prog_run(&p, r, in);
+	rule_prog_fini(&p);
+	return ok;
+}
+
+static void
+test_fields(void)
+{
+	rule       r;
+	rule_input in;
+	char      *filter[8] = { NULL };
+
+	// no WHERE clause, everything passes
+	rule_init(&r, "a/#");
+	input(&in, "a/b", NULL);
+	assert(run(&r, &in));
+
+	rule_where(&r, filter, RULE_QOS, "1", RULE_CMP_EQUAL);
+	input(&in, "a/b", "x");
+	assert(run(&r, &in));
+	// a WHERE clause needs a payload
+	input(&in, "a/b", NULL);
+	assert(!run(&r, &in));
+
+	r.cmp_type[RULE_QOS] = RULE_CMP_GREATER;
+	input(&in, "a/b", "x");
+	assert(!run(&r, &in));
+	filter[RULE_QOS] = NULL;
+
+	rule_where(&r, filter, RULE_CLIENTID, "client-1", RULE_CMP_EQUAL);
+	assert(run(&r, &in));
+	// whole strings, not prefixes
+	filter[RULE_CLIENTID] = "client";
+	assert(!run(&r, &in));
+	r.cmp_type[RULE_CLIENTID] = RULE_CMP_UNEQUAL;
+	assert(run(&r, &in));
+	filter[RULE_CLIENTID] = NULL;
+
+	// no password was given
+	rule_where(&r, filter, RULE_PASSWORD, "x", RULE_CMP_UNEQUAL);
+	assert(!run(&r, &in));
+	filter[RULE_PASSWORD] = NULL;
+
+	rule_where(&r, filter, RULE_PAYLOAD_ALL, "x", RULE_CMP_EQUAL);
+	assert(run(&r, &in));
+	input(&in, "a/b", "xy");
+	assert(!run(&r, &in));
+	filter[RULE_PAYLOAD_ALL] = NULL;
+
+	rule_where(&r, filter, RULE_TIMESTAMP, "1600000000", RULE_CMP_GREATER);
+	assert(run(&r, &in));
+}
+
+static void
+test_payload(void)
+{
+	rule          r;
+	rule_input    in;
+	rule_payload  temp = { 0 }, loc = { 0 };
+	char        **temp_psa = NULL, **loc_psa = NULL;
+	char         *filter[8] = { NULL };
+
+	cvector_push_back(temp_psa, "temp");
+	cvector_push_back(loc_psa, "loc");
+	temp.psa      = temp_psa;
+	temp.filter   = "20";
+	temp.cmp_type = RULE_CMP_GREATER;
+	loc.psa       = loc_psa;
+	rule_init(&r, "t");
+	r.filter = filter;
+	cvector_push_back(r.payload, &temp);
+	cvector_push_back(r.payload, &loc);
+
+	input(&in, "t", "{\"temp\":25,\"loc\":\"room\"}");
+	assert(run(&r, &in));
+	assert((long) temp.value == 25);
+	assert(strcmp(loc.value, "room") == 0);
+
+	input(&in, "t", "{\"temp\":15,\"loc\":\"room\"}");
+	assert(!run(&r, &in));
+	// a field the payload lacks
+	input(&in, "t", "{\"temp\":25}");
+	assert(!run(&r, &in));
+	input(&in, "t", "not json");
+	assert(!run(&r, &in));
+
+	nng_strfree(loc.value);
+	cvector_free(r.payload);
+	cvector_free(temp_psa);
+	cvector_free(loc_psa);
+}
+
+static void
+test_repub(void)
+{
+	rule       r;
+	rule_input in;
+	repub_t    repub = { 0 };
+
+	rule_init(&r, "#");
+	r.forword_type = RULE_FORWORD_REPUB;
+	r.repub        = &repub;
+	repub.clientid = "client-1";
+	input(&in, "a", "x");
+	// never feed back what the rule published
+	assert(!run(&r, &in));
+	repub.clientid = "client-2";
+	assert(run(&r, &in));
+}
+
+static void
+test_set(void)
+{
+	rule      *rules = NULL;
+	rule       r;
+	rule_set  *set;
+	uint32_t  *ids = NULL;
+	char       topic[32];
+
+	// 500 rules, each topic matched by a few of them only
+	for (int i = 0; i < 500; i++) {
+		snprintf(topic, sizeof(topic), "dev/%d/+", i);
+		rule_init(&r, nng_strdup(topic));
+		cvector_push_back(rules, r);
+	}
+	rule_init(&r, "dev/#");
+	cvector_push_back(rules, r);
+	rule_init(&r, "dev/42/temp");
+	cvector_push_back(rules, r);
+
+	assert(rule_set_compile(&set, rules) == 0);
+	assert(rule_set_size(set) == 502);
+
+	rule_set_match(set, "dev/42/temp", &ids);
+	assert(cvector_size(ids) == 3);
+	assert(ids[0] == 42 && ids[1] == 500 && ids[2] == 501);
+	assert(rule_set_prog(set, ids[2])->index == 501);
+
+	rule_set_match(set, "dev/7", &ids);
+	assert(cvector_size(ids) == 1 && ids[0] == 500);
+	rule_set_match(set, "other", &ids);
+	assert(cvector_size(ids) == 0);
+
+	// a REST call drops a rule, the set still reads the ones it compiled
+	cvector_erase(rules, 42);
+	rule_set_match(set, "dev/42/temp", &ids);
+	assert(cvector_size(ids) == 3);
+	assert(strcmp(rule_set_rule(set, ids[0])->topic, "dev/42/+") == 0);
+	assert(strcmp(rule_set_rule(set, ids[2])->topic, "dev/42/temp") == 0);
+	assert(rule_set_rule(set, 502) == NULL);
+
+	cvector_free(ids);
+	for (int i = 0; i < 500; i++) {
+		nng_strfree(rule_set_rule(set, i)->topic);
+	}
+	rule_set_free(set);
+	cvector_free(rules);
+}
+
+static void
+quiesce(void *arg)
+{
+	rule_set_quiesce();
+	*(bool *) arg = true;
+}
+
+// a set replaced under a work stays until the work puts it back
+static void
+test_quiesce(void)
+{
+	conf_rule   cr = { 0 };
+	rule        r;
+	rule_set   *held;
+	nng_thread *thr;
+	bool        done = false;
+
+	rule_init(&r, "a");
+	cvector_push_back(cr.rules, r);
+	rule_init(&r, "b");
+	cvector_push_back(cr.rules, r);
+	assert(rule_set_load(&cr) == 0);
+	assert((held = rule_set_get()) != NULL);
+	assert(rule_set_size(held) == 2);
+
+	cvector_erase(cr.rules, 0);
+	assert(rule_set_load(&cr) == 0);
+	assert(nng_thread_create(&thr, quiesce, &done) == 0);
+	nng_msleep(100);
+	assert(!done);
+	assert(strcmp(rule_set_rule(held, 0)->topic, "a") == 0);
+	rule_set_put(held);
+	nng_thread_destroy(thr);
+	assert(done);
+
+	held = rule_set_get();
+	assert(rule_set_size(held) == 1);
+	rule_set_put(held);
+	// nothing retired, nothing to wait for
+	rule_set_quiesce();
+	rule_set_fini();
+	cvector_free(cr.rules);
+}
+
+int
+main()
+{
+	test_fields();
+	test_payload();
+	test_repub();
+	test_set();
+	test_quiesce();
+	if (json != NULL) {
+		cJSON_Delete(json);
+	}
+	return 0;
+}
+
+#else
+
+int
+main()
+{
+	return 0;
+}
+
+#endif
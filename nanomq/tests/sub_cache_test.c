@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <string.h>
+
+#include "include/sub_cache.h"
+#include "nng/supplemental/nanolib/cvector.h"
+
+static size_t   seen_len;
+static uint32_t seen[8];
+
+static void
+collect(uint32_t *pipes, size_t len, void *arg)
+{
+	(void) arg;
+	seen_len = len;
+	memcpy(seen, pipes, len * sizeof(uint32_t));
+}
+
+int
+main()
+{
+	uint32_t       *pipes = NULL;
+	uint64_t        gen;
+	sub_cache_stats stats;
+
+	// nothing is cached before init
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_MISS);
+	assert(sub_cache_init(100) == 0);
+
+	cvector_push_back(pipes, 1);
+	cvector_push_back(pipes, 2);
+
+	gen = sub_cache_generation("a/b");
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_MISS);
+	sub_cache_put("a/b", gen, pipes, false);
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_HIT);
+	assert(seen_len == 2 && seen[0] == 1 && seen[1] == 2);
+
+	// topics without subscribers are cached as well
+	sub_cache_put("a/c", gen, NULL, true);
+	seen_len = 0;
+	assert(sub_cache_find("a/c", collect, NULL) == SUB_CACHE_HIT_SHARED);
+	assert(seen_len == 0);
+
+	// a filter under another first level leaves the topic cached
+	sub_cache_invalidate("x/+");
+	sub_cache_invalidate("$share/g/x/#");
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_HIT);
+
+	// one under its first level drops it, shared or not
+	sub_cache_invalidate("$share/g/a/#");
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_MISS);
+
+	// a walk that raced with a change is never stored
+	sub_cache_put("a/b", gen, pipes, false);
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_MISS);
+
+	// a wildcard first level can match any topic, so can an unknown
+	// filter
+	gen = sub_cache_generation("a/b");
+	sub_cache_put("a/b", gen, pipes, false);
+	sub_cache_invalidate("+/b");
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_MISS);
+	gen = sub_cache_generation("a/b");
+	sub_cache_put("a/b", gen, pipes, false);
+	sub_cache_invalidate(NULL);
+	assert(sub_cache_find("a/b", collect, NULL) == SUB_CACHE_MISS);
+
+	sub_cache_get_stats(&stats);
+	assert(stats.hits == 3);
+	assert(stats.misses == 5);
+	assert(stats.invalidations == 5);
+
+	cvector_free(pipes);
+	sub_cache_fini();
+	return 0;
+}
@@ -31,7 +31,7 @@ main()
 	// work->code       = SUCCESS;
 	// init dbtree
 	dbtree_create(&work->db);
-	dbtree_create(&work->db_ret);
+	retain_store_create(&work->db_ret);
 	dbhash_init_pipe_table();
 
 	// init msg.
@@ -124,7 +124,7 @@ main()
 	nng_free(nanomq_conf, sizeof(conf));
 	dbhash_destroy_pipe_table();
 	dbtree_destory(work->db);
-	dbtree_destory(work->db_ret);
+	retain_store_destroy(work->db_ret);
 	nng_msg_free(ack_msg);
 	nng_msg_free(msg);
 	nng_free(work, sizeof(struct work));
@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <string.h>
+
+#include "include/topic_trie.h"
+
+static uint32_t seen;
+
+static void
+collect(uint32_t id, void *arg)
+{
+	(void) arg;
+	seen |= 1u << id;
+}
+
+static uint32_t
+match(topic_trie *trie, const char *topic)
+{
+	seen = 0;
+	topic_trie_match(trie, topic, collect, NULL);
+	return seen;
+}
+
+int
+main()
+{
+	topic_trie *trie;
+
+	assert(topic_trie_create(&trie) == 0);
+	assert(topic_trie_empty(trie));
+
+	assert(topic_trie_insert(trie, "a/b", 0) == 0);
+	assert(topic_trie_insert(trie, "a/+", 1) == 0);
+	assert(topic_trie_insert(trie, "a/#", 2) == 0);
+	assert(topic_trie_insert(trie, "#", 3) == 0);
+	assert(topic_trie_insert(trie, "+/b/c", 4) == 0);
+	assert(topic_trie_insert(trie, "a/b", 5) == 0);
+	assert(topic_trie_insert(trie, "x//y", 6) == 0);
+	assert(!topic_trie_empty(trie));
+
+	assert(match(trie, "a/b") == ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 5)));
+	assert(match(trie, "a") == ((1 << 2) | (1 << 3)));
+	assert(match(trie, "a/c") == ((1 << 1) | (1 << 2) | (1 << 3)));
+	assert(match(trie, "z/b/c") == ((1 << 3) | (1 << 4)));
+	assert(match(trie, "a/b/c") == ((1 << 2) | (1 << 3) | (1 << 4)));
+	assert(match(trie, "x//y") == ((1 << 3) | (1 << 6)));
+	assert(match(trie, "b") == (1 << 3));
+
+	// subscription filters are compared level by level
+	assert(match(trie, "a/+") == ((1 << 1) | (1 << 2) | (1 << 3)));
+
+	topic_trie_destroy(trie);
+	return 0;
+}
@@ -0,0 +1,204 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <string.h>
+
+#include "include/topic_trie.h"
+#include "nng/nng.h"
+#include "nng/supplemental/nanolib/cvector.h"
+
+typedef struct trie_node trie_node;
+
+struct trie_node {
+	char       *level;
+	size_t      len;
+	trie_node **children; // cvector, literal levels
+	trie_node  *plus;     // '+' child
+	trie_node  *hash;     // '#' child
+	uint32_t   *ids;      // cvector, filters ending here
+};
+
+struct topic_trie {
+	trie_node *root;
+	size_t     filters;
+};
+
+static trie_node *
+node_alloc(const char *level, size_t len)
+{
+	trie_node *n;
+
+	if ((n = nng_zalloc(sizeof(*n))) == NULL) {
+		return NULL;
+	}
+	if (len > 0) {
+		if ((n->level = nng_alloc(len)) == NULL) {
+			nng_free(n, sizeof(*n));
+			return NULL;
+		}
+		memcpy(n->level, level, len);
+	}
+	n->len = len;
+	return n;
+}
+
+static void
+node_free(trie_node *n)
+{
+	if (n == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < cvector_size(n->children); i++) {
+		node_free(n->children[i]);
+	}
+	cvector_free(n->children);
+	node_free(n->plus);
+	node_free(n->hash);
+	cvector_free(n->ids);
+	if (n->level != NULL) {
+		nng_free(n->level, n->len);
+	}
+	nng_free(n, sizeof(*n));
+}
+
+static trie_node *
+node_child(trie_node *n, const char *level, size_t len)
+{
+	for (size_t i = 0; i < cvector_size(n->children); i++) {
+		trie_node *c = n->children[i];
+		if (c->len == len && memcmp(c->level, level, len) == 0) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+int
+topic_trie_create(topic_trie **trie)
+{
+	topic_trie *t;
+
+	if ((t = nng_zalloc(sizeof(*t))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	if ((t->root = node_alloc(NULL, 0)) == NULL) {
+		nng_free(t, sizeof(*t));
+		return NNG_ENOMEM;
+	}
+	*trie = t;
+	return 0;
+}
+
+void
+topic_trie_destroy(topic_trie *trie)
+{
+	if (trie == NULL) {
+		return;
+	}
+	node_free(trie->root);
+	nng_free(trie, sizeof(*trie));
+}
+
+int
+topic_trie_insert(topic_trie *trie, const char *filter, uint32_t id)
+{
+	trie_node  *n = trie->root;
+	trie_node **slot;
+	const char *level = filter;
+	const char *end;
+	size_t      len;
+
+	for (;;) {
+		end = strchr(level, '/');
+		len = end == NULL ? strlen(level) : (size_t) (end - level);
+
+		if (len == 1 && level[0] == '#') {
+			slot = &n->hash;
+		} else if (len == 1 && level[0] == '+') {
+			slot = &n->plus;
+		} else {
+			slot = NULL;
+		}
+		if (slot != NULL) {
+			if (*slot == NULL && (*slot = node_alloc(level, len)) == NULL) {
+				return NNG_ENOMEM;
+			}
+			n = *slot;
+		} else {
+			trie_node *c = node_child(n, level, len);
+			if (c == NULL) {
+				if ((c = node_alloc(level, len)) == NULL) {
+					return NNG_ENOMEM;
+				}
+				cvector_push_back(n->children, c);
+			}
+			n = c;
+		}
+		// nothing may follow '#'
+		if (end == NULL || (len == 1 && level[0] == '#')) {
+			break;
+		}
+		level = end + 1;
+	}
+	cvector_push_back(n->ids, id);
+	trie->filters++;
+	return 0;
+}
+
+static void
+node_report(trie_node *n, topic_trie_cb cb, void *arg)
+{
+	for (size_t i = 0; i < cvector_size(n->ids); i++) {
+		cb(n->ids[i], arg);
+	}
+}
+
+static void
+node_match(trie_node *n, const char *level, topic_trie_cb cb, void *arg)
+{
+	const char *end;
+	size_t      len;
+	trie_node  *c;
+
+	// "a/#" also matches "a"
+	if (n->hash != NULL) {
+		node_report(n->hash, cb, arg);
+	}
+	if (level == NULL) {
+		node_report(n, cb, arg);
+		return;
+	}
+	end = strchr(level, '/');
+	len = end == NULL ? strlen(level) : (size_t) (end - level);
+
+	if ((c = node_child(n, level, len)) != NULL) {
+		node_match(c, end == NULL ? NULL : end + 1, cb, arg);
+	}
+	if (n->plus != NULL) {
+		node_match(n->plus, end == NULL ? NULL : end + 1, cb, arg);
+	}
+}
+
+/**
+ * @brief call cb with the id of every filter matching topic, once per
+ *        inserted filter. A topic that is a filter itself has its '+'
+ *        and '#' levels compared literally, as topic_filter() does.
+ */
+void
+topic_trie_match(topic_trie *trie, const char *topic, topic_trie_cb cb,
+    void *arg)
+{
+	node_match(trie->root, topic, cb, arg);
+}
+
+bool
+topic_trie_empty(topic_trie *trie)
+{
+	return trie->filters == 0;
+}
@@ -12,13 +12,16 @@
 #include <string.h>
 #include <time.h>
 
+#include "include/conf_ext.h"
 #include "include/webhook_inproc.h"
+#include "include/webhook_pool.h"
 #include "nanomq.h"
 #include "nng/nng.h"
 #include "nng/protocol/pipeline0/pull.h"
 #include "nng/protocol/pipeline0/push.h"
 #include "nng/supplemental/http/http.h"
 #include "nng/supplemental/nanolib/conf.h"
+#include "nng/supplemental/nanolib/cvector.h"
 #include "nng/supplemental/nanolib/log.h"
 #include "nng/supplemental/nanolib/utils.h"
 #include "nng/supplemental/util/platform.h"
@@ -34,92 +37,108 @@ struct hook_work {
 	nng_msg *      msg;
 	nng_thread *   thread;
 	nng_mtx *      mtx;
+	nng_cv *       cv; // signalled when lmq gets a msg
 	nng_lmq *      lmq;
 	nng_socket     sock;
 	conf_web_hook *conf;
+	webhook_pool  *pool;
 	uint32_t       id;
 	bool           busy;
+	// events collected into one JSON array, NULL when none
+	nng_msg  *batch;
+	uint32_t  batch_events;
+	nng_time  batch_deadline;
+	nng_time *batch_ts; // cvector, enqueue time of each event
 };
 
 static void webhook_cb(void *arg);
 
-static nng_thread *inproc_thr;
+static nng_thread   *inproc_thr;
+static webhook_pool *hook_pool;
+
+static struct {
+	nng_atomic_u64 *queued; // msgs in all lmqs
+	nng_atomic_u64 *depth[WEBHOOK_HIST_BUCKETS];
+} hook_stats;
 
 static void
-send_msg(conf_web_hook *conf, nng_msg *msg)
+hist_add(nng_atomic_u64 **hist, uint64_t val)
 {
-	nng_http_client *client = NULL;
-	nng_http_conn *  conn   = NULL;
-	nng_url *        url    = NULL;
-	nng_aio *        aio    = NULL;
-	nng_http_req *   req    = NULL;
-	nng_http_res *   res    = NULL;
-	int              rv;
-
-	if (((rv = nng_url_parse(&url, conf->url)) != 0) ||
-	    ((rv = nng_http_client_alloc(&client, url)) != 0) ||
-	    ((rv = nng_http_req_alloc(&req, url)) != 0) ||
-	    ((rv = nng_http_res_alloc(&res)) != 0) ||
-	    ((rv = nng_aio_alloc(&aio, NULL, NULL)) != 0)) {
-		log_error("init failed: %s\n", nng_strerror(rv));
-		goto out;
-	}
-
-	// Start connection process...
-	nng_aio_set_timeout(aio, 1000);
-	nng_http_client_connect(client, aio);
+	size_t i = 0;
 
-	// Wait for it to finish.
-
-	nng_aio_wait(aio);
-	if ((rv = nng_aio_result(aio)) != 0) {
-		log_error("Connect failed: %s", nng_strerror(rv));
-		nng_aio_finish_sync(aio, rv);
-		goto out;
+	while (i < WEBHOOK_HIST_BUCKETS - 1 && val >= (1ull << i)) {
+		i++;
 	}
+	nng_atomic_inc64(hist[i]);
+}
 
-	// Get the connection, at the 0th output.
-	conn = nng_aio_get_output(aio, 0);
+// the enqueue time travels in the msg header, the body is the event
+static nng_time
+event_enqueued(nng_msg *msg)
+{
+	uint64_t ts = 0;
 
-	// Request is already set up with URL, and for GET via HTTP/1.1.
-	// The Host: header is already set up too.
-	// set_data(req, conf_req, params);
-	// Send the request, and wait for that to finish.
-	for (size_t i = 0; i < conf->header_count; i++) {
-		nng_http_req_add_header(
-		    req, conf->headers[i]->key, conf->headers[i]->value);
+	// appended in network byte order
+	if (nng_msg_header_len(msg) == sizeof(ts)) {
+		nng_msg_header_trim_u64(msg, &ts);
 	}
+	return ts;
+}
 
-	nng_http_req_set_method(req, "POST");
-	nng_http_req_set_data(req, nng_msg_body(msg), nng_msg_len(msg));
-	nng_http_conn_write_req(conn, req, aio);
-	nng_aio_set_timeout(aio, 1000);
-	nng_aio_wait(aio);
+// one event, one request, the pool times it until it is answered
+static void
+event_send(struct hook_work *w, nng_msg *msg)
+{
+	nng_time *ts = NULL;
 
-	if ((rv = nng_aio_result(aio)) != 0) {
-		log_error("Write req failed: %s", nng_strerror(rv));
-		nng_aio_finish_sync(aio, rv);
-		goto out;
-	}
+	cvector_push_back(ts, event_enqueued(msg));
+	webhook_pool_send(w->pool, msg, ts);
+}
 
-out:
-	if (url) {
-		nng_url_free(url);
-	}
-	if (conn) {
-		nng_http_conn_close(conn);
-	}
-	if (client) {
-		nng_http_client_free(client);
+static void
+batch_flush(struct hook_work *w)
+{
+	if (w->batch == NULL) {
+		return;
 	}
-	if (req) {
-		nng_http_req_free(req);
+	nng_msg_append(w->batch, "]", 1);
+	// one request, counted once by the pool whatever its size, the
+	// pool takes the arrival times along
+	webhook_pool_send(w->pool, w->batch, w->batch_ts);
+	w->batch        = NULL;
+	w->batch_ts     = NULL;
+	w->batch_events = 0;
+}
+
+// append the event to the pending array, flush on whichever limit of
+// webhook.batch is reached first
+static void
+batch_add(struct hook_work *w, nng_msg *msg)
+{
+	conf_webhook_batch *b = &conf_ext_get()->webhook.batch;
+
+	if (w->batch != NULL &&
+	    nng_msg_len(w->batch) + nng_msg_len(msg) + 2 > b->max_bytes) {
+		batch_flush(w);
 	}
-	if (res) {
-		nng_http_res_free(res);
+	if (w->batch == NULL) {
+		if (nng_msg_alloc(&w->batch, 0) != 0) {
+			event_send(w, msg);
+			return;
+		}
+		nng_msg_append(w->batch, "[", 1);
+		w->batch_deadline = nng_clock() + b->max_delay;
+	} else {
+		nng_msg_append(w->batch, ",", 1);
 	}
-	if (aio) {
-		nng_aio_free(aio);
+	nng_msg_append(w->batch, nng_msg_body(msg), nng_msg_len(msg));
+	cvector_push_back(w->batch_ts, event_enqueued(msg));
+	nng_msg_free(msg);
+
+	if (++w->batch_events >= b->max_events ||
+	    nng_msg_len(w->batch) + 1 >= b->max_bytes ||
+	    nng_clock() >= w->batch_deadline) {
+		batch_flush(w);
 	}
 }
 
@@ -132,26 +151,33 @@ thread_cb(void *arg)
 	nng_msg *         msg = NULL;
 	int               rv;
 	while (true) {
-		if (!nng_lmq_empty(lmq)) {
-			nng_mtx_lock(w->mtx);
-			rv = nng_lmq_get(lmq, &msg);
-			nng_mtx_unlock(w->mtx);
-			if (0 == rv) {
-				send_msg(w->conf, msg);
-				nng_msg_free(msg);
-			}
-		} else {
+		nng_mtx_lock(w->mtx);
+		while (nng_lmq_empty(lmq)) {
 			// try to reduce lmq cap
-			size_t lmq_len = nng_lmq_len(w->lmq);
-			if (lmq_len > (NANO_LMQ_INIT_CAP * 2)) {
-				size_t lmq_cap = nng_lmq_cap(w->lmq);
-				if (lmq_cap > (lmq_len * 2)) {
-					nng_mtx_lock(w->mtx);
-					nng_lmq_resize(w->lmq, lmq_cap / 2);
-					nng_mtx_unlock(w->mtx);
-				}
+			size_t lmq_cap = nng_lmq_cap(lmq);
+			if (lmq_cap > NANO_LMQ_INIT_CAP * 2) {
+				nng_lmq_resize(lmq, lmq_cap / 2);
+			}
+			if (w->batch == NULL) {
+				nng_cv_wait(w->cv);
+			} else if (nng_cv_until(w->cv, w->batch_deadline) ==
+			    NNG_ETIMEDOUT) {
+				nng_mtx_unlock(w->mtx);
+				batch_flush(w);
+				nng_mtx_lock(w->mtx);
 			}
-			nng_msleep(10);
+		}
+		rv = nng_lmq_get(lmq, &msg);
+		nng_mtx_unlock(w->mtx);
+		if (0 != rv) {
+			continue;
+		}
+		nng_atomic_dec64(hook_stats.queued);
+		if (conf_ext_get()->webhook.batch.max_events > 1) {
+			batch_add(w, msg);
+		} else {
+			// the pool frees msg once it is answered
+			event_send(w, msg);
 		}
 	}
 }
@@ -173,6 +199,8 @@ webhook_cb(void *arg)
 			nng_fatal("nng_recv_aio", rv);
 		}
 		work->msg = nng_aio_get_msg(work->aio);
+		nng_msg_header_clear(work->msg);
+		nng_msg_header_append_u64(work->msg, nng_clock());
 		nng_mtx_lock(work->mtx);
 		if (nng_lmq_full(work->lmq)) {
 			size_t lmq_cap = nng_lmq_cap(work->lmq);
@@ -181,7 +209,11 @@ webhook_cb(void *arg)
 				nng_fatal("nng_lmq_resize", rv);
 			}
 		}
+		// counted before the sender can take it out again
+		nng_atomic_inc64(hook_stats.queued);
+		hist_add(hook_stats.depth, nng_atomic_get64(hook_stats.queued));
 		nng_lmq_put(work->lmq, work->msg);
+		nng_cv_wake1(work->cv);
 		nng_mtx_unlock(work->mtx);
 		work->msg   = NULL;
 		work->state = HOOK_RECV;
@@ -195,12 +227,12 @@ webhook_cb(void *arg)
 }
 
 static struct hook_work *
-alloc_work(nng_socket sock, conf_web_hook *conf)
+alloc_work(nng_socket sock, conf_web_hook *conf, webhook_pool *pool)
 {
 	struct hook_work *w;
 	int               rv;
 
-	if ((w = nng_alloc(sizeof(*w))) == NULL) {
+	if ((w = nng_zalloc(sizeof(*w))) == NULL) {
 		nng_fatal("nng_alloc", NNG_ENOMEM);
 	}
 	if ((rv = nng_aio_alloc(&w->aio, webhook_cb, w)) != 0) {
@@ -209,17 +241,22 @@ alloc_work(nng_socket sock, conf_web_hook *conf)
 	if ((rv = nng_mtx_alloc(&w->mtx)) != 0) {
 		nng_fatal("nng_mtx_alloc", rv);
 	}
+	if ((rv = nng_cv_alloc(&w->cv, w->mtx)) != 0) {
+		nng_fatal("nng_cv_alloc", rv);
+	}
 	if ((rv = nng_lmq_alloc(&w->lmq, NANO_LMQ_INIT_CAP) != 0)) {
 		nng_fatal("nng_lmq_alloc", rv);
 	}
-	if ((rv = nng_thread_create(&w->thread, thread_cb, w)) != 0) {
-		nng_fatal("nng_thread_create", rv);
-	}
 
 	w->conf  = conf;
+	w->pool  = pool;
 	w->sock  = sock;
 	w->state = HOOK_INIT;
 	w->busy  = false;
+	// the sender reads the fields above
+	if ((rv = nng_thread_create(&w->thread, thread_cb, w)) != 0) {
+		nng_fatal("nng_thread_create", rv);
+	}
 	return (w);
 }
 
@@ -241,8 +278,19 @@ webhook_thr(void *arg)
 		nng_fatal("nng_rep0_open", rv);
 	}
 
+	nng_atomic_alloc64(&hook_stats.queued);
+	for (i = 0; i < WEBHOOK_HIST_BUCKETS; i++) {
+		nng_atomic_alloc64(&hook_stats.depth[i]);
+	}
+	// one pool of keep-alive connections shared by all senders
+	if ((rv = webhook_pool_create(&hook_pool, &conf->web_hook,
+	         conf_ext_get()->webhook.connections,
+	         conf_ext_get()->webhook.max_inflight)) != 0) {
+		nng_fatal("webhook_pool_create", rv);
+	}
+
 	for (i = 0; i < conf->web_hook.pool_size; i++) {
-		works[i]     = alloc_work(sock, &conf->web_hook);
+		works[i]     = alloc_work(sock, &conf->web_hook, hook_pool);
 		works[i]->id = i;
 	}
 	// NanoMQ core thread talks to others via INPROC
@@ -276,6 +324,20 @@ start_webhook_service(conf *conf)
 	return rv;
 }
 
+void
+webhook_get_stats(webhook_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	webhook_pool_get_stats(hook_pool, &stats->pool);
+	if (hook_stats.queued == NULL) {
+		return;
+	}
+	stats->queued = nng_atomic_get64(hook_stats.queued);
+	for (size_t i = 0; i < WEBHOOK_HIST_BUCKETS; i++) {
+		stats->depth[i] = nng_atomic_get64(hook_stats.depth[i]);
+	}
+}
+
 int
 stop_webhook_service(void)
 {
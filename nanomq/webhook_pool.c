@@ -0,0 +1,765 @@
+//
+// Copyright 2023 NanoMQ Team, Inc. <jaylin@emqx.io>
+//
+// This software is supplied under the terms of the MIT License, a
+// copy of which should be located in the distribution where this
+// file was obtained (LICENSE.txt).  A copy of the license may also be
+// found online at https://opensource.org/licenses/MIT.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/webhook_pool.h"
+#include "nng/nng.h"
+#include "nng/supplemental/http/http.h"
+#include "nng/supplemental/nanolib/cvector.h"
+#include "nng/supplemental/nanolib/log.h"
+#include "nng/supplemental/util/platform.h"
+
+typedef enum {
+	CONN_DOWN = 0,
+	CONN_CONNECTING,
+	CONN_READY,
+	// closed, waiting for the outstanding aios to come back
+	CONN_CLOSING,
+} conn_state;
+
+typedef struct webhook_conn webhook_conn;
+
+// a request not on a connection
+typedef struct {
+	nng_msg  *msg;
+	nng_time *enqueued; // cvector, arrival of each event in msg
+	nng_time  queued;   // fails when still queued WEBHOOK_POOL_TIMEOUT later
+} webhook_req;
+
+typedef struct {
+	webhook_conn *c;
+	nng_http_req *req; // headers are set once, only the body changes
+	nng_aio      *aio; // write
+	nng_msg      *msg; // body of the request
+	nng_time     *enqueued;
+	nng_time      sent;
+	bool          writing;  // write not completed yet
+	bool          answered; // response read or connection lost
+} webhook_slot;
+
+struct webhook_conn {
+	webhook_pool  *pool;
+	conn_state     state;
+	nng_http_conn *conn;
+	nng_aio       *cn_aio;
+	// one reader per connection, responses come in request order
+	nng_aio      *rd_aio;
+	nng_http_res *res;
+	bool          reading;
+	bool          rd_body;
+	void         *rd_buf;
+	size_t        rd_len;
+	// requests in write order, head is the oldest. They are written one
+	// at a time, those from head + written on never reached the socket.
+	webhook_slot *slots;
+	uint32_t      head;
+	uint32_t      count;
+	uint32_t      answered;
+	uint32_t      written;
+	bool          writing;
+	uint64_t      requests; // sent over this connection
+	// a response of known length was read, until then the connection
+	// carries one request, a body running until close would take the
+	// pipelined requests down with it
+	bool          framed;
+	nng_duration  backoff;
+	nng_time      retry_at;
+};
+
+struct webhook_pool {
+	conf_web_hook   *conf;
+	nng_url         *url;
+	nng_http_client *client;
+	nng_mtx         *mtx;
+	// runs while requests are queued or unanswered, reconnects after
+	// the backoff, expires queued requests and drops silent connections
+	nng_aio         *timer;
+	bool             ticking;
+	webhook_conn    *conns;
+	uint32_t         nconns;
+	// requests waiting for a connection with room, oldest at head
+	webhook_req     *queue;
+	uint32_t         q_head;
+	uint32_t         q_len;
+	uint32_t         q_cap;
+	uint32_t         max_inflight;
+	uint32_t         next;
+	bool             closed;
+	nng_atomic_u64  *connects;
+	nng_atomic_u64  *reuses;
+	nng_atomic_u64  *failures;
+	nng_atomic_u64  *latency[WEBHOOK_HIST_BUCKETS];
+};
+
+static void conn_connect_cb(void *arg);
+static void conn_read_cb(void *arg);
+static void slot_write_cb(void *arg);
+static void pool_timer_cb(void *arg);
+static void pool_dispatch(webhook_pool *p, nng_time now);
+
+static void
+req_free(nng_msg *msg, nng_time *enqueued)
+{
+	nng_msg_free(msg);
+	cvector_free(enqueued);
+}
+
+// new requests go behind, those taken back from a connection in front
+static int
+queue_put(webhook_pool *p, const webhook_req *r, bool front)
+{
+	webhook_req *q;
+	uint32_t     cap;
+
+	if (p->q_len == p->q_cap) {
+		cap = p->q_cap > 0 ? p->q_cap * 2 : p->max_inflight;
+		if ((q = nng_alloc(cap * sizeof(webhook_req))) == NULL) {
+			return NNG_ENOMEM;
+		}
+		for (uint32_t i = 0; i < p->q_len; i++) {
+			q[i] = p->queue[(p->q_head + i) % p->q_cap];
+		}
+		if (p->queue != NULL) {
+			nng_free(p->queue, p->q_cap * sizeof(webhook_req));
+		}
+		p->queue  = q;
+		p->q_cap  = cap;
+		p->q_head = 0;
+	}
+	if (front) {
+		p->q_head = (p->q_head + p->q_cap - 1) % p->q_cap;
+		p->queue[p->q_head] = *r;
+	} else {
+		p->queue[(p->q_head + p->q_len) % p->q_cap] = *r;
+	}
+	p->q_len++;
+	return 0;
+}
+
+static void
+queue_get(webhook_pool *p, webhook_req *r)
+{
+	*r        = p->queue[p->q_head];
+	p->q_head = (p->q_head + 1) % p->q_cap;
+	p->q_len--;
+}
+
+// the response to s came in, time each event it carried from its arrival
+static void
+slot_answered(webhook_pool *p, webhook_slot *s, nng_time now)
+{
+	nng_time t;
+	size_t   b;
+
+	for (size_t i = 0; i < cvector_size(s->enqueued); i++) {
+		t = now > s->enqueued[i] ? now - s->enqueued[i] : 0;
+		b = 0;
+		while (b < WEBHOOK_HIST_BUCKETS - 1 && t >= (1ull << b)) {
+			b++;
+		}
+		nng_atomic_inc64(p->latency[b]);
+	}
+}
+
+static bool
+conn_has_room(webhook_conn *c)
+{
+	return c->count < (c->framed ? c->pool->max_inflight : 1);
+}
+
+// drop the answered requests at the head of the ring
+static void
+conn_reap(webhook_conn *c)
+{
+	webhook_pool *p     = c->pool;
+	bool          freed = false;
+	webhook_slot *s;
+
+	while (c->count > 0) {
+		s = &c->slots[c->head];
+		if (!s->answered || s->writing) {
+			break;
+		}
+		req_free(s->msg, s->enqueued);
+		s->msg      = NULL;
+		s->enqueued = NULL;
+		s->answered = false;
+		c->head     = (c->head + 1) % p->max_inflight;
+		c->count--;
+		c->answered--;
+		c->written--;
+		freed = true;
+	}
+	if (c->state == CONN_CLOSING && c->count == 0 && !c->reading) {
+		c->state    = CONN_DOWN;
+		c->retry_at = nng_clock();
+		freed       = true;
+	}
+	if (freed) {
+		pool_dispatch(p, nng_clock());
+	}
+}
+
+// Detach the connection. A request written and not answered may have
+// been processed and fails, one never written goes back in front of the
+// queue for another connection. The caller closes what is returned once
+// the lock is dropped.
+static nng_http_conn *
+conn_drop(webhook_conn *c)
+{
+	webhook_pool  *p  = c->pool;
+	nng_http_conn *hc = c->conn;
+	webhook_slot  *s;
+	webhook_req    r;
+
+	if (c->state != CONN_READY) {
+		return NULL;
+	}
+	// newest first, so they keep their order in front of the queue
+	while (c->count > c->written) {
+		s = &c->slots[(c->head + c->count - 1) % p->max_inflight];
+		r.msg      = s->msg;
+		r.enqueued = s->enqueued;
+		r.queued   = nng_clock();
+		if (p->closed || queue_put(p, &r, true) != 0) {
+			nng_atomic_inc64(p->failures);
+			req_free(s->msg, s->enqueued);
+		}
+		s->msg      = NULL;
+		s->enqueued = NULL;
+		c->count--;
+	}
+	for (uint32_t i = c->answered; i < c->count; i++) {
+		s           = &c->slots[(c->head + i) % p->max_inflight];
+		s->answered = true;
+		nng_atomic_inc64(p->failures);
+	}
+	c->answered = c->count;
+	c->conn     = NULL;
+	c->state    = CONN_CLOSING;
+	conn_reap(c);
+	return hc;
+}
+
+static void
+conn_start_read(webhook_conn *c)
+{
+	int rv;
+
+	if (c->res != NULL) {
+		nng_http_res_free(c->res);
+		c->res = NULL;
+	}
+	if ((rv = nng_http_res_alloc(&c->res)) != 0) {
+		log_error("webhook response alloc failed: %s", nng_strerror(rv));
+		return;
+	}
+	c->reading = true;
+	c->rd_body = false;
+	nng_http_conn_read_res(c->conn, c->res, c->rd_aio);
+}
+
+static void
+conn_connect_cb(void *arg)
+{
+	webhook_conn  *c  = arg;
+	webhook_pool  *p  = c->pool;
+	nng_http_conn *hc = NULL;
+	int            rv = nng_aio_result(c->cn_aio);
+
+	nng_mtx_lock(p->mtx);
+	if (rv == 0) {
+		hc = nng_aio_get_output(c->cn_aio, 0);
+	}
+	if (rv == 0 && !p->closed) {
+		c->conn     = hc;
+		hc          = NULL;
+		c->state    = CONN_READY;
+		c->requests = 0;
+		c->framed   = false;
+		c->backoff  = WEBHOOK_POOL_BACKOFF_MIN;
+		nng_atomic_inc64(p->connects);
+		conn_start_read(c);
+		pool_dispatch(p, nng_clock());
+	} else {
+		if (rv != 0) {
+			log_warn("webhook connect to %s failed: %s, retry in "
+			         "%d ms",
+			    p->conf->url, nng_strerror(rv), c->backoff);
+			nng_atomic_inc64(p->failures);
+		}
+		c->state    = CONN_DOWN;
+		c->retry_at = nng_clock() + c->backoff;
+		c->backoff  = c->backoff * 2 > WEBHOOK_POOL_BACKOFF_MAX
+		     ? WEBHOOK_POOL_BACKOFF_MAX
+		     : c->backoff * 2;
+	}
+	nng_mtx_unlock(p->mtx);
+
+	if (hc != NULL) {
+		nng_http_conn_close(hc);
+	}
+}
+
+static void
+conn_read_cb(void *arg)
+{
+	webhook_conn  *c  = arg;
+	webhook_pool  *p  = c->pool;
+	nng_http_conn *hc = NULL;
+	webhook_slot  *s;
+	const char    *hdr;
+	uint16_t       status;
+	bool           keep = true;
+	int            rv   = nng_aio_result(c->rd_aio);
+
+	nng_mtx_lock(p->mtx);
+	c->reading = false;
+	if (rv != 0 || c->state != CONN_READY || c->answered == c->written) {
+		// closed by either side, or a response nobody asked for
+		if (rv != 0 && rv != NNG_ECLOSED && c->count > 0) {
+			log_warn("webhook response failed: %s", nng_strerror(rv));
+		}
+		goto drop;
+	}
+
+	status = nng_http_res_get_status(c->res);
+	if (!c->rd_body) {
+		hdr = nng_http_res_get_header(c->res, "Content-Length");
+		// without a length (chunked or until close) the body is not
+		// read, the connection goes after this response
+		keep = hdr != NULL || status == 204 || status == 304;
+		if (keep) {
+			c->framed = true;
+		}
+		if (hdr != NULL && (c->rd_len = strtoul(hdr, NULL, 10)) > 0) {
+			if ((c->rd_buf = nng_alloc(c->rd_len)) == NULL) {
+				goto drop;
+			}
+			// the body is of no interest, but it is in the way of
+			// the next response
+			nng_iov iov = { .iov_buf = c->rd_buf, .iov_len = c->rd_len };
+			nng_aio_set_iov(c->rd_aio, 1, &iov);
+			c->rd_body = true;
+			c->reading = true;
+			nng_http_conn_read_all(c->conn, c->rd_aio);
+			nng_mtx_unlock(p->mtx);
+			return;
+		}
+	} else {
+		nng_free(c->rd_buf, c->rd_len);
+		c->rd_buf = NULL;
+	}
+
+	s           = &c->slots[(c->head + c->answered) % p->max_inflight];
+	s->answered = true;
+	c->answered++;
+	slot_answered(p, s, nng_clock());
+	if (status < 200 || status >= 300) {
+		log_warn("webhook %s answered %d", p->conf->url, status);
+		nng_atomic_inc64(p->failures);
+	}
+	hdr = nng_http_res_get_header(c->res, "Connection");
+	if (hdr != NULL && nng_strcasecmp(hdr, "close") == 0) {
+		keep = false;
+	}
+	conn_reap(c);
+	if (keep) {
+		conn_start_read(c);
+		nng_mtx_unlock(p->mtx);
+		return;
+	}
+	// the server is done with this connection, what it left unanswered
+	// may have been processed all the same
+
+drop:
+	if (c->rd_buf != NULL) {
+		nng_free(c->rd_buf, c->rd_len);
+		c->rd_buf = NULL;
+	}
+	hc = conn_drop(c);
+	conn_reap(c);
+	nng_mtx_unlock(p->mtx);
+
+	if (hc != NULL) {
+		nng_http_conn_close(hc);
+	}
+}
+
+// start writing the oldest request not written yet, one at a time so
+// that those behind it are known to be off the wire
+static void
+conn_write_next(webhook_conn *c)
+{
+	webhook_pool *p = c->pool;
+	webhook_slot *s;
+
+	if (c->state != CONN_READY || c->writing || c->written == c->count) {
+		return;
+	}
+	s          = &c->slots[(c->head + c->written) % p->max_inflight];
+	s->sent    = nng_clock();
+	s->writing = true;
+	c->writing = true;
+	c->written++;
+	if (c->requests++ > 0) {
+		nng_atomic_inc64(p->reuses);
+	}
+	nng_http_req_set_data(s->req, nng_msg_body(s->msg), nng_msg_len(s->msg));
+	nng_http_conn_write_req(c->conn, s->req, s->aio);
+}
+
+static void
+slot_write_cb(void *arg)
+{
+	webhook_slot  *s  = arg;
+	webhook_conn  *c  = s->c;
+	webhook_pool  *p  = c->pool;
+	nng_http_conn *hc = NULL;
+	int            rv = nng_aio_result(s->aio);
+
+	nng_mtx_lock(p->mtx);
+	s->writing = false;
+	c->writing = false;
+	if (rv != 0) {
+		if (rv != NNG_ECLOSED) {
+			log_warn("webhook write failed: %s", nng_strerror(rv));
+		}
+		hc = conn_drop(c);
+	} else {
+		conn_write_next(c);
+	}
+	conn_reap(c);
+	nng_mtx_unlock(p->mtx);
+
+	if (hc != NULL) {
+		nng_http_conn_close(hc);
+	}
+}
+
+static void
+conn_submit(webhook_conn *c, nng_msg *msg, nng_time *enqueued)
+{
+	webhook_pool *p = c->pool;
+	webhook_slot *s = &c->slots[(c->head + c->count) % p->max_inflight];
+
+	c->count++;
+	s->msg      = msg;
+	s->enqueued = enqueued;
+	s->answered = false;
+	conn_write_next(c);
+}
+
+// keep the timer running while there is anything to wait for
+static void
+pool_tick(webhook_pool *p)
+{
+	bool busy = p->q_len > 0;
+
+	for (uint32_t i = 0; i < p->nconns && !busy; i++) {
+		busy = p->conns[i].count > 0;
+	}
+	if (busy && !p->ticking && !p->closed) {
+		p->ticking = true;
+		nng_sleep_aio(WEBHOOK_POOL_BACKOFF_MIN, p->timer);
+	}
+}
+
+// fail what waited too long for a connection, hand the rest to the ready
+// connections with room and open a connection when none is ready or the
+// others are busy
+static void
+pool_dispatch(webhook_pool *p, nng_time now)
+{
+	webhook_conn *c, *best, *down;
+	webhook_req   r;
+
+	while (p->q_len > 0 &&
+	    p->queue[p->q_head].queued + WEBHOOK_POOL_TIMEOUT <= now) {
+		queue_get(p, &r);
+		nng_atomic_inc64(p->failures);
+		req_free(r.msg, r.enqueued);
+	}
+	while (!p->closed && p->q_len > 0) {
+		best = NULL;
+		down = NULL;
+		for (uint32_t i = 0; i < p->nconns; i++) {
+			c = &p->conns[(p->next + i) % p->nconns];
+			if (c->state == CONN_READY && conn_has_room(c) &&
+			    (best == NULL || c->count < best->count)) {
+				best = c;
+			} else if (c->state == CONN_DOWN &&
+			    c->retry_at <= now && down == NULL) {
+				down = c;
+			}
+		}
+		if (down != NULL && (best == NULL || best->count > 0)) {
+			down->state = CONN_CONNECTING;
+			nng_http_client_connect(p->client, down->cn_aio);
+		}
+		if (best == NULL) {
+			// sent once a connection is ready or has room
+			break;
+		}
+		p->next = (p->next + 1) % p->nconns;
+		queue_get(p, &r);
+		conn_submit(best, r.msg, r.enqueued);
+	}
+	pool_tick(p);
+}
+
+static void
+pool_timer_cb(void *arg)
+{
+	webhook_pool  *p = arg;
+	nng_http_conn *hc;
+	webhook_conn  *c;
+	nng_time       now;
+
+	nng_mtx_lock(p->mtx);
+	p->ticking = false;
+	if (nng_aio_result(p->timer) != 0) {
+		nng_mtx_unlock(p->mtx);
+		return;
+	}
+	do {
+		hc  = NULL;
+		now = nng_clock();
+		for (uint32_t i = 0; i < p->nconns && hc == NULL; i++) {
+			c = &p->conns[i];
+			if (c->state == CONN_READY && c->written > c->answered &&
+			    c->slots[(c->head + c->answered) % p->max_inflight]
+			                .sent +
+			            WEBHOOK_POOL_TIMEOUT <=
+			        now) {
+				log_warn("webhook %s not answering", p->conf->url);
+				hc = conn_drop(c);
+			}
+		}
+		if (hc != NULL) {
+			nng_mtx_unlock(p->mtx);
+			nng_http_conn_close(hc);
+			nng_mtx_lock(p->mtx);
+		}
+	} while (hc != NULL);
+	pool_dispatch(p, now);
+	nng_mtx_unlock(p->mtx);
+}
+
+/**
+ * @brief hand a request body to the pool, the pool owns msg and
+ *        enqueued afterwards. Never waits, the request is queued until a
+ *        connection has room and fails when that takes longer than
+ *        WEBHOOK_POOL_TIMEOUT.
+ * @return 0 once the request is queued
+ */
+int
+webhook_pool_send(webhook_pool *p, nng_msg *msg, nng_time *enqueued)
+{
+	nng_time    now = nng_clock();
+	webhook_req r   = { .msg = msg, .enqueued = enqueued, .queued = now };
+	int         rv  = NNG_ECLOSED;
+
+	nng_mtx_lock(p->mtx);
+	if (!p->closed && (rv = queue_put(p, &r, false)) == 0) {
+		pool_dispatch(p, now);
+	}
+	nng_mtx_unlock(p->mtx);
+	if (rv != 0) {
+		nng_atomic_inc64(p->failures);
+		req_free(msg, enqueued);
+	}
+	return rv;
+}
+
+static int
+conn_init(webhook_conn *c, webhook_pool *p)
+{
+	conf_web_hook *conf = p->conf;
+	webhook_slot  *s;
+	int            rv;
+
+	c->pool    = p;
+	c->state   = CONN_DOWN;
+	c->backoff = WEBHOOK_POOL_BACKOFF_MIN;
+	if ((rv = nng_aio_alloc(&c->cn_aio, conn_connect_cb, c)) != 0 ||
+	    (rv = nng_aio_alloc(&c->rd_aio, conn_read_cb, c)) != 0) {
+		return rv;
+	}
+	nng_aio_set_timeout(c->cn_aio, WEBHOOK_POOL_TIMEOUT);
+	if ((c->slots = nng_zalloc(p->max_inflight * sizeof(webhook_slot))) ==
+	    NULL) {
+		return NNG_ENOMEM;
+	}
+	for (uint32_t i = 0; i < p->max_inflight; i++) {
+		s    = &c->slots[i];
+		s->c = c;
+		if ((rv = nng_aio_alloc(&s->aio, slot_write_cb, s)) != 0 ||
+		    (rv = nng_http_req_alloc(&s->req, p->url)) != 0) {
+			return rv;
+		}
+		nng_aio_set_timeout(s->aio, WEBHOOK_POOL_TIMEOUT);
+		nng_http_req_set_method(s->req, "POST");
+		for (size_t j = 0; j < conf->header_count; j++) {
+			nng_http_req_add_header(s->req, conf->headers[j]->key,
+			    conf->headers[j]->value);
+		}
+	}
+	return 0;
+}
+
+static void
+conn_fini(webhook_conn *c, uint32_t max_inflight)
+{
+	webhook_slot *s;
+
+	if (c->slots != NULL) {
+		for (uint32_t i = 0; i < max_inflight; i++) {
+			s = &c->slots[i];
+			if (s->msg != NULL) {
+				req_free(s->msg, s->enqueued);
+			}
+			if (s->req != NULL) {
+				nng_http_req_free(s->req);
+			}
+			nng_aio_free(s->aio);
+		}
+		nng_free(c->slots, max_inflight * sizeof(webhook_slot));
+	}
+	if (c->res != NULL) {
+		nng_http_res_free(c->res);
+	}
+	if (c->rd_buf != NULL) {
+		nng_free(c->rd_buf, c->rd_len);
+	}
+	nng_aio_free(c->cn_aio);
+	nng_aio_free(c->rd_aio);
+}
+
+int
+webhook_pool_create(webhook_pool **poolp, conf_web_hook *conf,
+    uint32_t conns, uint32_t max_inflight)
+{
+	webhook_pool *p;
+	int           rv;
+
+	if ((p = nng_zalloc(sizeof(*p))) == NULL) {
+		return NNG_ENOMEM;
+	}
+	p->conf         = conf;
+	p->nconns       = conns > 0 ? conns : 1;
+	p->max_inflight = max_inflight > 0 ? max_inflight : 1;
+	nng_atomic_alloc64(&p->connects);
+	nng_atomic_alloc64(&p->reuses);
+	nng_atomic_alloc64(&p->failures);
+	for (size_t i = 0; i < WEBHOOK_HIST_BUCKETS; i++) {
+		nng_atomic_alloc64(&p->latency[i]);
+	}
+	if ((rv = nng_mtx_alloc(&p->mtx)) != 0 ||
+	    (rv = nng_aio_alloc(&p->timer, pool_timer_cb, p)) != 0 ||
+	    (rv = nng_url_parse(&p->url, conf->url)) != 0 ||
+	    (rv = nng_http_client_alloc(&p->client, p->url)) != 0) {
+		goto fail;
+	}
+	if ((p->conns = nng_zalloc(p->nconns * sizeof(webhook_conn))) ==
+	    NULL) {
+		rv = NNG_ENOMEM;
+		goto fail;
+	}
+	for (uint32_t i = 0; i < p->nconns; i++) {
+		if ((rv = conn_init(&p->conns[i], p)) != 0) {
+			goto fail;
+		}
+	}
+	*poolp = p;
+	return 0;
+
+fail:
+	webhook_pool_destroy(p);
+	return rv;
+}
+
+void
+webhook_pool_destroy(webhook_pool *p)
+{
+	nng_http_conn *hc;
+	webhook_conn  *c;
+
+	if (p == NULL) {
+		return;
+	}
+	if (p->mtx != NULL) {
+		nng_mtx_lock(p->mtx);
+		p->closed = true;
+		nng_mtx_unlock(p->mtx);
+	}
+	nng_aio_stop(p->timer);
+	for (uint32_t i = 0; p->conns != NULL && i < p->nconns; i++) {
+		c = &p->conns[i];
+		nng_aio_stop(c->cn_aio);
+		nng_mtx_lock(p->mtx);
+		hc = conn_drop(c);
+		nng_mtx_unlock(p->mtx);
+		if (hc != NULL) {
+			nng_http_conn_close(hc);
+		}
+		nng_aio_stop(c->rd_aio);
+		for (uint32_t j = 0; c->slots != NULL && j < p->max_inflight;
+		     j++) {
+			nng_aio_stop(c->slots[j].aio);
+		}
+	}
+	for (uint32_t i = 0; p->conns != NULL && i < p->nconns; i++) {
+		conn_fini(&p->conns[i], p->max_inflight);
+	}
+	if (p->conns != NULL) {
+		nng_free(p->conns, p->nconns * sizeof(webhook_conn));
+	}
+	for (uint32_t i = 0; i < p->q_len; i++) {
+		webhook_req *r = &p->queue[(p->q_head + i) % p->q_cap];
+		req_free(r->msg, r->enqueued);
+	}
+	if (p->queue != NULL) {
+		nng_free(p->queue, p->q_cap * sizeof(webhook_req));
+	}
+	if (p->client != NULL) {
+		nng_http_client_free(p->client);
+	}
+	if (p->url != NULL) {
+		nng_url_free(p->url);
+	}
+	nng_aio_free(p->timer);
+	if (p->mtx != NULL) {
+		nng_mtx_free(p->mtx);
+	}
+	nng_atomic_free64(p->connects);
+	nng_atomic_free64(p->reuses);
+	nng_atomic_free64(p->failures);
+	for (size_t i = 0; i < WEBHOOK_HIST_BUCKETS; i++) {
+		nng_atomic_free64(p->latency[i]);
+	}
+	nng_free(p, sizeof(*p));
+}
+
+void
+webhook_pool_get_stats(webhook_pool *p, webhook_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (p == NULL) {
+		return;
+	}
+	stats->connects = nng_atomic_get64(p->connects);
+	stats->reuses   = nng_atomic_get64(p->reuses);
+	stats->failures = nng_atomic_get64(p->failures);
+	for (size_t i = 0; i < WEBHOOK_HIST_BUCKETS; i++) {
+		stats->latency[i] = nng_atomic_get64(p->latency[i]);
+	}
+}
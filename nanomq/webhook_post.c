@@ -8,21 +8,15 @@
 //
 
 #include "include/webhook_post.h"
+#include "include/json_writer.h"
 #include "include/pub_handler.h"
 
 #include "nng/supplemental/util/platform.h"
-#include "nng/supplemental/nanolib/base64.h"
-#include "nng/supplemental/nanolib/cJSON.h"
 #include "nng/protocol/mqtt/mqtt_parser.h"
 
 static bool event_filter(conf_web_hook *hook_conf, webhook_event event);
 static bool event_filter_with_topic(
     conf_web_hook *hook_conf, webhook_event event, const char *topic);
-static void         set_char(char *out, unsigned int *index, char c);
-static unsigned int base62_encode(
-    const unsigned char *in, unsigned int inlen, char *out);
-
-#define BASE62_ENCODE_OUT_SIZE(s) ((unsigned int) ((((s) *8) / 6) + 2))
 
 static bool
 event_filter(conf_web_hook *hook_conf, webhook_event event)
@@ -55,188 +49,113 @@ event_filter_with_topic(
 	return false;
 }
 
-static void
-set_char(char *out, unsigned int *index, char c)
+// the document is in buf, the inproc socket takes a copy
+static int
+webhook_send(nng_socket *sock, json_writer *w)
 {
-	unsigned int idx = *index;
-	switch (c) {
-	case 'i':
-		out[idx++] = 'i';
-		// out[idx++] = 'a';
-		break;
-	case '+':
-		// out[idx++] = 'i';
-		// out[idx++] = 'b';
-		out[idx++] = 'A';
-		break;
-	case '/':
-		// out[idx++] = 'i';
-		// out[idx++] = 'c';
-		out[idx++] = 'B';
-		break;
-	default:
-		out[idx++] = c;
-		break;
-	}
-
-	*index = idx;
-}
+	int rv;
 
-static unsigned int
-base62_encode(const unsigned char *in, unsigned int inlen, char *out)
-{
-	unsigned int i;
-	unsigned int j;
-	unsigned int pos = 0, val = 0;
-	const char   base62en[] =
-	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-	for (i = j = 0; i < inlen; i++) {
-		val = (val << 8) | (in[i] & 0xFF);
-		pos += 8;
-		while (pos > 5) {
-			char c = base62en[val >> (pos -= 6)];
-			set_char(out, &j, c);
-			val &= ((1 << pos) - 1);
-		}
-	}
-	if (pos > 0) {
-		char c = base62en[val << (6 - pos)];
-		set_char(out, &j, c);
+	if ((rv = json_writer_finish(w)) != 0) {
+		return rv;
 	}
-	return j;
+	return nng_send(*sock, nng_msg_body(w->msg), nng_msg_len(w->msg),
+	    NNG_FLAG_NONBLOCK);
 }
 
 int
-webhook_msg_publish(nng_socket *sock, conf_web_hook *hook_conf,
+webhook_msg_publish(nng_socket *sock, nng_msg *buf, conf_web_hook *hook_conf,
     pub_packet_struct *pub_packet, const char *username, const char *client_id)
 {
+	json_writer w;
+
 	if (!hook_conf->enable ||
 	    !event_filter_with_topic(hook_conf, MESSAGE_PUBLISH,
 	        pub_packet->var_header.publish.topic_name.body)) {
 		return -1;
 	}
 
-	cJSON *obj = cJSON_CreateObject();
-	
-	cJSON_AddNumberToObject(obj, "ts", nng_timestamp());
-	cJSON_AddStringToObject(
-	    obj, "topic", pub_packet->var_header.publish.topic_name.body);
-	cJSON_AddBoolToObject(obj, "retain", pub_packet->fixed_header.retain);
-	cJSON_AddNumberToObject(obj, "qos", pub_packet->fixed_header.qos);
-	cJSON_AddStringToObject(obj, "action", "message_publish");
-	cJSON_AddStringToObject(
-	    obj, "from_username", username == NULL ? "undefined" : username);
-	if (client_id) {
-		cJSON_AddStringToObject(obj, "from_client_id", client_id);
-	} else {
-		cJSON_AddNullToObject(obj, "from_client_id");
-	}
-	size_t out_size = 0;
-	char  *encode   = NULL;
-	size_t len      = 0;
+	json_writer_init(&w, buf);
+	json_obj_begin(&w, NULL);
+	json_add_uint(&w, "ts", nng_timestamp());
+	json_add_str(
+	    &w, "topic", pub_packet->var_header.publish.topic_name.body);
+	json_add_bool(&w, "retain", pub_packet->fixed_header.retain);
+	json_add_uint(&w, "qos", pub_packet->fixed_header.qos);
+	json_add_str(&w, "action", "message_publish");
+	json_add_str(
+	    &w, "from_username", username == NULL ? "undefined" : username);
+	json_add_str(&w, "from_client_id", client_id);
 	switch (hook_conf->encode_payload) {
 	case plain:
-		cJSON_AddStringToObject(
-		    obj, "payload", (const char *) pub_packet->payload.data);
+		json_add_strn(&w, "payload", (char *) pub_packet->payload.data,
+		    pub_packet->payload.len);
 		break;
 	case base64:
-		out_size = BASE64_ENCODE_OUT_SIZE(pub_packet->payload.len);
-		encode   = nng_zalloc(out_size);
-		len      = base64_encode(
-		         pub_packet->payload.data, pub_packet->payload.len, encode);
-		if (len > 0) {
-			cJSON_AddStringToObject(obj, "payload", encode);
-		} else {
-			cJSON_AddNullToObject(obj, "payload");
-		}
-		nng_strfree(encode);
+		json_add_base64(&w, "payload", pub_packet->payload.data,
+		    pub_packet->payload.len);
 		break;
 	case base62:
-		out_size = BASE62_ENCODE_OUT_SIZE(pub_packet->payload.len);
-		encode   = nng_zalloc(out_size);
-		len      = base62_encode(
-		         pub_packet->payload.data, pub_packet->payload.len, encode);
-		if (len > 0) {
-			cJSON_AddStringToObject(obj, "payload", encode);
-		} else {
-			cJSON_AddNullToObject(obj, "payload");
-		}
-		nng_strfree(encode);
+		json_add_base62(&w, "payload", pub_packet->payload.data,
+		    pub_packet->payload.len);
 		break;
 
 	default:
 		break;
 	}
+	json_obj_end(&w);
 
-	char *json = cJSON_PrintUnformatted(obj);
-
-	int rv = nng_send(*sock, json, strlen(json), NNG_FLAG_NONBLOCK);
-
-	nng_strfree(json);
-	cJSON_Delete(obj);
-
-	return rv;
+	return webhook_send(sock, &w);
 }
 
 int
-webhook_client_connack(nng_socket *sock, conf_web_hook *hook_conf,
-    uint8_t proto_ver, uint16_t keepalive, uint8_t reason,
-    const char *username, const char *client_id)
+webhook_client_connack(nng_socket *sock, nng_msg *buf,
+    conf_web_hook *hook_conf, uint8_t proto_ver, uint16_t keepalive,
+    uint8_t reason, const char *username, const char *client_id)
 {
+	json_writer w;
+
 	if (!hook_conf->enable || !event_filter(hook_conf, CLIENT_CONNACK)) {
 		return -1;
 	}
 
-	cJSON *obj = cJSON_CreateObject();
-
-	cJSON_AddNumberToObject(obj, "proto_ver", proto_ver);
-	cJSON_AddNumberToObject(obj, "keepalive", keepalive);
+	json_writer_init(&w, buf);
+	json_obj_begin(&w, NULL);
+	json_add_uint(&w, "proto_ver", proto_ver);
+	json_add_uint(&w, "keepalive", keepalive);
 	// TODO get reason string
-	cJSON_AddStringToObject(
-	    obj, "conn_ack", reason == SUCCESS ? "success" : "fail");
-	cJSON_AddStringToObject(
-	    obj, "username", username == NULL ? "undefined" : username);
-	cJSON_AddStringToObject(obj, "clientid", client_id);
-	cJSON_AddStringToObject(obj, "action", "client_connack");
-
-	char *json = cJSON_PrintUnformatted(obj);
-
-	int rv = nng_send(*sock, json, strlen(json), NNG_FLAG_NONBLOCK);
-
-	nng_strfree(json);
-	cJSON_Delete(obj);
-
-	return rv;
+	json_add_str(&w, "conn_ack", reason == SUCCESS ? "success" : "fail");
+	json_add_str(
+	    &w, "username", username == NULL ? "undefined" : username);
+	json_add_str(&w, "clientid", client_id);
+	json_add_str(&w, "action", "client_connack");
+	json_obj_end(&w);
+
+	return webhook_send(sock, &w);
 }
 
 int
-webhook_client_disconnect(nng_socket *sock, conf_web_hook *hook_conf,
-    uint8_t proto_ver, uint16_t keepalive, uint8_t reason,
-    const char *username, const char *client_id)
+webhook_client_disconnect(nng_socket *sock, nng_msg *buf,
+    conf_web_hook *hook_conf, uint8_t proto_ver, uint16_t keepalive,
+    uint8_t reason, const char *username, const char *client_id)
 {
+	json_writer w;
+
 	if (!hook_conf->enable ||
 	    !event_filter(hook_conf, CLIENT_DISCONNECTED)) {
 		return -1;
 	}
 
-	cJSON *obj = cJSON_CreateObject();
+	json_writer_init(&w, buf);
+	json_obj_begin(&w, NULL);
 	// TODO get reason string
-	cJSON_AddStringToObject(
-	    obj, "reason", reason == SUCCESS ? "normal" : "abnormal");
-	cJSON_AddStringToObject(
-	    obj, "username", username == NULL ? "undefined" : username);
-	cJSON_AddStringToObject(obj, "clientid", client_id);
-	cJSON_AddStringToObject(obj, "action", "client_disconnected");
-
-	char *json = cJSON_PrintUnformatted(obj);
-
-	int rv = nng_send(*sock, json, strlen(json), NNG_FLAG_NONBLOCK);
-
-	nng_strfree(json);
-	cJSON_Delete(obj);
-
-	return rv;
+	json_add_str(&w, "reason", reason == SUCCESS ? "normal" : "abnormal");
+	json_add_str(
+	    &w, "username", username == NULL ? "undefined" : username);
+	json_add_str(&w, "clientid", client_id);
+	json_add_str(&w, "action", "client_disconnected");
+	json_obj_end(&w);
+
+	return webhook_send(sock, &w);
 }
 
 inline int
@@ -251,19 +170,20 @@ webhook_entry(nano_work *work, uint8_t reason)
 		return 0;
 	switch (work->flag) {
 	case CMD_CONNACK:
-		rv = webhook_client_connack(sock, hook_conf,
+		rv = webhook_client_connack(sock, work->json_buf, hook_conf,
 		    conn_param_get_protover(cparam),
 		    conn_param_get_keepalive(cparam), reason,
 		    (const char*)conn_param_get_username(cparam),
 		    (const char*)conn_param_get_clientid(cparam));
 		break;
 	case CMD_PUBLISH:
-		rv = webhook_msg_publish(sock, hook_conf, work->pub_packet,
+		rv = webhook_msg_publish(sock, work->json_buf, hook_conf,
+		    work->pub_packet,
 		    (const char*)conn_param_get_username(cparam),
 		    (const char*)conn_param_get_clientid(cparam));
 		break;
 	case CMD_DISCONNECT_EV:
-		rv = webhook_client_disconnect(sock, hook_conf,
+		rv = webhook_client_disconnect(sock, work->json_buf, hook_conf,
 		    conn_param_get_protover(cparam),
 		    conn_param_get_keepalive(cparam), reason,
 		    (const char*)conn_param_get_username(cparam),